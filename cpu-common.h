@@ -74,6 +74,15 @@ void qemu_put_ram_ptr(void *addr);
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
 
+typedef void (RAMBlockIterFunc)(void *host_addr,
+    ram_addr_t offset, ram_addr_t length, void *opaque);
+/* Calls func on every RAM block, e.g. to register guest RAM with the
+ * host kernel for zero copy I/O */
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque);
+/* File the RAM block at addr is mapped shared from, e.g. to pass guest
+ * RAM to another process, or -1 if none */
+int qemu_ram_shared_fd(ram_addr_t addr);
+
 int cpu_register_io_memory(CPUReadMemoryFunc * const *mem_read,
                            CPUWriteMemoryFunc * const *mem_write,
                            void *opaque, enum device_endian endian);
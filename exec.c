@@ -3227,6 +3227,33 @@ ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
     return ram_addr;
 }
 
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        func(block->host, block->offset, block->length, opaque);
+    }
+}
+
+int qemu_ram_shared_fd(ram_addr_t addr)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block;
+
+    /* Without mem_prealloc the file is mapped private */
+    if (!mem_prealloc) {
+        return -1;
+    }
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            return block->fd ? block->fd : -1;
+        }
+    }
+#endif
+    return -1;
+}
+
 static uint32_t unassigned_mem_readb(void *opaque, target_phys_addr_t addr)
 {
 #ifdef DEBUG_UNASSIGNED
@@ -4047,7 +4074,7 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
     target_phys_addr_t page;
     unsigned long pd;
     PhysPageDesc *p;
-    target_phys_addr_t addr1 = addr;
+    ram_addr_t raddr = 0;
 
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
@@ -4075,13 +4102,20 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
             *plen = l;
             return bounce.buffer;
         }
+        /* RAM is found by its ram address, which only matches the guest
+         * address for the main memory below 4G */
+        if (!todo) {
+            raddr = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
+        } else if ((pd & TARGET_PAGE_MASK) != raddr + todo) {
+            break;
+        }
 
         len -= l;
         addr += l;
         todo += l;
     }
     *plen = todo;
-    return qemu_ram_ptr_length(addr1, plen);
+    return qemu_ram_ptr_length(raddr, plen);
 }
 
 /* Unmaps a memory region previously mapped by cpu_physical_memory_map().
@@ -1213,6 +1213,139 @@ STEXI
 @item block_passwd @var{device} @var{password}
 @findex block_passwd
 Set the encrypted device @var{device} password to @var{password}
+ETEXI
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_set_qos",
+        .args_type  = "device:s,nsid:i,iops:l,bps:o,iops_burst:l?,bps_burst:o?",
+        .params     = "device nsid iops bps [iops_burst [bps_burst]]",
+        .help       = "set the IOPS and bandwidth limits of an NVMe "
+                      "namespace, or of the I/O queues for nsid 0",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_set_qos,
+    },
+#endif
+
+STEXI
+@item nvme_set_qos @var{device} @var{nsid} @var{iops} @var{bps} [@var{iops_burst} [@var{bps_burst}]]
+@findex nvme_set_qos
+Limit namespace @var{nsid} of the NVMe controller @var{device}, its qdev id
+or nvme<instance>, to @var{iops} commands and @var{bps} bytes per second, 0
+for no limit. With @var{nsid} 0 the limits apply to each I/O submission
+queue instead. The bursts default to one second worth of the rates.
+Commands over the limits are delayed, not failed.
+ETEXI
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_cow_compact",
+        .args_type  = "device:s,nsid:i",
+        .params     = "device nsid",
+        .help       = "copy the blocks an NVMe namespace shares with its "
+                      "base image and close the base",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_cow_compact,
+    },
+#endif
+
+STEXI
+@item nvme_cow_compact @var{device} @var{nsid}
+@findex nvme_cow_compact
+Copy the blocks namespace @var{nsid} of the NVMe controller @var{device}, its
+qdev id or nvme<instance>, still shares with the base image it was cloned
+from, in the background. The base image is closed once none is left.
+ETEXI
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_create",
+        .args_type  = "device:s,size_mb:i,lbaf:i?",
+        .params     = "device size_mb [lbaf]",
+        .help       = "create an NVMe namespace, not attached",
+        .user_print = do_nvme_ns_create_print,
+        .mhandler.cmd_new = do_nvme_ns_create,
+    },
+#endif
+
+STEXI
+@item nvme_ns_create @var{device} @var{size_mb} [@var{lbaf}]
+@findex nvme_ns_create
+Create a namespace of @var{size_mb} MB in LBA format @var{lbaf} (0 by
+default) on the NVMe controller @var{device}, its qdev id or nvme<instance>,
+out of its unallocated capacity. It is not attached.
+ETEXI
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_delete",
+        .args_type  = "device:s,nsid:i",
+        .params     = "device nsid",
+        .help       = "delete an NVMe namespace and its backing files",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_delete,
+    },
+#endif
+
+STEXI
+@item nvme_ns_delete @var{device} @var{nsid}
+@findex nvme_ns_delete
+Delete namespace @var{nsid} of the NVMe controller @var{device} and remove its
+backing files.
+ETEXI
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_attach",
+        .args_type  = "device:s,nsid:i",
+        .params     = "device nsid",
+        .help       = "attach an NVMe namespace to its controller",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_attach,
+    },
+#endif
+
+STEXI
+@item nvme_ns_attach @var{device} @var{nsid}
+@findex nvme_ns_attach
+Attach namespace @var{nsid} to the NVMe controller @var{device}, making it
+visible to the guest.
+ETEXI
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_detach",
+        .args_type  = "device:s,nsid:i",
+        .params     = "device nsid",
+        .help       = "detach an NVMe namespace from its controller",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_detach,
+    },
+#endif
+
+STEXI
+@item nvme_ns_detach @var{device} @var{nsid}
+@findex nvme_ns_detach
+Detach namespace @var{nsid} from the NVMe controller @var{device}. Its data is
+kept.
+ETEXI
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_resize",
+        .args_type  = "device:s,nsid:i,size_mb:i",
+        .params     = "device nsid size_mb",
+        .help       = "grow or shrink an NVMe namespace",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_resize,
+    },
+#endif
+
+STEXI
+@item nvme_ns_resize @var{device} @var{nsid} @var{size_mb}
+@findex nvme_ns_resize
+Change the size of namespace @var{nsid} of the NVMe controller @var{device}
+to @var{size_mb} MB, within its unallocated capacity.
 ETEXI
 
     {
@@ -1305,6 +1438,8 @@ show the interrupts statistics (if available)
 show i8259 (PIC) state
 @item info pci
 show emulated PCI device info
+@item info nvme
+show NVMe namespaces and format progress
 @item info tlb
 show virtual to physical memory mappings (i386, SH4 and SPARC only)
 @item info mem
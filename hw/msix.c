@@ -28,8 +28,8 @@
  * a 4K aligned region all by itself. */
 #define MSIX_PAGE_SIZE 0x1000
 /* Reserve second half of the page for pending bits */
-#define MSIX_PAGE_PENDING (MSIX_PAGE_SIZE / 2)
-#define MSIX_MAX_ENTRIES 32
+#define MSIX_PAGE_PENDING(dev) ((dev)->msix_page_size / 2)
+#define MSIX_MAX_ENTRIES (PCI_MSIX_FLAGS_QSIZE + 1)
 
 
 /* Flag for interrupt controller to declare MSI-X support */
@@ -54,10 +54,10 @@ static int msix_add_config(struct PCIDevice *pdev, unsigned short nentries,
 
     /* Add space for MSI-X structures */
     if (!bar_size) {
-        new_size = MSIX_PAGE_SIZE;
-    } else if (bar_size < MSIX_PAGE_SIZE) {
-        bar_size = MSIX_PAGE_SIZE;
-        new_size = MSIX_PAGE_SIZE * 2;
+        new_size = pdev->msix_page_size;
+    } else if (bar_size < pdev->msix_page_size) {
+        bar_size = pdev->msix_page_size;
+        new_size = pdev->msix_page_size * 2;
     } else {
         new_size = bar_size * 2;
     }
@@ -73,7 +73,7 @@ static int msix_add_config(struct PCIDevice *pdev, unsigned short nentries,
     /* Table on top of BAR */
     pci_set_long(config + PCI_MSIX_TABLE, bar_size | bar_nr);
     /* Pending bits on top of that */
-    pci_set_long(config + PCI_MSIX_PBA, (bar_size + MSIX_PAGE_PENDING) |
+    pci_set_long(config + PCI_MSIX_PBA, (bar_size + MSIX_PAGE_PENDING(pdev)) |
                  bar_nr);
     pdev->msix_cap = config_offset;
     /* Make flags bit writable. */
@@ -85,7 +85,7 @@ static int msix_add_config(struct PCIDevice *pdev, unsigned short nentries,
 static uint32_t msix_mmio_readl(void *opaque, target_phys_addr_t addr)
 {
     PCIDevice *dev = opaque;
-    unsigned int offset = addr & (MSIX_PAGE_SIZE - 1) & ~0x3;
+    unsigned int offset = addr & (dev->msix_page_size - 1) & ~0x3;
     void *page = dev->msix_table_page;
 
     return pci_get_long(page + offset);
@@ -104,7 +104,7 @@ static uint8_t msix_pending_mask(int vector)
 
 static uint8_t *msix_pending_byte(PCIDevice *dev, int vector)
 {
-    return dev->msix_table_page + MSIX_PAGE_PENDING + vector / 8;
+    return dev->msix_table_page + MSIX_PAGE_PENDING(dev) + vector / 8;
 }
 
 static int msix_is_pending(PCIDevice *dev, int vector)
@@ -173,7 +173,7 @@ static void msix_mmio_writel(void *opaque, target_phys_addr_t addr,
                              uint32_t val)
 {
     PCIDevice *dev = opaque;
-    unsigned int offset = addr & (MSIX_PAGE_SIZE - 1) & ~0x3;
+    unsigned int offset = addr & (dev->msix_page_size - 1) & ~0x3;
     int vector = offset / PCI_MSIX_ENTRY_SIZE;
     pci_set_long(dev->msix_table_page + offset, val);
     msix_handle_mask_update(dev, vector);
@@ -199,7 +199,7 @@ void msix_mmio_map(PCIDevice *d, int region_num,
 {
     uint8_t *config = d->config + d->msix_cap;
     uint32_t table = pci_get_long(config + PCI_MSIX_TABLE);
-    uint32_t offset = table & ~(MSIX_PAGE_SIZE - 1);
+    uint32_t offset = table & ~(d->msix_page_size - 1);
     /* TODO: for assigned devices, we'll want to make it possible to map
      * pending bits separately in case they are in a separate bar. */
     int table_bir = table & PCI_MSIX_FLAGS_BIRMASK;
@@ -235,10 +235,15 @@ int msix_init(struct PCIDevice *dev, unsigned short nentries,
     if (nentries > MSIX_MAX_ENTRIES)
         return -EINVAL;
 
-    dev->msix_entry_used = qemu_mallocz(MSIX_MAX_ENTRIES *
+    dev->msix_entry_used = qemu_mallocz(nentries *
                                         sizeof *dev->msix_entry_used);
 
-    dev->msix_table_page = qemu_mallocz(MSIX_PAGE_SIZE);
+    /* Table in the first half of the page, pending bits in the second */
+    dev->msix_page_size = MSIX_PAGE_SIZE;
+    while (dev->msix_page_size / 2 < nentries * PCI_MSIX_ENTRY_SIZE) {
+        dev->msix_page_size <<= 1;
+    }
+    dev->msix_table_page = qemu_mallocz(dev->msix_page_size);
     msix_mask_all(dev, nentries);
 
     dev->msix_mmio_index = cpu_register_io_memory(msix_mmio_read,
@@ -305,7 +310,8 @@ void msix_save(PCIDevice *dev, QEMUFile *f)
     }
 
     qemu_put_buffer(f, dev->msix_table_page, n * PCI_MSIX_ENTRY_SIZE);
-    qemu_put_buffer(f, dev->msix_table_page + MSIX_PAGE_PENDING, (n + 7) / 8);
+    qemu_put_buffer(f, dev->msix_table_page + MSIX_PAGE_PENDING(dev),
+                    (n + 7) / 8);
 }
 
 /* Should be called after restoring the config space. */
@@ -319,7 +325,8 @@ void msix_load(PCIDevice *dev, QEMUFile *f)
 
     msix_free_irq_entries(dev);
     qemu_get_buffer(f, dev->msix_table_page, n * PCI_MSIX_ENTRY_SIZE);
-    qemu_get_buffer(f, dev->msix_table_page + MSIX_PAGE_PENDING, (n + 7) / 8);
+    qemu_get_buffer(f, dev->msix_table_page + MSIX_PAGE_PENDING(dev),
+                    (n + 7) / 8);
 }
 
 /* Does device support MSI-X? */
@@ -369,7 +376,7 @@ void msix_reset(PCIDevice *dev)
     msix_free_irq_entries(dev);
     dev->config[dev->msix_cap + MSIX_CONTROL_OFFSET] &=
 	    ~dev->wmask[dev->msix_cap + MSIX_CONTROL_OFFSET];
-    memset(dev->msix_table_page, 0, MSIX_PAGE_SIZE);
+    memset(dev->msix_table_page, 0, dev->msix_page_size);
     msix_mask_all(dev, dev->msix_entries_nr);
 }
 
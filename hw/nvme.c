@@ -25,13 +25,11 @@
 
 #include "nvme.h"
 #include "nvme_debug.h"
+#include "nvme_trace.h"
+#include "nvme_monitor.h"
+#include "qemu-objects.h"
 #include "range.h"
-
-
-static const VMStateDescription vmstate_nvme = {
-    .name = "nvme",
-    .version_id = 1,
-};
+#include <sys/mman.h>
 
 /* File Level scope functions */
 static void clear_nvme_device(NVMEState *n);
@@ -45,13 +43,24 @@ static void read_file(NVMEState *, uint8_t);
 static void sq_processing_timer_cb(void *);
 static int nvme_irqcq_empty(NVMEState *, uint32_t);
 static void msix_clr_pending(PCIDevice *, uint32_t);
+static void nvme_pmr_flush(NVMEState *);
+static void nvme_pmr_enable(NVMEState *, uint32_t);
+
+/* Devices reported by "info nvme" */
+static QTAILQ_HEAD(, NVMEState) nvme_devices =
+    QTAILQ_HEAD_INITIALIZER(nvme_devices);
 
 
 void enqueue_async_event(NVMEState *n, uint8_t event_type, uint8_t event_info,
     uint8_t log_page)
 {
-    AsyncEvent *event = (AsyncEvent *)qemu_malloc(sizeof(AsyncEvent));
+    AsyncEvent *event = nvme_async_event_alloc(n);
 
+    if (event == NULL) {
+        LOG_NORM("Async event queue full, dropping event type:%d info:%d",
+            event_type, event_info);
+        return;
+    }
     event->result.event_type = event_type;
     event->result.event_info = event_info;
     event->result.log_page   = log_page;
@@ -62,6 +71,39 @@ void enqueue_async_event(NVMEState *n, uint8_t event_type, uint8_t event_info,
             qemu_get_clock_ns(vm_clock) + 20000);
 }
 
+/*********************************************************************
+    Function     :    nvme_async_events_init
+    Description  :    Empties the async event queue, making every
+                      preallocated event available
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_async_events_init(NVMEState *n)
+{
+    int i;
+
+    QSIMPLEQ_INIT(&n->async_queue);
+    QSIMPLEQ_INIT(&n->async_free);
+    for (i = 0; i < NVME_ASYNC_EVENT_POOL; i++) {
+        QSIMPLEQ_INSERT_TAIL(&n->async_free, &n->async_events[i], entry);
+    }
+}
+
+AsyncEvent *nvme_async_event_alloc(NVMEState *n)
+{
+    AsyncEvent *event = QSIMPLEQ_FIRST(&n->async_free);
+
+    if (event != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&n->async_free, entry);
+    }
+    return event;
+}
+
+void nvme_async_event_free(NVMEState *n, AsyncEvent *event)
+{
+    QSIMPLEQ_INSERT_HEAD(&n->async_free, event, entry);
+}
+
 void isr_notify(NVMEState *n, NVMEIOCQueue *cq)
 {
     if (cq->irq_enabled) {
@@ -105,7 +147,7 @@ static void process_doorbell(NVMEState *nvme_dev, target_phys_addr_t addr,
                 event_info_err_invalid_sq, NVME_LOG_ERROR_INFORMATION);
             return;
         }
-        if (new_head >= nvme_dev->cq[queue_id].size) {
+        if (new_head >= nvme_dev->cq[queue_id]->size) {
             LOG_NORM("Bad cq head value: %d", new_head);
             enqueue_async_event(nvme_dev, event_type_error,
                 event_info_err_invalid_db, NVME_LOG_ERROR_INFORMATION);
@@ -119,20 +161,20 @@ static void process_doorbell(NVMEState *nvme_dev, target_phys_addr_t addr,
             qemu_mod_timer(nvme_dev->sq_processing_timer,
                 nvme_dev->sq_processing_timer_target);
         }
-        nvme_dev->cq[queue_id].head = new_head;
+        nvme_dev->cq[queue_id]->head = new_head;
         /* Reset the P bit if head == tail for all Queues on
          * a specific interrupt vector */
-        if (nvme_dev->cq[queue_id].irq_enabled &&
-            !(nvme_irqcq_empty(nvme_dev, nvme_dev->cq[queue_id].vector))) {
+        if (nvme_dev->cq[queue_id]->irq_enabled &&
+            !(nvme_irqcq_empty(nvme_dev, nvme_dev->cq[queue_id]->vector))) {
             /* reset the P bit */
-            LOG_DBG("Reset P bit for vec:%d", nvme_dev->cq[queue_id].vector);
-            msix_clr_pending(&nvme_dev->dev, nvme_dev->cq[queue_id].vector);
+            LOG_DBG("Reset P bit for vec:%d", nvme_dev->cq[queue_id]->vector);
+            msix_clr_pending(&nvme_dev->dev, nvme_dev->cq[queue_id]->vector);
 
         }
 
-        if (nvme_dev->cq[queue_id].tail != nvme_dev->cq[queue_id].head) {
+        if (nvme_dev->cq[queue_id]->tail != nvme_dev->cq[queue_id]->head) {
             /* more completion entries, submit interrupt */
-            isr_notify(nvme_dev, &nvme_dev->cq[queue_id]);
+            isr_notify(nvme_dev, nvme_dev->cq[queue_id]);
         }
     } else {
         /* SQ */
@@ -144,13 +186,14 @@ static void process_doorbell(NVMEState *nvme_dev, target_phys_addr_t addr,
                 event_info_err_invalid_sq, NVME_LOG_ERROR_INFORMATION);
             return;
         }
-        if (new_tail >= nvme_dev->sq[queue_id].size) {
+        if (new_tail >= nvme_dev->sq[queue_id]->size) {
             LOG_NORM("Bad sq tail value: %d", new_tail);
             enqueue_async_event(nvme_dev, event_type_error,
                 event_info_err_invalid_db, NVME_LOG_ERROR_INFORMATION);
             return;
         }
-        nvme_dev->sq[queue_id].tail = new_tail;
+        nvme_dev->sq[queue_id]->tail = new_tail;
+        nvme_sq_activate(nvme_dev, nvme_dev->sq[queue_id]);
 
         /* Check if the SQ processing routine is scheduled for
          * execution within 5 uS.If it isn't, make it so
@@ -177,7 +220,7 @@ static void process_doorbell(NVMEState *nvme_dev, target_phys_addr_t addr,
 *********************************************************************/
 static void msix_clr_pending(PCIDevice *dev, uint32_t vector)
 {
-    uint8_t *pending_byte = dev->msix_table_page + MSIX_PAGE_PENDING +
+    uint8_t *pending_byte = dev->msix_table_page + dev->msix_page_size / 2 +
         vector / 8;
     uint8_t pending_mask = 1 << (vector % 8);
     *pending_byte &= ~pending_mask;
@@ -192,11 +235,15 @@ static void msix_clr_pending(PCIDevice *dev, uint32_t vector)
 *********************************************************************/
 static int nvme_irqcq_empty(NVMEState *nvme_dev, uint32_t vector)
 {
-    int index, ret_val = FAIL;
-    for (index = 0; index < NVME_MAX_QS_ALLOCATED; index++) {
-        if (nvme_dev->cq[index].vector == vector &&
-            nvme_dev->cq[index].irq_enabled) {
-            if (nvme_dev->cq[index].head != nvme_dev->cq[index].tail) {
+    int ret_val = FAIL;
+    NVMEIOCQueue *cq;
+
+    if (vector >= nvme_dev->nvectors) {
+        return FAIL;
+    }
+    QTAILQ_FOREACH(cq, &nvme_dev->vector_cqs[vector], vector_entry) {
+        if (cq->irq_enabled) {
+            if (cq->head != cq->tail) {
                 ret_val = FAIL;
                 break;
             } else {
@@ -207,21 +254,93 @@ static int nvme_irqcq_empty(NVMEState *nvme_dev, uint32_t vector)
     return ret_val;
 }
 
+/*********************************************************************
+    Function     :    nvme_sq_activate
+    Description  :    Puts a SQ the guest has posted entries to on the
+                      list the SQ processing timer goes through
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMEIOSQueue * : Submission queue
+*********************************************************************/
+void nvme_sq_activate(NVMEState *n, NVMEIOSQueue *sq)
+{
+    if (!sq->active && sq->head != sq->tail) {
+        QTAILQ_INSERT_TAIL(&n->sq_active, sq, active_entry);
+        sq->active = 1;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_cq_link_vector
+    Description  :    Adds a CQ to the list of its interrupt vector,
+                      once its vector is set
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMEIOCQueue * : Completion queue
+*********************************************************************/
+void nvme_cq_link_vector(NVMEState *n, NVMEIOCQueue *cq)
+{
+    if (cq->vector < n->nvectors) {
+        QTAILQ_INSERT_TAIL(&n->vector_cqs[cq->vector], cq, vector_entry);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_set_page_size
+    Description  :    Sets the memory page size used for PRPs and
+                      discontiguous queues from CC.MPS
+    Return Type  :    int (SUCCESS/FAIL)
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+static int nvme_set_page_size(NVMEState *n)
+{
+    uint16_t mps;
+
+    memcpy(&mps, &n->cntrl_reg[NVME_CC], WORD);
+    mps &= (uint16_t) MASK(4, 7);
+    mps >>= 7;
+    if (mps < n->ctrlcap->mpsmin || mps > n->ctrlcap->mpsmax) {
+        LOG_ERR("CC.MPS %d outside of CAP.MPSMIN %d - CAP.MPSMAX %d", mps,
+            n->ctrlcap->mpsmin, n->ctrlcap->mpsmax);
+        return FAIL;
+    }
+    n->page_size = (1 << (12 + mps));
+    LOG_DBG("Page Size: %d", n->page_size);
+    return SUCCESS;
+}
+
 static void sq_processing_timer_cb(void *param)
 {
     NVMEState *n =  (NVMEState *) param;
-    int sq_id;
+    NVMEIOSQueue *sq, *next;
     int entries_to_process = ENTRIES_TO_PROCESS;
 
-    /* Check SQs for work */
-    for (sq_id = 0; sq_id < NVME_MAX_QS_ALLOCATED; sq_id++) {
-        while (n->sq[sq_id].head != n->sq[sq_id].tail) {
+    /* Post what the I/O workers are done with before fetching more */
+    if (n->worker_inflight) {
+        if (n->backend) {
+            nvme_backend_complete(n);
+        } else if (n->uring) {
+            nvme_uring_complete(n);
+        } else {
+            nvme_workers_complete(n);
+        }
+    }
+
+    /* Check SQs for work, only those with posted entries are listed */
+    sq = QTAILQ_FIRST(&n->sq_active);
+    while (sq != NULL) {
+        while (sq->head != sq->tail) {
             /* Handle one SQ entry */
-            if (process_sq(n, sq_id)) {
+            if (process_sq(n, sq->id)) {
                 break;
             }
             entries_to_process--;
             if (entries_to_process == 0) {
+                /* Start with the next SQ at the next run */
+                QTAILQ_REMOVE(&n->sq_active, sq, active_entry);
+                sq->active = 0;
+                nvme_sq_activate(n, sq);
+
                 /* Check back in a short while : 5 uS */
                 n->sq_processing_timer_target = qemu_get_clock_ns(vm_clock)
                     + 5000;
@@ -232,6 +351,21 @@ static void sq_processing_timer_cb(void *param)
                 return;
             }
         }
+        /* Admin commands may have deleted other SQs, not this one */
+        next = QTAILQ_NEXT(sq, active_entry);
+        if (sq->head == sq->tail) {
+            QTAILQ_REMOVE(&n->sq_active, sq, active_entry);
+            sq->active = 0;
+        }
+        sq = next;
+    }
+
+    if (n->worker_inflight) {
+        /* Keep polling for the completions of the I/O workers */
+        n->sq_processing_timer_target = qemu_get_clock_ns(vm_clock) + 5000;
+        qemu_mod_timer(n->sq_processing_timer,
+            n->sq_processing_timer_target);
+        return;
     }
 
     /* There isn't anything left to do: temporarily disable the timer */
@@ -285,7 +419,7 @@ static void nvme_mmio_writew(void *opaque, target_phys_addr_t addr,
                       target_phys_addr_t : Address (offset address)
                       uint32_t : Value to be written
 *********************************************************************/
-static void nvme_mmio_writel(void *opaque, target_phys_addr_t addr,
+void nvme_mmio_writel(void *opaque, target_phys_addr_t addr,
     uint32_t val)
 {
     NVMEState *nvme_dev = (NVMEState *) opaque;
@@ -329,14 +463,15 @@ static void nvme_mmio_writel(void *opaque, target_phys_addr_t addr,
             if (((var & CC_EN) ^ (val & CC_EN)) && (val & CC_EN)) {
                 /* Write to CC reg */
                 nvme_cntrl_write_config(nvme_dev, NVME_CC, val, DWORD);
-                /* Check if admin queues are ready to use and
-                 * check enable bit CC.EN
+                /* Check if admin queues are ready to use, the page
+                 * size is supported and check enable bit CC.EN
                  */
-                if (nvme_dev->cq[ACQ_ID].dma_addr &&
-                    nvme_dev->sq[ASQ_ID].dma_addr) {
+                if (nvme_set_page_size(nvme_dev) == SUCCESS &&
+                    nvme_dev->cq[ACQ_ID]->dma_addr &&
+                    nvme_dev->sq[ASQ_ID]->dma_addr) {
                     /* Update CSTS.RDY based on CC.EN and set the phase tag */
                     nvme_dev->cntrl_reg[NVME_CTST] |= CC_EN ;
-                    nvme_dev->cq[ACQ_ID].phase_tag = 1;
+                    nvme_dev->cq[ACQ_ID]->phase_tag = 1;
                 }
             } else if ((var & CC_EN) ^ (val & CC_EN)) {
                 /* For 1->0 transition for CC.EN */
@@ -354,29 +489,36 @@ static void nvme_mmio_writel(void *opaque, target_phys_addr_t addr,
             break;
         case NVME_AQA:
             nvme_cntrl_write_config(nvme_dev, NVME_AQA, val, DWORD);
-            nvme_dev->sq[ASQ_ID].size = (val & 0xfff) + 1;
-            nvme_dev->cq[ACQ_ID].size = ((val >> 16) & 0xfff) + 1;
+            /* Admin pool is rebuilt for the new size on first use */
+            nvme_sq_free_reqs(nvme_dev->sq[ASQ_ID]);
+            nvme_dev->sq[ASQ_ID]->size = (val & 0xfff) + 1;
+            nvme_dev->cq[ACQ_ID]->size = ((val >> 16) & 0xfff) + 1;
             break;
         case NVME_ASQ:
             nvme_cntrl_write_config(nvme_dev, NVME_ASQ, val, DWORD);
-            *((uint32_t *) &nvme_dev->sq[ASQ_ID].dma_addr) = val;
+            *((uint32_t *) &nvme_dev->sq[ASQ_ID]->dma_addr) = val;
             break;
         case (NVME_ASQ + 4):
             nvme_cntrl_write_config(nvme_dev, (NVME_ASQ + 4), val, DWORD);
-            *((uint32_t *) (&nvme_dev->sq[ASQ_ID].dma_addr) + 1) = val;
+            *((uint32_t *) (&nvme_dev->sq[ASQ_ID]->dma_addr) + 1) = val;
             break;
         case NVME_ACQ:
             nvme_cntrl_write_config(nvme_dev, NVME_ACQ, val, DWORD);
-            *((uint32_t *) &nvme_dev->cq[ACQ_ID].dma_addr) = val;
+            *((uint32_t *) &nvme_dev->cq[ACQ_ID]->dma_addr) = val;
             break;
         case (NVME_ACQ + 4):
             nvme_cntrl_write_config(nvme_dev, (NVME_ACQ + 4), val, DWORD);
-            *((uint32_t *) (&nvme_dev->cq[ACQ_ID].dma_addr) + 1) = val;
+            *((uint32_t *) (&nvme_dev->cq[ACQ_ID]->dma_addr) + 1) = val;
+            break;
+        case NVME_PMRCTL:
+            if (nvme_dev->pmr_buf) {
+                nvme_pmr_enable(nvme_dev, val & NVME_PMRCTL_EN);
+            }
             break;
         default:
             break;
         }
-    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL) {
+    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL(nvme_dev)) {
         /* Process the Doorbell Writes and masking of higher word */
         process_doorbell(nvme_dev, addr, val);
     }
@@ -490,12 +632,12 @@ static uint32_t nvme_mmio_readb(void *opaque, target_phys_addr_t addr)
     /* Check if NVME controller Capabilities was written */
     if (addr < NVME_SQ0TDBL) {
         rd_val = nvme_cntrl_read_config(nvme_dev, addr, BYTE);
-    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL) {
+    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL(nvme_dev)) {
         LOG_NORM("Undefined operation of reading the doorbell registers");
         rd_val = 0;
     } else {
         LOG_ERR("Undefined address read");
-        LOG_ERR("Qemu supports only 64 queues");
+        LOG_ERR("Qemu supports only %u queues", nvme_dev->num_queues);
         rd_val = 0 ;
     }
     return rd_val;
@@ -519,12 +661,12 @@ static uint32_t nvme_mmio_readw(void *opaque, target_phys_addr_t addr)
     /* Check if NVME controller Capabilities was written */
     if (addr < NVME_SQ0TDBL) {
         rd_val = nvme_cntrl_read_config(nvme_dev, addr, WORD);
-    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL) {
+    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL(nvme_dev)) {
         LOG_NORM("Undefined operation of reading the doorbell registers");
         rd_val = 0;
     } else {
         LOG_ERR("Undefined address read");
-        LOG_ERR("Qemu supports only 64 queues");
+        LOG_ERR("Qemu supports only %u queues", nvme_dev->num_queues);
         rd_val = 0 ;
     }
     return rd_val;
@@ -545,13 +687,17 @@ static uint32_t nvme_mmio_readl(void *opaque, target_phys_addr_t addr)
 
     /* Check if NVME controller Capabilities was written */
     if (addr < NVME_SQ0TDBL) {
+        if (addr == NVME_PMRSTS && nvme_dev->pmr_buf) {
+            /* The writes before are persistent once the read completes */
+            nvme_pmr_flush(nvme_dev);
+        }
         rd_val = nvme_cntrl_read_config(nvme_dev, addr, DWORD);
-    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL) {
+    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL(nvme_dev)) {
         LOG_NORM("Undefined operation of reading the doorbell registers");
         rd_val = 0;
     } else {
         LOG_ERR("Undefined address read");
-        LOG_ERR("Qemu supports only 64 queues");
+        LOG_ERR("Qemu supports only %u queues", nvme_dev->num_queues);
         rd_val = 0 ;
     }
     return rd_val;
@@ -621,12 +767,14 @@ static void nvme_pci_write_config(PCIDevice *pci_dev,
 *********************************************************************/
 static uint32_t nvme_pci_read_config(PCIDevice *pci_dev, uint32_t addr, int len)
 {
+    NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
     uint32_t val; /* Value to be returned */
 
     val = pci_default_read_config(pci_dev, addr, len);
     if (range_covers_reg(addr, len, PCI_BASE_ADDRESS_2, PCI_BASE_ADDRESS_2_LEN)
-        && (!(pci_dev->config[PCI_COMMAND] & PCI_COMMAND_IO))) {
-        /* When CMD.IOSE is not set */
+        && (!(pci_dev->config[PCI_COMMAND] & PCI_COMMAND_IO))
+        && n->cmb_buf == NULL) {
+        /* When CMD.IOSE is not set and BAR 2 is not the CMB */
         val = 0 ;
     }
     return val;
@@ -666,6 +814,44 @@ static void nvme_mmio_map(PCIDevice *pci_dev, int reg_num, pcibus_t addr,
     msix_mmio_map(pci_dev, reg_num, addr, size, type);
 }
 
+/*********************************************************************
+    Function     :    nvme_cmb_map
+    Description  :    Maps the Controller Memory Buffer as RAM, the
+                      guest accesses it without exits
+    Return Type  :    void
+    Arguments    :    PCIDevice * : Pointer to the PCI device
+                      int : Region number (BAR 2)
+                      pcibus_t : Address
+                      pcibus_t : Size of the BAR
+                      int : BAR type
+*********************************************************************/
+static void nvme_cmb_map(PCIDevice *pci_dev, int reg_num, pcibus_t addr,
+                            pcibus_t size, int type)
+{
+    NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
+
+    cpu_register_physical_memory(addr, size, n->cmb_offset);
+}
+
+/*********************************************************************
+    Function     :    nvme_pmr_map
+    Description  :    Maps the Persistent Memory Region as RAM, the
+                      guest accesses the host file without exits
+    Return Type  :    void
+    Arguments    :    PCIDevice * : Pointer to the PCI device
+                      int : Region number (BAR 4)
+                      pcibus_t : Address
+                      pcibus_t : Size of the BAR
+                      int : BAR type
+*********************************************************************/
+static void nvme_pmr_map(PCIDevice *pci_dev, int reg_num, pcibus_t addr,
+                            pcibus_t size, int type)
+{
+    NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
+
+    cpu_register_physical_memory(addr, size, n->pmr_offset);
+}
+
 /*********************************************************************
     Function     :    nvme_set_registry
     Description  :    Default initialization of NVME Registery
@@ -695,6 +881,177 @@ static void nvme_set_registry(NVMEState *n)
     }
 }
 
+/*********************************************************************
+    Function     :    nvme_cmb_set_registry
+    Description  :    Sets CMBLOC and CMBSZ, left to 0 (no CMB) by
+                      the config file and the default initialization
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device state
+*********************************************************************/
+static void nvme_cmb_set_registry(NVMEState *n)
+{
+    uint32_t cmbloc = 0, cmbsz = 0;
+
+    if (n->cmb_buf) {
+        /* At offset 0 of BAR 2 */
+        cmbloc = NVME_CMB_BIR;
+        cmbsz = NVME_CMBSZ_SQS | NVME_CMBSZ_SZU_MB | (n->cmb_size_mb << 12);
+        if (n->cmb_data) {
+            cmbsz |= NVME_CMBSZ_LISTS | NVME_CMBSZ_RDS | NVME_CMBSZ_WDS;
+        }
+    }
+    cmbloc = cpu_to_le32(cmbloc);
+    cmbsz = cpu_to_le32(cmbsz);
+    memcpy(&n->cntrl_reg[NVME_CMBLOC], &cmbloc, DWORD);
+    memcpy(&n->cntrl_reg[NVME_CMBSZ], &cmbsz, DWORD);
+}
+
+/*********************************************************************
+    Function     :    nvme_pmr_set_registry
+    Description  :    Sets CAP.PMRS and the PMR registers, left to 0
+                      (no PMR) by the config file and the default
+                      initialization. PMRCTL.EN is the only writable
+                      bit; the region is not ready until it is set.
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device state
+*********************************************************************/
+static void nvme_pmr_set_registry(NVMEState *n)
+{
+    uint32_t pmrcap = 0, pmrsts = 0;
+
+    n->ctrlcap->pmrs = n->pmr_buf != NULL;
+    if (n->pmr_buf) {
+        pmrcap = NVME_PMRCAP_RDS | NVME_PMRCAP_WDS |
+            (NVME_PMR_BIR << NVME_PMRCAP_BIR_SHIFT) | NVME_PMRCAP_WBM_STS |
+            (1 << NVME_PMRCAP_TO_SHIFT);
+        pmrsts = NVME_PMRSTS_NRDY;
+        n->rw_mask[NVME_PMRCTL] = NVME_PMRCTL_EN;
+        n->used_mask[NVME_PMRCTL] = (uint8_t)MASK(8, 0);
+    }
+    pmrcap = cpu_to_le32(pmrcap);
+    pmrsts = cpu_to_le32(pmrsts);
+    memcpy(&n->cntrl_reg[NVME_PMRCAP], &pmrcap, DWORD);
+    memset(&n->cntrl_reg[NVME_PMRCTL], 0, DWORD);
+    memcpy(&n->cntrl_reg[NVME_PMRSTS], &pmrsts, DWORD);
+    memset(&n->cntrl_reg[NVME_PMREBS], 0, 2 * DWORD);
+}
+
+/*********************************************************************
+    Function     :    nvme_pmr_flush
+    Description  :    Writes the guest stores to the PMR back to the
+                      host file, or persistent memory, it maps
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device state
+*********************************************************************/
+static void nvme_pmr_flush(NVMEState *n)
+{
+    if (msync(n->pmr_buf, n->pmr_size, MS_SYNC) < 0) {
+        LOG_ERR("PMR not flushed to %s: %s", n->pmr_path, strerror(errno));
+        n->cntrl_reg[NVME_PMRSTS] = 0xff; /* PMRSTS.ERR */
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_pmr_enable
+    Description  :    Handles a write of PMRCTL. Disabling the PMR
+                      flushes it, it is ready right after enabling.
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device state
+                      uint32_t : PMRCTL.EN written
+*********************************************************************/
+static void nvme_pmr_enable(NVMEState *n, uint32_t en)
+{
+    if (!en && (n->cntrl_reg[NVME_PMRCTL] & NVME_PMRCTL_EN)) {
+        nvme_pmr_flush(n);
+    }
+    nvme_cntrl_write_config(n, NVME_PMRCTL, en, DWORD);
+    if (en) {
+        n->cntrl_reg[NVME_PMRSTS + 1] &= ~(NVME_PMRSTS_NRDY >> 8);
+    } else {
+        n->cntrl_reg[NVME_PMRSTS + 1] |= NVME_PMRSTS_NRDY >> 8;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_pmr_init
+    Description  :    Maps the host file, or DAX device, of the
+                      Persistent Memory Region and registers it as
+                      BAR 4. A regular file is created or grown to
+                      pmr_size_mb if given, otherwise its size is
+                      used; the size of a device must be given. BAR
+                      sizes are powers of 2, so is the PMR.
+    Return Type  :    int (0:1 Success:Failure)
+    Arguments    :    NVMEState * : Pointer to NVME device state
+*********************************************************************/
+static int nvme_pmr_init(NVMEState *n)
+{
+    uint64_t size = (uint64_t)n->pmr_size_mb << 20;
+    struct stat st;
+    void *host;
+
+    n->pmr_fd = open(n->pmr_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (n->pmr_fd < 0 || fstat(n->pmr_fd, &st) < 0) {
+        LOG_ERR("Error while opening PMR %s: %s", n->pmr_path,
+            strerror(errno));
+        goto fail;
+    }
+    if (S_ISREG(st.st_mode)) {
+        if (size == 0) {
+            size = st.st_size;
+        } else if ((uint64_t)st.st_size < size &&
+            ftruncate(n->pmr_fd, size) < 0) {
+            LOG_ERR("Error while sizing PMR %s to %lu bytes", n->pmr_path,
+                size);
+            goto fail;
+        }
+    }
+    if (size < PAGE_SIZE || (size & (size - 1))) {
+        LOG_ERR("bad PMR size:%lu, must be a power of 2 of a page or more, "
+            "set with pmr_size_mb", size);
+        goto fail;
+    }
+    host = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, n->pmr_fd, 0);
+    if (host == MAP_FAILED) {
+        LOG_ERR("Error while mapping PMR %s: %s", n->pmr_path,
+            strerror(errno));
+        goto fail;
+    }
+    n->pmr_buf = host;
+    n->pmr_size = size;
+    n->pmr_offset = qemu_ram_alloc_from_ptr(&n->dev.qdev, "nvme.pmr", size,
+        host);
+    pci_register_bar(&n->dev, NVME_PMR_BIR, size,
+        PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+        PCI_BASE_ADDRESS_MEM_PREFETCH, nvme_pmr_map);
+    LOG_NORM("%s(): PMR of %lu MB from %s in BAR %d", __func__, size >> 20,
+        n->pmr_path, NVME_PMR_BIR);
+    return SUCCESS;
+
+fail:
+    if (n->pmr_fd >= 0) {
+        close(n->pmr_fd);
+    }
+    return FAIL;
+}
+
+/*********************************************************************
+    Function     :    nvme_pmr_uninit
+    Description  :    Flushes and unmaps the Persistent Memory Region
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device state
+*********************************************************************/
+static void nvme_pmr_uninit(NVMEState *n)
+{
+    if (n->pmr_buf == NULL) {
+        return;
+    }
+    qemu_ram_free(n->pmr_offset);
+    nvme_pmr_flush(n);
+    munmap(n->pmr_buf, n->pmr_size);
+    close(n->pmr_fd);
+    n->pmr_buf = NULL;
+}
+
 /*********************************************************************
     Function     :    clear_nvme_device
     Description  :    To reset Nvme Device (Controller Reset)
@@ -703,15 +1060,26 @@ static void nvme_set_registry(NVMEState *n)
 *********************************************************************/
 static void clear_nvme_device(NVMEState *n)
 {
+    uint8_t pmr_reg[NVME_PMRSWTP + DWORD - NVME_PMRCAP];
     uint32_t i = 0;
 
     if (!n) {
         return;
     }
 
-    /* Inflight Operations will not be processed */
+    /* Commands already with the I/O workers are completed first,
+     * inflight operations will not be processed */
+    nvme_workers_drain(n);
     qemu_del_timer(n->sq_processing_timer);
     n->sq_processing_timer_target = 0;
+    /* Outstanding Asynchronous Event Requests are aborted without
+     * completions, as the admin queues are gone */
+    qemu_del_timer(n->async_event_timer);
+    n->outstanding_asyncs = 0;
+    /* Formats in progress go on but their commands are gone */
+    nvme_format_reset(n);
+    /* Open zones are closed, as across a power cycle */
+    nvme_zone_close_all(n);
 
     /* Saving the Admin Queue States before reset */
     n->aqstate.aqa = nvme_cntrl_read_config(n, NVME_AQA, DWORD);
@@ -721,14 +1089,28 @@ static void clear_nvme_device(NVMEState *n)
     n->aqstate.acqa = nvme_cntrl_read_config(n, NVME_ACQ + 4, DWORD);
     n->aqstate.acqa = (n->aqstate.acqa << 32) |
         nvme_cntrl_read_config(n, NVME_ACQ, DWORD);
-    /* Update NVME space registery from config file */
-    read_file(n, NVME_SPACE);
+    /* The PMR is disabled as by a write of PMRCTL, which flushes it.
+     * Its registers are not restored, PMRSTS.ERR telling whether that
+     * flush failed. */
+    if (n->pmr_buf) {
+        nvme_pmr_enable(n, 0);
+        memcpy(pmr_reg, &n->cntrl_reg[NVME_PMRCAP], sizeof(pmr_reg));
+    }
+    /* Back to the registers read from the config file at init */
+    memcpy(n->cntrl_reg, n->reset_reg, NVME_CNTRL_SIZE);
+    if (n->pmr_buf) {
+        memcpy(&n->cntrl_reg[NVME_PMRCAP], pmr_reg, sizeof(pmr_reg));
+    }
     n->intr_vect = 0;
 
-    for (i = 1; i < NVME_MAX_QS_ALLOCATED; i++) {
-        memset(&(n->sq[i]), 0, sizeof(NVMEIOSQueue));
-        memset(&(n->cq[i]), 0, sizeof(NVMEIOCQueue));
+    nvme_sq_free_reqs(n->sq[ASQ_ID]);
+    for (i = 1; i < n->num_queues; i++) {
+        nvme_sq_release(n, i);
+        nvme_cq_release(n, i);
     }
+    /* Commands waiting on the QoS limits went with their SQs */
+    qemu_del_timer(n->qos_timer);
+    n->qos_timer_target = 0;
 
     /* Writing the Admin Queue Attributes after reset */
     nvme_cntrl_write_config(n, NVME_AQA, n->aqstate.aqa, DWORD);
@@ -739,16 +1121,21 @@ static void clear_nvme_device(NVMEState *n)
     nvme_cntrl_write_config(n, NVME_ACQ + 4,
         (uint32_t) (n->aqstate.acqa >> 32), DWORD);
 
-    n->sq[ASQ_ID].head = n->sq[ASQ_ID].tail = 0;
-    n->cq[ACQ_ID].head = n->cq[ACQ_ID].tail = 0;
+    if (n->sq[ASQ_ID]->active) {
+        QTAILQ_REMOVE(&n->sq_active, n->sq[ASQ_ID], active_entry);
+        n->sq[ASQ_ID]->active = 0;
+    }
+    n->sq[ASQ_ID]->head = n->sq[ASQ_ID]->tail = 0;
+    n->cq[ACQ_ID]->head = n->cq[ACQ_ID]->tail = 0;
 
-    n->outstanding_asyncs = 0;
     n->feature.temperature_threshold = NVME_TEMPERATURE + 10;
     n->temp_warn_issued = 0;
     n->err_sts_mask = 0;
     n->smart_mask = 0;
+    /* The notice goes with the queue, the host rescans all namespaces */
+    n->changed_ns_count = 0;
 
-    QSIMPLEQ_INIT(&n->async_queue);
+    nvme_async_events_init(n);
 }
 
 /*********************************************************************
@@ -806,9 +1193,6 @@ static void pci_space_init(PCIDevice *pci_dev)
 
     LOG_NORM("%s(): Setting PCI Interrupt PIN A", __func__);
     pci_conf[PCI_INTERRUPT_PIN] = 1;
-
-    n->nvectors = NVME_MSIX_NVECTORS;
-    n->bar0_size = NVME_REG_SIZE;
 }
 
 /*********************************************************************
@@ -876,10 +1260,10 @@ static void read_identify_cns(NVMEState *n)
 
     LOG_NORM("%s(): called", __func__);
     for (index = 0; index < n->num_namespaces; index++) {
-        n->disk[index].idtfy_ns.nsze = (n->ns_size * BYTES_PER_MB) /
-            BYTES_PER_BLOCK;
-        n->disk[index].idtfy_ns.ncap = (n->ns_size * BYTES_PER_MB) /
-            BYTES_PER_BLOCK;
+        n->disk[index].idtfy_ns.nsze = (n->disk[index].size_mb *
+            BYTES_PER_MB) / BYTES_PER_BLOCK;
+        n->disk[index].idtfy_ns.ncap = (n->disk[index].size_mb *
+            BYTES_PER_MB) / BYTES_PER_BLOCK;
         n->disk[index].idtfy_ns.nuse = 0;
         n->disk[index].idtfy_ns.nlbaf = NO_LBA_FORMATS;
         n->disk[index].idtfy_ns.flbas = LBA_FORMAT_INUSE;
@@ -888,6 +1272,13 @@ static void read_identify_cns(NVMEState *n)
         n->disk[index].idtfy_ns.mc = 1 << 1 | 1 << 0;
         n->disk[index].idtfy_ns.dpc = 1 << 4 | 1 << 3 | 1 << 0;
         n->disk[index].idtfy_ns.dps = 0;
+        n->disk[index].idtfy_ns.fpi = NVME_FPI_SUPPORTED;
+        n->disk[index].idtfy_ns.mssrl = NVME_COPY_MSSRL;
+        n->disk[index].idtfy_ns.mcl = NVME_COPY_MCL;
+        n->disk[index].idtfy_ns.msrc = NVME_COPY_MSRC;
+        n->disk[index].idtfy_ns.nmic = n->subsys_name ? NVME_NMIC_SHARED : 0;
+        n->disk[index].idtfy_ns.rescap = NVME_RESCAP_TYPES;
+        nvme_subsys_nguid(n, index + 1, n->disk[index].idtfy_ns.nguid);
 
         /* Filling in the LBA Format structure */
         for (i = 0 ; i <= NO_LBA_FORMATS; i++) {
@@ -905,7 +1296,9 @@ static void read_identify_cns(NVMEState *n)
     }
     pstrcpy((char *)n->idtfy_ctrl->mn, sizeof(n->idtfy_ctrl->mn),
         "Qemu NVMe Driver 0xabcd");
-    pstrcpy((char *)n->idtfy_ctrl->sn, sizeof(n->idtfy_ctrl->sn), "NVMeQx1000");
+    /* Controllers of a subsystem have the same serial number */
+    pstrcpy((char *)n->idtfy_ctrl->sn, sizeof(n->idtfy_ctrl->sn),
+        n->subsys_name ? n->subsys_name : "NVMeQx1000");
     pstrcpy((char *)n->idtfy_ctrl->fr, sizeof(n->idtfy_ctrl->fr), "012345");
 
     /* TODO: fix this hardcoded values !!!
@@ -918,19 +1311,33 @@ static void read_identify_cns(NVMEState *n)
     n->idtfy_ctrl->sqes = 6 << 4 | 6;
     n->idtfy_ctrl->oacs = 0x2;  /* set due to adm_cmd_format_nvm() */
     n->idtfy_ctrl->oacs |= 0x4; /* set for adm_cmd_act_fw() & adm_cmd_act_dl()*/
+    n->idtfy_ctrl->oacs |= 0x8; /* namespace management and attachment */
+    n->idtfy_ctrl->oaes = NVME_AEN_NS_ATTR;
     n->idtfy_ctrl->oncs = 0x4;  /* dataset mgmt cmd */
+    n->idtfy_ctrl->oncs |= 0x100; /* copy cmd */
+    n->idtfy_ctrl->oncs |= NVME_ONCS_RESERVATIONS;
+    n->idtfy_ctrl->ocfs = 0x1; /* copy descriptor format 0 */
 
     n->idtfy_ctrl->vid = 0x8086;
     n->idtfy_ctrl->ssvid = 0x0111;
     /* number of supported name spaces bytes [516:519] */
     n->idtfy_ctrl->nn = n->num_namespaces;
+    n->idtfy_ctrl->mnan = n->num_namespaces;
+    n->idtfy_ctrl->cntlid = n->instance;
+    n->idtfy_ctrl->ver = NVME_VERSION;
+    n->idtfy_ctrl->mic = n->subsys_name ? NVME_CMIC_MULTI_CTRL : 0;
+    nvme_subsys_nqn(n, (char *)n->idtfy_ctrl->subnqn,
+        sizeof(n->idtfy_ctrl->subnqn));
+    n->idtfy_ctrl->tnvmcap[0] = n->capacity_mb * BYTES_PER_MB;
     n->idtfy_ctrl->acl = NVME_ABORT_COMMAND_LIMIT;
     n->idtfy_ctrl->aerl = ASYNC_EVENT_REQ_LIMIT;
     n->idtfy_ctrl->frmw = 1 << 1 | 0;
     n->idtfy_ctrl->npss = NO_POWER_STATE_SUPPORT;
-    n->idtfy_ctrl->awun = 0xff;
+    n->idtfy_ctrl->awun = n->awun - 1;
+    n->idtfy_ctrl->awupf = n->awupf - 1;
     n->idtfy_ctrl->lpa = 1 << 0;
     n->idtfy_ctrl->mdts = 5; /* 128k max transfer */
+    n->idtfy_ctrl->sgls = NVME_SGLS_SUPPORTED | NVME_SGLS_BIT_BUCKET;
 
     power = (struct power_state_description *)&(n->idtfy_ctrl->psd0);
     power->mp = 1;
@@ -942,6 +1349,45 @@ static void read_identify_cns(NVMEState *n)
     power->mp = 3;
 }
 
+/*********************************************************************
+    Function     :    nvme_parse_ns_sizes
+    Description  :    Sets the size of each namespace from the "size"
+                      property, overridden per namespace by the
+                      colon separated "sizes" list (both in MB)
+    Return Type  :    int (0:1 Success:Failure)
+    Arguments    :    NVMEState * : Pointer to the NVMEState device
+*********************************************************************/
+static int nvme_parse_ns_sizes(NVMEState *n)
+{
+    const char *p = n->ns_sizes;
+    char *end;
+    uint32_t index;
+
+    for (index = 0; index < n->num_namespaces; index++) {
+        n->disk[index].size_mb = n->ns_size;
+        if (p != NULL && *p != '\0') {
+            n->disk[index].size_mb = strtoull(p, &end, 0);
+            if (end == p || (*end != ':' && *end != '\0')) {
+                LOG_ERR("bad namespace sizes list:%s", n->ns_sizes);
+                return FAIL;
+            }
+            p = (*end == ':') ? end + 1 : end;
+        }
+        if (n->disk[index].size_mb == 0 ||
+            n->disk[index].size_mb > NVME_MAX_NAMESPACE_SIZE) {
+            LOG_ERR("bad size value:%lu for namespace %d, must be between 1 "
+                "and %llu", n->disk[index].size_mb, index + 1,
+                NVME_MAX_NAMESPACE_SIZE);
+            return FAIL;
+        }
+    }
+    if (p != NULL && *p != '\0') {
+        LOG_ERR("more sizes than namespaces in list:%s", n->ns_sizes);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
 static void fw_slot_logpage_init(NVMEState *n)
 {
     n->last_fw_slot = 1;
@@ -950,6 +1396,32 @@ static void fw_slot_logpage_init(NVMEState *n)
     strncpy((char *)&(n->fw_slot_log.frs1[0]), "1.0", 3);
 }
 
+/*********************************************************************
+    Function     :    nvme_vm_change_state
+    Description  :    Completes the I/O transfers and formats in
+                      progress when the VM stops, so nothing reaches
+                      guest memory afterwards, as for a migration
+                      sending the last dirty pages
+    Return Type  :    void
+    Arguments    :    void * : Pointer to NVME device State
+                      int    : VM running
+                      int    : Reason of the change
+*********************************************************************/
+static void nvme_vm_change_state(void *opaque, int running, int reason)
+{
+    NVMEState *n = (NVMEState *)opaque;
+
+    if (!running) {
+        /* Throttled commands are not migrated */
+        nvme_qos_flush(n);
+        nvme_workers_drain(n);
+        nvme_format_finish_all(n);
+        if (n->trace_file) {
+            fflush(n->trace_file);
+        }
+    }
+}
+
 /*********************************************************************
     Function     :    pci_nvme_init
     Description  :    NVME initialization
@@ -961,8 +1433,9 @@ static void fw_slot_logpage_init(NVMEState *n)
 static int pci_nvme_init(PCIDevice *pci_dev)
 {
     NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
-    uint32_t ret;
-    uint16_t mps;
+    NVMEState *primary;
+    uint32_t ret, nn;
+    uint64_t size_mb;
     static uint32_t instance;
 
     n->start_time = time(NULL);
@@ -972,28 +1445,163 @@ static int pci_nvme_init(PCIDevice *pci_dev)
             n->num_namespaces, NVME_MAX_NUM_NAMESPACES);
         return -1;
     }
-    if (n->ns_size == 0 || n->ns_size > NVME_MAX_NAMESPACE_SIZE) {
-        LOG_ERR("bad namespace size value:%u, must be between 1 and %d",
-            n->ns_size, NVME_MAX_NAMESPACE_SIZE);
+    if (n->num_queues < 2 || n->num_queues > NVME_MAX_QUEUES) {
+        LOG_ERR("bad number of queues value:%u, must be between 2 and %d",
+            n->num_queues, NVME_MAX_QUEUES);
+        return -1;
+    }
+    if (n->nvectors == 0 || n->nvectors > NVME_MSIX_MAX_NVECTORS) {
+        LOG_ERR("bad number of vectors value:%u, must be between 1 and %d",
+            n->nvectors, NVME_MSIX_MAX_NVECTORS);
+        return -1;
+    }
+    if (n->cmb_size_mb > NVME_CMB_MAX_SIZE_MB) {
+        LOG_ERR("bad cmb_size_mb value:%u, must be at most %d",
+            n->cmb_size_mb, NVME_CMB_MAX_SIZE_MB);
+        return -1;
+    }
+    if (n->num_workers > NVME_MAX_WORKERS) {
+        LOG_ERR("bad number of workers value:%u, must be at most %d",
+            n->num_workers, NVME_MAX_WORKERS);
+        return -1;
+    }
+    if (n->uring_entries > NVME_MAX_URING_ENTRIES) {
+        LOG_ERR("bad io_uring value:%u, must be at most %d",
+            n->uring_entries, NVME_MAX_URING_ENTRIES);
+        return -1;
+    }
+    if (n->awun == 0 || n->awun > NVME_MAX_AWUN || n->awupf == 0 ||
+        n->awupf > MIN(n->awun, NVME_MAX_AWUPF)) {
+        LOG_ERR("bad awun/awupf values:%u/%u, must be 1 <= awupf <= awun "
+            "<= %d, awupf <= %d", n->awun, n->awupf, NVME_MAX_AWUN,
+            NVME_MAX_AWUPF);
+        return -1;
+    }
+    if (n->awupf > 1 && n->subsys_name) {
+        /* Its journal would be one per controller */
+        LOG_ERR("awupf needs namespaces of a single controller");
+        return -1;
+    }
+    if (n->readahead_kb > NVME_MAX_READAHEAD_KB) {
+        LOG_ERR("bad readahead_kb value:%u, must be at most %d",
+            n->readahead_kb, NVME_MAX_READAHEAD_KB);
+        return -1;
+    }
+    if (n->ftl_op > NVME_FTL_MAX_OP || n->ftl_block_kb == 0 ||
+        n->ftl_block_kb % (NVME_FTL_PAGE_SIZE / 1024) ||
+        n->ftl_block_kb > 65536) {
+        LOG_ERR("bad ftl_op/ftl_block_kb values:%u/%u, must be at most %d "
+            "percent and a multiple of %d KB up to 65536", n->ftl_op,
+            n->ftl_block_kb, NVME_FTL_MAX_OP, NVME_FTL_PAGE_SIZE / 1024);
+        return -1;
+    }
+    if (n->ftl_gc_name == NULL || !strcmp(n->ftl_gc_name, "greedy")) {
+        n->ftl_gc = NVME_FTL_GC_GREEDY;
+    } else if (!strcmp(n->ftl_gc_name, "cost-benefit")) {
+        n->ftl_gc = NVME_FTL_GC_COST_BENEFIT;
+    } else {
+        LOG_ERR("bad ftl_gc value:%s, must be greedy or cost-benefit",
+            n->ftl_gc_name);
         return -1;
     }
 
+    if (n->max_namespaces > NVME_MAX_NUM_NAMESPACES) {
+        LOG_ERR("bad max_namespaces value:%u, must be at most %d",
+            n->max_namespaces, NVME_MAX_NUM_NAMESPACES);
+        return -1;
+    }
+    if (nvme_subsys_check(n)) {
+        return -1;
+    }
+
+    /* Controllers joining a subsystem take its namespaces */
+    primary = nvme_subsys_primary_of(n);
+    nn = primary ? primary->num_namespaces :
+        MAX(n->num_namespaces, n->max_namespaces);
+    n->disk = (DiskInfo *)qemu_mallocz(sizeof(DiskInfo) * nn);
+    if (primary) {
+        n->num_namespaces = MIN(n->num_namespaces, nn);
+        for (ret = 0; ret < nn; ret++) {
+            n->disk[ret].size_mb = primary->disk[ret].size_mb;
+        }
+        n->capacity_mb = primary->capacity_mb;
+    } else if (nvme_parse_ns_sizes(n)) {
+        qemu_free(n->disk);
+        return -1;
+    }
+    for (ret = 0, size_mb = 0; ret < n->num_namespaces; ret++) {
+        size_mb += n->disk[ret].size_mb;
+    }
+    if (n->capacity_mb == 0) {
+        n->capacity_mb = size_mb;
+    } else if (n->capacity_mb < size_mb) {
+        LOG_ERR("bad capacity_mb value:%lu, the namespaces take %lu MB",
+            n->capacity_mb, size_mb);
+        qemu_free(n->disk);
+        return -1;
+    }
+    if (n->zone_cap_mb > n->zone_size_mb) {
+        LOG_ERR("bad zone_cap_mb value:%u, must be at most zone_size_mb:%u",
+            n->zone_cap_mb, n->zone_size_mb);
+        qemu_free(n->disk);
+        return -1;
+    }
+    if (n->max_open_zones && n->max_active_zones &&
+        n->max_open_zones > n->max_active_zones) {
+        LOG_ERR("bad max_open_zones value:%u, must be at most "
+            "max_active_zones:%u", n->max_open_zones, n->max_active_zones);
+        qemu_free(n->disk);
+        return -1;
+    }
+    for (ret = 0; ret < nn; ret++) {
+        if (ret < n->num_namespaces &&
+            n->disk[ret].size_mb < n->zone_size_mb) {
+            LOG_ERR("bad zone_size_mb value:%u, namespace %d is %lu MB",
+                n->zone_size_mb, ret + 1, n->disk[ret].size_mb);
+            qemu_free(n->disk);
+            return -1;
+        }
+        /* The namespaces given are there from the start, the others
+         * unallocated */
+        n->disk[ret].allocated = n->disk[ret].attached =
+            ret < n->num_namespaces;
+        n->disk[ret].nsid = ret + 1;
+        nvme_backing_init(&n->disk[ret].data);
+        nvme_backing_init(&n->disk[ret].meta);
+        nvme_backing_init(&n->disk[ret].zones);
+        nvme_throttle_set(&n->disk[ret].qos, n->qos_iops, n->qos_bps,
+            n->qos_iops_burst, n->qos_bps_burst);
+        QSIMPLEQ_INIT(&n->disk[ret].qos_queue);
+        QTAILQ_INIT(&n->disk[ret].rw_inflight);
+    }
+    /* Namespace IDs from here on, allocated or not */
+    n->num_namespaces = nn;
     n->instance = instance++;
-    n->disk = (DiskInfo *)qemu_malloc(sizeof(DiskInfo)*n->num_namespaces);
 
-    /* Zero out the Queue Datastructures */
-    memset(n->cq, 0, sizeof(NVMEIOCQueue) * NVME_MAX_QS_ALLOCATED);
-    memset(n->sq, 0, sizeof(NVMEIOSQueue) * NVME_MAX_QS_ALLOCATED);
+    /* Only the admin queues exist until the guest creates more */
+    n->cq = qemu_mallocz(sizeof(NVMEIOCQueue *) * n->num_queues);
+    n->sq = qemu_mallocz(sizeof(NVMEIOSQueue *) * n->num_queues);
+    QTAILQ_INIT(&n->sq_active);
+    n->vector_cqs = qemu_malloc(sizeof(*n->vector_cqs) * n->nvectors);
+    for (ret = 0; ret < n->nvectors; ret++) {
+        QTAILQ_INIT(&n->vector_cqs[ret]);
+    }
 
     /* Initialize the admin queues */
-    n->sq[ASQ_ID].phys_contig = 1;
-    n->cq[ACQ_ID].phys_contig = 1;
-    n->cq[ACQ_ID].irq_enabled = 1;
-    n->cq[ACQ_ID].vector = 0;
+    nvme_sq_alloc(n, ASQ_ID);
+    nvme_cq_alloc(n, ACQ_ID);
+    n->sq[ASQ_ID]->phys_contig = 1;
+    n->cq[ACQ_ID]->phys_contig = 1;
+    n->cq[ACQ_ID]->irq_enabled = 1;
+    n->cq[ACQ_ID]->vector = 0;
+    nvme_cq_link_vector(n, n->cq[ACQ_ID]);
 
     /* TODO: pci_conf = n->dev.config; */
-    n->nvectors = NVME_MSIX_NVECTORS;
+    /* Registers, then the doorbells of all the queues */
     n->bar0_size = NVME_REG_SIZE;
+    while (n->bar0_size < NVME_SQ0TDBL + 8 * n->num_queues) {
+        n->bar0_size <<= 1;
+    }
 
     /* Reading the PCI space from the file */
     read_file(n, PCI_SPACE);
@@ -1020,6 +1628,26 @@ static int pci_nvme_init(PCIDevice *pci_dev)
         PCI_BASE_ADDRESS_MEM_TYPE_64),
         nvme_mmio_map);
 
+    /* Controller Memory Buffer, BAR sizes are powers of 2 */
+    if (n->cmb_size_mb) {
+        pcibus_t cmb_bar_size = 1;
+
+        while (cmb_bar_size < NVME_CMB_SIZE(n)) {
+            cmb_bar_size <<= 1;
+        }
+        n->cmb_offset = qemu_ram_alloc(&n->dev.qdev, "nvme.cmb",
+            cmb_bar_size);
+        n->cmb_buf = qemu_get_ram_ptr(n->cmb_offset);
+        pci_register_bar(&n->dev, NVME_CMB_BIR, cmb_bar_size,
+            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+            PCI_BASE_ADDRESS_MEM_PREFETCH, nvme_cmb_map);
+        LOG_NORM("%s(): CMB of %u MB in BAR %d", __func__, n->cmb_size_mb,
+            NVME_CMB_BIR);
+    }
+    if (n->pmr_path && nvme_pmr_init(n) != SUCCESS) {
+        return -1;
+    }
+
     /* Allocating space for NVME regspace & masks except the doorbells */
     n->cntrl_reg = qemu_mallocz(NVME_CNTRL_SIZE);
     n->rw_mask = qemu_mallocz(NVME_CNTRL_SIZE);
@@ -1045,11 +1673,20 @@ static int pci_nvme_init(PCIDevice *pci_dev)
 
     /* Update NVME space registery from config file */
     read_file(n, NVME_SPACE);
+    nvme_cmb_set_registry(n);
+    nvme_pmr_set_registry(n);
+    if (n->zone_size_mb) {
+        /* Namespaces of other command sets than NVM are reported */
+        n->ctrlcap->css |= NVME_CAP_CSS_IOCS;
+    }
+    /* Kept for controller resets, which do not read the file again */
+    n->reset_reg = qemu_malloc(NVME_CNTRL_SIZE);
+    memcpy(n->reset_reg, n->cntrl_reg, NVME_CNTRL_SIZE);
 
     /* Defaulting the number of Queues */
     /* Indicates the number of I/O Q's allocated. This is 0's based value. */
-    n->feature.number_of_queues = ((NVME_MAX_QID - 1) << 16)
-        | (NVME_MAX_QID - 1);
+    n->feature.number_of_queues = ((NVME_MAX_QID(n) - 1) << 16)
+        | (NVME_MAX_QID(n) - 1);
 
     /* Defaulting the temperature threshold, 60 C */
     n->feature.temperature_threshold = NVME_TEMPERATURE + 10;
@@ -1068,18 +1705,18 @@ static int pci_nvme_init(PCIDevice *pci_dev)
     fw_slot_logpage_init(n);
 
     /* Reading CC.MPS field */
-    memcpy(&mps, &n->cntrl_reg[NVME_CC], WORD);
-    mps &= (uint16_t) MASK(4, 7);
-    mps >>= 7;
-    n->page_size = (1 << (12 + mps));
-    LOG_DBG("Page Size: %d", n->page_size);
+    nvme_set_page_size(n);
 
-    /* Create the Storage Disk */
+    /* Create the Storage Disk, or open those of the subsystem */
+    nvme_subsys_join(n, primary);
     if (nvme_create_storage_disks(n)) {
         LOG_NORM("Errors while creating NVME disk");
     }
     n->sq_processing_timer = qemu_new_timer_ns(vm_clock,
         sq_processing_timer_cb, n);
+    n->format_timer = qemu_new_timer_ns(vm_clock, nvme_format_timer_cb, n);
+    n->cow_timer = qemu_new_timer_ns(vm_clock, nvme_cow_timer_cb, n);
+    n->qos_timer = qemu_new_timer_ns(vm_clock, nvme_qos_timer_cb, n);
 
     n->outstanding_asyncs = 0;
     n->async_event_timer = qemu_new_timer_ns(vm_clock,
@@ -1087,7 +1724,47 @@ static int pci_nvme_init(PCIDevice *pci_dev)
     n->err_sts_mask = 0;
     n->smart_mask = 0;
 
-    QSIMPLEQ_INIT(&n->async_queue);
+    nvme_async_events_init(n);
+    qemu_sglist_init(&n->qsg, 16);
+    if (n->detect_zeroes) {
+        n->zero_map = bitmap_new(NVME_MAX_NLB);
+    }
+
+    if (n->backend_path && nvme_backend_init(n)) {
+        LOG_NORM("Backend not used, transfers run as without it");
+    }
+    if (n->backend && (n->uring_entries || n->num_workers)) {
+        LOG_NORM("I/O workers and io_uring not started, the backend runs "
+            "the transfers");
+        n->uring_entries = 0;
+        n->num_workers = 0;
+    }
+    if (n->uring_entries && nvme_uring_init(n)) {
+        LOG_NORM("io_uring not set up, transfers run as without it");
+    }
+    if (n->uring && n->num_workers) {
+        LOG_NORM("I/O workers not started, io_uring runs the transfers");
+        n->num_workers = 0;
+    }
+    if (nvme_workers_init(n)) {
+        LOG_NORM("I/O workers not started, commands run in the main thread");
+        n->num_workers = 0;
+    }
+    if (n->trace_path && nvme_trace_init(n)) {
+        LOG_NORM("Commands not traced");
+    }
+    if (n->replay_path && nvme_replay_init(n)) {
+        nvme_subsys_leave(n);
+        return -1;
+    }
+    n->vmstate_change = qemu_add_vm_change_state_handler(nvme_vm_change_state,
+        n);
+    QTAILQ_INSERT_TAIL(&nvme_devices, n, entry);
+
+    /* Namespace data, streamed ahead of the device state when migrating */
+    register_savevm_live(&n->dev.qdev, "nvme-storage", -1, 1,
+        nvme_storage_mig_set_params, nvme_storage_save_live, NULL,
+        nvme_storage_load, n);
 
     return 0;
 }
@@ -1101,6 +1778,18 @@ static int pci_nvme_init(PCIDevice *pci_dev)
 static int pci_nvme_uninit(PCIDevice *pci_dev)
 {
     NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
+    uint32_t i;
+
+    unregister_savevm(&n->dev.qdev, "nvme-storage", n);
+    QTAILQ_REMOVE(&nvme_devices, n, entry);
+    qemu_del_vm_change_state_handler(n->vmstate_change);
+    n->vmstate_change = NULL;
+    nvme_replay_uninit(n);
+    nvme_trace_uninit(n);
+    nvme_backend_uninit(n);
+    nvme_uring_uninit(n);
+    nvme_workers_uninit(n);
+    nvme_subsys_leave(n);
 
     /* Freeing space allocated for NVME regspace masks except the doorbells */
     qemu_free(n->cntrl_reg);
@@ -1108,8 +1797,24 @@ static int pci_nvme_uninit(PCIDevice *pci_dev)
     qemu_free(n->rwc_mask);
     qemu_free(n->rws_mask);
     qemu_free(n->used_mask);
+    qemu_free(n->reset_reg);
     qemu_free(n->idtfy_ctrl);
+    for (i = 0; i < n->num_queues; i++) {
+        nvme_sq_release(n, i);
+        nvme_cq_release(n, i);
+    }
     qemu_free(n->disk);
+    qemu_free(n->sq);
+    qemu_free(n->cq);
+    qemu_free(n->vector_cqs);
+    qemu_sglist_destroy(&n->qsg);
+    qemu_vfree(n->direct_buf);
+    qemu_free(n->zero_map);
+    if (n->cmb_buf) {
+        qemu_ram_free(n->cmb_offset);
+        n->cmb_buf = NULL;
+    }
+    nvme_pmr_uninit(n);
 
     if (n->sq_processing_timer) {
         if (n->sq_processing_timer_target) {
@@ -1125,11 +1830,419 @@ static int pci_nvme_uninit(PCIDevice *pci_dev)
         n->async_event_timer = NULL;
     }
 
+    if (n->format_timer) {
+        qemu_del_timer(n->format_timer);
+        qemu_free_timer(n->format_timer);
+        n->format_timer = NULL;
+    }
+
+    if (n->cow_timer) {
+        qemu_del_timer(n->cow_timer);
+        qemu_free_timer(n->cow_timer);
+        n->cow_timer = NULL;
+    }
+
+    if (n->qos_timer) {
+        qemu_del_timer(n->qos_timer);
+        qemu_free_timer(n->qos_timer);
+        n->qos_timer = NULL;
+    }
+
     nvme_close_storage_disks(n);
     LOG_NORM("Freed NVME device memory");
     return 0;
 }
 
+/* Fields of NVMEState and DiskInfo saved through a custom VMStateInfo */
+#define VMSTATE_NVME_INFO(_field, _state, _info) {                   \
+    .name       = (stringify(_field)),                               \
+    .info       = &(_info),                                          \
+    .flags      = VMS_SINGLE,                                        \
+    .offset     = offsetof(_state, _field),                          \
+}
+
+static void put_nvme_msix(QEMUFile *f, void *pv, size_t size)
+{
+    msix_save((PCIDevice *)pv, f);
+}
+
+static int get_nvme_msix(QEMUFile *f, void *pv, size_t size)
+{
+    msix_load((PCIDevice *)pv, f);
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_nvme_msix = {
+    .name = "nvme msix",
+    .get  = get_nvme_msix,
+    .put  = put_nvme_msix,
+};
+
+/* Pending asynchronous events, as a count followed by the results */
+static void put_nvme_async_queue(QEMUFile *f, void *pv, size_t size)
+{
+    struct async_queue *queue = pv;
+    AsyncEvent *event;
+    uint32_t count = 0;
+
+    QSIMPLEQ_FOREACH(event, queue, entry) {
+        count++;
+    }
+    qemu_put_be32(f, count);
+    QSIMPLEQ_FOREACH(event, queue, entry) {
+        qemu_put_byte(f, event->result.event_type);
+        qemu_put_byte(f, event->result.event_info);
+        qemu_put_byte(f, event->result.log_page);
+    }
+}
+
+static int get_nvme_async_queue(QEMUFile *f, void *pv, size_t size)
+{
+    NVMEState *n = container_of(pv, NVMEState, async_queue);
+    AsyncEvent *event;
+    uint32_t count;
+
+    nvme_async_events_init(n);
+    for (count = qemu_get_be32(f); count > 0; count--) {
+        event = nvme_async_event_alloc(n);
+        if (event == NULL) {
+            return -EINVAL;
+        }
+        event->result.event_type = qemu_get_byte(f);
+        event->result.event_info = qemu_get_byte(f);
+        event->result.log_page = qemu_get_byte(f);
+        QSIMPLEQ_INSERT_TAIL(&n->async_queue, event, entry);
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_nvme_async_queue = {
+    .name = "nvme async queue",
+    .get  = get_nvme_async_queue,
+    .put  = put_nvme_async_queue,
+};
+
+/* Namespace utilization bitmap, sized from the namespace it belongs to */
+static void put_nvme_ns_util(QEMUFile *f, void *pv, size_t size)
+{
+    DiskInfo *disk = container_of(pv, DiskInfo, ns_util);
+    uint64_t len = disk->ns_util ? (disk->idtfy_ns.nsze + 7) / 8 : 0;
+
+    qemu_put_be64(f, len);
+    if (len) {
+        qemu_put_buffer(f, disk->ns_util, len);
+    }
+}
+
+static int get_nvme_ns_util(QEMUFile *f, void *pv, size_t size)
+{
+    DiskInfo *disk = container_of(pv, DiskInfo, ns_util);
+    uint64_t len = qemu_get_be64(f);
+
+    if (len != (disk->idtfy_ns.nsze + 7) / 8 && len != 0) {
+        LOG_ERR("%s(): bitmap of %lu bytes for nsid:%d", __func__, len,
+            disk->nsid);
+        return -EINVAL;
+    }
+    qemu_free(disk->ns_util);
+    disk->ns_util = len ? qemu_malloc(len) : NULL;
+    if (len) {
+        qemu_get_buffer(f, disk->ns_util, len);
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_nvme_ns_util = {
+    .name = "nvme ns_util",
+    .get  = get_nvme_ns_util,
+    .put  = put_nvme_ns_util,
+};
+
+static const VMStateDescription vmstate_nvme_sq = {
+    .name = "nvme-sq",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT16(id, NVMEIOSQueue),
+        VMSTATE_UINT16(cq_id, NVMEIOSQueue),
+        VMSTATE_UINT32(head, NVMEIOSQueue),
+        VMSTATE_UINT32(tail, NVMEIOSQueue),
+        VMSTATE_UINT16(prio, NVMEIOSQueue),
+        VMSTATE_UINT16(phys_contig, NVMEIOSQueue),
+        VMSTATE_UINT32(size, NVMEIOSQueue),
+        VMSTATE_UINT64(dma_addr, NVMEIOSQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_nvme_cq = {
+    .name = "nvme-cq",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT16(id, NVMEIOCQueue),
+        VMSTATE_UINT16(usage_cnt, NVMEIOCQueue),
+        VMSTATE_UINT32(head, NVMEIOCQueue),
+        VMSTATE_UINT32(tail, NVMEIOCQueue),
+        VMSTATE_UINT32(vector, NVMEIOCQueue),
+        VMSTATE_UINT16(irq_enabled, NVMEIOCQueue),
+        VMSTATE_UINT16(phys_contig, NVMEIOCQueue),
+        VMSTATE_UINT32(size, NVMEIOCQueue),
+        VMSTATE_UINT64(dma_addr, NVMEIOCQueue),
+        VMSTATE_UINT8(phase_tag, NVMEIOCQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Allocated queues only: be32 count, then be16 ID and state of each,
+ * CQs first so that SQs find theirs. Lists are relinked by post_load */
+static void put_nvme_queues_of(QEMUFile *f, NVMEState *n, int sqs)
+{
+    uint32_t i, count = 0;
+
+    for (i = 0; i < n->num_queues; i++) {
+        if (sqs ? n->sq[i] != NULL : n->cq[i] != NULL) {
+            count++;
+        }
+    }
+    qemu_put_be32(f, count);
+    for (i = 0; i < n->num_queues; i++) {
+        if (sqs && n->sq[i]) {
+            qemu_put_be16(f, i);
+            vmstate_save_state(f, &vmstate_nvme_sq, n->sq[i]);
+        } else if (!sqs && n->cq[i]) {
+            qemu_put_be16(f, i);
+            vmstate_save_state(f, &vmstate_nvme_cq, n->cq[i]);
+        }
+    }
+}
+
+static void put_nvme_queues(QEMUFile *f, void *pv, size_t size)
+{
+    NVMEState *n = container_of(pv, NVMEState, cq);
+
+    put_nvme_queues_of(f, n, 0);
+    put_nvme_queues_of(f, n, 1);
+}
+
+static int get_nvme_queues(QEMUFile *f, void *pv, size_t size)
+{
+    NVMEState *n = container_of(pv, NVMEState, cq);
+    uint32_t i, count;
+    uint16_t qid;
+    int ret;
+
+    /* Admin queues stay allocated, I/O ones come from the stream */
+    for (i = 1; i < n->num_queues; i++) {
+        nvme_sq_release(n, i);
+        nvme_cq_release(n, i);
+    }
+    for (count = qemu_get_be32(f); count > 0; count--) {
+        qid = qemu_get_be16(f);
+        if (qid >= n->num_queues) {
+            return -EINVAL;
+        }
+        if (n->cq[qid] == NULL) {
+            nvme_cq_alloc(n, qid);
+        }
+        ret = vmstate_load_state(f, &vmstate_nvme_cq, n->cq[qid], 1);
+        if (ret) {
+            return ret;
+        }
+    }
+    for (count = qemu_get_be32(f); count > 0; count--) {
+        qid = qemu_get_be16(f);
+        if (qid >= n->num_queues) {
+            return -EINVAL;
+        }
+        if (n->sq[qid] == NULL) {
+            nvme_sq_alloc(n, qid);
+        }
+        ret = vmstate_load_state(f, &vmstate_nvme_sq, n->sq[qid], 1);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_nvme_queues = {
+    .name = "nvme queues",
+    .get  = get_nvme_queues,
+    .put  = put_nvme_queues,
+};
+
+static const VMStateDescription vmstate_nvme_features = {
+    .name = "nvme-features",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT32(arbitration, struct nvme_features),
+        VMSTATE_UINT32(power_management, struct nvme_features),
+        VMSTATE_UINT32(LBA_range_type, struct nvme_features),
+        VMSTATE_UINT32(temperature_threshold, struct nvme_features),
+        VMSTATE_UINT32(error_recovery, struct nvme_features),
+        VMSTATE_UINT32(volatile_write_cache, struct nvme_features),
+        VMSTATE_UINT32(number_of_queues, struct nvme_features),
+        VMSTATE_UINT32(interrupt_coalescing, struct nvme_features),
+        VMSTATE_UINT32(interrupt_vector_configuration, struct nvme_features),
+        VMSTATE_UINT32(write_atomicity, struct nvme_features),
+        VMSTATE_UINT32(asynchronous_event_configuration,
+            struct nvme_features),
+        VMSTATE_UINT32(software_progress_marker, struct nvme_features),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* The namespace data itself goes through the "nvme-storage" section */
+static const VMStateDescription vmstate_nvme_disk = {
+    .name = "nvme-disk",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField []) {
+        VMSTATE_BUFFER_UNSAFE(idtfy_ns, DiskInfo, 0,
+            sizeof(NVMEIdentifyNamespace)),
+        VMSTATE_NVME_INFO(ns_util, DiskInfo, vmstate_info_nvme_ns_util),
+        VMSTATE_UINT8(thresh_warn_issued, DiskInfo),
+        VMSTATE_UINT32(write_data_counter, DiskInfo),
+        VMSTATE_UINT32(read_data_counter, DiskInfo),
+        VMSTATE_UINT64_ARRAY(data_units_read, DiskInfo, 2),
+        VMSTATE_UINT64_ARRAY(data_units_written, DiskInfo, 2),
+        VMSTATE_UINT64_ARRAY(host_read_commands, DiskInfo, 2),
+        VMSTATE_UINT64_ARRAY(host_write_commands, DiskInfo, 2),
+        VMSTATE_UINT8(allocated, DiskInfo),
+        VMSTATE_UINT8(attached, DiskInfo),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_nvme_registrant = {
+    .name = "nvme-registrant",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT64(rkey, NVMERegistrant),
+        VMSTATE_UINT64(hostid, NVMERegistrant),
+        VMSTATE_UINT16(cntlid, NVMERegistrant),
+        VMSTATE_UINT8(valid, NVMERegistrant),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Shared by the controllers of a subsystem, each sending the same */
+static const VMStateDescription vmstate_nvme_resv = {
+    .name = "nvme-resv",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT32(gen, NVMEReservation),
+        VMSTATE_UINT8(rtype, NVMEReservation),
+        VMSTATE_UINT8(holder, NVMEReservation),
+        VMSTATE_STRUCT_ARRAY(regs, NVMEReservation, NVME_SUBSYS_MAX_CTRLS, 0,
+            vmstate_nvme_registrant, NVMERegistrant),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/*********************************************************************
+    Function     :    nvme_post_load
+    Description  :    Restores the state not carried by the fields
+                      after an incoming migration. Commands the guest
+                      submitted but the source had not fetched yet are
+                      replayed from the restored SQ head/tail.
+    Return Type  :    int
+    Arguments    :    void * : Pointer to NVME device State
+                      int    : Version of the incoming state
+*********************************************************************/
+static int nvme_post_load(void *opaque, int version_id)
+{
+    NVMEState *n = (NVMEState *)opaque;
+    uint32_t i;
+    int pending = 0;
+
+    /* msix_load() released the vectors */
+    for (i = 0; i < n->nvectors; i++) {
+        msix_vector_use(&n->dev, i);
+        QTAILQ_INIT(&n->vector_cqs[i]);
+    }
+
+    QTAILQ_INIT(&n->sq_active);
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->cq[i]) {
+            nvme_cq_link_vector(n, n->cq[i]);
+        }
+        if (n->sq[i] == NULL) {
+            continue;
+        }
+        /* No request is outstanding when the state is saved, the pools
+         * are rebuilt on first use */
+        nvme_sq_free_reqs(n->sq[i]);
+        n->sq[i]->active = 0;
+        nvme_sq_activate(n, n->sq[i]);
+        if (n->sq[i]->active) {
+            pending = 1;
+        }
+    }
+    /* Zone states came in with the storage, and the writes journaled
+     * before are played back over it now that the source stopped */
+    for (i = 0; i < n->num_namespaces; i++) {
+        nvme_zone_recount(&n->disk[i]);
+        nvme_journal_recover(n, &n->disk[i]);
+    }
+
+    if (pending && !qemu_timer_pending(n->sq_processing_timer)) {
+        n->sq_processing_timer_target = qemu_get_clock_ns(vm_clock) + 5000;
+        qemu_mod_timer(n->sq_processing_timer,
+            n->sq_processing_timer_target);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_nvme = {
+    .name = "nvme",
+    .version_id = 4,
+    .minimum_version_id = 4,
+    .post_load = nvme_post_load,
+    .fields = (VMStateField []) {
+        VMSTATE_PCI_DEVICE(dev, NVMEState),
+        VMSTATE_UINT32_EQUAL(nvectors, NVMEState),
+        VMSTATE_NVME_INFO(dev, NVMEState, vmstate_info_nvme_msix),
+        VMSTATE_BUFFER_POINTER_UNSAFE(cntrl_reg, NVMEState, 0,
+            NVME_CNTRL_SIZE),
+        VMSTATE_UINT32(intr_vect, NVMEState),
+        VMSTATE_UINT32(page_size, NVMEState),
+        VMSTATE_STRUCT(feature, NVMEState, 0, vmstate_nvme_features,
+            struct nvme_features),
+        VMSTATE_UINT32(aqstate.aqa, NVMEState),
+        VMSTATE_UINT64(aqstate.asqa, NVMEState),
+        VMSTATE_UINT64(aqstate.acqa, NVMEState),
+        VMSTATE_UINT32_EQUAL(num_queues, NVMEState),
+        VMSTATE_NVME_INFO(cq, NVMEState, vmstate_info_nvme_queues),
+        VMSTATE_UINT32_EQUAL(num_namespaces, NVMEState),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(disk, NVMEState, num_namespaces,
+            vmstate_nvme_disk, DiskInfo),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(resv, NVMEState, num_namespaces,
+            vmstate_nvme_resv, NVMEReservation),
+        VMSTATE_UINT64(hostid, NVMEState),
+        VMSTATE_BUFFER_UNSAFE(fw_slot_log, NVMEState, 0,
+            sizeof(NVMEFwSlotInfoLog)),
+        VMSTATE_UINT8(last_fw_slot, NVMEState),
+        VMSTATE_UINT8(temp_warn_issued, NVMEState),
+        VMSTATE_UINT16_ARRAY(async_cid, NVMEState, ASYNC_EVENT_REQ_LIMIT + 1),
+        VMSTATE_UINT16(outstanding_asyncs, NVMEState),
+        VMSTATE_NVME_INFO(async_queue, NVMEState,
+            vmstate_info_nvme_async_queue),
+        VMSTATE_UINT8(err_sts_mask, NVMEState),
+        VMSTATE_UINT8(smart_mask, NVMEState),
+        VMSTATE_UINT32_ARRAY(changed_ns, NVMEState, NVME_CHANGED_NS_MAX),
+        VMSTATE_UINT32(changed_ns_count, NVMEState),
+        VMSTATE_INT64(sq_processing_timer_target, NVMEState),
+        VMSTATE_TIMER(sq_processing_timer, NVMEState),
+        VMSTATE_TIMER(async_event_timer, NVMEState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static PCIDeviceInfo nvme_info = {
     .qdev.name = "nvme",
     .qdev.desc = "Non-Volatile Memory Express",
@@ -1142,7 +2255,53 @@ static PCIDeviceInfo nvme_info = {
     .exit = pci_nvme_uninit,
     .qdev.props = (Property[]) {
         DEFINE_PROP_UINT32("namespaces", NVMEState, num_namespaces, 1),
-        DEFINE_PROP_UINT32("size", NVMEState, ns_size, 512),
+        DEFINE_PROP_UINT64("size", NVMEState, ns_size, 512),
+        DEFINE_PROP_STRING("sizes", NVMEState, ns_sizes),
+        DEFINE_PROP_UINT32("max_namespaces", NVMEState, max_namespaces, 0),
+        DEFINE_PROP_UINT64("capacity_mb", NVMEState, capacity_mb, 0),
+        DEFINE_PROP_STRING("subsys", NVMEState, subsys_name),
+        DEFINE_PROP_UINT32("queues", NVMEState, num_queues,
+            NVME_DEFAULT_QUEUES),
+        DEFINE_PROP_UINT32("vectors", NVMEState, nvectors, NVME_MSIX_NVECTORS),
+        DEFINE_PROP_UINT32("cmb_size_mb", NVMEState, cmb_size_mb, 0),
+        DEFINE_PROP_UINT32("cmb_data", NVMEState, cmb_data, 0),
+        DEFINE_PROP_STRING("pmr", NVMEState, pmr_path),
+        DEFINE_PROP_UINT32("pmr_size_mb", NVMEState, pmr_size_mb, 0),
+        DEFINE_PROP_UINT32("workers", NVMEState, num_workers, 0),
+        DEFINE_PROP_UINT32("io_uring", NVMEState, uring_entries, 0),
+        DEFINE_PROP_UINT32("io_uring_sqpoll", NVMEState, uring_sqpoll, 0),
+        DEFINE_PROP_STRING("backend", NVMEState, backend_path),
+        DEFINE_PROP_STRING("base", NVMEState, base_path),
+        DEFINE_PROP_UINT32("ftl", NVMEState, ftl, 0),
+        DEFINE_PROP_UINT32("ftl_op", NVMEState, ftl_op, 7),
+        DEFINE_PROP_UINT32("ftl_block_kb", NVMEState, ftl_block_kb, 1024),
+        DEFINE_PROP_STRING("ftl_gc", NVMEState, ftl_gc_name),
+        DEFINE_PROP_UINT32("ftl_copy_us", NVMEState, ftl_copy_us, 20),
+        DEFINE_PROP_UINT32("ftl_erase_us", NVMEState, ftl_erase_us, 2000),
+        DEFINE_PROP_STRING("trace", NVMEState, trace_path),
+        DEFINE_PROP_STRING("replay", NVMEState, replay_path),
+        DEFINE_PROP_UINT32("replay_speed", NVMEState, replay_speed, 1),
+        DEFINE_PROP_UINT32("direct", NVMEState, direct, 0),
+        DEFINE_PROP_UINT32("detect_zeroes", NVMEState, detect_zeroes, 0),
+        DEFINE_PROP_UINT32("awun", NVMEState, awun, NVME_AWUN),
+        DEFINE_PROP_UINT32("awupf", NVMEState, awupf, NVME_AWUPF),
+        DEFINE_PROP_UINT32("readahead_kb", NVMEState, readahead_kb,
+            NVME_READAHEAD_KB),
+        DEFINE_PROP_UINT32("zone_size_mb", NVMEState, zone_size_mb, 0),
+        DEFINE_PROP_UINT32("zone_cap_mb", NVMEState, zone_cap_mb, 0),
+        DEFINE_PROP_UINT32("max_open_zones", NVMEState, max_open_zones, 0),
+        DEFINE_PROP_UINT32("max_active_zones", NVMEState, max_active_zones,
+            0),
+        DEFINE_PROP_UINT64("qos_iops", NVMEState, qos_iops, 0),
+        DEFINE_PROP_UINT64("qos_bps", NVMEState, qos_bps, 0),
+        DEFINE_PROP_UINT64("qos_iops_burst", NVMEState, qos_iops_burst, 0),
+        DEFINE_PROP_UINT64("qos_bps_burst", NVMEState, qos_bps_burst, 0),
+        DEFINE_PROP_UINT64("qos_sq_iops", NVMEState, qos_sq_iops, 0),
+        DEFINE_PROP_UINT64("qos_sq_bps", NVMEState, qos_sq_bps, 0),
+        DEFINE_PROP_UINT64("qos_sq_iops_burst", NVMEState, qos_sq_iops_burst,
+            0),
+        DEFINE_PROP_UINT64("qos_sq_bps_burst", NVMEState, qos_sq_bps_burst,
+            0),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
@@ -1152,6 +2311,8 @@ static inline void _nvme_check_size(void)
     BUILD_BUG_ON(sizeof(NVMEIdentifyController) != 4096);
     BUILD_BUG_ON(sizeof(NVMEIdentifyNamespace) != 4096);
     BUILD_BUG_ON(sizeof(NVMESmartLog) != 512);
+    BUILD_BUG_ON(sizeof(NVMETraceRecord) != 40);
+    BUILD_BUG_ON(sizeof(NVMESglDesc) != 16);
     BUILD_BUG_ON(sizeof(NVMEAdmCmdFeatures) != 64);
     BUILD_BUG_ON(sizeof(NVMEAdmCmdDeleteSQ) != 64);
     BUILD_BUG_ON(sizeof(NVMEAdmCmdCreateSQ) != 64);
@@ -1173,6 +2334,424 @@ static inline void _nvme_check_size(void)
     BUILD_BUG_ON(sizeof(NVMEStatusField) != 2);
     BUILD_BUG_ON(sizeof(RangeDef) != 16);
     BUILD_BUG_ON(sizeof(CtxAttrib) != 4);
+    BUILD_BUG_ON(sizeof(NVMEIdentifyZonedNs) != 4096);
+    BUILD_BUG_ON(sizeof(NVMEIdentifyZonedCtrl) != 4096);
+    BUILD_BUG_ON(sizeof(NVMEZoneDescr) != 64);
+    BUILD_BUG_ON(sizeof(NVMEZone) != 16);
+    BUILD_BUG_ON(sizeof(NVMEResvStatus) != 24);
+    BUILD_BUG_ON(sizeof(NVMEResvReportEntry) != 24);
+}
+
+/*********************************************************************
+    Function     :    do_nvme_info
+    Description  :    Monitor query of the namespaces of every NVMe
+                      controller and their format progress
+    Return Type  :    void
+    Arguments    :    Monitor * : Monitor
+                      QObject ** : Returned list of controllers
+*********************************************************************/
+void do_nvme_info(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    QList *ns_list;
+    NVMEState *n;
+    DiskInfo *disk;
+    NVMEFtlLog ftl;
+    uint32_t i;
+
+    QTAILQ_FOREACH(n, &nvme_devices, entry) {
+        ns_list = qlist_new();
+        for (i = 0; i < n->num_namespaces; i++) {
+            disk = &n->disk[i];
+            if (!disk->allocated) {
+                continue;
+            }
+            memset(&ftl, 0, sizeof(ftl));
+            nvme_ftl_log(disk, &ftl);
+            qlist_append_obj(ns_list, qobject_from_jsonf("{ 'nsid': %d, "
+                "'size': %" PRId64 ", 'attached': %i, 'ready': %i, "
+                "'formatting': %i, "
+                "'progress': %d, 'remaining': %" PRId64 ", "
+                "'iops': %" PRId64 ", 'bps': %" PRId64 ", "
+                "'clone': %i, 'shared': %" PRId64 ", 'compacting': %i, "
+                "'ftl': %i, 'waf': %d, 'gc_blocks': %" PRId64 ", "
+                "'gc_stall': %" PRId64 ", 'reservation': %d }",
+                i + 1, nvme_ns_bytes(disk), disk->attached,
+                nvme_storage_ready(disk), disk->formatting,
+                100 - (disk->idtfy_ns.fpi & NVME_FPI_REMAINING_MASK),
+                nvme_format_remaining(disk), disk->qos.iops, disk->qos.bps,
+                disk->cow_map != NULL, disk->cow_shared, disk->compacting,
+                disk->ftl != NULL, ftl.waf, ftl.gc_blocks, ftl.stall_ns,
+                n->resv[i].rtype));
+        }
+        qlist_append_obj(list, qobject_from_jsonf("{ 'instance': %d, "
+            "'qdev_id': %s, 'subsys': %s, 'cntlid': %d, 'capacity': %"
+            PRId64 ", 'unallocated': %" PRId64 ", 'namespaces': %p }",
+            n->instance, n->dev.qdev.id ? n->dev.qdev.id : "",
+            n->subsys_name ? n->subsys_name : "", n->idtfy_ctrl->cntlid,
+            n->idtfy_ctrl->tnvmcap[0], nvme_ns_unallocated(n), ns_list));
+    }
+    *ret_data = QOBJECT(list);
+}
+
+static void nvme_ns_info_print(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *ns = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "  namespace %" PRId64 ": %" PRId64 " bytes, ",
+        qdict_get_int(ns, "nsid"), qdict_get_int(ns, "size"));
+    if (!qdict_get_bool(ns, "attached")) {
+        monitor_printf(mon, "detached\n");
+    } else if (qdict_get_bool(ns, "formatting")) {
+        monitor_printf(mon, "formatting %" PRId64 "%% done\n",
+            qdict_get_int(ns, "progress"));
+    } else {
+        monitor_printf(mon, "%s\n", qdict_get_bool(ns, "ready") ?
+            "ready" : "not ready");
+    }
+    if (qdict_get_int(ns, "iops") || qdict_get_int(ns, "bps")) {
+        monitor_printf(mon, "    limited to %" PRId64 " IOPS, %" PRId64
+            " bytes/s (0 for no limit)\n", qdict_get_int(ns, "iops"),
+            qdict_get_int(ns, "bps"));
+    }
+    if (qdict_get_bool(ns, "clone")) {
+        monitor_printf(mon, "    clone, %" PRId64 " blocks shared with its "
+            "base%s\n", qdict_get_int(ns, "shared"),
+            qdict_get_bool(ns, "compacting") ? ", compacting" : "");
+    }
+    if (qdict_get_bool(ns, "ftl")) {
+        monitor_printf(mon, "    FTL write amplification %" PRId64 ".%02"
+            PRId64 ", %" PRId64 " blocks collected, %" PRId64 " us stalled "
+            "by GC\n", qdict_get_int(ns, "waf") / 100,
+            qdict_get_int(ns, "waf") % 100, qdict_get_int(ns, "gc_blocks"),
+            qdict_get_int(ns, "gc_stall") / 1000);
+    }
+    if (qdict_get_int(ns, "reservation")) {
+        monitor_printf(mon, "    reservation type %" PRId64 " held\n",
+            qdict_get_int(ns, "reservation"));
+    }
+}
+
+static void nvme_ctrl_info_print(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *ctrl = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "nvme%" PRId64 " %s: %" PRId64 " of %" PRId64
+        " bytes unallocated\n", qdict_get_int(ctrl, "instance"),
+        qdict_get_str(ctrl, "qdev_id"), qdict_get_int(ctrl, "unallocated"),
+        qdict_get_int(ctrl, "capacity"));
+    if (*qdict_get_str(ctrl, "subsys")) {
+        monitor_printf(mon, "  controller %" PRId64 " of subsystem %s\n",
+            qdict_get_int(ctrl, "cntlid"), qdict_get_str(ctrl, "subsys"));
+    }
+    qlist_iter(qdict_get_qlist(ctrl, "namespaces"), nvme_ns_info_print, mon);
+}
+
+void do_nvme_info_print(Monitor *mon, const QObject *data)
+{
+    qlist_iter(qobject_to_qlist(data), nvme_ctrl_info_print, (void *)mon);
+}
+
+/*********************************************************************
+    Function     :    nvme_find_device
+    Description  :    Looks up a controller by qdev id or as
+                      nvme<instance>
+    Return Type  :    NVMEState * (NULL if none)
+    Arguments    :    const char * : Device name
+*********************************************************************/
+static NVMEState *nvme_find_device(const char *id)
+{
+    char name[16];
+    NVMEState *n;
+
+    QTAILQ_FOREACH(n, &nvme_devices, entry) {
+        snprintf(name, sizeof(name), "nvme%d", n->instance);
+        if ((n->dev.qdev.id && !strcmp(n->dev.qdev.id, id)) ||
+            !strcmp(name, id)) {
+            break;
+        }
+    }
+    return n;
+}
+
+/*********************************************************************
+    Function     :    do_nvme_set_qos
+    Description  :    Monitor command changing the limits of a
+                      namespace, or of every I/O SQ for nsid 0, of a
+                      controller given by qdev id or as nvme<instance>
+    Return Type  :    int (0 on success, -1 on error)
+    Arguments    :    Monitor * : Monitor
+                      const QDict * : Arguments
+                      QObject ** : Unused
+*********************************************************************/
+int do_nvme_set_qos(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *id = qdict_get_str(qdict, "device");
+    int64_t nsid = qdict_get_int(qdict, "nsid");
+    int64_t iops = qdict_get_int(qdict, "iops");
+    int64_t bps = qdict_get_int(qdict, "bps");
+    int64_t iops_burst = qdict_get_try_int(qdict, "iops_burst", 0);
+    int64_t bps_burst = qdict_get_try_int(qdict, "bps_burst", 0);
+    NVMEState *n;
+    uint16_t i;
+
+    n = nvme_find_device(id);
+    if (n == NULL) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, id);
+        return -1;
+    }
+    if (nsid < 0 || nsid > n->num_namespaces) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+            "a namespace of the controller, or 0 for its I/O queues");
+        return -1;
+    }
+    if (iops < 0 || bps < 0 || iops_burst < 0 || bps_burst < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "iops",
+            "limits of 0 or more");
+        return -1;
+    }
+
+    if (nsid == 0) {
+        /* Also the limits of the queues the guest creates later */
+        n->qos_sq_iops = iops;
+        n->qos_sq_bps = bps;
+        n->qos_sq_iops_burst = iops_burst;
+        n->qos_sq_bps_burst = bps_burst;
+        for (i = 1; i < n->num_queues; i++) {
+            if (n->sq[i] != NULL) {
+                nvme_throttle_set(&n->sq[i]->qos, iops, bps, iops_burst,
+                    bps_burst);
+            }
+        }
+    } else {
+        nvme_throttle_set(&n->disk[nsid - 1].qos, iops, bps, iops_burst,
+            bps_burst);
+    }
+    /* Waiting commands see the new limits right away */
+    nvme_qos_kick(n);
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    do_nvme_cow_compact
+    Description  :    Monitor command copying the blocks a clone
+                      namespace still shares with its base image, in
+                      the background, after which the base is closed
+    Return Type  :    int (0 on success, -1 on error)
+    Arguments    :    Monitor * : Monitor
+                      const QDict * : Arguments
+                      QObject ** : Unused
+*********************************************************************/
+int do_nvme_cow_compact(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *id = qdict_get_str(qdict, "device");
+    int64_t nsid = qdict_get_int(qdict, "nsid");
+    NVMEState *n;
+
+    n = nvme_find_device(id);
+    if (n == NULL) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, id);
+        return -1;
+    }
+    if (nsid <= 0 || nsid > n->num_namespaces) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+            "a namespace of the controller");
+        return -1;
+    }
+    if (n->disk[nsid - 1].cow_map == NULL) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+            "a namespace cloned from a base image");
+        return -1;
+    }
+    return nvme_cow_compact(n, &n->disk[nsid - 1]) == SUCCESS ? 0 : -1;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_error
+    Description  :    Reports the status of a failed Namespace
+                      Management or Attachment monitor command
+    Return Type  :    int (-1)
+    Arguments    :    NVMEStatusField * : Status of the operation
+*********************************************************************/
+static int nvme_ns_error(NVMEStatusField *sf)
+{
+    if (sf->sct == NVME_SCT_CMD_SPEC_ERR) {
+        switch (sf->sc) {
+        case NVME_NS_ID_UNAVAILABLE:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "device",
+                "a controller with a namespace ID left");
+            return -1;
+        case NVME_NS_INSUFFICIENT_CAPACITY:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "size_mb",
+                "a size within the unallocated capacity");
+            return -1;
+        case NVME_INVALID_FORMAT:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "lbaf",
+                "a supported LBA format");
+            return -1;
+        case NVME_NS_ALREADY_ATTACHED:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+                "a detached namespace");
+            return -1;
+        case NVME_NS_NOT_ATTACHED:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+                "an attached namespace");
+            return -1;
+        }
+    } else if (sf->sc == NVME_SC_INVALID_NAMESPACE) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+            "an allocated namespace of the controller");
+        return -1;
+    } else if (sf->sc == NVME_SC_INVALID_FIELD) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "size_mb",
+            "a size the namespace can take");
+        return -1;
+    } else if (sf->sc == NVME_SC_FORMAT_IN_PROGRESS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+            "a namespace not being formatted");
+        return -1;
+    }
+    qerror_report(QERR_UNDEFINED_ERROR);
+    return -1;
+}
+
+/*********************************************************************
+    Function     :    do_nvme_ns_create
+    Description  :    Monitor command creating a namespace, not
+                      attached, in the given LBA format
+    Return Type  :    int (0 on success, -1 on error)
+    Arguments    :    Monitor * : Monitor
+                      const QDict * : Arguments
+                      QObject ** : Returned namespace id
+*********************************************************************/
+int do_nvme_ns_create(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *id = qdict_get_str(qdict, "device");
+    int64_t size_mb = qdict_get_int(qdict, "size_mb");
+    int64_t lbaf = qdict_get_try_int(qdict, "lbaf", LBA_FORMAT_INUSE);
+    NVMEIdentifyNamespace *ns;
+    NVMEStatusField sf;
+    NVMEState *n;
+    uint32_t nsid;
+    int ret;
+
+    n = nvme_find_device(id);
+    if (n == NULL) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, id);
+        return -1;
+    }
+    if (lbaf < 0 || lbaf > NO_LBA_FORMATS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "lbaf",
+            "a supported LBA format");
+        return -1;
+    }
+    if (size_mb <= 0 || size_mb > NVME_MAX_NAMESPACE_SIZE) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "size_mb",
+            "a size the namespace can take");
+        return -1;
+    }
+
+    ns = qemu_mallocz(sizeof(*ns));
+    ns->flbas = lbaf;
+    ns->nsze = ns->ncap = size_mb * BYTES_PER_MB / NVME_BLOCK_SIZE(
+        n->disk[0].idtfy_ns.lbafx[lbaf].lbads);
+    memset(&sf, 0, sizeof(sf));
+    ret = nvme_ns_create(n, ns, &nsid, &sf);
+    qemu_free(ns);
+    if (ret != SUCCESS) {
+        return nvme_ns_error(&sf);
+    }
+    *ret_data = qobject_from_jsonf("{ 'nsid': %d }", nsid);
+    return 0;
+}
+
+void do_nvme_ns_create_print(Monitor *mon, const QObject *data)
+{
+    monitor_printf(mon, "namespace %" PRId64 " created\n",
+        qdict_get_int(qobject_to_qdict(data), "nsid"));
+}
+
+/* Operations of do_nvme_ns_manage() */
+enum {
+    NVME_MON_NS_DELETE,
+    NVME_MON_NS_ATTACH,
+    NVME_MON_NS_DETACH,
+    NVME_MON_NS_RESIZE,
+};
+
+/*********************************************************************
+    Function     :    do_nvme_ns_manage
+    Description  :    Monitor commands deleting, attaching, detaching
+                      and resizing a namespace
+    Return Type  :    int (0 on success, -1 on error)
+    Arguments    :    Monitor * : Monitor
+                      const QDict * : Arguments
+                      int : Operation, NVME_MON_NS_*
+*********************************************************************/
+static int do_nvme_ns_manage(Monitor *mon, const QDict *qdict, int op)
+{
+    const char *id = qdict_get_str(qdict, "device");
+    int64_t nsid = qdict_get_int(qdict, "nsid");
+    int64_t size_mb = qdict_get_try_int(qdict, "size_mb", 0);
+    NVMEStatusField sf;
+    NVMEState *n;
+    DiskInfo *disk;
+    int ret;
+
+    n = nvme_find_device(id);
+    if (n == NULL) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, id);
+        return -1;
+    }
+    if (nsid <= 0 || nsid > n->num_namespaces) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "nsid",
+            "an allocated namespace of the controller");
+        return -1;
+    }
+    disk = &n->disk[nsid - 1];
+    memset(&sf, 0, sizeof(sf));
+    switch (op) {
+    case NVME_MON_NS_DELETE:
+        ret = nvme_ns_delete(n, nsid, &sf);
+        break;
+    case NVME_MON_NS_ATTACH:
+    case NVME_MON_NS_DETACH:
+        ret = nvme_ns_attach(n, nsid, op == NVME_MON_NS_ATTACH, &sf);
+        break;
+    default:
+        if (size_mb <= 0 || size_mb > NVME_MAX_NAMESPACE_SIZE) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "size_mb",
+                "a size the namespace can take");
+            return -1;
+        }
+        ret = nvme_ns_resize(n, nsid, size_mb * BYTES_PER_MB /
+            NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[
+            disk->idtfy_ns.flbas & 0xf].lbads), &sf);
+        break;
+    }
+    return ret == SUCCESS ? 0 : nvme_ns_error(&sf);
+}
+
+int do_nvme_ns_delete(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return do_nvme_ns_manage(mon, qdict, NVME_MON_NS_DELETE);
+}
+
+int do_nvme_ns_attach(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return do_nvme_ns_manage(mon, qdict, NVME_MON_NS_ATTACH);
+}
+
+int do_nvme_ns_detach(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return do_nvme_ns_manage(mon, qdict, NVME_MON_NS_DETACH);
+}
+
+int do_nvme_ns_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    return do_nvme_ns_manage(mon, qdict, NVME_MON_NS_RESIZE);
 }
 
 /*********************************************************************
@@ -8,6 +8,9 @@
 #include "loader.h"
 #include "sysemu.h"
 #include "msix.h"
+#include "bitmap.h"
+#include "dma.h"
+#include "qemu-thread.h"
 #include <pthread.h>
 #include <sched.h>
 
@@ -23,7 +26,8 @@
 /* Config FIlE names */
 #define NVME_CONFIG_FILE "NVME_device_NVME_config"
 #define PCI_CONFIG_FILE "NVME_device_PCI_config"
-/* Page size supported by the hardware */
+/* Minimum memory page size (CAP.MPSMIN), the unit of MDTS. The page
+ * size used for PRPs is set by CC.MPS, see NVMEState.page_size */
 #define PAGE_SIZE 4096
 /* Should be in pci class someday. */
 #define PCI_CLASS_STORAGE_EXPRESS 0x010802
@@ -60,28 +64,49 @@
  */
 #define MASK(numbr, offset) ((0xffffffff ^ (0xffffffff << numbr)) << offset)
 
-/* The spec requires giving the table structure
- * a 4K aligned region all by itself. */
-#define MSIX_PAGE_SIZE 0x1000
-/* Reserve second half of the page for pending bits */
-#define MSIX_PAGE_PENDING (MSIX_PAGE_SIZE / 2)
-/* Give 8kB for registers. Should be OK for 512 queues. */
+/* Give at least 8kB for registers, grown to fit the doorbells of all
+ * the queues. */
 #define NVME_REG_SIZE (1024 * 8)
 /* Size of NVME Controller Registers except the Doorbells */
 #define NVME_CNTRL_SIZE 0xfff
 
-/* Maximum Q's allocated for the controller including Admin Q */
-#define NVME_MAX_QS_ALLOCATED 64
+/* Default and maximum Q's of the controller including Admin Q */
+#define NVME_DEFAULT_QUEUES 64
+#define NVME_MAX_QUEUES 65536
 
 /* The Q ID starts from 0 for Admin Q and ends at
- * NVME_MAX_QS_ALLOCATED minus 1 for IO Q's */
-#define NVME_MAX_QID (NVME_MAX_QS_ALLOCATED - 1)
+ * the number of queues minus 1 for IO Q's */
+#define NVME_MAX_QID(n) ((n)->num_queues - 1)
 
 /* Size of PRP entry in bytes */
 #define PRP_ENTRY_SIZE 8
 
-/* Queue Limit.*/
+/* Default and maximum MSI-X vectors */
 #define NVME_MSIX_NVECTORS 32
+#define NVME_MSIX_MAX_NVECTORS 2048
+
+/* Maximum I/O worker threads, none by default */
+#define NVME_MAX_WORKERS 64
+
+/* Maximum entries of the io_uring submission queue, none by default */
+#define NVME_MAX_URING_ENTRIES 4096
+
+/* Default and maximum host read-ahead of sequential streams, in KB */
+#define NVME_READAHEAD_KB 2048
+#define NVME_MAX_READAHEAD_KB 65536
+
+/* Default and maximum atomic write units, normal and power fail, in
+ * logical blocks. Power fail atomicity beyond a single block, as written
+ * by the host file system, takes a journal of NVME_JOURNAL_SLOTS writes
+ * per namespace. */
+#define NVME_AWUN 256
+#define NVME_AWUPF 1
+#define NVME_MAX_AWUN 65536
+#define NVME_MAX_AWUPF 256
+#define NVME_JOURNAL_SLOTS 32
+
+/* Most logical blocks of a read or write, NLB being 16 bits 0's based */
+#define NVME_MAX_NLB 65536
 
 /* Assume that block is 512 bytes */
 #define NVME_BUF_SIZE 4096
@@ -98,6 +123,8 @@
 #define NO_POWER_STATE_SUPPORT 2 /* 0 BASED */
 #define NVME_ABORT_COMMAND_LIMIT 10 /* 0 BASED */
 #define ASYNC_EVENT_REQ_LIMIT 3 /* 0 BASED */
+/* Asynchronous events that can be queued before new ones are dropped */
+#define NVME_ASYNC_EVENT_POOL 32
 
 /* Definitions regarding  Identify Controller Datastructure */
 #define NO_LBA_FORMATS 15 /* 0 BASED */
@@ -105,7 +132,8 @@
 
 #define NVME_SPARE_THRESH 20
 #define NVME_TEMPERATURE 0x143
-#define NVME_MAX_NAMESPACE_SIZE 8192
+/* Namespace size limit in MB (16 TB) */
+#define NVME_MAX_NAMESPACE_SIZE (16ULL * 1024 * 1024)
 #define NVME_MAX_NUM_NAMESPACES 256
 
 /* NVMe Controller Registers */
@@ -119,15 +147,49 @@ enum {
     NVME_AQA       = 0x0024, /* Admin Queue Attributes, 32bit*/
     NVME_ASQ       = 0x0028, /* Admin Submission Queue Base Address, 64b.*/
     NVME_ACQ       = 0x0030, /* Admin Completion Queue Base Address, 64b.*/
-    NVME_RESERVED  = 0x0038, /* Reserved */
+    NVME_CMBLOC    = 0x0038, /* Controller Memory Buffer Location, 32bit */
+    NVME_CMBSZ     = 0x003c, /* Controller Memory Buffer Size, 32bit */
+    NVME_RESERVED  = 0x0040, /* Reserved */
+    NVME_PMRCAP    = 0x0E00, /* Persistent Memory Capabilities, 32bit */
+    NVME_PMRCTL    = 0x0E04, /* Persistent Memory Region Control, 32bit */
+    NVME_PMRSTS    = 0x0E08, /* Persistent Memory Region Status, 32bit */
+    NVME_PMREBS    = 0x0E0C, /* Elasticity Buffer Size, 32bit */
+    NVME_PMRSWTP   = 0x0E10, /* Sustained Write Throughput, 32bit */
     NVME_CMD_SS    = 0x0F00, /* Command Set Specific*/
     NVME_SQ0TDBL   = 0x1000, /* SQ 0 Tail Doorbell, 32bit (Admin) */
     NVME_CQ0HDBL   = 0x1004, /* CQ 0 Head Doorbell, 32bit (Admin)*/
     NVME_SQ1TDBL   = 0x1008, /* SQ 1 Tail Doorbell, 32bit */
     NVME_CQ1HDBL   = 0x100c, /* CQ 1 Head Doorbell, 32bit */
+};
 
-    NVME_SQMAXTDBL = (NVME_SQ0TDBL + 8 * NVME_MAX_QID),
-    NVME_CQMAXHDBL = (NVME_CQ0HDBL + 8 * NVME_MAX_QID)
+/* Last doorbells, depend on the number of queues */
+#define NVME_SQMAXTDBL(n) (NVME_SQ0TDBL + 8 * NVME_MAX_QID(n))
+#define NVME_CQMAXHDBL(n) (NVME_CQ0HDBL + 8 * NVME_MAX_QID(n))
+
+/* Controller Memory Buffer, in the 64 bit BAR 2 */
+#define NVME_CMB_BIR 2
+#define NVME_CMB_SIZE(n) ((uint64_t)(n)->cmb_size_mb << 20)
+/* CMBSZ.SZ is in MB units (CMBSZ.SZU = 2) */
+#define NVME_CMB_MAX_SIZE_MB 0xfffff
+enum {
+    NVME_CMBSZ_SQS   = 1 << 0, /* Submission Queues */
+    NVME_CMBSZ_CQS   = 1 << 1, /* Completion Queues */
+    NVME_CMBSZ_LISTS = 1 << 2, /* PRP Lists */
+    NVME_CMBSZ_RDS   = 1 << 3, /* Read Data */
+    NVME_CMBSZ_WDS   = 1 << 4, /* Write Data */
+    NVME_CMBSZ_SZU_MB = 2 << 8,
+};
+
+/* Persistent Memory Region, in the 64 bit BAR 4 */
+#define NVME_PMR_BIR 4
+enum {
+    NVME_PMRCAP_RDS     = 1 << 3,  /* Read Data */
+    NVME_PMRCAP_WDS     = 1 << 4,  /* Write Data */
+    NVME_PMRCAP_BIR_SHIFT = 5,
+    NVME_PMRCAP_WBM_STS = 1 << 11, /* Reading PMRSTS flushes the writes */
+    NVME_PMRCAP_TO_SHIFT = 16,     /* Timeout, in 500 ms units */
+    NVME_PMRCTL_EN      = 1 << 0,
+    NVME_PMRSTS_NRDY    = 1 << 8,
 };
 
 /* address for SQ ID. */
@@ -166,13 +228,17 @@ typedef struct NVMECtrlCap {
     uint16_t res0:5;
     uint16_t to:8;
     uint16_t res1:5;
-    uint16_t css:4;
-    uint16_t res2:7;
+    uint16_t css:8;
+    uint16_t res2:3;
     uint16_t mpsmin:4;
     uint16_t mpsmax:4;
-    uint16_t res3:8;
+    uint16_t pmrs:1;
+    uint16_t res3:7;
 } NVMECtrlCap;
 
+/* CAP.CSS: I/O Command Sets supported, besides the NVM command set */
+#define NVME_CAP_CSS_IOCS 0x40
+
 typedef struct NVMEVersion {
     uint16_t mnr; /* minor = 0. */
     uint16_t mjr; /* major = 1. */
@@ -206,10 +272,18 @@ typedef struct NVMEAQA {
     uint32_t res1:4;
 } NVMEAQA;
 
-typedef struct CommandEntry {
-    QTAILQ_ENTRY(CommandEntry) entry;
-    uint16_t cid;
-} CommandEntry;
+/* Token buckets limiting the commands and bytes per second of a
+ * namespace or a SQ. The buckets hold up to the burst sizes and may go
+ * into debt, so a command larger than the burst still gets through. */
+typedef struct NVMEThrottle {
+    uint64_t iops;          /* 0 for no limit */
+    uint64_t bps;           /* 0 for no limit */
+    uint64_t iops_burst;    /* one second worth of iops if set as 0 */
+    uint64_t bps_burst;     /* one second worth of bps if set as 0 */
+    double io_tokens;
+    double byte_tokens;
+    int64_t stamp;          /* vm_clock of the last refill */
+} NVMEThrottle;
 
 typedef struct NVMEIOSQueue {
     uint16_t id;
@@ -221,7 +295,16 @@ typedef struct NVMEIOSQueue {
     uint32_t size;
     uint64_t dma_addr; /* DMA Address */
     /*FIXME: Add support for PRP List. */
-    QTAILQ_HEAD(cmd_list, CommandEntry) cmd_list;
+    /* Request pool, one request per queue slot */
+    struct NVMERequest *reqs;
+    QTAILQ_HEAD(req_free, NVMERequest) req_free;
+    /* Requests fetched from the queue and not completed yet */
+    QTAILQ_HEAD(cmd_list, NVMERequest) cmd_list;
+    /* Linked in sq_active while the guest has posted entries */
+    QTAILQ_ENTRY(NVMEIOSQueue) active_entry;
+    uint8_t active;
+    /* Commands are left in the queue while over its limits */
+    NVMEThrottle qos;
 } NVMEIOSQueue;
 
 typedef struct NVMEIOCQueue {
@@ -235,6 +318,10 @@ typedef struct NVMEIOCQueue {
     uint32_t size;
     uint64_t dma_addr; /* DMA Address */
     uint8_t phase_tag; /* check spec for Phase Tag details*/
+    /* Entries fetched for this CQ and still with an I/O worker */
+    uint32_t inflight;
+    /* Linked in the list of CQs sharing the interrupt vector */
+    QTAILQ_ENTRY(NVMEIOCQueue) vector_entry;
 } NVMEIOCQueue;
 
 /* FIXME*/
@@ -260,8 +347,12 @@ enum {
     NVME_FEATURE_WRITE_ATOMICITY          = 0x0a,
     NVME_FEATURE_ASYNCHRONOUS_EVENT_CONF  = 0x0b,
     NVME_FEATURE_SOFTWARE_PROGRESS_MARKER = 0x80, /* Set Features only*/
+    NVME_FEATURE_HOST_IDENTIFIER          = 0x81, /* uses memory buffer */
 };
 
+/* Write Atomicity DN: only AWUPF is honored, for all writes */
+#define NVME_WRITE_ATOMICITY_DN 0x1
+
 struct nvme_features {
     uint32_t arbitration;
     uint32_t power_management;
@@ -315,7 +406,11 @@ typedef struct NVMEIdentifyController {
     uint8_t ieee[3];
     uint8_t mic;
     uint8_t mdts;
-    uint8_t rsvd255[178];
+    uint16_t cntlid; /* [78-79] Controller ID */
+    uint32_t ver; /* [80-83] Version */
+    uint8_t rsvd91[8];
+    uint32_t oaes; /* [92-95] Optional Asynchronous Events Supported */
+    uint8_t rsvd255[160];
     uint16_t oacs;
     uint8_t acl;
     uint8_t aerl;
@@ -323,7 +418,10 @@ typedef struct NVMEIdentifyController {
     uint8_t lpa;
     uint8_t elpe;
     uint8_t npss;
-    uint8_t rsvd511[248];
+    uint8_t rsvd279[16];
+    uint64_t tnvmcap[2]; /* [280-295] Total NVM Capacity, in bytes */
+    uint64_t unvmcap[2]; /* [296-311] Unallocated NVM Capacity */
+    uint8_t rsvd511[200];
     uint8_t sqes;
     uint8_t cqes;
     uint16_t rsvd515;
@@ -334,8 +432,16 @@ typedef struct NVMEIdentifyController {
     uint8_t vwc;
     uint16_t awun;
     uint16_t awupf;
-    uint8_t rsvd703[174];
-    uint8_t rsvd2047[1344];
+    uint8_t nvscc;
+    uint8_t rsvd531;
+    uint16_t acwu;
+    uint16_t ocfs; /* Copy formats supported */
+    uint32_t sgls;
+    uint32_t mnan; /* [540-543] Maximum Number of Allowed Namespaces */
+    uint8_t rsvd703[160];
+    uint8_t rsvd767[64];
+    uint8_t subnqn[256]; /* [768-1023] NVM Subsystem NVMe Qualified Name */
+    uint8_t rsvd2047[1024];
     uint8_t psd0[32];
     uint8_t psdx[992];
     uint8_t vs[1024];
@@ -390,12 +496,103 @@ typedef struct NVMEIdentifyNamespace {
     uint8_t  mc;        /* [27] Metadata Capabilities */
     uint8_t  dpc;       /* [28] End2end Data Protection Capabilities */
     uint8_t  dps;       /* [29] End2end Data Protection Type Settings */
-    uint8_t  res0[98];  /* [30-127] Reserved */
+    uint8_t  nmic;      /* [30] Namespace Multi-path I/O Capabilities */
+    uint8_t  rescap;    /* [31] Reservation Capabilities */
+    uint8_t  fpi;       /* [32] Format Progress Indicator */
+    uint8_t  res0[41];  /* [33-73] Reserved */
+    uint16_t mssrl;     /* [74-75] Maximum Single Source Range Length */
+    uint32_t mcl;       /* [76-79] Maximum Copy Length */
+    uint8_t  msrc;      /* [80] Maximum Source Range Count */
+    uint8_t  res2[23];  /* [81-103] Reserved */
+    uint8_t  nguid[16]; /* [104-119] Namespace Globally Unique Identifier */
+    uint8_t  eui64[8];  /* [120-127] IEEE Extended Unique Identifier */
     struct NVMELBAFormat lbafx[16]; /* [128-191] LBA Format 0-15 Support */
     uint8_t  res1[192]; /* [192-383] Reserved */
     uint8_t  vs[3712];  /* [384-4095] Vendor Specific */
 } NVMEIdentifyNamespace;
 
+/* Identify Namespace of the Zoned Namespace Command Set (CNS 05h) */
+typedef struct NVMEIdentifyZonedNs {
+    uint16_t zoc;       /* [0-1] Zone Operation Characteristics */
+    uint16_t ozcs;      /* [2-3] Optional Zoned Command Support */
+    uint32_t mar;       /* [4-7] Maximum Active Resources, 0's based */
+    uint32_t mor;       /* [8-11] Maximum Open Resources, 0's based */
+    uint32_t rrl;       /* [12-15] Reset Recommended Limit */
+    uint32_t frl;       /* [16-19] Finish Recommended Limit */
+    uint8_t  res0[2796]; /* [20-2815] Reserved */
+    struct {
+        uint64_t zsze;  /* Zone Size in LBAs */
+        uint8_t  zdes;  /* Zone Descriptor Extension Size */
+        uint8_t  res[7];
+    } lbafe[16];        /* [2816-3071] LBA Format Extensions */
+    uint8_t  res1[768]; /* [3072-3839] Reserved */
+    uint8_t  vs[256];   /* [3840-4095] Vendor Specific */
+} NVMEIdentifyZonedNs;
+
+/* Identify Controller of the Zoned Namespace Command Set (CNS 06h) */
+typedef struct NVMEIdentifyZonedCtrl {
+    uint8_t  zasl;      /* [0] Zone Append Size Limit, 0 for MDTS */
+    uint8_t  res0[4095];
+} NVMEIdentifyZonedCtrl;
+
+/* Zone Descriptor of the Report Zones data */
+typedef struct NVMEZoneDescr {
+    uint8_t  zt;        /* [0] Zone Type */
+    uint8_t  zs;        /* [1] Zone State in bits 7:4 */
+    uint8_t  za;        /* [2] Zone Attributes */
+    uint8_t  res0[5];
+    uint64_t zcap;      /* [8-15] Zone Capacity */
+    uint64_t zslba;     /* [16-23] Zone Start LBA */
+    uint64_t wp;        /* [24-31] Write Pointer */
+    uint8_t  res1[32];
+} NVMEZoneDescr;
+
+#define NVME_ZONE_TYPE_SEQ_WRITE 0x2
+
+/* Zone states, stored as reported in ZS except for Empty (1h) which is
+ * stored as 0, so that a new zone file holds empty zones */
+enum {
+    NVME_ZONE_EMPTY         = 0x0,
+    NVME_ZONE_IMPLICIT_OPEN = 0x2,
+    NVME_ZONE_EXPLICIT_OPEN = 0x3,
+    NVME_ZONE_CLOSED        = 0x4,
+    NVME_ZONE_READ_ONLY     = 0xd,
+    NVME_ZONE_FULL          = 0xe,
+    NVME_ZONE_OFFLINE       = 0xf,
+};
+#define NVME_ZONE_STATE_EMPTY 0x1
+
+/* State of a zone in the zone backing file of its namespace */
+typedef struct NVMEZone {
+    uint64_t wp;        /* Write pointer, in LBAs from the zone start */
+    uint8_t  state;
+    uint8_t  res[7];
+} NVMEZone;
+
+/* Zone Send Actions (CDW13[7:0]) */
+enum {
+    NVME_ZSA_CLOSE   = 0x1,
+    NVME_ZSA_FINISH  = 0x2,
+    NVME_ZSA_OPEN    = 0x3,
+    NVME_ZSA_RESET   = 0x4,
+    NVME_ZSA_OFFLINE = 0x5,
+};
+#define NVME_ZSA_SELECT_ALL 0x100 /* CDW13[8] */
+
+/* Zone Receive Action (CDW13[7:0]) and its options */
+#define NVME_ZRA_REPORT 0x0
+#define NVME_ZRA_PARTIAL 0x10000 /* CDW13[16] */
+enum {
+    NVME_ZRASF_ALL = 0x0,
+    NVME_ZRASF_EMPTY,
+    NVME_ZRASF_IMPLICIT_OPEN,
+    NVME_ZRASF_EXPLICIT_OPEN,
+    NVME_ZRASF_CLOSED,
+    NVME_ZRASF_FULL,
+    NVME_ZRASF_READ_ONLY,
+    NVME_ZRASF_OFFLINE,
+};
+
 typedef struct AsyncResult {
     uint8_t event_type;
     uint8_t event_info;
@@ -451,27 +648,285 @@ typedef struct NVMEFwSlotInfoLog {
     uint8_t  reserved2[448];
 } NVMEFwSlotInfoLog;
 
+/* Backing files are mapped on demand in windows of NVME_MAP_WINDOW_SIZE
+ * bytes, at most NVME_MAP_WINDOWS of them at a time per file, so the
+ * address space used by a namespace does not depend on its capacity. */
+#define NVME_MAP_WINDOW_SHIFT 26
+#define NVME_MAP_WINDOW_SIZE (1ULL << NVME_MAP_WINDOW_SHIFT)
+#define NVME_MAP_WINDOWS 16
+
+typedef struct NVMEMapWindow {
+    uint64_t index;     /* window number within the file */
+    uint8_t *addr;      /* NULL when the slot is unused */
+    size_t len;
+    uint64_t last_use;
+} NVMEMapWindow;
+
+/* Granularity of the dirty tracking used to migrate namespace data */
+#define NVME_MIG_CHUNK_SHIFT 20
+#define NVME_MIG_CHUNK_SIZE (1ULL << NVME_MIG_CHUNK_SHIFT)
+
+typedef struct NVMEBackingFile {
+    int fd;
+    uint64_t size;
+    uint64_t use_clock;
+    NVMEMapWindow *last;
+    NVMEMapWindow win[NVME_MAP_WINDOWS];
+    /* Chunks written and not yet sent, only set while migrating */
+    unsigned long *dirty;
+    uint64_t dirty_count;
+    /* Registered in its io_uring fixed file slot since opened */
+    uint8_t uring_fixed;
+    /* Opened again with O_DIRECT for the data transfers, -1 if not */
+    int direct_fd;
+    uint32_t direct_align;
+    /* Backend connection the file was last passed on */
+    uint32_t backend_gen;
+    /* Opened read-only, e.g. a base image shared with other VMs */
+    uint8_t read_only;
+} NVMEBackingFile;
+
 enum {
     NVME_LOG_ERROR_INFORMATION   = 0x01,
     NVME_LOG_SMART_INFORMATION   = 0x02,
     NVME_LOG_FW_SLOT_INFORMATION = 0x03,
+    NVME_LOG_CHANGED_NS          = 0x04,
+    NVME_LOG_FORMAT_PROGRESS     = 0xc0, /* Vendor specific */
+    NVME_LOG_FTL                 = 0xc1, /* Vendor specific */
 };
 
+/* Identify Namespace FPI: supported, and percentage left to format */
+#define NVME_FPI_SUPPORTED 0x80
+#define NVME_FPI_REMAINING_MASK 0x7f
+
+/* Format NVM initializes at most this much of a namespace per
+ * NVME_FORMAT_INTERVAL ns, so the main loop keeps running */
+#define NVME_FORMAT_STEP (32ULL * BYTES_PER_MB)
+#define NVME_FORMAT_INTERVAL 100000
+
+/* Entry of the format progress log page, one per namespace */
+typedef struct NVMEFormatProgress {
+    uint32_t nsid;
+    uint8_t  fpi;       /* As in Identify Namespace */
+    uint8_t  rsvd[3];
+    uint64_t remaining; /* Bytes left to initialize */
+} NVMEFormatProgress;
+
+/* Emulated FTL: flash pages of this size are mapped, a write of part of
+ * one programs all of it. Garbage collection starts when no more than
+ * NVME_FTL_GC_RESERVE free blocks are left, which it keeps for itself. */
+#define NVME_FTL_PAGE_SIZE 4096
+#define NVME_FTL_GC_RESERVE 1
+#define NVME_FTL_MAX_OP 400
+
+enum {
+    NVME_FTL_GC_GREEDY       = 0, /* fewest valid pages */
+    NVME_FTL_GC_COST_BENEFIT = 1, /* most free space times age per copy */
+};
+
+/* Entry of the FTL log page, one per namespace, zeroed but for the nsid
+ * when the FTL is not emulated */
+typedef struct NVMEFtlLog {
+    uint32_t nsid;
+    uint32_t waf;          /* nand_pages / host_pages, in hundredths */
+    uint64_t host_pages;   /* flash pages the host wrote */
+    uint64_t nand_pages;   /* flash pages programmed, GC included */
+    uint64_t trim_pages;   /* flash pages deallocated */
+    uint64_t gc_blocks;    /* blocks reclaimed and erased by GC */
+    uint64_t stall_ns;     /* commands held by GC, in total */
+    uint64_t max_stall_ns; /* longest single GC stall */
+    uint32_t free_blocks;
+    uint32_t max_erases;   /* erase count of the most worn block */
+} NVMEFtlLog;
+
+/* Namespace Management (SEL of CDW10) and Namespace Attachment */
+enum {
+    NVME_NS_MGMT_CREATE = 0,
+    NVME_NS_MGMT_DELETE = 1,
+    NVME_NS_CTRL_ATTACH = 0,
+    NVME_NS_CTRL_DETACH = 1,
+};
+#define NVME_NSID_ALL 0xffffffff
+/* Controller list of Namespace Attachment and Identify: a count followed
+ * by the controller IDs, in a 4KB page */
+#define NVME_CTRL_LIST_MAX 2047
+/* Changed Namespace List log page: the IDs of the namespaces whose
+ * attributes changed since the last read, a single 0xffffffff when more
+ * than NVME_CHANGED_NS_MAX did */
+#define NVME_CHANGED_NS_MAX 1024
+/* Namespace Attribute Notices, in OAES and the Asynchronous Event
+ * Configuration feature */
+#define NVME_AEN_NS_ATTR (1 << 8)
+
+/* Controllers of an NVM subsystem sharing its namespaces, named by the
+ * subsys property of each. Names are used in the NQN, the serial number
+ * and the backing file names. */
+#define NVME_SUBSYS_MAX_CTRLS 16
+#define NVME_SUBSYS_NAME_MAX 20
+#define NVME_SUBSYS_NQN_PREFIX "nqn.2019-08.org.qemu:"
+/* CMIC and NMIC: more than one controller, namespace shared among them */
+#define NVME_CMIC_MULTI_CTRL (1 << 1)
+#define NVME_NMIC_SHARED (1 << 0)
+
+/* Reservation types (RTYPE), 0 for no reservation */
+enum {
+    NVME_RESV_WRITE_EXCLUSIVE          = 1,
+    NVME_RESV_EXCLUSIVE_ACCESS         = 2,
+    NVME_RESV_WRITE_EXCLUSIVE_REG_ONLY = 3,
+    NVME_RESV_EXCLUSIVE_ACCESS_REG_ONLY = 4,
+    NVME_RESV_WRITE_EXCLUSIVE_ALL_REGS = 5,
+    NVME_RESV_EXCLUSIVE_ACCESS_ALL_REGS = 6,
+};
+/* Reservation Register (RREGA), Acquire (RACQA) and Release (RRELA)
+ * actions, in CDW10[2:0] */
+enum {
+    NVME_RESV_REGISTER     = 0,
+    NVME_RESV_UNREGISTER   = 1,
+    NVME_RESV_REPLACE      = 2,
+    NVME_RESV_ACQUIRE      = 0,
+    NVME_RESV_PREEMPT      = 1,
+    NVME_RESV_PREEMPT_ABORT = 2,
+    NVME_RESV_RELEASE      = 0,
+    NVME_RESV_CLEAR        = 1,
+};
+/* RESCAP: the six reservation types, no Persist Through Power Loss */
+#define NVME_RESCAP_TYPES 0x7e
+/* ONCS: Reservations */
+#define NVME_ONCS_RESERVATIONS (1 << 5)
+/* VS and Identify Controller VER: 1.2.1, from which hosts read SUBNQN */
+#define NVME_VERSION 0x00010201
+
+/* A host registered with a namespace: controllers with the same Host
+ * Identifier, or this controller when the host did not set one */
+typedef struct NVMERegistrant {
+    uint64_t rkey;
+    uint64_t hostid;
+    uint16_t cntlid;   /* controller which registered */
+    uint8_t  valid;
+    uint8_t  rsvd[5];
+} NVMERegistrant;
+
+/* Reservation of a namespace, shared by the controllers of its NVM
+ * subsystem */
+typedef struct NVMEReservation {
+    uint32_t gen;      /* generation, bumped by registration changes */
+    uint8_t  rtype;
+    uint8_t  holder;   /* registrant holding it, unless all of them do */
+    uint8_t  rsvd[2];
+    NVMERegistrant regs[NVME_SUBSYS_MAX_CTRLS];
+} NVMEReservation;
+
+/* Reservation Report data, without the extended data structure */
+typedef struct NVMEResvStatus {
+    uint32_t gen;
+    uint8_t  rtype;
+    uint16_t regctl;   /* registrant entries following */
+    uint8_t  rsvd5[2];
+    uint8_t  ptpls;
+    uint8_t  rsvd10[14];
+} __attribute__((__packed__)) NVMEResvStatus;
+
+typedef struct NVMEResvReportEntry {
+    uint16_t cntlid;
+    uint8_t  rcsts;    /* bit 0: holds the reservation */
+    uint8_t  rsvd3[5];
+    uint64_t hostid;
+    uint64_t rkey;
+} __attribute__((__packed__)) NVMEResvReportEntry;
+
+typedef struct NVMESubsys {
+    char *name;        /* NULL for a controller of its own */
+    QTAILQ_HEAD(, NVMEState) ctrls;  /* by increasing controller ID */
+    uint32_t num_ctrls;
+    /* One per namespace ID */
+    NVMEReservation *resv;
+    QTAILQ_ENTRY(NVMESubsys) entry;
+} NVMESubsys;
+
+/* Controller defining the namespaces of the subsystem of a controller,
+ * and sending them when migrating */
+#define NVME_SUBSYS_PRIMARY(n) QTAILQ_FIRST(&(n)->subsys->ctrls)
+
+/* Sequential streams tracked per namespace, matched by the LBA their
+ * next command starts at */
+#define NVME_STREAMS 8
+/* Contiguous reads after which a stream is read ahead */
+#define NVME_STREAM_SEQ_CMDS 2
+/* First read-ahead window of a stream, doubled up to readahead_kb */
+#define NVME_STREAM_RA_MIN (128 * 1024)
+
+typedef struct NVMEStream {
+    uint64_t next_lba; /* LBA following the last command */
+    uint64_t end; /* Data file offset following the last command */
+    uint64_t ra_end; /* Data file offset read ahead up to */
+    uint64_t behind; /* Data file offset not dropped from the cache from */
+    uint64_t last_use;
+    uint32_t ra_size; /* Read-ahead window in bytes */
+    uint32_t cmds; /* Contiguous commands seen, 0 for a free slot */
+    uint8_t is_write;
+    uint8_t drop; /* Guest hinted the data is not accessed again soon */
+} NVMEStream;
+
 typedef struct DiskInfo {
-    int fd;
-    int mfd;
     int nsid;
-    size_t mapping_size;
-    uint8_t *mapping_addr;
+    /* Namespace size in MB, as given by the size/sizes properties */
+    uint64_t size_mb;
 
-    size_t meta_mapping_size;
-    uint8_t *meta_mapping_addr;
+    NVMEBackingFile data;
+    NVMEBackingFile meta;
 
     /* Pointer to Identify Namespace Strucutre */
     NVMEIdentifyNamespace idtfy_ns;
     /* Namespace utilization bitmasks (rounded off) */
     uint8_t *ns_util;
     uint8_t thresh_warn_issued;
+    /* Format sent and dirty tracking armed for the running migration */
+    uint8_t mig_sync;
+    /* Format NVM running in the background; the command completes,
+     * if the controller was not reset meanwhile, once format_done
+     * covers the data and meta-data backing files */
+    uint8_t formatting;
+    struct NVMERequest *format_req;
+    uint64_t format_done;
+    /* Zones of a zoned namespace, zone_count is 0 otherwise. Their
+     * states live in a backing file next to the data, which goes along
+     * with it; the open and active counts are derived from them */
+    NVMEBackingFile zones;
+    uint64_t zone_size; /* in LBAs */
+    uint64_t zone_cap; /* writable LBAs of a zone */
+    uint64_t zone_count;
+    uint32_t zone_open; /* implicitly and explicitly opened zones */
+    uint32_t zone_active; /* opened and closed zones */
+    /* Copy-on-write clone of a read-only base image when cow_map is set.
+     * Blocks with their bit set live in data, the others are still read
+     * from base; cow_shared counts those. A compaction copies them up
+     * from cow_next on, and drops the base once none is left. */
+    NVMEBackingFile base;
+    unsigned long *cow_map;
+    uint64_t cow_shared;
+    uint64_t cow_next;
+    uint8_t compacting;
+    /* Sequential stream detection, host side only and not migrated */
+    NVMEStream streams[NVME_STREAMS];
+    uint64_t stream_clock;
+    /* Limits of the namespace; commands over them wait on qos_queue,
+     * fetched from their SQ and holding a CQ entry */
+    NVMEThrottle qos;
+    QSIMPLEQ_HEAD(, NVMERequest) qos_queue;
+    /* Emulated FTL, host side only and not migrated; its garbage
+     * collection holds commands on qos_queue too */
+    struct NVMEFtl *ftl;
+    /* Writes within AWUPF, staged until the data files are synced; NULL
+     * when AWUPF is a single block */
+    struct NVMEJournal *journal;
+    /* Reads and writes with their transfers on the workers, io_uring or
+     * the backend, which those of atomic writes must not interleave */
+    QTAILQ_HEAD(, NVMERequest) rw_inflight;
+    /* Created, with its NVM counted against the controller capacity, and
+     * visible to the host once attached too. Its backing files are only
+     * created on the first attachment. */
+    uint8_t allocated;
+    uint8_t attached;
 
     uint32_t write_data_counter;
     uint32_t read_data_counter;
@@ -487,7 +942,7 @@ typedef struct NVMEState {
     int mmio_index;
     void *bar0;
     int bar0_size;
-    uint8_t nvectors;
+    uint32_t nvectors;
 
     /* Space for NVME Ctrl Space except doorbells */
     uint8_t *cntrl_reg;
@@ -496,14 +951,24 @@ typedef struct NVMEState {
     uint8_t *rwc_mask; /* RW1C mask */
     uint8_t *rws_mask; /* RW1S mask */
     uint8_t *used_mask; /* Used/Resv mask */
+    /* Registers as set up at init, restored by a controller reset. The
+     * masks are not changed after init. */
+    uint8_t *reset_reg;
 
     struct nvme_features feature;
 
-    NVMEIOCQueue cq[NVME_MAX_QS_ALLOCATED];
-    NVMEIOSQueue sq[NVME_MAX_QS_ALLOCATED];
+    /* Queues indexed by ID, allocated when created (NULL otherwise) */
+    uint32_t num_queues;
+    NVMEIOCQueue **cq;
+    NVMEIOSQueue **sq;
+    /* SQs with entries to fetch, the only ones the timer looks at */
+    QTAILQ_HEAD(sq_active, NVMEIOSQueue) sq_active;
+    /* CQs by interrupt vector, nvectors lists */
+    QTAILQ_HEAD(vector_cqs, NVMEIOCQueue) *vector_cqs;
 
     DiskInfo *disk;
-    uint32_t ns_size;
+    uint64_t ns_size;
+    char *ns_sizes;
     uint32_t num_namespaces;
     uint32_t instance;
 
@@ -548,9 +1013,143 @@ typedef struct NVMEState {
     uint16_t outstanding_asyncs;
 
     QSIMPLEQ_HEAD(async_queue, AsyncEvent) async_queue;
+    /* Preallocated events and the ones not in async_queue */
+    AsyncEvent async_events[NVME_ASYNC_EVENT_POOL];
+    QSIMPLEQ_HEAD(async_free, AsyncEvent) async_free;
     /* Masks for async event requests */
     uint8_t err_sts_mask; /* error status event mask */
     uint8_t smart_mask; /* smart/health status event mask */
+
+    /* Namespace data is sent along with the VM (migrate -b) */
+    int mig_blk_enable;
+
+    /* Controller Memory Buffer, none when cmb_size_mb is 0 */
+    uint32_t cmb_size_mb;
+    uint32_t cmb_data; /* PRP lists and data allowed in the CMB too */
+    ram_addr_t cmb_offset;
+    uint8_t *cmb_buf;
+
+    /* Persistent Memory Region mapped from pmr_path, none if not set */
+    char *pmr_path;
+    uint32_t pmr_size_mb;
+    int pmr_fd;
+    uint64_t pmr_size;
+    ram_addr_t pmr_offset;
+    uint8_t *pmr_buf;
+
+    /* Data pointer of the command being processed, PRPs or SGL */
+    QEMUSGList qsg;
+
+    /* I/O worker threads, I/O SQs run on worker (qid - 1) % num_workers */
+    uint32_t num_workers;
+    struct NVMEWorker *workers;
+    /* Request whose transfers are being collected for a worker */
+    struct NVMERequest *worker_req;
+    uint32_t worker_inflight;
+    /* Requests done by the workers, pushed without locking */
+    struct NVMERequest *worker_done;
+    int worker_pipe[2];
+
+    /* io_uring submission queue entries, 0 for none. When set up the
+     * ring runs the transfers instead of the workers. */
+    uint32_t uring_entries;
+    /* Idle time in ms of the kernel SQ polling thread, 0 for no SQPOLL */
+    uint32_t uring_sqpoll;
+    struct NVMEUring *uring;
+
+    /* Unix socket of an external storage backend running the transfers
+     * instead of the workers or io_uring, see nvme_backend.h */
+    char *backend_path;
+    struct NVMEBackend *backend;
+
+    /* Commands completed are logged to trace_path when set, and those
+     * of replay_path are submitted by the device itself, replay_speed
+     * times faster than traced (0 as fast as they complete) */
+    char *trace_path;
+    FILE *trace_file;
+    int64_t trace_start;
+    char *replay_path;
+    uint32_t replay_speed;
+    struct NVMEReplay *replay;
+
+    /* Namespace data transferred with O_DIRECT, bypassing the host page
+     * cache. Unaligned commands go through the bounce buffer. */
+    uint32_t direct;
+    uint8_t *direct_buf;
+    uint64_t direct_buf_size;
+
+    /* Writes of all-zero blocks deallocate them when set. The map has
+     * a bit per block of the write, set for those found all zero. */
+    uint32_t detect_zeroes;
+    unsigned long *zero_map;
+
+    /* Atomic write units, normal and power fail, in logical blocks */
+    uint32_t awun;
+    uint32_t awupf;
+
+    /* Most host read-ahead of a sequential stream, 0 disables the
+     * stream detection */
+    uint32_t readahead_kb;
+
+    /* Zoned namespaces when zone_size_mb is not 0 */
+    uint32_t zone_size_mb;
+    uint32_t zone_cap_mb; /* 0 for the zone size */
+    uint32_t max_open_zones; /* 0 for no limit */
+    uint32_t max_active_zones; /* 0 for no limit */
+
+    /* Default limits of every namespace and limits of every I/O SQ,
+     * 0 for none; the monitor changes them live */
+    uint64_t qos_iops;
+    uint64_t qos_bps;
+    uint64_t qos_iops_burst;
+    uint64_t qos_bps_burst;
+    uint64_t qos_sq_iops;
+    uint64_t qos_sq_bps;
+    uint64_t qos_sq_iops_burst;
+    uint64_t qos_sq_bps_burst;
+    /* Releases the throttled commands */
+    QEMUTimer *qos_timer;
+    int64_t qos_timer_target;
+
+    /* Drains the workers and formats when the VM stops */
+    VMChangeStateEntry *vmstate_change;
+    /* Steps the namespaces being formatted */
+    QEMUTimer *format_timer;
+    /* Read-only image the namespaces are cloned from, "%d" standing
+     * for the namespace id; steps their compaction */
+    char *base_path;
+    QEMUTimer *cow_timer;
+    /* Emulated FTL of every namespace when ftl is set: ftl_op percent
+     * more flash than logical space, erased in ftl_block_kb blocks
+     * picked by the ftl_gc policy, GC taking ftl_copy_us per page moved
+     * and ftl_erase_us per block */
+    uint32_t ftl;
+    uint32_t ftl_op;
+    uint32_t ftl_block_kb;
+    char *ftl_gc_name;
+    uint8_t ftl_gc;
+    uint32_t ftl_copy_us;
+    uint32_t ftl_erase_us;
+    /* Namespace IDs up to max_namespaces, those past the initial ones
+     * left for Namespace Management, which allocates them out of the
+     * capacity_mb of NVM (0 for the size of the initial ones) */
+    uint32_t max_namespaces;
+    uint64_t capacity_mb;
+    /* Changed Namespace List log page, changed_ns_count going past
+     * NVME_CHANGED_NS_MAX once more changed */
+    uint32_t changed_ns[NVME_CHANGED_NS_MAX];
+    uint32_t changed_ns_count;
+    /* NVM subsystem, shared with the controllers of the same subsys_name
+     * or of this one only. The first controller of a named one defines
+     * its namespaces, the others take them as they are. */
+    char *subsys_name;
+    struct NVMESubsys *subsys;
+    QTAILQ_ENTRY(NVMEState) subsys_entry;
+    /* Reservations of the subsystem, per namespace */
+    struct NVMEReservation *resv;
+    /* Host Identifier feature, 0 when not set */
+    uint64_t hostid;
+    QTAILQ_ENTRY(NVMEState) entry; /* list of devices for the monitor */
 } NVMEState;
 
 /* Structure used for default initialization sequence (except doorbell) */
@@ -578,7 +1177,7 @@ static const struct NVMEReg nvme_reg[] = {
 {
     .offset = NVME_CAP + 4,
     .len = 0x04,
-    .reset = 0x00000020,
+    .reset = 0x00400020, /* CSS NVM, MPSMIN 4 KB, MPSMAX 64 KB */
     .rw_mask = 0x00,
     .rwc_mask = 0x00,
     .rws_mask = 0x00,
@@ -587,7 +1186,7 @@ static const struct NVMEReg nvme_reg[] = {
 {
     .offset = NVME_VER,
     .len = 0x04,
-    .reset = 0x00010000,
+    .reset = NVME_VERSION,
     .rw_mask = 0x00,
     .rwc_mask = 0x00,
     .rws_mask = 0x00,
@@ -692,8 +1291,10 @@ enum {
     NVME_ADM_CMD_SET_FEATURES  = 0x09,
     NVME_ADM_CMD_GET_FEATURES  = 0x0a,
     NVME_ADM_CMD_ASYNC_EV_REQ  = 0x0c,
+    NVME_ADM_CMD_NS_MGMT       = 0x0d,
     NVME_ADM_CMD_ACTIVATE_FW   = 0x10,
     NVME_ADM_CMD_DOWNLOAD_FW   = 0x11,
+    NVME_ADM_CMD_NS_ATTACH     = 0x15,
     NVME_ADM_CMD_FORMAT_NVM    = 0x80,
     NVME_ADM_CMD_SECURITY_SEND = 0x81,
     NVME_ADM_CMD_SECURITY_RECV = 0x82,
@@ -706,6 +1307,14 @@ enum {
     NVME_CMD_WRITE      = 0x01,
     NVME_CMD_READ       = 0x02,
     NVME_CMD_DSM        = 0x09,
+    NVME_CMD_RESV_REGISTER = 0x0d,
+    NVME_CMD_RESV_REPORT   = 0x0e,
+    NVME_CMD_RESV_ACQUIRE  = 0x11,
+    NVME_CMD_RESV_RELEASE  = 0x15,
+    NVME_CMD_COPY       = 0x19,
+    NVME_CMD_ZONE_MGMT_SEND = 0x79,
+    NVME_CMD_ZONE_MGMT_RECV = 0x7a,
+    NVME_CMD_ZONE_APPEND    = 0x7d,
     NVME_CMD_LAST
 };
 
@@ -821,9 +1430,10 @@ typedef struct NVMEAdmCmdIdentify {
     uint64_t mptr;
     uint64_t prp1;
     uint64_t prp2;
-    uint32_t cns:1; /* CDW10[0] Controller or Namespace Structure  */
-    uint32_t res2:31; /* CDW10[1-31] Reserved */
-    uint32_t cdw11;
+    uint32_t cns:8; /* CDW10[0-7] Controller or Namespace Structure  */
+    uint32_t res2:8; /* CDW10[8-15] Reserved */
+    uint32_t cntid:16; /* CDW10[16-31] Controller Identifier */
+    uint32_t cdw11; /* CDW11[24-31] Command Set Identifier */
     uint32_t cdw12;
     uint32_t cdw13;
     uint32_t cdw14;
@@ -852,6 +1462,7 @@ typedef struct NVMEAdmCmdAbort {
 enum {
     event_type_error = 0,
     event_type_smart = 1,
+    event_type_notice = 2,
     event_info_err_invalid_sq = 0,
     event_info_err_invalid_db = 1,
     event_info_err_diag_fail  = 2,
@@ -860,7 +1471,8 @@ enum {
     event_info_err_fw_img_load_err = 5,
     event_info_smart_reliability = 0,
     event_info_smart_temp_thresh = 1,
-    event_info_smart_spare_thresh = 2
+    event_info_smart_spare_thresh = 2,
+    event_info_notice_ns_attr = 0
 };
 
 typedef struct NVMEAdmCmdAsyncEvRq {
@@ -898,6 +1510,40 @@ typedef struct NVME_rw {
     uint32_t cdw15;
 } NVME_rw;
 
+/* CDW0 bits 15:14, PRP Or SGL for Data Transfer */
+#define NVME_CMD_PSDT(cmd) ((cmd)->fuse >> 6)
+enum {
+    NVME_PSDT_PRP          = 0,
+    NVME_PSDT_SGL_MPTR_BUF = 1, /* MPTR is a contiguous buffer */
+    NVME_PSDT_SGL_MPTR_SGL = 2, /* MPTR is a SGL segment, unsupported */
+};
+
+/* SGL descriptor, the first one takes the place of PRP1 and PRP2 */
+typedef struct NVMESglDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint8_t rsvd[3];
+    uint8_t type; /* [7:4] type, [3:0] sub type */
+} NVMESglDesc;
+
+enum {
+    NVME_SGL_DATA_BLOCK   = 0x0,
+    NVME_SGL_BIT_BUCKET   = 0x1,
+    NVME_SGL_SEGMENT      = 0x2,
+    NVME_SGL_LAST_SEGMENT = 0x3,
+};
+
+/* Identify Controller SGLS: SGLs and bit buckets supported */
+#define NVME_SGLS_SUPPORTED  (1 << 0)
+#define NVME_SGLS_BIT_BUCKET (1 << 16)
+
+/* Segments followed at most per command */
+#define NVME_SGL_MAX_SEGMENTS 1024
+
+/* Scatter gather list address standing for a bit bucket: the data
+ * read for it is discarded */
+#define NVME_SGL_BIT_BUCKET_ADDR ((target_phys_addr_t)-1)
+
 typedef struct NVMECmd {
     uint8_t  opcode;
     uint8_t  fuse;
@@ -997,9 +1643,18 @@ enum {
     NVME_SC_FUSED_FAIL        = 0x9,
     NVME_SC_FUSED_MISSING     = 0xa,
     NVME_SC_INVALID_NAMESPACE = 0xb,
+    NVME_SC_CMD_SEQ_ERROR     = 0xc,
+    NVME_SC_SGL_SEG_INVALID   = 0xd,
+    NVME_SC_SGL_NUM_INVALID   = 0xe,
+    NVME_SC_SGL_DATA_LEN_INVALID = 0xf,
+    NVME_SC_SGL_META_LEN_INVALID = 0x10,
+    NVME_SC_SGL_TYPE_INVALID  = 0x11,
+    NVME_SC_HOSTID_INCONSISTENT = 0x18,
     NVME_SC_LBA_RANGE         = 0x80,
     NVME_SC_CAP_EXCEEDED      = 0x81,
     NVME_SC_NS_NOT_READY      = 0x82,
+    NVME_SC_RESERVATION_CONFLICT = 0x83,
+    NVME_SC_FORMAT_IN_PROGRESS = 0x84,
 };
 
 /* Figure 18: Status Code – Command Specific Errors Values */
@@ -1015,8 +1670,23 @@ enum {
     NVME_INVALID_INTERRUPT_VECTOR   = 0x08,
     NVME_INVALID_LOG_PAGE           = 0x09,
     NVME_INVALID_FORMAT             = 0x0a,
+    NVME_NS_INSUFFICIENT_CAPACITY   = 0x15,
+    NVME_NS_ID_UNAVAILABLE          = 0x16,
+    NVME_NS_ALREADY_ATTACHED        = 0x18,
+    NVME_NS_NOT_ATTACHED            = 0x1a,
+    NVME_THIN_PROVISIONING_NOT_SUPPORTED = 0x1b,
+    NVME_CONTROLLER_LIST_INVALID    = 0x1c,
 
     NVME_CMD_NVM_ERR_CONFLICT       = 0x80,
+    NVME_CMD_NVM_ERR_SIZE_LIMIT     = 0x83,
+    NVME_CMD_ZONE_ERR_BOUNDARY      = 0xb8,
+    NVME_CMD_ZONE_ERR_FULL          = 0xb9,
+    NVME_CMD_ZONE_ERR_READ_ONLY     = 0xba,
+    NVME_CMD_ZONE_ERR_OFFLINE       = 0xbb,
+    NVME_CMD_ZONE_ERR_INVALID_WRITE = 0xbc,
+    NVME_CMD_ZONE_ERR_TOO_MANY_ACTIVE = 0xbd,
+    NVME_CMD_ZONE_ERR_TOO_MANY_OPEN = 0xbe,
+    NVME_CMD_ZONE_ERR_TRANSITION    = 0xbf,
 };
 
 /* Figure 20: Status Code – Media Error Values */
@@ -1040,13 +1710,80 @@ typedef struct NVMECQE {
     NVMEStatusField status; /* DW3[16] Phase Tag & DW3[17-31] Status Field */
 } NVMECQE;
 
-
-/* CNS bit in Identify command */
+/* Context of a command between its fetch from the SQ and its completion.
+ * Requests are cache line aligned and live in a per SQ pool, so there is
+ * no heap traffic on the command path. */
+#define NVME_REQ_ALIGN 64
+
+/* Part of a transfer handed to an I/O worker: guest memory mapped by the
+ * main thread, copied from or to the backing file by the worker */
+typedef struct NVMEXfer {
+    struct NVMERequest *req;
+    NVMEBackingFile *bf;
+    uint64_t offset;
+    uint8_t *host;
+    target_phys_addr_t len;
+    int is_write; /* 1 when the backing file is written */
+    int direct;   /* 1 when aligned for the O_DIRECT descriptor */
+} NVMEXfer;
+
+typedef struct NVMERequest {
+    QTAILQ_ENTRY(NVMERequest) entry; /* free list or outstanding list */
+    uint16_t sq_id;
+    uint16_t slot; /* index in the pool */
+    NVMECmd cmd;
+    NVMECQE cqe;
+    /* Transfers of the request when run by an I/O worker */
+    NVMEXfer *xfer;
+    uint32_t nxfer;
+    uint32_t xfer_max;
+    uint32_t xfer_pending; /* not completed by io_uring yet */
+    /* Queued to a worker, then pushed on the list of done requests;
+     * or waiting on the QoS queue of its namespace */
+    QSIMPLEQ_ENTRY(NVMERequest) worker_entry;
+    /* On rw_inflight of its namespace while rw_linked is set */
+    QTAILQ_ENTRY(NVMERequest) rw_entry;
+    uint8_t rw_linked;
+    /* Journal slot of the write + 1, 0 if not journaled */
+    uint8_t jslot;
+    struct NVMERequest *done_next;
+    int64_t trace_ns; /* fetched, for the trace */
+} __attribute__((aligned(NVME_REQ_ALIGN))) NVMERequest;
+
+typedef struct NVMEWorker {
+    struct NVMEState *n;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(worker_queue, NVMERequest) queue;
+    int stop;
+} NVMEWorker;
+
+
+/* CNS value in Identify command */
 enum {
     NVME_IDENTIFY_NAMESPACE  = 0,
     NVME_IDENTIFY_CONTROLLER = 1,
+    NVME_IDENTIFY_ACTIVE_NS_LIST = 2,
+    NVME_IDENTIFY_NS_DESCS   = 3,
+    NVME_IDENTIFY_CSI_NAMESPACE  = 5,
+    NVME_IDENTIFY_CSI_CONTROLLER = 6,
+    NVME_IDENTIFY_ALLOC_NS_LIST  = 0x10,
+    NVME_IDENTIFY_ALLOC_NAMESPACE = 0x11,
+    NVME_IDENTIFY_NS_CTRL_LIST   = 0x12,
+    NVME_IDENTIFY_CTRL_LIST      = 0x13,
+};
+
+/* Command Set Identifiers */
+enum {
+    NVME_CSI_NVM   = 0,
+    NVME_CSI_ZONED = 2,
 };
 
+/* Namespace Identification Descriptor types: NGUID and CSI */
+#define NVME_NIDT_NGUID 2
+#define NVME_NIDT_CSI 4
+
 /* Config File Read Strucutre */
 typedef struct FILERead {
     uint32_t offset;
@@ -1059,6 +1796,63 @@ typedef struct FILERead {
     char *cfg_name;
 } FILERead;
 
+/* Copy command, source ranges follow the data pointer */
+typedef struct NVMECmdCopy {
+    uint8_t  opcode;
+    uint8_t  fuse;
+    uint16_t cid;
+
+    uint32_t nsid;
+    uint64_t res1;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint64_t sdlba; /* CDW10 & CDW11 - Starting Destination LBA */
+    uint32_t nr:8; /* CDW12[0-7] Number of Ranges, 0's based */
+    uint32_t desfmt:4; /* CDW12[8-11] Descriptor Format */
+    uint32_t res2:14; /* CDW12[12-25] Protection Info Read, Reserved */
+    uint32_t prinfow:4; /* CDW12[26-29] Protection Information Write */
+    uint32_t fua:1; /* CDW12[30] Force Unit Access */
+    uint32_t lr:1; /* CDW12[31] Limited Retry */
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} NVMECmdCopy;
+
+/* Copy source range, descriptor format 0 */
+typedef struct NVMECopyRange {
+    uint64_t res0;
+    uint64_t slba;      /* Starting LBA */
+    uint16_t nlb;       /* Number of Logical Blocks, 0's based */
+    uint16_t res1;
+    uint32_t eilbrt;    /* Expected Initial Logical Block Reference Tag */
+    uint16_t elbat;     /* Expected Logical Block Application Tag */
+    uint16_t elbatm;    /* Expected Logical Block Application Tag Mask */
+    uint32_t res2;
+} __attribute__((__packed__)) NVMECopyRange;
+
+/* Copy limits reported in Identify Namespace, in LBAs */
+#define NVME_COPY_MSSRL 2048
+#define NVME_COPY_MCL 8192
+#define NVME_COPY_MSRC 127 /* 0's based, 128 ranges fit in a 4K page */
+
+/* Dataset Management field of Read and Write (CDW13[7:0]) */
+#define NVME_RW_DSM_AF_MASK 0x0f /* access frequency */
+#define NVME_RW_DSM_SEQ_REQ 0x40 /* part of a sequential request */
+
+/* Access frequency of the DSM field and of the DSM context attributes */
+enum {
+    NVME_DSM_AF_NONE = 0,
+    NVME_DSM_AF_TYPICAL = 1,
+    NVME_DSM_AF_INFREQ_WRITE_READ = 2,
+    NVME_DSM_AF_INFREQ_WRITE = 3,
+    NVME_DSM_AF_INFREQ_READ = 4,
+    NVME_DSM_AF_FREQ_WRITE_READ = 5,
+    NVME_DSM_AF_ONE_TIME_READ = 6,
+    NVME_DSM_AF_SPECULATIVE_READ = 7,
+    NVME_DSM_AF_OVERWRITTEN = 8,
+};
+
 /* DSM context attributes */
 typedef struct CtxAttrib {
     uint16_t AF        : 4;      /* access frequency */
@@ -1092,6 +1886,24 @@ uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
 
 /* NVM dataset management cmd processing */
 uint8_t nvme_dsm_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
+uint8_t nvme_copy_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
+uint16_t nvme_cmd_data_rw(NVMEState *n, NVMECmd *cmd, uint8_t *buf,
+    uint64_t len, int to_guest);
+
+/* Zoned namespaces */
+void nvme_zone_setup(NVMEState *n, DiskInfo *disk);
+void nvme_zone_recount(DiskInfo *disk);
+void nvme_zone_close_all(NVMEState *n);
+uint8_t nvme_zone_read(DiskInfo *disk, uint64_t slba, uint64_t nlb,
+    NVMEStatusField *sf);
+uint8_t nvme_zone_write(NVMEState *n, DiskInfo *disk, uint64_t slba,
+    uint64_t nlb, NVMEStatusField *sf);
+uint8_t nvme_zone_append(NVMEState *n, DiskInfo *disk, NVME_rw *e,
+    NVMECQE *cqe);
+uint8_t nvme_zone_mgmt_send(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
+uint8_t nvme_zone_mgmt_recv(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
+void nvme_identify_zoned_ns(NVMEState *n, DiskInfo *disk,
+    NVMEIdentifyZonedNs *id);
 
 /* All NVM cmd processing */
 uint8_t nvme_command_set(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
@@ -1103,19 +1915,191 @@ int nvme_close_storage_disks(NVMEState *n);
 int nvme_close_storage_disk(DiskInfo *disk);
 int nvme_create_storage_disks(NVMEState *n);
 int nvme_del_storage_disks(NVMEState *n);
-int nvme_del_storage_disk(DiskInfo *disk);
+int nvme_del_storage_disk(NVMEState *n, DiskInfo *disk);
 int nvme_create_storage_disk(uint32_t instance, uint32_t nsid, DiskInfo *disk,
     NVMEState *n);
-
-void nvme_dma_mem_read(target_phys_addr_t addr, uint8_t *buf, int len);
-void nvme_dma_mem_write(target_phys_addr_t addr, uint8_t *buf, int len);
+int nvme_storage_ready(DiskInfo *disk);
+int nvme_storage_alloc(NVMEState *n, DiskInfo *disk);
+int nvme_storage_resize(NVMEState *n, DiskInfo *disk, uint64_t nsze);
+int nvme_storage_share(NVMEState *n, DiskInfo *disk, DiskInfo *from);
+
+/* Background Format NVM */
+uint16_t nvme_format_start(NVMEState *n, DiskInfo *disk);
+void nvme_format_timer_cb(void *opaque);
+void nvme_format_finish_all(NVMEState *n);
+void nvme_format_reset(NVMEState *n);
+uint64_t nvme_format_remaining(DiskInfo *disk);
+
+/* Copy-on-write clones */
+int nvme_cow_open(NVMEState *n, DiskInfo *disk);
+void nvme_cow_close(DiskInfo *disk);
+int nvme_cow_read(NVMEState *n, DiskInfo *disk, uint64_t offset,
+    uint64_t slba, uint32_t nlb, uint32_t lba_sz);
+void nvme_cow_written(DiskInfo *disk, uint64_t slba, uint64_t nlb);
+int nvme_cow_fill(DiskInfo *disk, uint64_t slba, uint64_t nlb);
+int nvme_cow_compact(NVMEState *n, DiskInfo *disk);
+void nvme_cow_timer_cb(void *opaque);
+void nvme_cow_save(QEMUFile *f, DiskInfo *disk);
+int nvme_cow_load(QEMUFile *f, NVMEState *n, DiskInfo *disk);
+
+/* Power fail atomicity journal */
+int nvme_journal_open(NVMEState *n, DiskInfo *disk, const char *name);
+void nvme_journal_close(DiskInfo *disk);
+int nvme_journal_wanted(NVMEState *n, NVMECmd *cmd);
+void nvme_journal_prepare(NVMEState *n, NVMERequest *req);
+int nvme_journal_stage(NVMEState *n, DiskInfo *disk, NVME_rw *e,
+    uint64_t offset, uint64_t meta_offset, uint64_t meta_len);
+void nvme_journal_applied(DiskInfo *disk, int slot);
+void nvme_journal_retire(DiskInfo *disk);
+void nvme_journal_discard(DiskInfo *disk);
+void nvme_journal_recover(NVMEState *n, DiskInfo *disk);
+
+/* Emulated FTL */
+int nvme_ftl_open(NVMEState *n, DiskInfo *disk);
+void nvme_ftl_close(DiskInfo *disk);
+int nvme_ftl_resize(NVMEState *n, DiskInfo *disk);
+void nvme_ftl_write(NVMEState *n, DiskInfo *disk, uint64_t slba,
+    uint64_t nlb);
+void nvme_ftl_trim(DiskInfo *disk, uint64_t slba, uint64_t nlb);
+int64_t nvme_ftl_busy(DiskInfo *disk, int64_t now);
+void nvme_ftl_log(DiskInfo *disk, NVMEFtlLog *log);
+
+/* Namespace Management and Attachment, nvme_ns.c */
+uint64_t nvme_ns_bytes(DiskInfo *disk);
+uint64_t nvme_ns_unallocated(NVMEState *n);
+int nvme_ns_create(NVMEState *n, NVMEIdentifyNamespace *id, uint32_t *nsid,
+    NVMEStatusField *sf);
+int nvme_ns_delete(NVMEState *n, uint32_t nsid, NVMEStatusField *sf);
+int nvme_ns_attach(NVMEState *n, uint32_t nsid, int attach,
+    NVMEStatusField *sf);
+int nvme_ns_resize(NVMEState *n, uint32_t nsid, uint64_t nsze,
+    NVMEStatusField *sf);
+void nvme_ns_changed(NVMEState *n, uint32_t nsid);
+void nvme_ns_sync(NVMEState *n, uint32_t nsid, int changed);
+int nvme_ns_busy(NVMEState *n, uint32_t nsid);
+
+/* NVM subsystems, nvme_subsys.c */
+int nvme_subsys_check(NVMEState *n);
+NVMEState *nvme_subsys_primary_of(NVMEState *n);
+void nvme_subsys_join(NVMEState *n, NVMEState *primary);
+void nvme_subsys_leave(NVMEState *n);
+void nvme_subsys_drain(NVMEState *n);
+NVMEState *nvme_subsys_ctrl(NVMEState *n, uint16_t cntlid);
+void nvme_subsys_nqn(NVMEState *n, char *buf, size_t len);
+void nvme_subsys_nguid(NVMEState *n, uint32_t nsid, uint8_t *nguid);
+DiskInfo *nvme_subsys_ns_source(NVMEState *n, uint32_t nsid);
+
+/* Reservations, nvme_resv.c */
+uint8_t nvme_resv_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
+int nvme_resv_conflict(NVMEState *n, uint32_t nsid, uint8_t opcode);
+int nvme_resv_registered(NVMEState *n);
+
+/* Windowed access to namespace backing files */
+void nvme_backing_init(NVMEBackingFile *bf);
+uint8_t *nvme_backing_map(NVMEBackingFile *bf, uint64_t offset, uint64_t *len);
+int nvme_backing_rw(NVMEState *n, NVMEBackingFile *bf,
+    uint64_t offset, target_phys_addr_t mem_addr, uint64_t len, int is_write);
+int nvme_sg_range_rw(NVMEState *n, NVMEBackingFile *bf, uint64_t offset,
+    uint64_t start, uint64_t end, int is_write);
+int nvme_backing_close(NVMEBackingFile *bf);
+int nvme_backing_pio(NVMEBackingFile *bf, uint8_t *buf, uint64_t offset,
+    uint64_t len, int is_write);
+int nvme_backing_dio(NVMEBackingFile *bf, uint8_t *buf, uint64_t offset,
+    uint64_t len, int is_write);
+int nvme_backing_direct_ok(NVMEBackingFile *bf, uint64_t offset,
+    uint64_t addr, uint64_t len);
+int nvme_backing_copy(NVMEBackingFile *bf, uint64_t src, uint64_t dst,
+    uint64_t len);
+int nvme_backing_zero(NVMEBackingFile *bf, uint64_t offset, uint64_t len);
+
+/* Live migration of namespace data */
+void nvme_storage_mig_set_params(int blk_enable, int shared, void *opaque);
+int nvme_storage_save_live(Monitor *mon, QEMUFile *f, int stage,
+    void *opaque);
+int nvme_storage_load(QEMUFile *f, void *opaque, int version_id);
+
+void nvme_dma_mem_read(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len);
+void nvme_dma_mem_write(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len);
+uint16_t nvme_map_prp(NVMEState *n, QEMUSGList *qsg, uint64_t prp1,
+    uint64_t prp2, uint64_t len);
+uint16_t nvme_prp_rw(NVMEState *n, NVMECmd *cmd, uint8_t *buf, uint64_t len,
+    int to_guest);
 int  process_sq(NVMEState *n, uint16_t sq_id);
 void async_process_cb(void *);
 void incr_cq_tail(NVMEIOCQueue *q);
 
+/* Per SQ request pools */
+void nvme_sq_init_reqs(NVMEIOSQueue *sq);
+void nvme_sq_free_reqs(NVMEIOSQueue *sq);
+NVMERequest *nvme_req_alloc(NVMEIOSQueue *sq);
+void nvme_req_free(NVMEIOSQueue *sq, NVMERequest *req);
+void nvme_req_complete(NVMEState *n, NVMERequest *req);
+
+/* Asynchronous event pool */
+void nvme_async_events_init(NVMEState *n);
+AsyncEvent *nvme_async_event_alloc(NVMEState *n);
+void nvme_async_event_free(NVMEState *n, AsyncEvent *event);
+
 uint32_t adm_check_cqid(NVMEState *n, uint16_t cqid);
 uint32_t adm_check_sqid(NVMEState *n, uint16_t sqid);
 
+/* Queue allocation, the admin queues are never released */
+NVMEIOSQueue *nvme_sq_alloc(NVMEState *n, uint16_t sq_id);
+void nvme_sq_release(NVMEState *n, uint16_t sq_id);
+NVMEIOCQueue *nvme_cq_alloc(NVMEState *n, uint16_t cq_id);
+void nvme_cq_release(NVMEState *n, uint16_t cq_id);
+void nvme_sq_activate(NVMEState *n, NVMEIOSQueue *sq);
+void nvme_cq_link_vector(NVMEState *n, NVMEIOCQueue *cq);
+
+/* I/O worker threads */
+int nvme_workers_init(NVMEState *n);
+void nvme_workers_uninit(NVMEState *n);
+void nvme_workers_drain(NVMEState *n);
+void nvme_workers_complete(void *opaque);
+int nvme_worker_add_xfer(NVMEState *n, NVMEBackingFile *bf, uint64_t offset,
+    target_phys_addr_t mem_addr, uint64_t len, int is_write);
+void nvme_worker_submit(NVMEState *n, NVMERequest *req);
+void nvme_worker_finish(NVMEState *n, NVMERequest *req);
+int nvme_xfer_run(NVMEXfer *x);
+
+/* io_uring engine */
+int nvme_uring_init(NVMEState *n);
+void nvme_uring_uninit(NVMEState *n);
+void nvme_uring_submit(NVMEState *n, NVMERequest *req);
+void nvme_uring_complete(void *opaque);
+void nvme_uring_drain(NVMEState *n);
+
+/* External storage backend */
+int nvme_backend_init(NVMEState *n);
+void nvme_backend_uninit(NVMEState *n);
+void nvme_backend_submit(NVMEState *n, NVMERequest *req);
+void nvme_backend_complete(void *opaque);
+void nvme_backend_drain(NVMEState *n);
+
+/* Command trace and replay */
+int nvme_trace_init(NVMEState *n);
+void nvme_trace_req(NVMEState *n, NVMERequest *req);
+void nvme_trace_uninit(NVMEState *n);
+int nvme_replay_init(NVMEState *n);
+void nvme_replay_complete(NVMEState *n, NVMERequest *req);
+void nvme_replay_uninit(NVMEState *n);
+void nvme_io_start(NVMEState *n, NVMERequest *req);
+
+/* QoS throttling */
+void nvme_throttle_set(NVMEThrottle *t, uint64_t iops, uint64_t bps,
+    uint64_t iops_burst, uint64_t bps_burst);
+int nvme_qos_sq_throttled(NVMEState *n, NVMEIOSQueue *sq);
+int nvme_qos_submit(NVMEState *n, NVMERequest *req);
+void nvme_qos_timer_cb(void *opaque);
+void nvme_qos_flush(NVMEState *n);
+void nvme_qos_cancel_sq(NVMEState *n, uint16_t sq_id, int abort);
+int nvme_qos_cancel_req(NVMEState *n, NVMERequest *req);
+void nvme_qos_kick(NVMEState *n);
+void nvme_backing_set_dirty(NVMEBackingFile *bf, uint64_t offset,
+    uint64_t len);
+
 /* Config file read functions */
 int read_config_file(FILE *, NVMEState *, uint8_t);
 
@@ -1126,6 +2110,7 @@ uint32_t nvme_cntrl_read_config(NVMEState *,
     target_phys_addr_t, uint8_t);
 void nvme_cntrl_write_config(NVMEState *,
     target_phys_addr_t, uint32_t, uint8_t);
+void nvme_mmio_writel(void *opaque, target_phys_addr_t addr, uint32_t val);
 void enqueue_async_event(NVMEState *n, uint8_t event_type, uint8_t event_info,
     uint8_t log_page);
 int random_chance(int chance);
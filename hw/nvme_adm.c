@@ -40,6 +40,8 @@ static uint32_t adm_cmd_async_ev_req(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_act_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_dl_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
+static uint32_t adm_cmd_ns_mgmt(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
+static uint32_t adm_cmd_ns_attach(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 
 typedef uint32_t adm_command_func(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 
@@ -54,8 +56,10 @@ static adm_command_func * const adm_cmds_funcs[] = {
     [NVME_ADM_CMD_SET_FEATURES] = adm_cmd_set_features,
     [NVME_ADM_CMD_GET_FEATURES] = adm_cmd_get_features,
     [NVME_ADM_CMD_ASYNC_EV_REQ] = adm_cmd_async_ev_req,
+    [NVME_ADM_CMD_NS_MGMT] = adm_cmd_ns_mgmt,
     [NVME_ADM_CMD_ACTIVATE_FW] = adm_cmd_act_fw,
     [NVME_ADM_CMD_DOWNLOAD_FW] = adm_cmd_dl_fw,
+    [NVME_ADM_CMD_NS_ATTACH] = adm_cmd_ns_attach,
     [NVME_ADM_CMD_FORMAT_NVM] = adm_cmd_format_nvm,
     [NVME_ADM_CMD_LAST] = NULL,
 };
@@ -80,9 +84,9 @@ uint8_t nvme_admin_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
 uint32_t adm_check_cqid(NVMEState *n, uint16_t cqid)
 {
     /* If queue is allocated dma_addr!=NULL and has the same ID */
-    if (cqid > NVME_MAX_QID) {
+    if (cqid > NVME_MAX_QID(n) || n->cq[cqid] == NULL) {
         return FAIL;
-    } else if (n->cq[cqid].dma_addr && n->cq[cqid].id == cqid) {
+    } else if (n->cq[cqid]->dma_addr && n->cq[cqid]->id == cqid) {
         return 0;
     } else {
       return FAIL;
@@ -92,36 +96,113 @@ uint32_t adm_check_cqid(NVMEState *n, uint16_t cqid)
 uint32_t adm_check_sqid(NVMEState *n, uint16_t sqid)
 {
     /* If queue is allocated dma_addr!=NULL and has the same ID */
-    if (sqid > NVME_MAX_QID) {
+    if (sqid > NVME_MAX_QID(n) || n->sq[sqid] == NULL) {
         return FAIL;
-    } else if (n->sq[sqid].dma_addr && n->sq[sqid].id == sqid) {
+    } else if (n->sq[sqid]->dma_addr && n->sq[sqid]->id == sqid) {
         return 0;
     } else {
         return FAIL;
     }
 }
 
-static uint16_t adm_get_sq(NVMEState *n, uint16_t sqid)
+static NVMEIOSQueue *adm_get_sq(NVMEState *n, uint16_t sqid)
 {
-    if (sqid > NVME_MAX_QID) {
-        return USHRT_MAX;
-    } else if (n->sq[sqid].dma_addr && n->sq[sqid].id == sqid) {
-        return sqid;
-    } else {
-        return USHRT_MAX;
+    if (adm_check_sqid(n, sqid)) {
+        return NULL;
     }
+    return n->sq[sqid];
 }
 
-static uint16_t adm_get_cq(NVMEState *n, uint16_t cqid)
+static NVMEIOCQueue *adm_get_cq(NVMEState *n, uint16_t cqid)
 {
-    if (cqid > NVME_MAX_QID) {
-        return USHRT_MAX;
-    } else if (n->cq[cqid].dma_addr && n->cq[cqid].id == cqid) {
-        return cqid;
-    } else {
-        return USHRT_MAX;
+    if (adm_check_cqid(n, cqid)) {
+        return NULL;
+    }
+    return n->cq[cqid];
+}
+
+/*********************************************************************
+    Function     :    nvme_sq_alloc
+    Description  :    Allocates the state of a submission queue, the
+                      caller fills it in
+    Return Type  :    NVMEIOSQueue *
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue ID, not allocated yet
+*********************************************************************/
+NVMEIOSQueue *nvme_sq_alloc(NVMEState *n, uint16_t sq_id)
+{
+    NVMEIOSQueue *sq = qemu_mallocz(sizeof(NVMEIOSQueue));
+
+    sq->id = sq_id;
+    QTAILQ_INIT(&sq->req_free);
+    QTAILQ_INIT(&sq->cmd_list);
+    if (sq_id != ASQ_ID) {
+        nvme_throttle_set(&sq->qos, n->qos_sq_iops, n->qos_sq_bps,
+            n->qos_sq_iops_burst, n->qos_sq_bps_burst);
+    }
+    n->sq[sq_id] = sq;
+    return sq;
+}
+
+/*********************************************************************
+    Function     :    nvme_sq_release
+    Description  :    Frees a submission queue and its request pool
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue ID
+*********************************************************************/
+void nvme_sq_release(NVMEState *n, uint16_t sq_id)
+{
+    NVMEIOSQueue *sq = n->sq[sq_id];
+
+    if (sq == NULL) {
+        return;
+    }
+    if (sq->active) {
+        QTAILQ_REMOVE(&n->sq_active, sq, active_entry);
     }
+    nvme_qos_cancel_sq(n, sq_id, 0);
+    nvme_sq_free_reqs(sq);
+    qemu_free(sq);
+    n->sq[sq_id] = NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_cq_alloc
+    Description  :    Allocates the state of a completion queue, the
+                      caller fills it in and links it to its vector
+    Return Type  :    NVMEIOCQueue *
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue ID, not allocated yet
+*********************************************************************/
+NVMEIOCQueue *nvme_cq_alloc(NVMEState *n, uint16_t cq_id)
+{
+    NVMEIOCQueue *cq = qemu_mallocz(sizeof(NVMEIOCQueue));
 
+    cq->id = cq_id;
+    n->cq[cq_id] = cq;
+    return cq;
+}
+
+/*********************************************************************
+    Function     :    nvme_cq_release
+    Description  :    Frees a completion queue
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : Queue ID
+*********************************************************************/
+void nvme_cq_release(NVMEState *n, uint16_t cq_id)
+{
+    NVMEIOCQueue *cq = n->cq[cq_id];
+
+    if (cq == NULL) {
+        return;
+    }
+    if (cq->vector < n->nvectors) {
+        QTAILQ_REMOVE(&n->vector_cqs[cq->vector], cq, vector_entry);
+    }
+    qemu_free(cq);
+    n->cq[cq_id] = NULL;
 }
 
 /* FIXME: For now allow only empty queue. */
@@ -133,7 +214,6 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEIOCQueue *cq;
     NVMEIOSQueue *sq;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
-    uint16_t i;
     sf->sc = NVME_SC_SUCCESS;
 
     LOG_NORM("%s(): called with QID:%d", __func__, c->qid);
@@ -150,7 +230,7 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    if (c->qid == 0 || c->qid > NVME_MAX_QID) {
+    if (c->qid == 0 || c->qid > NVME_MAX_QID(n)) {
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
         return FAIL;
@@ -160,40 +240,33 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    i = adm_get_sq(n, c->qid);
-    if (i == USHRT_MAX) {
+    sq = adm_get_sq(n, c->qid);
+    if (sq == NULL) {
         LOG_NORM("No such queue: SQ %d", c->qid);
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
         return FAIL;
     }
-    sq = &n->sq[i];
     if (sq->tail != sq->head) {
         /* Queue not empty */
     }
 
-    if (sq->cq_id <= NVME_MAX_QID) {
-        cq = &n->cq[sq->cq_id];
-        if (cq->id > NVME_MAX_QID) {
-            /* error */
-            sf->sct = NVME_SCT_CMD_SPEC_ERR;
-            sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
-            return FAIL;
-        }
-
-        if (!cq->usage_cnt) {
-            /* error FIXME */
-        }
+    cq = adm_get_cq(n, sq->cq_id);
+    if (cq == NULL) {
+        /* error */
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
+        return FAIL;
+    }
 
-        cq->usage_cnt--;
+    if (!cq->usage_cnt) {
+        /* error FIXME */
     }
 
-    sq->id = sq->cq_id = USHRT_MAX;
-    sq->head = sq->tail = 0;
-    sq->size = 0;
-    sq->prio = 0;
-    sq->phys_contig = 0;
-    sq->dma_addr = 0;
+    cq->usage_cnt--;
+
+    nvme_qos_cancel_sq(n, c->qid, 1);
+    nvme_sq_release(n, c->qid);
 
     return 0;
 }
@@ -227,7 +300,7 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     LOG_DBG("Create SQ command with PRP2: %lu", c->prp2);
     LOG_DBG("Create SQ command is assoc with CQID: %u", c->cqid);
 
-    if (c->qid == 0 || c->qid > NVME_MAX_QID) {
+    if (c->qid == 0 || c->qid > NVME_MAX_QID(n)) {
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
         LOG_NORM("%s():Invalid QID:%d in Command", __func__, c->qid);
@@ -285,22 +358,21 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    sq = &n->sq[c->qid];
-    sq->id = c->qid;
+    sq = nvme_sq_alloc(n, c->qid);
     sq->size = c->qsize + 1;
     sq->phys_contig = c->pc;
     sq->cq_id = c->cqid;
     sq->prio = c->qprio;
     sq->dma_addr = c->prp1;
 
-    QTAILQ_INIT(&sq->cmd_list);
+    nvme_sq_init_reqs(sq);
 
     LOG_DBG("sq->id %d, sq->dma_addr 0x%x, %lu",
         sq->id, (unsigned int)sq->dma_addr,
         (unsigned long int)sq->dma_addr);
 
     /* Mark CQ as used by this queue. */
-    n->cq[adm_get_cq(n, c->cqid)].usage_cnt++;
+    n->cq[c->cqid]->usage_cnt++;
 
     return 0;
 }
@@ -310,7 +382,6 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEAdmCmdDeleteCQ *c = (NVMEAdmCmdDeleteCQ *)cmd;
     NVMEIOCQueue *cq;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
-    uint16_t i;
     sf->sc = NVME_SC_SUCCESS;
 
     LOG_NORM("%s(): called", __func__);
@@ -328,7 +399,7 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    if (c->qid == 0 || c->qid > NVME_MAX_QID) {
+    if (c->qid == 0 || c->qid > NVME_MAX_QID(n)) {
         LOG_NORM("%s():Invalid Queue ID %d", __func__, c->qid);
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
@@ -340,14 +411,13 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
 
 
-    i = adm_get_cq(n, c->qid);
-    if (i == USHRT_MAX) {
+    cq = adm_get_cq(n, c->qid);
+    if (cq == NULL) {
         LOG_NORM("No such queue: CQ %d", c->qid);
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
         return FAIL;
     }
-    cq = &n->cq[i];
 
     if (cq->tail != cq->head) {
         /* Queue not empty */
@@ -361,13 +431,7 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return NVME_SC_INVALID_FIELD;
     }
 
-    cq->id = USHRT_MAX;
-    cq->head = cq->tail = 0;
-    cq->size = 0;
-    cq->irq_enabled = 0;
-    cq->vector = 0;
-    cq->dma_addr = 0;
-    cq->phys_contig = 0;
+    nvme_cq_release(n, c->qid);
 
     return 0;
 }
@@ -399,7 +463,7 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    if (c->qid == 0 || c->qid > NVME_MAX_QID) {
+    if (c->qid == 0 || c->qid > NVME_MAX_QID(n)) {
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
         LOG_NORM("%s(): invalid qid:%d in Command", __func__, c->qid);
@@ -447,9 +511,7 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    cq = &n->cq[c->qid];
-
-    cq->id = c->qid;
+    cq = nvme_cq_alloc(n, c->qid);
     cq->dma_addr = c->prp1;
     cq->irq_enabled = c->ien;
     cq->vector = c->iv;
@@ -460,6 +522,7 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
                      cq->id, cq->vector, cq->irq_enabled);
     cq->size = c->qsize + 1;
     cq->phys_contig = c->pc;
+    nvme_cq_link_vector(n, cq);
 
     return 0;
 }
@@ -467,7 +530,7 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 static uint32_t adm_cmd_fw_log_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEFwSlotInfoLog *fw_info = &(n->fw_slot_log);
-    uint32_t len, buf_len, trans_len;
+    uint32_t buf_len, trans_len;
 
     LOG_NORM("%s called", __func__);
 
@@ -479,18 +542,13 @@ static uint32_t adm_cmd_fw_log_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
                 sizeof(*fw_info), buf_len);
     }
 
-    len = min(PAGE_SIZE - (cmd->prp1 % PAGE_SIZE), trans_len);
-    nvme_dma_mem_write(cmd->prp1, (uint8_t *)fw_info, len);
-    if (len < trans_len) {
-        nvme_dma_mem_write(cmd->prp2, (uint8_t *)((uint8_t *)fw_info + len),
-            trans_len - len);
-    }
+    nvme_prp_rw(n, cmd, (uint8_t *)fw_info, trans_len, 1);
     return 0;
 }
 
 static uint32_t adm_cmd_smart_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
-    uint32_t len, buf_len, trans_len;
+    uint32_t buf_len, trans_len;
     time_t current_seconds;
     NVMESmartLog smart_log;
 
@@ -562,7 +620,7 @@ static uint32_t adm_cmd_smart_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         smart_log.available_spare = 100 - (uint32_t)((((double)total_use) /
             total_size) * 100);
     } else if (cmd->nsid > 0 && cmd->nsid <= n->num_namespaces &&
-        (n->idtfy_ctrl->lpa & 0x1)) {
+        n->disk[cmd->nsid - 1].attached && (n->idtfy_ctrl->lpa & 0x1)) {
         LOG_NORM("getting smart log info for instance:%d nsid:%d",
             n->instance, cmd->nsid);
         DiskInfo *disk = &n->disk[cmd->nsid - 1];
@@ -597,15 +655,80 @@ static uint32_t adm_cmd_smart_info(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         smart_log.critical_warning |= 1 << 1;
     }
 
-    len = min(PAGE_SIZE - (cmd->prp1 % PAGE_SIZE), trans_len);
-    nvme_dma_mem_write(cmd->prp1, (uint8_t *)&smart_log, len);
-    if (len < trans_len) {
-        nvme_dma_mem_write(cmd->prp2, (uint8_t *)((uint8_t *)&smart_log + len),
-            trans_len - len);
-    }
+    nvme_prp_rw(n, cmd, (uint8_t *)&smart_log, trans_len, 1);
     return 0;
 }
 
+static uint32_t adm_cmd_format_progress(NVMEState *n, NVMECmd *cmd,
+    NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEFormatProgress *log;
+    uint32_t i, buf_len, trans_len;
+
+    LOG_NORM("%s called", __func__);
+
+    buf_len = (((cmd->cdw10 >> 16) & 0xfff) + 1) * 4;
+    trans_len = min(n->num_namespaces * sizeof(*log), buf_len);
+
+    log = qemu_mallocz(n->num_namespaces * sizeof(*log));
+    for (i = 0; i < n->num_namespaces; i++) {
+        log[i].nsid = i + 1;
+        log[i].fpi = n->disk[i].idtfy_ns.fpi;
+        log[i].remaining = nvme_format_remaining(&n->disk[i]);
+    }
+    sf->sc = nvme_prp_rw(n, cmd, (uint8_t *)log, trans_len, 1);
+    qemu_free(log);
+    return sf->sc == NVME_SC_SUCCESS ? 0 : FAIL;
+}
+
+static uint32_t adm_cmd_ftl_log(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEFtlLog *log;
+    uint32_t i, buf_len, trans_len;
+
+    LOG_NORM("%s called", __func__);
+
+    buf_len = (((cmd->cdw10 >> 16) & 0xfff) + 1) * 4;
+    trans_len = min(n->num_namespaces * sizeof(*log), buf_len);
+
+    log = qemu_mallocz(n->num_namespaces * sizeof(*log));
+    for (i = 0; i < n->num_namespaces; i++) {
+        nvme_ftl_log(&n->disk[i], &log[i]);
+        log[i].nsid = i + 1;
+    }
+    sf->sc = nvme_prp_rw(n, cmd, (uint8_t *)log, trans_len, 1);
+    qemu_free(log);
+    return sf->sc == NVME_SC_SUCCESS ? 0 : FAIL;
+}
+
+static uint32_t adm_cmd_changed_ns(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint32_t list[NVME_CHANGED_NS_MAX];
+    uint32_t buf_len, trans_len;
+
+    LOG_NORM("%s called", __func__);
+
+    buf_len = (((cmd->cdw10 >> 16) & 0xfff) + 1) * 4;
+    trans_len = min(sizeof(list), buf_len);
+
+    memset(list, 0, sizeof(list));
+    if (n->changed_ns_count > NVME_CHANGED_NS_MAX) {
+        list[0] = 0xffffffff;
+    } else {
+        memcpy(list, n->changed_ns, n->changed_ns_count * sizeof(list[0]));
+    }
+    sf->sc = nvme_prp_rw(n, cmd, (uint8_t *)list, trans_len, 1);
+    /* Read, and the next change sends a notice again, unless the host
+     * retains the event (RAE) */
+    if (sf->sc == NVME_SC_SUCCESS && !(cmd->cdw10 & (1 << 15))) {
+        n->changed_ns_count = 0;
+    }
+    return sf->sc == NVME_SC_SUCCESS ? 0 : FAIL;
+}
+
 static uint32_t adm_cmd_get_log_page(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEAdmCmdGetLogPage *c = (NVMEAdmCmdGetLogPage *)cmd;
@@ -632,6 +755,15 @@ static uint32_t adm_cmd_get_log_page(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     case NVME_LOG_FW_SLOT_INFORMATION:
         ret = adm_cmd_fw_log_info(n, cmd, cqe);
         break;
+    case NVME_LOG_CHANGED_NS:
+        ret = adm_cmd_changed_ns(n, cmd, cqe);
+        break;
+    case NVME_LOG_FORMAT_PROGRESS:
+        ret = adm_cmd_format_progress(n, cmd, cqe);
+        break;
+    case NVME_LOG_FTL:
+        ret = adm_cmd_ftl_log(n, cmd, cqe);
+        break;
     default:
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_LOG_PAGE;
@@ -645,37 +777,122 @@ static uint32_t adm_cmd_get_log_page(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 
 static uint32_t adm_cmd_id_ctrl(NVMEState *n, NVMECmd *cmd)
 {
-    uint32_t len;
+    n->idtfy_ctrl->unvmcap[0] = nvme_ns_unallocated(n);
     LOG_NORM("%s(): copying %lu data into addr %lu",
         __func__, sizeof(*n->idtfy_ctrl), cmd->prp1);
 
-    len = PAGE_SIZE - (cmd->prp1 % PAGE_SIZE);
-    nvme_dma_mem_write(cmd->prp1, (uint8_t *) n->idtfy_ctrl, len);
-    if (len != sizeof(*(n->idtfy_ctrl))) {
-        nvme_dma_mem_write(cmd->prp2,
-            (uint8_t *) ((uint8_t *) n->idtfy_ctrl + len),
-                (sizeof(*(n->idtfy_ctrl)) - len));
-    }
+    nvme_prp_rw(n, cmd, (uint8_t *)n->idtfy_ctrl, sizeof(*n->idtfy_ctrl), 1);
     return 0;
 }
 
-/* Needs to be checked if this namespace exists. */
-static uint32_t adm_cmd_id_ns(NVMEState *n, NVMECmd *cmd)
+/* Identify Namespace, zeroed for a namespace not present: inactive for
+ * CNS 00h, unallocated for CNS 11h */
+static uint32_t adm_cmd_id_ns(NVMEState *n, NVMECmd *cmd, int present)
 {
-    uint32_t len;
+    NVMEIdentifyNamespace *id;
+
     LOG_NORM("%s(): called", __func__);
 
     LOG_DBG("Current Namespace utilization: %lu",
         n->disk[(cmd->nsid - 1)].idtfy_ns.nuse);
 
-    len = PAGE_SIZE - (cmd->prp1 % PAGE_SIZE);
-    nvme_dma_mem_write(cmd->prp1,
-        (uint8_t *) &n->disk[(cmd->nsid - 1)].idtfy_ns, len);
-    if (len != sizeof(n->disk[(cmd->nsid - 1)].idtfy_ns)) {
-        nvme_dma_mem_write(cmd->prp2,
-            (uint8_t *) ((uint8_t *)&n->disk[(cmd->nsid - 1)].idtfy_ns + len),
-                (sizeof(n->disk[(cmd->nsid - 1)].idtfy_ns)) - len);
+    if (!present) {
+        id = qemu_mallocz(sizeof(*id));
+        nvme_prp_rw(n, cmd, (uint8_t *)id, sizeof(*id), 1);
+        qemu_free(id);
+        return 0;
+    }
+    nvme_prp_rw(n, cmd, (uint8_t *)&n->disk[(cmd->nsid - 1)].idtfy_ns,
+        sizeof(n->disk[(cmd->nsid - 1)].idtfy_ns), 1);
+    return 0;
+}
+
+/* Namespace list of the active (attached) or allocated namespaces with
+ * an ID greater than NSID, in increasing order */
+static uint32_t adm_cmd_id_ns_list(NVMEState *n, NVMECmd *cmd, int active)
+{
+    uint32_t list[PAGE_SIZE / sizeof(uint32_t)];
+    uint32_t i, j = 0;
+
+    memset(list, 0, sizeof(list));
+    for (i = cmd->nsid; i < n->num_namespaces && j < ARRAY_SIZE(list); i++) {
+        if (active ? n->disk[i].attached : n->disk[i].allocated) {
+            list[j++] = i + 1;
+        }
+    }
+    nvme_prp_rw(n, cmd, (uint8_t *)list, sizeof(list), 1);
+    return 0;
+}
+
+/* Controller list of the controllers of the subsystem from CNTID on, in
+ * increasing order, those a namespace is attached to for CNS 12h */
+static uint32_t adm_cmd_id_ctrl_list(NVMEState *n, NVMECmd *cmd,
+    uint32_t nsid)
+{
+    NVMEAdmCmdIdentify *c = (NVMEAdmCmdIdentify *)cmd;
+    uint16_t list[NVME_CTRL_LIST_MAX + 1];
+    uint32_t cntlid = c->cntid;
+    NVMEState *p, *next;
+
+    memset(list, 0, sizeof(list));
+    while (list[0] < NVME_CTRL_LIST_MAX) {
+        next = NULL;
+        QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+            if (p->idtfy_ctrl->cntlid >= cntlid &&
+                (nsid == 0 || p->disk[nsid - 1].attached) &&
+                (next == NULL ||
+                p->idtfy_ctrl->cntlid < next->idtfy_ctrl->cntlid)) {
+                next = p;
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        list[++list[0]] = next->idtfy_ctrl->cntlid;
+        cntlid = next->idtfy_ctrl->cntlid + 1;
     }
+    nvme_prp_rw(n, cmd, (uint8_t *)list, sizeof(list), 1);
+    return 0;
+}
+
+/* Identify Namespace Identification Descriptor list: the NGUID, the same
+ * through every controller of the subsystem, and the command set of the
+ * namespace */
+static uint32_t adm_cmd_id_ns_descs(NVMEState *n, NVMECmd *cmd)
+{
+    uint8_t list[PAGE_SIZE];
+
+    memset(list, 0, sizeof(list));
+    list[0] = NVME_NIDT_NGUID;
+    list[1] = 16;
+    nvme_subsys_nguid(n, cmd->nsid, &list[4]);
+    list[20] = NVME_NIDT_CSI;
+    list[21] = 1;
+    list[24] = n->disk[cmd->nsid - 1].zone_count ? NVME_CSI_ZONED :
+        NVME_CSI_NVM;
+    nvme_prp_rw(n, cmd, list, sizeof(list), 1);
+    return 0;
+}
+
+/* I/O Command Set specific Identify Namespace, for zoned namespaces */
+static uint32_t adm_cmd_id_ns_zoned(NVMEState *n, NVMECmd *cmd)
+{
+    NVMEIdentifyZonedNs *id = qemu_malloc(sizeof(*id));
+
+    nvme_identify_zoned_ns(n, &n->disk[cmd->nsid - 1], id);
+    nvme_prp_rw(n, cmd, (uint8_t *)id, sizeof(*id), 1);
+    qemu_free(id);
+    return 0;
+}
+
+/* I/O Command Set specific Identify Controller. Zone Append takes as much
+ * data as a write (ZASL of 0 is MDTS), the NVM set has nothing to tell */
+static uint32_t adm_cmd_id_ctrl_csi(NVMEState *n, NVMECmd *cmd)
+{
+    NVMEIdentifyZonedCtrl id;
+
+    memset(&id, 0, sizeof(id));
+    nvme_prp_rw(n, cmd, (uint8_t *)&id, sizeof(id), 1);
     return 0;
 }
 
@@ -683,6 +900,7 @@ static uint32_t adm_cmd_identify(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEAdmCmdIdentify *c = (NVMEAdmCmdIdentify *)cmd;
     uint8_t ret;
+    uint8_t csi = c->cdw11 >> 24;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
@@ -701,22 +919,72 @@ static uint32_t adm_cmd_identify(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
 
     /* Construct some data and copy it to the addr.*/
-    if (c->cns == NVME_IDENTIFY_CONTROLLER) {
+    if (c->cns == NVME_IDENTIFY_CONTROLLER ||
+            c->cns == NVME_IDENTIFY_CSI_CONTROLLER) {
         if (c->nsid != 0) {
             LOG_NORM("%s(): Invalid namespace id:%d for id controller",
                 __func__, c->nsid);
             sf->sc = NVME_SC_INVALID_NAMESPACE;
             return FAIL;
         }
-        ret = adm_cmd_id_ctrl(n, cmd);
-    } else {
+        if (c->cns == NVME_IDENTIFY_CONTROLLER) {
+            ret = adm_cmd_id_ctrl(n, cmd);
+        } else if (csi == NVME_CSI_NVM ||
+                (csi == NVME_CSI_ZONED && n->zone_size_mb)) {
+            ret = adm_cmd_id_ctrl_csi(n, cmd);
+        } else {
+            LOG_NORM("%s(): Unsupported command set:%d", __func__, csi);
+            sf->sc = NVME_SC_INVALID_FIELD;
+            return FAIL;
+        }
+    } else if (c->cns == NVME_IDENTIFY_ACTIVE_NS_LIST ||
+            c->cns == NVME_IDENTIFY_ALLOC_NS_LIST) {
+        if (c->nsid >= 0xfffffffe) {
+            LOG_NORM("%s(): Invalid Namespace ID", __func__);
+            sf->sc = NVME_SC_INVALID_NAMESPACE;
+            return FAIL;
+        }
+        ret = adm_cmd_id_ns_list(n, cmd,
+            c->cns == NVME_IDENTIFY_ACTIVE_NS_LIST);
+    } else if (c->cns == NVME_IDENTIFY_CTRL_LIST) {
+        ret = adm_cmd_id_ctrl_list(n, cmd, 0);
+    } else if (c->cns == NVME_IDENTIFY_NAMESPACE ||
+            c->cns == NVME_IDENTIFY_NS_DESCS ||
+            c->cns == NVME_IDENTIFY_CSI_NAMESPACE ||
+            c->cns == NVME_IDENTIFY_ALLOC_NAMESPACE ||
+            c->cns == NVME_IDENTIFY_NS_CTRL_LIST) {
         /* Check for name space */
         if (c->nsid == 0 || (c->nsid > n->idtfy_ctrl->nn)) {
             LOG_NORM("%s(): Invalid Namespace ID", __func__);
             sf->sc = NVME_SC_INVALID_NAMESPACE;
             return FAIL;
         }
-        ret = adm_cmd_id_ns(n, cmd);
+        if (c->cns == NVME_IDENTIFY_NAMESPACE) {
+            ret = adm_cmd_id_ns(n, cmd, n->disk[c->nsid - 1].attached);
+        } else if (c->cns == NVME_IDENTIFY_ALLOC_NAMESPACE) {
+            ret = adm_cmd_id_ns(n, cmd, n->disk[c->nsid - 1].allocated);
+        } else if (c->cns == NVME_IDENTIFY_NS_CTRL_LIST) {
+            ret = adm_cmd_id_ctrl_list(n, cmd, c->nsid);
+        } else if (!n->disk[c->nsid - 1].attached) {
+            LOG_NORM("%s(): Inactive Namespace ID", __func__);
+            sf->sc = NVME_SC_INVALID_NAMESPACE;
+            return FAIL;
+        } else if (c->cns == NVME_IDENTIFY_NS_DESCS) {
+            ret = adm_cmd_id_ns_descs(n, cmd);
+        } else if (csi == NVME_CSI_ZONED &&
+                n->disk[c->nsid - 1].zone_count) {
+            ret = adm_cmd_id_ns_zoned(n, cmd);
+        } else {
+            /* Nothing specific to the NVM command set either */
+            LOG_NORM("%s(): No command set:%d data for nsid:%d", __func__,
+                csi, c->nsid);
+            sf->sc = NVME_SC_INVALID_FIELD;
+            return FAIL;
+        }
+    } else {
+        LOG_NORM("%s(): Unsupported CNS:%d", __func__, c->cns);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
     }
     if (ret) {
         sf->sc = NVME_SC_INTERNAL;
@@ -743,7 +1011,7 @@ static uint32_t adm_cmd_abort(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEIOSQueue *sq;
 
     sf->sc = NVME_SC_SUCCESS;
-    CommandEntry *ce;
+    NVMERequest *req;
 
     if (cmd->opcode != NVME_ADM_CMD_ABORT) {
         LOG_NORM("%s(): Invalid opcode %d", __func__, cmd->opcode);
@@ -763,36 +1031,24 @@ static uint32_t adm_cmd_abort(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
     LOG_NORM("%s(): called", __func__);
 
-    sq = &n->sq[c->sqid];
-    QTAILQ_FOREACH(ce, &sq->cmd_list, entry) {
-        if (ce->cid == c->cmdid) {
-            uint16_t aborted_cq_id;
-            NVMECQE acqe;
-            NVMEIOCQueue *cq;
-            NVMEStatusField *aborted_sf = (NVMEStatusField *) &acqe.status;
-
-            aborted_cq_id = sq->cq_id;
-            if (adm_check_cqid(n, aborted_cq_id)) {
-                LOG_ERR("Abort, submission queue:%d has invalid cq:%d", sq->id,
-                    aborted_cq_id);
-                sf->sct = NVME_SCT_CMD_SPEC_ERR;
-                sf->sc = NVME_REQ_CMD_TO_ABORT_NOT_FOUND;
-                return FAIL;
+    sq = n->sq[c->sqid];
+    QTAILQ_FOREACH(req, &sq->cmd_list, entry) {
+        if (req->cmd.cid == c->cmdid) {
+            NVMEStatusField *aborted_sf;
+
+            /* The workers are drained, so an outstanding command has
+             * been fetched but waits for its namespace QoS limits or
+             * FTL. One still running is let complete. */
+            if (nvme_qos_cancel_req(n, req) != SUCCESS) {
+                LOG_NORM("Abort cmdid:%d on sq:%d, command is running",
+                    c->cmdid, sq->id);
+                cqe->cmd_specific = 1;
+                return 0;
             }
-            cq = &n->cq[aborted_cq_id];
-
-            memset(&acqe, 0, sizeof(acqe));
-            aborted_sf->p = cq->phase_tag;
+            aborted_sf = (NVMEStatusField *)&req->cqe.status;
+            aborted_sf->sct = NVME_SCT_GEN_CMD_STATUS;
             aborted_sf->sc = NVME_SC_ABORT_REQ;
-
-            acqe.sq_id = c->sqid;
-            acqe.sq_head = sq->head;
-            acqe.command_id = c->cmdid;
-
-            post_cq_entry(n, cq, &acqe);
-
-            QTAILQ_REMOVE(&sq->cmd_list, ce, entry);
-            qemu_free(ce);
+            nvme_req_complete(n, req);
 
             LOG_NORM("Abort cmdid:%d on sq:%d success", c->cmdid, sq->id);
 
@@ -867,11 +1123,11 @@ static uint32_t do_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         if (sqe->opcode == NVME_ADM_CMD_SET_FEATURES) {
             uint16_t cqs = sqe->cdw11 >> 16;
             uint16_t sqs = sqe->cdw11 & 0xffff;
-            if (cqs > NVME_MAX_QID) {
-                cqs = NVME_MAX_QID;
+            if (cqs > NVME_MAX_QID(n)) {
+                cqs = NVME_MAX_QID(n);
             }
-            if (sqs > NVME_MAX_QID) {
-                sqs = NVME_MAX_QID;
+            if (sqs > NVME_MAX_QID(n)) {
+                sqs = NVME_MAX_QID(n);
             }
             n->feature.number_of_queues = (((uint32_t)cqs) << 16) | sqs;
             cqe->cmd_specific = n->feature.number_of_queues;
@@ -899,7 +1155,8 @@ static uint32_t do_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 
     case NVME_FEATURE_WRITE_ATOMICITY:
         if (sqe->opcode == NVME_ADM_CMD_SET_FEATURES) {
-            n->feature.write_atomicity = sqe->cdw11;
+            n->feature.write_atomicity =
+                sqe->cdw11 & NVME_WRITE_ATOMICITY_DN;
         } else {
             cqe->cmd_specific = n->feature.write_atomicity;
         }
@@ -921,6 +1178,23 @@ static uint32_t do_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         }
         break;
 
+    case NVME_FEATURE_HOST_IDENTIFIER:
+        /* 64 bit only, and fixed while the host is registered with any
+         * namespace */
+        if (sqe->cdw11 & 1) {
+            sf->sc = NVME_SC_INVALID_FIELD;
+        } else if (sqe->opcode == NVME_ADM_CMD_GET_FEATURES) {
+            sf->sc = nvme_prp_rw(n, cmd, (uint8_t *)&n->hostid,
+                sizeof(n->hostid), 1);
+        } else if (nvme_resv_registered(n)) {
+            LOG_NORM("%s(): host registered, hostid kept", __func__);
+            sf->sc = NVME_SC_CMD_SEQ_ERROR;
+        } else {
+            sf->sc = nvme_prp_rw(n, cmd, (uint8_t *)&n->hostid,
+                sizeof(n->hostid), 0);
+        }
+        break;
+
     default:
         LOG_NORM("Unknown feature ID: %d", sqe->fid);
         sf->sc = NVME_SC_INVALID_FIELD;
@@ -1055,72 +1329,11 @@ static uint32_t adm_cmd_act_fw(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     return res;
 }
 
-static uint8_t do_dlfw_prp(NVMEState *n, uint64_t mem_addr,
-    uint64_t *data_size_p, uint64_t *buf_offset, uint8_t *buf)
-{
-    uint64_t data_len;
-
-    if (*data_size_p == 0) {
-        return FAIL;
-    }
-
-    /* Data Len to be written per page basis */
-    data_len = PAGE_SIZE - (mem_addr % PAGE_SIZE);
-    if (data_len > *data_size_p) {
-        data_len = *data_size_p;
-    }
-
-    LOG_DBG("Length of FW Img:%ld", data_len);
-    LOG_DBG("Address for FW Img:%ld", mem_addr);
-    nvme_dma_mem_read(mem_addr, (buf + *buf_offset), data_len);
-
-    *buf_offset = *buf_offset + data_len;
-    *data_size_p = *data_size_p - data_len;
-    return NVME_SC_SUCCESS;
-}
-
-static uint8_t do_dlfw_prp_list(NVMEState *n, NVMECmd *cmd,
-    uint64_t *data_size_p, uint64_t *buf_offset, uint8_t *buf)
-{
-    uint64_t prp_list[512], prp_entries;
-    uint16_t i;
-    uint8_t res = NVME_SC_SUCCESS;
-
-    LOG_DBG("Data Size remaining for FW Image:%ld", *data_size_p);
-
-    /* Logic to find the number of PRP Entries */
-    prp_entries = (uint64_t) ((*data_size_p + PAGE_SIZE - 1) / PAGE_SIZE);
-    nvme_dma_mem_read(cmd->prp2, (uint8_t *)prp_list,
-        min(sizeof(prp_list), prp_entries * sizeof(uint64_t)));
-
-    i = 0;
-    /* Read/Write on PRPList */
-    while (*data_size_p != 0) {
-        if (i == 511 && *data_size_p > PAGE_SIZE) {
-            /* Calculate the actual number of remaining entries */
-            prp_entries = (uint64_t) ((*data_size_p + PAGE_SIZE - 1) /
-                PAGE_SIZE);
-            nvme_dma_mem_read(prp_list[511], (uint8_t *)prp_list,
-                min(sizeof(prp_list), prp_entries * sizeof(uint64_t)));
-            i = 0;
-        }
-
-        res = do_dlfw_prp(n, prp_list[i], data_size_p, buf_offset, buf);
-        LOG_DBG("Data Size remaining for read/write:%ld", *data_size_p);
-        if (res == FAIL) {
-            break;
-        }
-        i++;
-    }
-    return res;
-}
-
 static uint32_t fw_get_img(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe,
                                      uint8_t *buf, uint32_t sz_fw_buf)
 {
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     uint32_t res = 0;
-    uint64_t data_size = sz_fw_buf;
-    uint64_t buf_offset = 0;
     int fd;
     uint64_t offset = 0;
     uint64_t bytes_written = 0;
@@ -1132,20 +1345,11 @@ static uint32_t fw_get_img(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe,
     }
 
     /* Reading PRP1 and PRP2 */
-    res = do_dlfw_prp(n, cmd->prp1, &data_size, &buf_offset, buf);
-    if (res == FAIL) {
+    sf->sc = nvme_prp_rw(n, cmd, buf, sz_fw_buf, 0);
+    if (sf->sc != NVME_SC_SUCCESS) {
+        close(fd);
         return FAIL;
     }
-    if (data_size > 0) {
-        if (data_size <= PAGE_SIZE) {
-            res = do_dlfw_prp(n, cmd->prp2, &data_size, &buf_offset, buf);
-        } else {
-            res = do_dlfw_prp_list(n, cmd, &data_size, &buf_offset, buf);
-        }
-        if (res == FAIL) {
-            return FAIL;
-        }
-    }
 
     /* Writing to Firmware image file */
     offset = cmd->cdw11 * 4;
@@ -1232,35 +1436,38 @@ void async_process_cb(void *param)
             } else if (!n->smart_mask &&
                 (event->result.event_type == event_type_smart)) {
                 n->smart_mask = 0x1;
-            } else {
+            } else if (event->result.event_type != event_type_notice) {
+                /* Notices are sent once until their log page is read */
                 LOG_DBG("%s(): Async event type %d is masked, use GetLogPage "
                     "to unmask.", __func__,event->result.event_type);
                 continue;
             }
 
-            QSIMPLEQ_REMOVE_HEAD(&n->async_queue, entry);
+            /* Masked events before it stay queued */
+            QSIMPLEQ_REMOVE(&n->async_queue, event, AsyncEvent, entry);
 
             result = (AsyncResult *)&cqe.cmd_specific;
             result->event_type = event->result.event_type;
             result->event_info = event->result.event_info;
             result->log_page   = event->result.log_page;
 
-            qemu_free(event);
+            nvme_async_event_free(n, event);
 
             n->outstanding_asyncs--;
 
             cqe.sq_id = 0;
-            cqe.sq_head = n->sq[0].head;
+            cqe.sq_head = n->sq[ASQ_ID]->head;
             cqe.command_id = n->async_cid[n->outstanding_asyncs];
 
             sf->sc = NVME_SC_SUCCESS;
-            sf->p = n->cq[0].phase_tag;
+            sf->p = n->cq[ACQ_ID]->phase_tag;
             sf->m = 0;
             sf->dnr = 0;
 
-            addr = n->cq[0].dma_addr + n->cq[0].tail * sizeof(cqe);
-            nvme_dma_mem_write(addr, (uint8_t *)&cqe, sizeof(cqe));
-            incr_cq_tail(&n->cq[0]);
+            addr = n->cq[ACQ_ID]->dma_addr +
+                n->cq[ACQ_ID]->tail * sizeof(cqe);
+            nvme_dma_mem_write(n, addr, (uint8_t *)&cqe, sizeof(cqe));
+            incr_cq_tail(n->cq[ACQ_ID]);
 
             if (n->outstanding_asyncs == 0)
                 break;
@@ -1317,13 +1524,19 @@ static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
 
     nsid = cmd->nsid;
-    if (nsid > n->num_namespaces || nsid == 0) {
+    if (nsid > n->num_namespaces || nsid == 0 ||
+        !n->disk[nsid - 1].attached) {
         LOG_NORM("%s(): bad nsid:%d", __func__, nsid);
         sf->sc = NVME_SC_INVALID_NAMESPACE;
         return FAIL;
     }
 
     disk = &n->disk[nsid - 1];
+    if (nvme_ns_busy(n, nsid)) {
+        LOG_NORM("%s(): nsid:%d is being formatted", __func__, nsid);
+        sf->sc = NVME_SC_FORMAT_IN_PROGRESS;
+        return FAIL;
+    }
     if ((lba_idx) > disk->idtfy_ns.nlbaf) {
         LOG_NORM("%s(): Invalid format %x, lbaf out of range", __func__, dw10);
         sf->sc = NVME_INVALID_FORMAT;
@@ -1364,6 +1577,8 @@ static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
+    /* No other controller of the subsystem may use the old files */
+    nvme_subsys_drain(n);
     if (nvme_close_storage_disk(disk)) {
         return FAIL;
     }
@@ -1387,10 +1602,86 @@ static uint32_t adm_cmd_format_nvm(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     disk->idtfy_ns.ncap = disk->idtfy_ns.nsze;
     disk->idtfy_ns.dps = pil | pi;
 
-    if (nvme_create_storage_disk(n->instance, nsid, disk, n)) {
+    /* The command completes once the namespace is formatted */
+    sf->sc = nvme_format_start(n, disk);
+    nvme_ns_sync(n, nsid, 1);
+    if (sf->sc != NVME_SC_SUCCESS) {
         return FAIL;
     }
 
     return 0;
 }
 
+
+/* Namespace Management: creates a namespace from the Identify Namespace
+ * structure in the data buffer, its ID returned in Dword 0, or deletes
+ * one, or all of them */
+static uint32_t adm_cmd_ns_mgmt(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEIdentifyNamespace *id;
+    uint32_t sel = cmd->cdw10 & 0xf;
+    uint32_t nsid;
+
+    sf->sc = NVME_SC_SUCCESS;
+    LOG_NORM("%s(): called, sel:%u nsid:%u", __func__, sel, cmd->nsid);
+
+    if (sel == NVME_NS_MGMT_CREATE) {
+        id = qemu_malloc(sizeof(*id));
+        sf->sc = nvme_prp_rw(n, cmd, (uint8_t *)id, sizeof(*id), 0);
+        if (sf->sc == NVME_SC_SUCCESS &&
+            nvme_ns_create(n, id, &nsid, sf) == SUCCESS) {
+            cqe->cmd_specific = nsid;
+        }
+        qemu_free(id);
+    } else if (sel == NVME_NS_MGMT_DELETE) {
+        nvme_ns_delete(n, cmd->nsid, sf);
+    } else {
+        LOG_NORM("%s(): Invalid sel:%u", __func__, sel);
+        sf->sc = NVME_SC_INVALID_FIELD;
+    }
+    return sf->sc == NVME_SC_SUCCESS ? 0 : FAIL;
+}
+
+/* Namespace Attachment: to or from the controllers of the subsystem in
+ * the controller list of the data buffer */
+static uint32_t adm_cmd_ns_attach(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint16_t list[NVME_CTRL_LIST_MAX + 1];
+    uint32_t sel = cmd->cdw10 & 0xf;
+    uint32_t i;
+    NVMEState *p;
+
+    sf->sc = NVME_SC_SUCCESS;
+    LOG_NORM("%s(): called, sel:%u nsid:%u", __func__, sel, cmd->nsid);
+
+    if (sel != NVME_NS_CTRL_ATTACH && sel != NVME_NS_CTRL_DETACH) {
+        LOG_NORM("%s(): Invalid sel:%u", __func__, sel);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    sf->sc = nvme_prp_rw(n, cmd, (uint8_t *)list, sizeof(list), 0);
+    if (sf->sc != NVME_SC_SUCCESS) {
+        return FAIL;
+    }
+    for (i = 1; i <= list[0] && i <= NVME_CTRL_LIST_MAX; i++) {
+        if (nvme_subsys_ctrl(n, list[i]) == NULL) {
+            break;
+        }
+    }
+    if (list[0] == 0 || i <= list[0]) {
+        LOG_NORM("%s(): Invalid controller list of %u", __func__, list[0]);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_CONTROLLER_LIST_INVALID;
+        return FAIL;
+    }
+    for (i = 1; i <= list[0]; i++) {
+        p = nvme_subsys_ctrl(n, list[i]);
+        if (nvme_ns_attach(p, cmd->nsid, sel == NVME_NS_CTRL_ATTACH, sf) !=
+            SUCCESS) {
+            return FAIL;
+        }
+    }
+    return 0;
+}
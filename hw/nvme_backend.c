@@ -0,0 +1,894 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * External storage backend.
+ *
+ * An alternative to the I/O worker threads and io_uring: the transfers
+ * collected for a request are sent to a separate process over a Unix
+ * socket, see nvme_backend.h, which copies them between the namespace
+ * files and guest RAM it maps itself. The device keeps the registers,
+ * the doorbells, the queues, the commands and the interrupts, and does
+ * not hand SQ processing to the backend; the storage I/O runs in it,
+ * which can be pinned, restarted or replaced on its own. Requests whose
+ * guest memory is not shared with the backend, and all of them while it
+ * is away, are run by the device as they would be without it.
+ *
+ * A lost connection does not stop the backend: it may still be running
+ * the requests it was sent, and write after the guest was told they are
+ * done. Those requests are fenced until the backend process is gone, or
+ * answers HELLO again, which it only does once done with the previous
+ * connection; then the device runs them itself. A backend doing neither
+ * in time is killed, and they are run once it is gone: none of them is
+ * completed while it could still write.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include "nvme_backend.h"
+#include "qemu_socket.h"
+#include <sys/un.h>
+#include <poll.h>
+
+/* Time between two connection attempts, in ms */
+#define NVME_BACKEND_RETRY 1000
+
+/* Time the fenced requests wait for the lost backend before it is
+ * killed, and between two checks of its process, in ms */
+#define NVME_BACKEND_FENCE_TIMEOUT 5000
+#define NVME_BACKEND_FENCE_POLL 10
+
+/* How nvme_backend_send() dealt with a request */
+enum {
+    NVME_BACKEND_SENT,
+    NVME_BACKEND_FULL,  /* the socket is, try again when writable */
+    NVME_BACKEND_LOCAL, /* the backend cannot reach its memory */
+    NVME_BACKEND_LOST,  /* the connection is gone */
+};
+
+typedef struct NVMEBackendRegion {
+    uint8_t *host;
+    uint64_t len;
+} NVMEBackendRegion;
+
+typedef struct NVMEBackend {
+    int fd; /* -1 while not connected */
+    /* Connection number, the files are passed again on a new one */
+    uint32_t gen;
+    /* Connection attempt waiting for HELLO, -1 if none. Attempts are
+     * made by an rt_clock timer, never in the I/O path, and stop for
+     * good when guest RAM cannot be shared. */
+    int conn_fd;
+    QEMUTimer *retry_timer;
+    int64_t retry_at;
+    uint8_t no_retry;
+    /* Guest RAM the backend mapped, in the order passed */
+    NVMEBackendRegion region[NVME_BACKEND_MAX_REGIONS];
+    uint32_t nregions;
+    /* Requests not sent yet, the socket being full */
+    QSIMPLEQ_HEAD(backend_pending, NVMERequest) pending;
+    /* Process of the backend connected, which must be known */
+    pid_t pid;
+    /* Requests sent to a lost backend, which may still run them, with
+     * its process and the rt_clock time it is killed at */
+    QSIMPLEQ_HEAD(backend_fenced, NVMERequest) fenced;
+    pid_t fence_pid;
+    int64_t fence_deadline;
+    uint8_t fence_killed;
+    QEMUTimer *fence_timer;
+    /* IO message being built */
+    NVMEBackendMsg *msg;
+} NVMEBackend;
+
+/*********************************************************************
+    Function     :    nvme_backend_sendmsg
+    Description  :    Sends a message to the backend, with a file
+                      descriptor when one is given
+    Return Type  :    int (0, or -errno)
+
+    Arguments    :    int              : Socket
+                      NVMEBackendMsg * : Message, followed by its
+                                         transfers for IO
+                      size_t           : Length of the message
+                      int              : File descriptor, -1 for none
+                      int              : send flags
+*********************************************************************/
+static int nvme_backend_sendmsg(int sock, NVMEBackendMsg *m, size_t len,
+    int fd, int flags)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t ret;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = m;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    do {
+        ret = sendmsg(sock, &mh, flags | MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -errno : 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_region
+    Description  :    Passes a block of guest RAM to the backend when
+                      it is mapped shared from a file
+    Return Type  :    void
+
+    Arguments    :    void *     : Host address of the block
+                      ram_addr_t : RAM offset of the block
+                      ram_addr_t : Length of the block
+                      void *     : Backend
+*********************************************************************/
+static void nvme_backend_region(void *host_addr, ram_addr_t offset,
+    ram_addr_t length, void *opaque)
+{
+    NVMEBackend *b = opaque;
+    NVMEBackendMsg m;
+    int fd = qemu_ram_shared_fd(offset);
+
+    if (fd < 0 || b->nregions == NVME_BACKEND_MAX_REGIONS) {
+        return;
+    }
+    memset(&m, 0, sizeof(m));
+    m.type = NVME_BACKEND_REGION;
+    m.index = b->nregions;
+    m.size = length;
+    if (nvme_backend_sendmsg(b->fd, &m, sizeof(m), fd, 0) == 0) {
+        b->region[b->nregions].host = host_addr;
+        b->region[b->nregions].len = length;
+        b->nregions++;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_run_local
+    Description  :    Runs the transfers of a request in the main
+                      thread and completes it
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+static void nvme_backend_run_local(NVMEState *n, NVMERequest *req)
+{
+    NVMEStatusField *sf = (NVMEStatusField *) &req->cqe.status;
+    uint32_t i;
+
+    for (i = 0; i < req->nxfer; i++) {
+        if (nvme_xfer_run(&req->xfer[i])) {
+            sf->sc = NVME_SC_INTERNAL;
+            break;
+        }
+    }
+    nvme_worker_finish(n, req);
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_peer
+    Description  :    Finds the process at the other end of the socket
+    Return Type  :    pid_t (0 if unknown)
+
+    Arguments    :    int : Socket
+*********************************************************************/
+static pid_t nvme_backend_peer(int sock)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        return cred.pid;
+    }
+#endif
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_peer_gone
+    Description  :    Tells whether a backend process has exited, so
+                      that it cannot write anything any more
+    Return Type  :    int (1 if it has)
+
+    Arguments    :    pid_t : Process, 0 if unknown
+*********************************************************************/
+static int nvme_backend_peer_gone(pid_t pid)
+{
+    char path[32], buf[256], *p;
+    ssize_t len;
+    int fd;
+
+    if (pid <= 0) {
+        return 0;
+    }
+    if (kill(pid, 0) < 0 && errno == ESRCH) {
+        return 1;
+    }
+    /* Exited, but not reaped yet by its parent */
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+    p = strrchr(buf, ')');
+    return p && p[1] == ' ' && (p[2] == 'Z' || p[2] == 'X');
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_unfence
+    Description  :    Runs the requests sent to a lost backend, once it
+                      cannot touch them any more
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_backend_unfence(NVMEState *n)
+{
+    NVMEBackend *b = n->backend;
+    NVMERequest *req;
+
+    if (!QSIMPLEQ_EMPTY(&b->fenced)) {
+        LOG_ERR("Device:%d running the requests of the lost backend",
+            n->instance);
+    }
+    qemu_del_timer(b->fence_timer);
+    b->fence_pid = 0;
+    b->fence_killed = 0;
+    while ((req = QSIMPLEQ_FIRST(&b->fenced)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&b->fenced, worker_entry);
+        nvme_backend_run_local(n, req);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_kill
+    Description  :    Kills the lost backend that still has not let go
+                      of the requests it was sent
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_backend_kill(NVMEState *n)
+{
+    NVMEBackend *b = n->backend;
+
+    if (b->fence_killed) {
+        return;
+    }
+    b->fence_killed = 1;
+    if (kill(b->fence_pid, SIGKILL) < 0 && errno != ESRCH) {
+        /* Then only its exit, or its HELLO, lets them go */
+        LOG_ERR("Device:%d cannot kill backend %d: %s, its requests wait "
+            "for it", n->instance, (int)b->fence_pid, strerror(errno));
+        return;
+    }
+    LOG_ERR("Device:%d killed backend %d", n->instance, (int)b->fence_pid);
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_retry
+    Description  :    Drops the connection attempt, if any, and makes
+                      the next one in NVME_BACKEND_RETRY ms
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_backend_retry(NVMEState *n)
+{
+    NVMEBackend *b = n->backend;
+
+    if (b->conn_fd >= 0) {
+        qemu_set_fd_handler(b->conn_fd, NULL, NULL, NULL);
+        close(b->conn_fd);
+        b->conn_fd = -1;
+    }
+    if (!b->no_retry) {
+        b->retry_at = qemu_get_clock_ms(rt_clock) + NVME_BACKEND_RETRY;
+        qemu_mod_timer(b->retry_timer, b->retry_at);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_hello
+    Description  :    Completes a connection attempt once the backend
+                      answered HELLO: checks it speaks the same
+                      protocol and passes it guest RAM. Read handler
+                      of the socket of the attempt.
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_backend_hello(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMEBackend *b = n->backend;
+    NVMEBackendMsg m;
+    ssize_t ret;
+
+    do {
+        ret = recv(b->conn_fd, &m, sizeof(m), MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (ret != sizeof(m) || m.type != NVME_BACKEND_HELLO ||
+        m.tag != NVME_BACKEND_MAGIC || m.index != NVME_BACKEND_VERSION) {
+        LOG_ERR("Device:%d no NVMe backend protocol %d at %s", n->instance,
+            NVME_BACKEND_VERSION, n->backend_path);
+        nvme_backend_retry(n);
+        return;
+    }
+
+    qemu_set_fd_handler(b->conn_fd, NULL, NULL, NULL);
+    qemu_del_timer(b->retry_timer);
+    b->fd = b->conn_fd;
+    b->conn_fd = -1;
+    b->pid = nvme_backend_peer(b->fd);
+    if (b->pid == 0) {
+        /* Without it, requests of a lost connection could never be
+         * known to be left alone */
+        LOG_ERR("Device:%d process of the backend at %s unknown, not "
+            "used", n->instance, n->backend_path);
+        b->no_retry = 1;
+        close(b->fd);
+        b->fd = -1;
+        return;
+    }
+    b->nregions = 0;
+    qemu_ram_foreach_block(nvme_backend_region, b);
+    if (b->nregions == 0) {
+        LOG_ERR("Device:%d guest RAM cannot be shared with the backend, "
+            "it needs -mem-path and -mem-prealloc", n->instance);
+        /* Which does not change, the transfers always run locally */
+        b->no_retry = 1;
+        close(b->fd);
+        b->fd = -1;
+        return;
+    }
+
+    b->gen++;
+    qemu_set_fd_handler(b->fd, nvme_backend_complete, NULL, n);
+    LOG_NORM("Device:%d connected to the backend at %s, %u RAM regions",
+        n->instance, n->backend_path, b->nregions);
+    if (b->pid == b->fence_pid) {
+        /* Its HELLO comes once done with the previous connection */
+        nvme_backend_unfence(n);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_connect
+    Description  :    Starts a connection attempt: connects without
+                      blocking and sends HELLO, answered later. An
+                      attempt still waiting for the answer is given up.
+                      Timer of the connection attempts.
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_backend_connect(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMEBackend *b = n->backend;
+    struct sockaddr_un sun;
+    NVMEBackendMsg m;
+
+    if (b->fd >= 0) {
+        return;
+    }
+    if (b->conn_fd >= 0) {
+        LOG_ERR("Device:%d no answer from the backend at %s", n->instance,
+            n->backend_path);
+        nvme_backend_retry(n);
+        return;
+    }
+    b->conn_fd = qemu_socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (b->conn_fd < 0) {
+        nvme_backend_retry(n);
+        return;
+    }
+    /* Unix sockets connect at once, or fail with EAGAIN when the
+     * backend has too many waiting to be accepted */
+    socket_set_nonblock(b->conn_fd);
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    pstrcpy(sun.sun_path, sizeof(sun.sun_path), n->backend_path);
+    memset(&m, 0, sizeof(m));
+    m.type = NVME_BACKEND_HELLO;
+    m.index = NVME_BACKEND_VERSION;
+    m.tag = NVME_BACKEND_MAGIC;
+    if (connect(b->conn_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        nvme_backend_sendmsg(b->conn_fd, &m, sizeof(m), -1,
+        MSG_DONTWAIT) < 0) {
+        nvme_backend_retry(n);
+        return;
+    }
+    qemu_set_fd_handler(b->conn_fd, nvme_backend_hello, NULL, n);
+    /* A backend that does not answer is given up on then */
+    b->retry_at = qemu_get_clock_ms(rt_clock) + NVME_BACKEND_RETRY;
+    qemu_mod_timer(b->retry_timer, b->retry_at);
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_fence
+    Description  :    Checks on the lost backend for the requests it
+                      was sent, killing it past the deadline, and
+                      waiting for it to be gone when asked to
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      int         : 1 to wait
+*********************************************************************/
+static void nvme_backend_fence(NVMEState *n, int wait)
+{
+    NVMEBackend *b = n->backend;
+    struct pollfd pfd;
+    int64_t now;
+
+    while (!QSIMPLEQ_EMPTY(&b->fenced)) {
+        now = qemu_get_clock_ms(rt_clock);
+        if (nvme_backend_peer_gone(b->fence_pid)) {
+            nvme_backend_unfence(n);
+            break;
+        }
+        if (now >= b->fence_deadline && !b->fence_killed) {
+            LOG_ERR("Device:%d backend %d still running after %d ms",
+                n->instance, (int)b->fence_pid, NVME_BACKEND_FENCE_TIMEOUT);
+            nvme_backend_kill(n);
+        }
+        if (wait) {
+            /* Connecting on, as the timer would: the backend answering
+             * HELLO is done with them */
+            if (b->fd < 0 && !b->no_retry && now >= b->retry_at) {
+                nvme_backend_connect(n);
+            }
+            pfd.fd = b->conn_fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, NVME_BACKEND_FENCE_POLL) > 0) {
+                nvme_backend_hello(n);
+            }
+        } else {
+            qemu_mod_timer(b->fence_timer, b->fence_killed ?
+                now + NVME_BACKEND_FENCE_POLL : MIN(now +
+                NVME_BACKEND_FENCE_POLL, b->fence_deadline));
+            return;
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_fence_cb
+    Description  :    Timer checking on the lost backend
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_backend_fence_cb(void *opaque)
+{
+    nvme_backend_fence(opaque, 0);
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_lost
+    Description  :    Drops the connection to the backend. The requests
+                      waiting to be sent are run in the main thread,
+                      those it was sent are fenced until it is known
+                      not to run them any more.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_backend_lost(NVMEState *n)
+{
+    NVMEBackend *b = n->backend;
+    NVMERequest *req, *next;
+    pid_t pid = b->pid;
+    uint32_t i;
+
+    LOG_ERR("Device:%d lost the backend", n->instance);
+    qemu_set_fd_handler(b->fd, NULL, NULL, NULL);
+    close(b->fd);
+    b->fd = -1;
+    nvme_backend_retry(n);
+    while ((req = QSIMPLEQ_FIRST(&b->pending)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&b->pending, worker_entry);
+        nvme_backend_run_local(n, req);
+    }
+
+    /* Those of an earlier backend still running are waited for, the
+     * fence tracking a single process: it is killed now */
+    if (!QSIMPLEQ_EMPTY(&b->fenced)) {
+        nvme_backend_kill(n);
+        nvme_backend_fence(n, 1);
+    }
+
+    /* The other requests with transfers are the backend's */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i] == NULL) {
+            continue;
+        }
+        QTAILQ_FOREACH_SAFE(req, &n->sq[i]->cmd_list, entry, next) {
+            if (req->nxfer) {
+                QSIMPLEQ_INSERT_TAIL(&b->fenced, req, worker_entry);
+            }
+        }
+    }
+    if (QSIMPLEQ_EMPTY(&b->fenced)) {
+        return;
+    }
+    b->fence_pid = pid;
+    b->fence_deadline = qemu_get_clock_ms(rt_clock) +
+        NVME_BACKEND_FENCE_TIMEOUT;
+    nvme_backend_fence(n, 0);
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_file
+    Description  :    Finds the slot of a backing file, passing the
+                      file to the backend once per connection after it
+                      was opened
+    Return Type  :    int (slot, or -1 if none, or -2 if the socket is
+                      full, or -3 if the connection is lost)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file
+*********************************************************************/
+static int nvme_backend_file(NVMEState *n, NVMEBackingFile *bf)
+{
+    NVMEBackend *b = n->backend;
+    NVMEBackendMsg m;
+    int slot = -1, ret;
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces && slot < 0; i++) {
+        if (bf == &n->disk[i].data) {
+            slot = 2 * i;
+        } else if (bf == &n->disk[i].meta) {
+            slot = 2 * i + 1;
+        }
+    }
+    if (slot < 0 || bf->backend_gen == b->gen) {
+        return slot;
+    }
+
+    memset(&m, 0, sizeof(m));
+    m.type = NVME_BACKEND_FILE;
+    m.index = slot;
+    ret = nvme_backend_sendmsg(b->fd, &m, sizeof(m), bf->fd, MSG_DONTWAIT);
+    if (ret == 0 && bf->direct_fd >= 0) {
+        m.flags = NVME_BACKEND_F_DIRECT;
+        ret = nvme_backend_sendmsg(b->fd, &m, sizeof(m), bf->direct_fd,
+            MSG_DONTWAIT);
+    }
+    if (ret == -EAGAIN) {
+        return -2;
+    } else if (ret < 0) {
+        return -3;
+    }
+    bf->backend_gen = b->gen;
+    return slot;
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_send
+    Description  :    Sends the transfers of a request to the backend
+    Return Type  :    int (NVME_BACKEND_SENT, _FULL, _LOCAL or _LOST)
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+static int nvme_backend_send(NVMEState *n, NVMERequest *req)
+{
+    NVMEBackend *b = n->backend;
+    NVMEBackendXfer *bx = (NVMEBackendXfer *)(b->msg + 1);
+    NVMEXfer *x;
+    uint32_t i, r;
+    int file, ret;
+
+    if (req->nxfer > NVME_BACKEND_MAX_XFERS) {
+        return NVME_BACKEND_LOCAL;
+    }
+    for (i = 0; i < req->nxfer; i++, bx++) {
+        x = &req->xfer[i];
+        for (r = 0; r < b->nregions; r++) {
+            if (x->host >= b->region[r].host &&
+                x->host + x->len <= b->region[r].host + b->region[r].len) {
+                break;
+            }
+        }
+        if (r == b->nregions) {
+            return NVME_BACKEND_LOCAL;
+        }
+        file = nvme_backend_file(n, x->bf);
+        if (file == -1) {
+            return NVME_BACKEND_LOCAL;
+        } else if (file == -2) {
+            return NVME_BACKEND_FULL;
+        } else if (file == -3) {
+            return NVME_BACKEND_LOST;
+        }
+        bx->region = r;
+        bx->file = file;
+        bx->addr = x->host - b->region[r].host;
+        bx->offset = x->offset;
+        bx->len = x->len;
+        bx->flags = (x->direct ? NVME_BACKEND_F_DIRECT : 0) |
+            (x->is_write ? NVME_BACKEND_F_WRITE : 0);
+        bx->rsvd = 0;
+    }
+
+    memset(b->msg, 0, sizeof(*b->msg));
+    b->msg->type = NVME_BACKEND_IO;
+    b->msg->tag = ((uint64_t)req->sq_id << 32) | req->slot;
+    b->msg->count = req->nxfer;
+    ret = nvme_backend_sendmsg(b->fd, b->msg, sizeof(*b->msg) +
+        req->nxfer * sizeof(NVMEBackendXfer), -1, MSG_DONTWAIT);
+    if (ret == -EAGAIN) {
+        return NVME_BACKEND_FULL;
+    } else if (ret < 0) {
+        return NVME_BACKEND_LOST;
+    }
+    return NVME_BACKEND_SENT;
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_flush
+    Description  :    Sends the requests waiting for room in the
+                      socket. Write handler of the socket while any
+                      is waiting.
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_backend_flush(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMEBackend *b = n->backend;
+    NVMERequest *req;
+
+    while ((req = QSIMPLEQ_FIRST(&b->pending)) != NULL) {
+        switch (nvme_backend_send(n, req)) {
+        case NVME_BACKEND_FULL:
+            return;
+        case NVME_BACKEND_LOST:
+            nvme_backend_lost(n);
+            return;
+        case NVME_BACKEND_LOCAL:
+            QSIMPLEQ_REMOVE_HEAD(&b->pending, worker_entry);
+            nvme_backend_run_local(n, req);
+            break;
+        default:
+            QSIMPLEQ_REMOVE_HEAD(&b->pending, worker_entry);
+            break;
+        }
+    }
+    qemu_set_fd_handler(b->fd, nvme_backend_complete, NULL, n);
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_submit
+    Description  :    Hands the transfers of a request to the backend,
+                      keeping a CQ entry for it. Without a backend
+                      they run in the main thread.
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+void nvme_backend_submit(NVMEState *n, NVMERequest *req)
+{
+    NVMEBackend *b = n->backend;
+    NVMEIOSQueue *sq = n->sq[req->sq_id];
+
+    n->cq[sq->cq_id]->inflight++;
+    n->worker_inflight++;
+
+    if (b->fd < 0) {
+        nvme_backend_run_local(n, req);
+        return;
+    }
+    if (!QSIMPLEQ_EMPTY(&b->pending)) {
+        QSIMPLEQ_INSERT_TAIL(&b->pending, req, worker_entry);
+        return;
+    }
+    switch (nvme_backend_send(n, req)) {
+    case NVME_BACKEND_FULL:
+        QSIMPLEQ_INSERT_TAIL(&b->pending, req, worker_entry);
+        qemu_set_fd_handler(b->fd, nvme_backend_complete,
+            nvme_backend_flush, n);
+        break;
+    case NVME_BACKEND_LOCAL:
+        nvme_backend_run_local(n, req);
+        break;
+    case NVME_BACKEND_LOST:
+        nvme_backend_lost(n);
+        break;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_complete
+    Description  :    Completes the requests the backend is done with.
+                      Read handler of the socket.
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+void nvme_backend_complete(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMEBackend *b = n->backend;
+    NVMEStatusField *sf;
+    NVMEBackendMsg m;
+    NVMERequest *req;
+    uint32_t sq_id, slot;
+    ssize_t ret;
+
+    while (b->fd >= 0) {
+        ret = recv(b->fd, &m, sizeof(m), MSG_DONTWAIT);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (ret <= 0) {
+            nvme_backend_lost(n);
+            return;
+        }
+        sq_id = m.tag >> 32;
+        slot = (uint32_t)m.tag;
+        if (ret != sizeof(m) || m.type != NVME_BACKEND_DONE ||
+            sq_id == 0 || sq_id >= n->num_queues || n->sq[sq_id] == NULL ||
+            slot >= n->sq[sq_id]->size || !n->sq[sq_id]->reqs ||
+            !n->sq[sq_id]->reqs[slot].nxfer) {
+            LOG_ERR("Device:%d bad message from the backend", n->instance);
+            nvme_backend_lost(n);
+            return;
+        }
+        req = &n->sq[sq_id]->reqs[slot];
+        if (m.result < 0) {
+            LOG_ERR("Backend transfer failed: %s", strerror(-m.result));
+            sf = (NVMEStatusField *) &req->cqe.status;
+            sf->sc = NVME_SC_INTERNAL;
+        }
+        nvme_worker_finish(n, req);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_drain
+    Description  :    Waits for the backend to be done with every
+                      request and completes them, and for a lost one
+                      to be done with those it was sent
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_backend_drain(NVMEState *n)
+{
+    NVMEBackend *b = n->backend;
+    struct pollfd pfd;
+
+    while (n->worker_inflight) {
+        if (!QSIMPLEQ_EMPTY(&b->fenced)) {
+            nvme_backend_fence(n, 1);
+            continue;
+        }
+        if (b->fd < 0) {
+            break;
+        }
+        pfd.fd = b->fd;
+        pfd.events = POLLIN;
+        if (!QSIMPLEQ_EMPTY(&b->pending)) {
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, -1) < 0) {
+            continue;
+        }
+        if (pfd.revents & POLLOUT) {
+            nvme_backend_flush(n);
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            nvme_backend_complete(n);
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_init
+    Description  :    Connects the device to its storage backend. A
+                      backend not listening yet is connected to later.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_backend_init(NVMEState *n)
+{
+    NVMEBackend *b = qemu_mallocz(sizeof(*b));
+
+    if (strlen(n->backend_path) >= sizeof(((struct sockaddr_un *)0)->
+        sun_path)) {
+        LOG_ERR("Backend socket path too long: %s", n->backend_path);
+        qemu_free(b);
+        return FAIL;
+    }
+    b->fd = b->conn_fd = -1;
+    QSIMPLEQ_INIT(&b->pending);
+    QSIMPLEQ_INIT(&b->fenced);
+    b->fence_timer = qemu_new_timer_ms(rt_clock, nvme_backend_fence_cb, n);
+    b->retry_timer = qemu_new_timer_ms(rt_clock, nvme_backend_connect, n);
+    b->msg = qemu_malloc(sizeof(*b->msg) +
+        NVME_BACKEND_MAX_XFERS * sizeof(NVMEBackendXfer));
+    n->backend = b;
+    nvme_backend_connect(n);
+    if (b->conn_fd < 0) {
+        LOG_NORM("Device:%d backend %s not listening, retrying every %d ms",
+            n->instance, n->backend_path, NVME_BACKEND_RETRY);
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_backend_uninit
+    Description  :    Completes the outstanding requests and closes
+                      the connection
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_backend_uninit(NVMEState *n)
+{
+    NVMEBackend *b = n->backend;
+
+    if (b == NULL) {
+        return;
+    }
+    nvme_backend_drain(n);
+    if (b->fd >= 0) {
+        qemu_set_fd_handler(b->fd, NULL, NULL, NULL);
+        close(b->fd);
+    }
+    b->no_retry = 1;
+    nvme_backend_retry(n);
+    qemu_del_timer(b->retry_timer);
+    qemu_free_timer(b->retry_timer);
+    qemu_del_timer(b->fence_timer);
+    qemu_free_timer(b->fence_timer);
+    qemu_free(b->msg);
+    qemu_free(b);
+    n->backend = NULL;
+}
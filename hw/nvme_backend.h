@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef NVME_BACKEND_H
+#define NVME_BACKEND_H
+
+#include <stdint.h>
+
+/*
+ * Protocol between the NVMe device and an external storage backend
+ * process, e.g. qemu-nvme-backend, over a SOCK_SEQPACKET Unix socket.
+ * Both ends run on the same host, fields are in host byte order.
+ *
+ * The device connects and sends HELLO, which the backend sends back.
+ * The device then passes, as SCM_RIGHTS file descriptors with REGION and
+ * FILE messages, the guest RAM blocks shared with it (-mem-path with
+ * -mem-prealloc) and the namespace files as they are first used. Each IO
+ * message carries the transfers of one command, between guest RAM and a
+ * file, and is answered by a DONE message with the same tag. DONE
+ * messages may come in any order. The backend sees no queue, doorbell
+ * or command: those stay with the device, which only hands it the data
+ * transfers the commands resolved to. When the connection is lost the
+ * device runs the transfers not sent yet itself, and connects again
+ * later. It runs those it sent once the backend process has exited, or
+ * once the same process answered HELLO on a new connection: a backend
+ * must only do so when done with every IO of the previous one. One that
+ * does neither within 5 seconds is sent SIGKILL, so the device must be
+ * allowed to signal it.
+ */
+
+#define NVME_BACKEND_MAGIC   0x454d564eU /* "NVME" */
+#define NVME_BACKEND_VERSION 1
+
+/* Most guest RAM blocks and transfers per IO message */
+#define NVME_BACKEND_MAX_REGIONS 64
+#define NVME_BACKEND_MAX_XFERS   1024
+
+enum {
+    NVME_BACKEND_HELLO  = 1, /* index: version, tag: magic */
+    NVME_BACKEND_REGION = 2, /* fd, index: region, size */
+    NVME_BACKEND_FILE   = 3, /* fd, index: file slot, flags */
+    NVME_BACKEND_IO     = 4, /* tag, count transfers follow */
+    NVME_BACKEND_DONE   = 5, /* tag, result */
+};
+
+/* FILE and transfer flags */
+#define NVME_BACKEND_F_DIRECT 0x1 /* the O_DIRECT descriptor of the file */
+#define NVME_BACKEND_F_WRITE  0x2 /* guest RAM to the file */
+
+typedef struct NVMEBackendMsg {
+    uint32_t type;
+    uint32_t index;
+    uint64_t tag;
+    uint64_t size;
+    int64_t  result;  /* 0, or -errno of the first failed transfer */
+    uint32_t count;
+    uint32_t flags;
+} NVMEBackendMsg;
+
+typedef struct NVMEBackendXfer {
+    uint32_t region;
+    uint32_t file;    /* slot: 2 * (nsid - 1), + 1 for the meta-data */
+    uint64_t addr;    /* offset within the region */
+    uint64_t offset;  /* offset within the file */
+    uint64_t len;
+    uint32_t flags;
+    uint32_t rsvd;
+} NVMEBackendXfer;
+
+#endif /* NVME_BACKEND_H */
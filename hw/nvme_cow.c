@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Copy-on-write clones.
+ *
+ * With base=<file> every namespace starts as a clone of a read-only image
+ * laid out like its data backing file, which many devices may share. The
+ * data file then only takes the blocks written, or copied up, and a
+ * bitmap of one bit per LBA tells which blocks it holds; reads of the
+ * others go to the base image. A compaction started from the monitor
+ * copies the shared blocks up in the background, after which the base
+ * image is closed and the namespace is an ordinary one.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include <sys/stat.h>
+
+/*********************************************************************
+    Function     :    nvme_cow_path
+    Description  :    Name of the base image of a namespace: the base
+                      property with "%d" standing for the namespace id
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+                      char *      : Buffer for the name
+                      size_t      : Size of the buffer
+*********************************************************************/
+static void nvme_cow_path(NVMEState *n, uint32_t nsid, char *buf,
+    size_t size)
+{
+    const char *p = strstr(n->base_path, "%d");
+
+    if (p == NULL) {
+        pstrcpy(buf, size, n->base_path);
+        return;
+    }
+    snprintf(buf, size, "%.*s%u%s", (int)(p - n->base_path), n->base_path,
+        nsid, p + 2);
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_blk_sz
+    Description  :    Bytes per LBA in the data file, as laid out by
+                      nvme_io_command()
+    Return Type  :    uint32_t
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+static uint32_t nvme_cow_blk_sz(DiskInfo *disk)
+{
+    uint8_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+
+    return NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_open
+    Description  :    Opens the base image of a namespace just created,
+                      all of whose blocks are then read from the base.
+                      Blocks past the end of the base image read as
+                      zeroes from the data file.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk, backing files open
+*********************************************************************/
+int nvme_cow_open(NVMEState *n, DiskInfo *disk)
+{
+    uint64_t nbits = disk->idtfy_ns.nsze;
+    uint64_t blocks, lba;
+    struct stat st;
+    char name[PATH_MAX];
+
+    if (disk->data.size == 0) {
+        return SUCCESS;
+    }
+    nvme_cow_path(n, disk->nsid, name, sizeof(name));
+    nvme_backing_init(&disk->base);
+    disk->base.read_only = 1;
+    disk->base.fd = open(name, O_RDONLY);
+    if (disk->base.fd < 0 || fstat(disk->base.fd, &st) < 0) {
+        LOG_ERR("Error while opening base image %s: %s", name,
+            strerror(errno));
+        nvme_backing_close(&disk->base);
+        return FAIL;
+    }
+    /* Only whole blocks are shared */
+    blocks = min((uint64_t)st.st_size, disk->data.size) /
+        nvme_cow_blk_sz(disk);
+    blocks = min(blocks, nbits);
+    disk->base.size = blocks * nvme_cow_blk_sz(disk);
+
+    disk->cow_map = bitmap_new(nbits);
+    bitmap_set(disk->cow_map, blocks, nbits - blocks);
+    disk->cow_shared = blocks;
+    disk->cow_next = 0;
+    disk->compacting = 0;
+    /* Blocks of the base image hold data */
+    for (lba = 0; lba < blocks; lba++) {
+        if (!(disk->ns_util[lba / 8] & (1 << (lba % 8)))) {
+            disk->ns_util[lba / 8] |= 1 << (lba % 8);
+            disk->idtfy_ns.nuse++;
+        }
+    }
+    LOG_NORM("namespace %d cloned from %s, %lu blocks shared", disk->nsid,
+        name, blocks);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_close
+    Description  :    Closes the base image of a namespace, which no
+                      longer reads from it
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+void nvme_cow_close(DiskInfo *disk)
+{
+    if (disk->cow_map == NULL) {
+        return;
+    }
+    qemu_free(disk->cow_map);
+    disk->cow_map = NULL;
+    disk->cow_shared = 0;
+    disk->compacting = 0;
+    nvme_backing_close(&disk->base);
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_read
+    Description  :    Reads the blocks of a command into n->qsg, each
+                      run of blocks from the data file or the base
+                      image, whichever holds it
+    Return Type  :    int (0 when all blocks are in the data file and
+                      left to the caller, 1 if read, -1 if a transfer
+                      failed)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk of a clone
+                      uint64_t    : Offset of the first block in the
+                                    files
+                      uint64_t    : Starting LBA
+                      uint32_t    : Number of logical blocks
+                      uint32_t    : Logical block size
+*********************************************************************/
+int nvme_cow_read(NVMEState *n, DiskInfo *disk, uint64_t offset,
+    uint64_t slba, uint32_t nlb, uint32_t lba_sz)
+{
+    uint64_t end = slba + nlb, lba = slba, next;
+    NVMEBackingFile *bf;
+
+    if (find_next_zero_bit(disk->cow_map, end, slba) >= end) {
+        return 0;
+    }
+    while (lba < end) {
+        if (test_bit(lba, disk->cow_map)) {
+            next = find_next_zero_bit(disk->cow_map, end, lba);
+            bf = &disk->data;
+        } else {
+            next = find_next_bit(disk->cow_map, end, lba);
+            bf = &disk->base;
+        }
+        if (nvme_sg_range_rw(n, bf, offset, (lba - slba) * lba_sz,
+                (next - slba) * lba_sz, 0)) {
+            return -1;
+        }
+        lba = next;
+    }
+    return 1;
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_written
+    Description  :    Records blocks of a clone written to its data
+                      file, no longer read from the base image
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk of a clone
+                      uint64_t   : Starting LBA
+                      uint64_t   : Number of logical blocks
+*********************************************************************/
+void nvme_cow_written(DiskInfo *disk, uint64_t slba, uint64_t nlb)
+{
+    uint64_t end = min(slba + nlb, disk->idtfy_ns.nsze);
+    uint64_t lba, next;
+
+    for (lba = find_next_zero_bit(disk->cow_map, end, slba); lba < end;
+            lba = find_next_zero_bit(disk->cow_map, end, next)) {
+        next = find_next_bit(disk->cow_map, end, lba);
+        bitmap_set(disk->cow_map, lba, next - lba);
+        disk->cow_shared -= next - lba;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_fill
+    Description  :    Copies the blocks of a range still shared with
+                      the base image up to the data file, e.g. before
+                      they are read without going through n->qsg
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    DiskInfo * : NVME disk of a clone
+                      uint64_t   : Starting LBA
+                      uint64_t   : Number of logical blocks
+*********************************************************************/
+int nvme_cow_fill(DiskInfo *disk, uint64_t slba, uint64_t nlb)
+{
+    uint32_t lba_sz = nvme_cow_blk_sz(disk);
+    uint64_t end = min(slba + nlb, disk->idtfy_ns.nsze);
+    uint64_t lba, next, offset, len, chunk, avail;
+    uint8_t *src, *dst;
+
+    for (lba = find_next_zero_bit(disk->cow_map, end, slba); lba < end;
+            lba = find_next_zero_bit(disk->cow_map, end, next)) {
+        next = find_next_bit(disk->cow_map, end, lba);
+        offset = lba * lba_sz;
+        len = (next - lba) * lba_sz;
+        while (len) {
+            chunk = len;
+            src = nvme_backing_map(&disk->base, offset, &chunk);
+            avail = chunk;
+            dst = nvme_backing_map(&disk->data, offset, &avail);
+            if (src == NULL || dst == NULL) {
+                LOG_ERR("Error while copying up namespace %d at %lu",
+                    disk->nsid, offset);
+                return FAIL;
+            }
+            chunk = min(chunk, avail);
+            memcpy(dst, src, chunk);
+            nvme_backing_set_dirty(&disk->data, offset, chunk);
+            offset += chunk;
+            len -= chunk;
+        }
+        bitmap_set(disk->cow_map, lba, next - lba);
+        disk->cow_shared -= next - lba;
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_compact
+    Description  :    Starts copying the blocks a clone shares with
+                      its base image up to its data file
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk of a clone
+*********************************************************************/
+int nvme_cow_compact(NVMEState *n, DiskInfo *disk)
+{
+    if (disk->cow_map == NULL) {
+        return FAIL;
+    }
+    if (!disk->compacting) {
+        LOG_NORM("compacting namespace %d, %lu blocks shared", disk->nsid,
+            disk->cow_shared);
+        disk->compacting = 1;
+        disk->cow_next = 0;
+        qemu_mod_timer(n->cow_timer, qemu_get_clock_ns(vm_clock));
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_timer_cb
+    Description  :    Copies up to NVME_FORMAT_STEP bytes of every
+                      namespace being compacted and rearms itself
+                      while any is left. The base image is closed
+                      once the transfers that may still read it are
+                      done.
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+void nvme_cow_timer_cb(void *opaque)
+{
+    NVMEState *n = (NVMEState *)opaque;
+    DiskInfo *disk;
+    uint64_t nbits, lba, end;
+    uint32_t i;
+    int pending = 0;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        disk = &n->disk[i];
+        if (!disk->compacting) {
+            continue;
+        }
+        nbits = disk->idtfy_ns.nsze;
+        lba = find_next_zero_bit(disk->cow_map, nbits, disk->cow_next);
+        if (lba < nbits) {
+            end = min(nbits, lba + NVME_FORMAT_STEP / nvme_cow_blk_sz(disk));
+            if (nvme_cow_fill(disk, lba, end - lba) != SUCCESS) {
+                LOG_ERR("Compaction of namespace %d stopped", disk->nsid);
+                disk->compacting = 0;
+                continue;
+            }
+            disk->cow_next = end;
+            pending = 1;
+            continue;
+        }
+        nvme_workers_drain(n);
+        nvme_cow_close(disk);
+        LOG_NORM("namespace %d compacted, base image closed", disk->nsid);
+    }
+    if (pending) {
+        qemu_mod_timer(n->cow_timer,
+            qemu_get_clock_ns(vm_clock) + NVME_FORMAT_INTERVAL);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_save
+    Description  :    Sends which blocks of a namespace are still
+                      shared with its base image, if a clone
+    Return Type  :    void
+
+    Arguments    :    QEMUFile * : Migration stream
+                      DiskInfo * : NVME disk
+*********************************************************************/
+void nvme_cow_save(QEMUFile *f, DiskInfo *disk)
+{
+    uint64_t nbits = disk->idtfy_ns.nsze;
+    uint64_t bit, word;
+
+    qemu_put_byte(f, disk->cow_map != NULL);
+    if (disk->cow_map == NULL) {
+        return;
+    }
+    qemu_put_byte(f, disk->compacting);
+    qemu_put_be64(f, disk->cow_next);
+    qemu_put_be64(f, disk->cow_shared);
+    qemu_put_be64(f, nbits);
+    /* 64 bits at a time, whatever the size of a long */
+    for (bit = 0; bit < nbits; bit += 64) {
+        word = disk->cow_map[bit / BITS_PER_LONG];
+        if (BITS_PER_LONG == 32 && bit + 32 < nbits) {
+            word |= (uint64_t)disk->cow_map[bit / BITS_PER_LONG + 1] << 32;
+        }
+        qemu_put_be64(f, word);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_cow_load
+    Description  :    Receives which blocks of a namespace are still
+                      shared with its base image. The destination
+                      opens the same base image, so it has to be
+                      started with the same base property.
+    Return Type  :    int (0 on success, negative errno otherwise)
+
+    Arguments    :    QEMUFile *  : Migration stream
+                      NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+*********************************************************************/
+int nvme_cow_load(QEMUFile *f, NVMEState *n, DiskInfo *disk)
+{
+    uint64_t nbits, bit, word;
+    uint64_t next, shared;
+    uint8_t compacting;
+
+    if (!qemu_get_byte(f)) {
+        /* Compacted at the source */
+        nvme_cow_close(disk);
+        return 0;
+    }
+    compacting = qemu_get_byte(f);
+    next = qemu_get_be64(f);
+    shared = qemu_get_be64(f);
+    nbits = qemu_get_be64(f);
+    if (disk->cow_map == NULL || nbits != disk->idtfy_ns.nsze) {
+        LOG_ERR("%s(): nsid:%u is a clone of %lu blocks, not here",
+            __func__, disk->nsid, nbits);
+        return -EINVAL;
+    }
+    for (bit = 0; bit < nbits; bit += 64) {
+        word = qemu_get_be64(f);
+        disk->cow_map[bit / BITS_PER_LONG] = word;
+        if (BITS_PER_LONG == 32 && bit + 32 < nbits) {
+            disk->cow_map[bit / BITS_PER_LONG + 1] = word >> 32;
+        }
+    }
+    disk->cow_shared = shared;
+    disk->cow_next = next;
+    disk->compacting = compacting;
+    if (compacting) {
+        qemu_mod_timer(n->cow_timer, qemu_get_clock_ns(vm_clock));
+    }
+    return 0;
+}
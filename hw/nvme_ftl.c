@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Emulated flash translation layer.
+ *
+ * With ftl=1 every namespace gets a page mapped FTL over flash blocks of
+ * ftl_block_kb, ftl_op percent larger than the namespace. Writes program
+ * the next pages of the open block and invalidate the pages they
+ * replace, deallocations only invalidate. When the open block is full and
+ * no more than NVME_FTL_GC_RESERVE blocks are free, garbage collection
+ * picks victims by the ftl_gc policy, moves their valid pages and erases
+ * them. The time that takes holds the commands of the namespace on its
+ * QoS queue, as a drive busy with GC would.
+ *
+ * Only the mapping is emulated: data stays where nvme_io_command() puts
+ * it in the namespace file, so the FTL costs no I/O of its own.
+ *
+ * A resized namespace keeps its FTL: the maps grow or shrink in place,
+ * the pages of the blocks a smaller namespace drops being programmed
+ * again like GC moves them.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+#define NVME_FTL_UNMAPPED UINT32_MAX
+
+typedef struct NVMEFtlBlock {
+    uint32_t valid;       /* pages still mapped */
+    uint32_t erases;
+    uint64_t stamp;       /* nand_pages when last programmed */
+} NVMEFtlBlock;
+
+typedef struct NVMEFtl {
+    /* Physical page of each logical page and back */
+    uint32_t *l2p;
+    uint32_t *p2l;
+    uint32_t lpages;
+    NVMEFtlBlock *blocks;
+    uint32_t nblocks;
+    uint32_t ppb;         /* pages per block */
+    /* Stack of the erased blocks */
+    uint32_t *free;
+    uint32_t nfree;
+    /* Block the host and GC program, and its next page */
+    uint32_t open;
+    uint32_t open_page;
+    uint8_t policy;
+    int64_t copy_ns;
+    int64_t erase_ns;
+    /* vm_clock until which GC holds the commands */
+    int64_t busy_until;
+
+    uint64_t host_pages;
+    uint64_t nand_pages;
+    uint64_t trim_pages;
+    uint64_t gc_blocks;
+    uint64_t stall_ns;
+    uint64_t max_stall_ns;
+} NVMEFtl;
+
+/*********************************************************************
+    Function     :    nvme_ftl_pages
+    Description  :    Flash pages of a range of LBAs: those it touches
+                      for a write, those it covers whole for a trim
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+                      uint64_t   : Starting LBA
+                      uint64_t   : Number of LBAs
+                      int        : 1 for the pages covered whole
+                      uint64_t * : First page
+                      uint64_t * : Page past the last one
+*********************************************************************/
+static void nvme_ftl_pages(DiskInfo *disk, uint64_t slba, uint64_t nlb,
+    int whole, uint64_t *first, uint64_t *end)
+{
+    uint8_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+    uint64_t blk_sz = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+    uint64_t start = slba * blk_sz, stop = (slba + nlb) * blk_sz;
+
+    if (whole) {
+        *first = (start + NVME_FTL_PAGE_SIZE - 1) / NVME_FTL_PAGE_SIZE;
+        *end = stop / NVME_FTL_PAGE_SIZE;
+    } else {
+        *first = start / NVME_FTL_PAGE_SIZE;
+        *end = (stop + NVME_FTL_PAGE_SIZE - 1) / NVME_FTL_PAGE_SIZE;
+    }
+    *end = MIN(*end, disk->ftl->lpages);
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_invalidate
+    Description  :    Unmaps a logical page from its flash page
+    Return Type  :    void
+
+    Arguments    :    NVMEFtl * : FTL of the namespace
+                      uint32_t  : Logical page
+*********************************************************************/
+static void nvme_ftl_invalidate(NVMEFtl *ftl, uint32_t lpn)
+{
+    uint32_t ppn = ftl->l2p[lpn];
+
+    if (ppn == NVME_FTL_UNMAPPED) {
+        return;
+    }
+    ftl->p2l[ppn] = NVME_FTL_UNMAPPED;
+    ftl->blocks[ppn / ftl->ppb].valid--;
+    ftl->l2p[lpn] = NVME_FTL_UNMAPPED;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_program
+    Description  :    Writes a logical page to the next page of the
+                      open block, which must have room
+    Return Type  :    void
+
+    Arguments    :    NVMEFtl * : FTL of the namespace
+                      uint32_t  : Logical page
+*********************************************************************/
+static void nvme_ftl_program(NVMEFtl *ftl, uint32_t lpn)
+{
+    uint32_t ppn = ftl->open * ftl->ppb + ftl->open_page++;
+
+    nvme_ftl_invalidate(ftl, lpn);
+    ftl->l2p[lpn] = ppn;
+    ftl->p2l[ppn] = lpn;
+    ftl->blocks[ftl->open].valid++;
+    ftl->blocks[ftl->open].stamp = ++ftl->nand_pages;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_next_block
+    Description  :    Opens the next erased block
+    Return Type  :    void
+
+    Arguments    :    NVMEFtl * : FTL of the namespace
+*********************************************************************/
+static void nvme_ftl_next_block(NVMEFtl *ftl)
+{
+    assert(ftl->nfree > 0);
+    ftl->open = ftl->free[--ftl->nfree];
+    ftl->open_page = 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_victim
+    Description  :    Picks the block GC reclaims next: the one with
+                      the fewest valid pages, or with cost-benefit the
+                      one with the most (1 - u) * age / 2u, u being its
+                      share of valid pages and age the pages programmed
+                      since it was last written
+    Return Type  :    uint32_t (NVME_FTL_UNMAPPED if none has room)
+
+    Arguments    :    NVMEFtl * : FTL of the namespace
+*********************************************************************/
+static uint32_t nvme_ftl_victim(NVMEFtl *ftl)
+{
+    uint32_t i, victim = NVME_FTL_UNMAPPED;
+    uint32_t min_valid = ftl->ppb;
+    double score, best = -1;
+    NVMEFtlBlock *b;
+
+    for (i = 0; i < ftl->nblocks; i++) {
+        b = &ftl->blocks[i];
+        /* Erased blocks have no stamp yet or were reset to 0 */
+        if (i == ftl->open || b->stamp == 0 || b->valid == ftl->ppb) {
+            continue;
+        }
+        if (b->valid == 0) {
+            return i;
+        }
+        if (ftl->policy == NVME_FTL_GC_GREEDY) {
+            if (b->valid < min_valid) {
+                min_valid = b->valid;
+                victim = i;
+            }
+            continue;
+        }
+        score = (double)(ftl->ppb - b->valid) *
+            (ftl->nand_pages - b->stamp + 1) / (2.0 * b->valid);
+        if (score > best) {
+            best = score;
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_gc
+    Description  :    Reclaims one block, moving its valid pages to the
+                      open block and erasing it
+    Return Type  :    int64_t (ns it took, -1 if nothing to reclaim)
+
+    Arguments    :    NVMEFtl * : FTL of the namespace
+*********************************************************************/
+static int64_t nvme_ftl_gc(NVMEFtl *ftl)
+{
+    uint32_t victim = nvme_ftl_victim(ftl);
+    uint32_t ppn, moved;
+    NVMEFtlBlock *b;
+
+    if (victim == NVME_FTL_UNMAPPED) {
+        return -1;
+    }
+    b = &ftl->blocks[victim];
+    moved = b->valid;
+    for (ppn = victim * ftl->ppb; b->valid; ppn++) {
+        if (ftl->p2l[ppn] == NVME_FTL_UNMAPPED) {
+            continue;
+        }
+        /* A victim has fewer valid pages than a block, the reserve
+         * holds them */
+        if (ftl->open_page == ftl->ppb) {
+            nvme_ftl_next_block(ftl);
+        }
+        nvme_ftl_program(ftl, ftl->p2l[ppn]);
+    }
+    b->erases++;
+    b->stamp = 0;
+    ftl->free[ftl->nfree++] = victim;
+    ftl->gc_blocks++;
+    return moved * ftl->copy_ns + ftl->erase_ns;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_size
+    Description  :    Logical pages and flash blocks of the FTL of a
+                      namespace of its current size
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+                      uint64_t *  : Logical pages
+                      uint64_t *  : Flash blocks
+*********************************************************************/
+static int nvme_ftl_size(NVMEState *n, DiskInfo *disk, uint64_t *lpages,
+    uint64_t *nblocks)
+{
+    uint8_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+    uint64_t blk_sz = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+    uint32_t ppb = n->ftl_block_kb * 1024 / NVME_FTL_PAGE_SIZE;
+
+    *lpages = (disk->idtfy_ns.nsze * blk_sz + NVME_FTL_PAGE_SIZE - 1) /
+        NVME_FTL_PAGE_SIZE;
+    *nblocks = (*lpages * (100 + n->ftl_op) / 100 + ppb - 1) / ppb;
+    /* GC needs its reserve, the open block and one with room for
+     * whatever over-provisioning is asked for */
+    *nblocks = MAX(*nblocks, (*lpages + ppb - 1) / ppb +
+        NVME_FTL_GC_RESERVE + 2);
+    if (*nblocks * ppb >= NVME_FTL_UNMAPPED) {
+        LOG_ERR("namespace %d too large for the FTL, %lu blocks of %u pages",
+            disk->nsid, *nblocks, ppb);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_place
+    Description  :    Programs a logical page, opening the next block
+                      when the open one is full and running GC first
+                      when that leaves only the reserve
+    Return Type  :    int64_t (ns GC took)
+
+    Arguments    :    NVMEFtl * : FTL of the namespace
+                      uint32_t  : Logical page
+*********************************************************************/
+static int64_t nvme_ftl_place(NVMEFtl *ftl, uint32_t lpn)
+{
+    int64_t stall = 0, ns;
+
+    if (ftl->open_page == ftl->ppb) {
+        while (ftl->nfree <= NVME_FTL_GC_RESERVE &&
+            (ns = nvme_ftl_gc(ftl)) >= 0) {
+            stall += ns;
+        }
+        nvme_ftl_next_block(ftl);
+    }
+    nvme_ftl_program(ftl, lpn);
+    return stall;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_stall
+    Description  :    Holds the commands of a namespace for the time
+                      GC took
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+                      int64_t    : ns GC took
+*********************************************************************/
+static void nvme_ftl_stall(DiskInfo *disk, int64_t stall)
+{
+    NVMEFtl *ftl = disk->ftl;
+    int64_t now;
+
+    if (stall == 0) {
+        return;
+    }
+    now = qemu_get_clock_ns(vm_clock);
+    ftl->busy_until = MAX(ftl->busy_until, now) + stall;
+    ftl->stall_ns += stall;
+    ftl->max_stall_ns = MAX(ftl->max_stall_ns, (uint64_t)stall);
+    LOG_DBG("namespace %d GC stall %ld ns", disk->nsid, stall);
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_open
+    Description  :    Sets up the FTL of a namespace just created, all
+                      of its blocks erased
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+*********************************************************************/
+int nvme_ftl_open(NVMEState *n, DiskInfo *disk)
+{
+    uint64_t lpages, nblocks;
+    uint32_t ppb = n->ftl_block_kb * 1024 / NVME_FTL_PAGE_SIZE;
+    NVMEFtl *ftl;
+    uint32_t i;
+
+    if (nvme_ftl_size(n, disk, &lpages, &nblocks) != SUCCESS) {
+        return FAIL;
+    }
+
+    ftl = qemu_mallocz(sizeof(*ftl));
+    ftl->lpages = lpages;
+    ftl->nblocks = nblocks;
+    ftl->ppb = ppb;
+    ftl->policy = n->ftl_gc;
+    ftl->copy_ns = n->ftl_copy_us * 1000LL;
+    ftl->erase_ns = n->ftl_erase_us * 1000LL;
+    ftl->l2p = qemu_malloc(lpages * sizeof(uint32_t));
+    memset(ftl->l2p, 0xff, lpages * sizeof(uint32_t));
+    ftl->p2l = qemu_malloc(nblocks * ppb * sizeof(uint32_t));
+    memset(ftl->p2l, 0xff, nblocks * ppb * sizeof(uint32_t));
+    ftl->blocks = qemu_mallocz(nblocks * sizeof(NVMEFtlBlock));
+    ftl->free = qemu_malloc(nblocks * sizeof(uint32_t));
+    /* Lowest blocks first */
+    for (i = 0; i < nblocks; i++) {
+        ftl->free[i] = nblocks - 1 - i;
+    }
+    ftl->nfree = nblocks;
+    nvme_ftl_next_block(ftl);
+    disk->ftl = ftl;
+
+    LOG_NORM("namespace %d FTL: %lu pages in %lu blocks of %u pages",
+        disk->nsid, lpages, nblocks, ppb);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_close
+    Description  :    Drops the FTL of a namespace, if any
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+void nvme_ftl_close(DiskInfo *disk)
+{
+    NVMEFtl *ftl = disk->ftl;
+
+    if (ftl == NULL) {
+        return;
+    }
+    qemu_free(ftl->l2p);
+    qemu_free(ftl->p2l);
+    qemu_free(ftl->blocks);
+    qemu_free(ftl->free);
+    qemu_free(ftl);
+    disk->ftl = NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_resize
+    Description  :    Fits the FTL of a namespace to its new size,
+                      keeping the mappings of the logical pages still
+                      in it and the counters. The flash pages of the
+                      blocks dropped are moved to those left as GC
+                      moves pages, holding the commands meanwhile.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+*********************************************************************/
+int nvme_ftl_resize(NVMEState *n, DiskInfo *disk)
+{
+    NVMEFtl *ftl = disk->ftl;
+    uint64_t lpages, nblocks;
+    uint32_t *moved = NULL;
+    uint32_t i, j, nmoved = 0, added;
+    uint32_t ppn, lpn;
+    int64_t stall = 0;
+
+    if (nvme_ftl_size(n, disk, &lpages, &nblocks) != SUCCESS) {
+        return FAIL;
+    }
+
+    for (lpn = lpages; lpn < ftl->lpages; lpn++) {
+        nvme_ftl_invalidate(ftl, lpn);
+    }
+    if (nblocks < ftl->nblocks) {
+        /* The valid pages of the blocks dropped are unmapped until
+         * programmed again, so that GC leaves them alone */
+        moved = qemu_malloc((ftl->nblocks - nblocks) * ftl->ppb *
+            sizeof(uint32_t));
+        for (ppn = nblocks * ftl->ppb; ppn < ftl->nblocks * ftl->ppb;
+            ppn++) {
+            if (ftl->p2l[ppn] != NVME_FTL_UNMAPPED) {
+                moved[nmoved++] = ftl->p2l[ppn];
+                nvme_ftl_invalidate(ftl, ftl->p2l[ppn]);
+            }
+        }
+        for (i = j = 0; i < ftl->nfree; i++) {
+            if (ftl->free[i] < nblocks) {
+                ftl->free[j++] = ftl->free[i];
+            }
+        }
+        ftl->nfree = j;
+        if (ftl->open >= nblocks) {
+            /* Full, so that the next page opens another */
+            ftl->open = NVME_FTL_UNMAPPED;
+            ftl->open_page = ftl->ppb;
+        }
+    }
+
+    ftl->l2p = qemu_realloc(ftl->l2p, lpages * sizeof(uint32_t));
+    if (lpages > ftl->lpages) {
+        memset(ftl->l2p + ftl->lpages, 0xff, (lpages - ftl->lpages) *
+            sizeof(uint32_t));
+    }
+    ftl->lpages = lpages;
+    ftl->p2l = qemu_realloc(ftl->p2l, nblocks * ftl->ppb * sizeof(uint32_t));
+    ftl->blocks = qemu_realloc(ftl->blocks, nblocks * sizeof(NVMEFtlBlock));
+    ftl->free = qemu_realloc(ftl->free, nblocks * sizeof(uint32_t));
+    if (nblocks > ftl->nblocks) {
+        added = nblocks - ftl->nblocks;
+        memset(ftl->p2l + ftl->nblocks * ftl->ppb, 0xff, added * ftl->ppb *
+            sizeof(uint32_t));
+        memset(ftl->blocks + ftl->nblocks, 0, added *
+            sizeof(NVMEFtlBlock));
+        /* Under the erased blocks there were, lowest first */
+        memmove(ftl->free + added, ftl->free, ftl->nfree * sizeof(uint32_t));
+        for (i = 0; i < added; i++) {
+            ftl->free[i] = nblocks - 1 - i;
+        }
+        ftl->nfree += added;
+    }
+    ftl->nblocks = nblocks;
+
+    for (i = 0; i < nmoved; i++) {
+        stall += nvme_ftl_place(ftl, moved[i]) + ftl->copy_ns;
+    }
+    qemu_free(moved);
+    nvme_ftl_stall(disk, stall);
+
+    LOG_NORM("namespace %d FTL: %lu pages in %lu blocks of %u pages",
+        disk->nsid, lpages, nblocks, ftl->ppb);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_write
+    Description  :    Programs the flash pages a write touches, running
+                      GC for each block it needs. The GC time holds the
+                      commands started after this one.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+                      uint64_t    : Starting LBA
+                      uint64_t    : Number of LBAs
+*********************************************************************/
+void nvme_ftl_write(NVMEState *n, DiskInfo *disk, uint64_t slba,
+    uint64_t nlb)
+{
+    NVMEFtl *ftl = disk->ftl;
+    uint64_t lpn, end;
+    int64_t stall = 0;
+
+    nvme_ftl_pages(disk, slba, nlb, 0, &lpn, &end);
+    for (; lpn < end; lpn++) {
+        stall += nvme_ftl_place(ftl, lpn);
+        ftl->host_pages++;
+    }
+    nvme_ftl_stall(disk, stall);
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_trim
+    Description  :    Unmaps the flash pages deallocated LBAs cover
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+                      uint64_t   : Starting LBA
+                      uint64_t   : Number of LBAs
+*********************************************************************/
+void nvme_ftl_trim(DiskInfo *disk, uint64_t slba, uint64_t nlb)
+{
+    NVMEFtl *ftl = disk->ftl;
+    uint64_t lpn, end;
+
+    nvme_ftl_pages(disk, slba, nlb, 1, &lpn, &end);
+    for (; lpn < end; lpn++) {
+        if (ftl->l2p[lpn] != NVME_FTL_UNMAPPED) {
+            nvme_ftl_invalidate(ftl, lpn);
+            ftl->trim_pages++;
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_busy
+    Description  :    Tells how long GC still holds the commands of a
+                      namespace
+    Return Type  :    int64_t (ns to wait, 0 to go now)
+
+    Arguments    :    DiskInfo * : NVME disk
+                      int64_t    : vm_clock now
+*********************************************************************/
+int64_t nvme_ftl_busy(DiskInfo *disk, int64_t now)
+{
+    if (disk->ftl == NULL || disk->ftl->busy_until <= now) {
+        return 0;
+    }
+    return disk->ftl->busy_until - now;
+}
+
+/*********************************************************************
+    Function     :    nvme_ftl_log
+    Description  :    Fills the FTL log page entry of a namespace
+    Return Type  :    void
+
+    Arguments    :    DiskInfo *   : NVME disk
+                      NVMEFtlLog * : Entry, zeroed
+*********************************************************************/
+void nvme_ftl_log(DiskInfo *disk, NVMEFtlLog *log)
+{
+    NVMEFtl *ftl = disk->ftl;
+    uint32_t i;
+
+    log->nsid = disk->nsid;
+    if (ftl == NULL) {
+        return;
+    }
+    log->host_pages = ftl->host_pages;
+    log->nand_pages = ftl->nand_pages;
+    log->waf = ftl->host_pages ? ftl->nand_pages * 100 / ftl->host_pages : 0;
+    log->trim_pages = ftl->trim_pages;
+    log->gc_blocks = ftl->gc_blocks;
+    log->stall_ns = ftl->stall_ns;
+    log->max_stall_ns = ftl->max_stall_ns;
+    log->free_blocks = ftl->nfree;
+    for (i = 0; i < ftl->nblocks; i++) {
+        log->max_erases = MAX(log->max_erases, ftl->blocks[i].erases);
+    }
+}
@@ -25,11 +25,15 @@
 #include "nvme_debug.h"
 
 
-/* queue is full if tail is just behind head. */
+/* queue is full if tail is just behind head, counting the entries
+ * already promised to the commands running on I/O workers. */
 
 uint8_t is_cq_full(NVMEState *n, uint16_t qid)
 {
-    return (((n->cq[qid].tail + 1) % n->cq[qid].size) == n->cq[qid].head);
+    NVMEIOCQueue *cq = n->cq[qid];
+    uint32_t used = (cq->tail + cq->size - cq->head) % cq->size;
+
+    return (used + cq->inflight + 1 >= cq->size);
 }
 
 static void incr_sq_head(NVMEIOSQueue *q)
@@ -51,8 +55,9 @@ void incr_cq_tail(NVMEIOCQueue *q)
 /* Used to get the required Queue entry for discontig SQ and CQ
  * Returns- dma address
  */
-static uint64_t find_discontig_queue_entry(uint32_t pg_size, uint16_t queue_ptr,
+static uint64_t find_discontig_queue_entry(NVMEState *n, uint16_t queue_ptr,
     uint32_t cmd_size, uint64_t st_dma_addr) {
+    uint32_t pg_size = n->page_size;
     uint32_t index = 0;
     uint32_t pg_no, prp_pg_no, entr_per_pg, prps_per_pg, prp_entry, pg_entry;
     uint64_t dma_addr, entry_addr;
@@ -70,7 +75,8 @@ static uint64_t find_discontig_queue_entry(uint32_t pg_size, uint16_t queue_ptr,
 
     /* Get to the correct page */
     for (index = 1; index <= prp_pg_no; index++) {
-        nvme_dma_mem_read((st_dma_addr + ((prps_per_pg - 1) * PRP_ENTRY_SIZE)),
+        nvme_dma_mem_read(n,
+            (st_dma_addr + ((prps_per_pg - 1) * PRP_ENTRY_SIZE)),
             (uint8_t *)&dma_addr, PRP_ENTRY_SIZE);
         st_dma_addr = dma_addr;
     }
@@ -78,7 +84,7 @@ static uint64_t find_discontig_queue_entry(uint32_t pg_size, uint16_t queue_ptr,
     /* Correct offset within the prp list page */
     dma_addr = st_dma_addr + (prp_entry * PRP_ENTRY_SIZE);
     /* Reading the PRP List at required offset */
-    nvme_dma_mem_read(dma_addr, (uint8_t *)&entry_addr, PRP_ENTRY_SIZE);
+    nvme_dma_mem_read(n, dma_addr, (uint8_t *)&entry_addr, PRP_ENTRY_SIZE);
 
     /* Correct offset within the page */
     dma_addr = entry_addr + (pg_entry * cmd_size);
@@ -91,10 +97,10 @@ void post_cq_entry(NVMEState *n, NVMEIOCQueue *cq, NVMECQE* cqe)
     if (cq->phys_contig) {
         addr = cq->dma_addr + cq->tail * sizeof(*cqe);
     } else {
-        addr = find_discontig_queue_entry(n->page_size, cq->tail,
+        addr = find_discontig_queue_entry(n, cq->tail,
             sizeof(*cqe), cq->dma_addr);
     }
-    nvme_dma_mem_write(addr, (uint8_t *)cqe, sizeof(*cqe));
+    nvme_dma_mem_write(n, addr, (uint8_t *)cqe, sizeof(*cqe));
 
     incr_cq_tail(cq);
     if (cq->irq_enabled) {
@@ -102,63 +108,347 @@ void post_cq_entry(NVMEState *n, NVMEIOCQueue *cq, NVMECQE* cqe)
     }
 }
 
+/*********************************************************************
+    Function     :    nvme_sq_init_reqs
+    Description  :    Allocates the request pool of a submission queue,
+                      one cache aligned request per queue slot
+    Return Type  :    void
+    Arguments    :    NVMEIOSQueue * : Submission queue, size set
+*********************************************************************/
+void nvme_sq_init_reqs(NVMEIOSQueue *sq)
+{
+    uint32_t i;
+
+    nvme_sq_free_reqs(sq);
+    sq->reqs = qemu_memalign(NVME_REQ_ALIGN, sq->size * sizeof(NVMERequest));
+    memset(sq->reqs, 0, sq->size * sizeof(NVMERequest));
+    QTAILQ_INIT(&sq->req_free);
+    QTAILQ_INIT(&sq->cmd_list);
+    for (i = 0; i < sq->size; i++) {
+        sq->reqs[i].slot = i;
+        QTAILQ_INSERT_TAIL(&sq->req_free, &sq->reqs[i], entry);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_sq_free_reqs
+    Description  :    Releases the request pool of a submission queue
+    Return Type  :    void
+    Arguments    :    NVMEIOSQueue * : Submission queue
+*********************************************************************/
+void nvme_sq_free_reqs(NVMEIOSQueue *sq)
+{
+    uint32_t i;
+
+    if (sq->reqs) {
+        for (i = 0; i < sq->size; i++) {
+            qemu_free(sq->reqs[i].xfer);
+        }
+        qemu_vfree(sq->reqs);
+        sq->reqs = NULL;
+    }
+    QTAILQ_INIT(&sq->req_free);
+    QTAILQ_INIT(&sq->cmd_list);
+}
+
+/*********************************************************************
+    Function     :    nvme_req_alloc
+    Description  :    Takes a free request from the SQ pool and puts
+                      it on the outstanding list
+    Return Type  :    NVMERequest * (NULL if all are outstanding)
+    Arguments    :    NVMEIOSQueue * : Submission queue
+*********************************************************************/
+NVMERequest *nvme_req_alloc(NVMEIOSQueue *sq)
+{
+    NVMERequest *req = QTAILQ_FIRST(&sq->req_free);
+
+    if (req == NULL) {
+        return NULL;
+    }
+    QTAILQ_REMOVE(&sq->req_free, req, entry);
+    QTAILQ_INSERT_TAIL(&sq->cmd_list, req, entry);
+    req->sq_id = sq->id;
+    req->nxfer = 0;
+    return req;
+}
+
+/*********************************************************************
+    Function     :    nvme_req_free
+    Description  :    Returns an outstanding request to the SQ pool
+    Return Type  :    void
+    Arguments    :    NVMEIOSQueue * : Submission queue
+                      NVMERequest *  : Request
+*********************************************************************/
+void nvme_req_free(NVMEIOSQueue *sq, NVMERequest *req)
+{
+    QTAILQ_REMOVE(&sq->cmd_list, req, entry);
+    QTAILQ_INSERT_HEAD(&sq->req_free, req, entry);
+}
+
+/*********************************************************************
+    Function     :    nvme_req_complete
+    Description  :    Posts the completion entry of a request on the
+                      CQ of its SQ and releases the request
+    Return Type  :    void
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request, with cqe status and
+                                      command specific fields set
+*********************************************************************/
+void nvme_req_complete(NVMEState *n, NVMERequest *req)
+{
+    NVMEIOSQueue *sq = n->sq[req->sq_id];
+    NVMEIOCQueue *cq = n->cq[sq->cq_id];
+    NVMEStatusField *sf = (NVMEStatusField *) &req->cqe.status;
+
+    /* Filling up the CQ entry */
+    req->cqe.sq_id = req->sq_id;
+    req->cqe.sq_head = sq->head;
+    req->cqe.command_id = req->cmd.cid;
+
+    sf->p = cq->phase_tag;
+    sf->m = 0;
+    sf->dnr = 0; /* TODO add support for dnr */
+
+    if (n->trace_file) {
+        nvme_trace_req(n, req);
+    }
+    if (n->replay) {
+        nvme_replay_complete(n, req);
+    }
+    post_cq_entry(n, cq, &req->cqe);
+    nvme_req_free(sq, req);
+}
+
+/*********************************************************************
+    Function     :    nvme_adm_drains
+    Description  :    Tells whether an admin command must see no I/O
+                      on the workers, io_uring or the backend: those
+                      deleting queues, aborting commands or changing
+                      namespaces. The others run alongside the I/O.
+    Return Type  :    int (1 if it must)
+    Arguments    :    uint8_t : Opcode
+*********************************************************************/
+static int nvme_adm_drains(uint8_t opcode)
+{
+    switch (opcode) {
+    case NVME_ADM_CMD_DELETE_SQ:
+    case NVME_ADM_CMD_DELETE_CQ:
+    case NVME_ADM_CMD_ABORT:
+    case NVME_ADM_CMD_NS_MGMT:
+    case NVME_ADM_CMD_NS_ATTACH:
+    case NVME_ADM_CMD_FORMAT_NVM:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 int process_sq(NVMEState *n, uint16_t sq_id)
 {
     target_phys_addr_t addr;
     uint16_t cq_id;
-    NVMECmd sqe;
-    NVMECQE cqe;
-    NVMEStatusField *sf = (NVMEStatusField *) &cqe.status;
+    NVMEIOSQueue *sq = n->sq[sq_id];
+    NVMERequest *req;
+    NVMEStatusField *sf;
 
-    if (n->sq[sq_id].dma_addr == 0 || n->cq[n->sq[sq_id].cq_id].dma_addr
-        == 0) {
+    if (sq->dma_addr == 0 || adm_check_cqid(n, sq->cq_id)) {
         LOG_ERR("Required Submission/Completion Queue does not exist");
-        n->sq[sq_id].head = n->sq[sq_id].tail = 0;
+        sq->head = sq->tail = 0;
         return -1;
     }
-    cq_id = n->sq[sq_id].cq_id;
+    cq_id = sq->cq_id;
     if (is_cq_full(n, cq_id)) {
         LOG_DBG("CQ %d is full", cq_id);
         return -1;
     }
-    memset(&cqe, 0, sizeof(cqe));
+    if (sq->reqs == NULL) {
+        /* Admin SQ enabled without a pool, or restored by migration */
+        nvme_sq_init_reqs(sq);
+    }
+    if (sq_id != ASQ_ID && nvme_qos_sq_throttled(n, sq)) {
+        /* Fetched again once the QoS timer refilled the SQ's buckets */
+        LOG_DBG("SQ %d is over its limits", sq_id);
+        return -1;
+    }
+    req = nvme_req_alloc(sq);
+    if (req == NULL) {
+        LOG_DBG("No free request on SQ %d", sq_id);
+        return -1;
+    }
+    memset(&req->cqe, 0, sizeof(req->cqe));
+    sf = (NVMEStatusField *) &req->cqe.status;
 
     LOG_DBG("%s(): called", __func__);
 
     /* Process SQE */
-    if (sq_id == ASQ_ID || n->sq[sq_id].phys_contig) {
-        addr = n->sq[sq_id].dma_addr + n->sq[sq_id].head * sizeof(sqe);
+    if (sq_id == ASQ_ID || sq->phys_contig) {
+        addr = sq->dma_addr + sq->head * sizeof(req->cmd);
     } else {
         /* PRP implementation */
-        addr = find_discontig_queue_entry(n->page_size, n->sq[sq_id].head,
-            sizeof(sqe), n->sq[sq_id].dma_addr);
+        addr = find_discontig_queue_entry(n, sq->head,
+            sizeof(req->cmd), sq->dma_addr);
+    }
+    nvme_dma_mem_read(n, addr, (uint8_t *)&req->cmd, sizeof(req->cmd));
+    if (n->trace_file) {
+        req->trace_ns = get_clock();
     }
-    nvme_dma_mem_read(addr, (uint8_t *)&sqe, sizeof(sqe));
 
-    incr_sq_head(&n->sq[sq_id]);
+    incr_sq_head(sq);
 
     if (sq_id == ASQ_ID) {
-        nvme_admin_command(n, &sqe, &cqe);
-        if (sqe.opcode == NVME_ADM_CMD_ASYNC_EV_REQ &&
+        if (nvme_adm_drains(req->cmd.opcode)) {
+            nvme_workers_drain(n);
+        }
+        nvme_admin_command(n, &req->cmd, &req->cqe);
+        if (req->cmd.opcode == NVME_ADM_CMD_ASYNC_EV_REQ &&
             sf->sc == NVME_SC_SUCCESS) {
             /* completion entry is done separately */
+            nvme_req_free(sq, req);
+            return 0;
+        }
+        if (req->cmd.opcode == NVME_ADM_CMD_FORMAT_NVM &&
+            sf->sct == 0 && sf->sc == NVME_SC_SUCCESS) {
+            /* Completed once the namespace is formatted */
+            n->disk[req->cmd.nsid - 1].format_req = req;
+            n->cq[ACQ_ID]->inflight++;
             return 0;
         }
     } else {
        /* TODO add support for IO commands with different sizes of Q elements */
-       nvme_command_set(n, &sqe, &cqe);
+       if (!nvme_qos_submit(n, req)) {
+           nvme_io_start(n, req);
+       }
+       return 0;
     }
 
-    /* Filling up the CQ entry */
-    cqe.sq_id = sq_id;
-    cqe.sq_head = n->sq[sq_id].head;
-    cqe.command_id = sqe.cid;
+    nvme_req_complete(n, req);
 
-    sf->p = n->cq[cq_id].phase_tag;
-    sf->m = 0;
-    sf->dnr = 0; /* TODO add support for dnr */
+    return 0;
+}
 
-    post_cq_entry(n, &n->cq[cq_id], &cqe);
+/*********************************************************************
+    Function     :    nvme_atomic_write
+    Description  :    Tells whether a command is a write within the
+                      atomic write unit: AWUPF once the host set the
+                      Disable Normal bit of Write Atomicity, else AWUN
+    Return Type  :    int (1 if it is)
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVME_rw *   : Command
+*********************************************************************/
+static int nvme_atomic_write(NVMEState *n, NVME_rw *e)
+{
+    uint32_t unit = n->awun;
 
-    return 0;
+    if (n->feature.write_atomicity & NVME_WRITE_ATOMICITY_DN) {
+        unit = n->awupf;
+    }
+    return (e->opcode == NVME_CMD_WRITE ||
+        e->opcode == NVME_CMD_ZONE_APPEND) && e->nlb + 1 <= unit;
+}
+
+/*********************************************************************
+    Function     :    nvme_rw_overlap
+    Description  :    Tells whether two reads or writes touch common
+                      blocks. A Zone Append may write anywhere from
+                      the start of its zone.
+    Return Type  :    int (1 if they do)
+    Arguments    :    NVME_rw * : Command
+                      NVME_rw * : Other command
+*********************************************************************/
+static int nvme_rw_overlap(NVME_rw *a, NVME_rw *b)
+{
+    uint64_t a_end = a->slba + a->nlb + 1;
+    uint64_t b_end = b->slba + b->nlb + 1;
+
+    if (a->opcode == NVME_CMD_ZONE_APPEND) {
+        a_end = UINT64_MAX;
+    }
+    if (b->opcode == NVME_CMD_ZONE_APPEND) {
+        b_end = UINT64_MAX;
+    }
+    return a->nsid == b->nsid && a->slba < b_end && b->slba < a_end;
+}
+
+/*********************************************************************
+    Function     :    nvme_atomic_conflict
+    Description  :    Checks a read or write against those whose
+                      transfers are in flight on its namespace, through
+                      any controller of the subsystem. Overlapping a
+                      write within the atomic write unit, or being one,
+                      it must wait for them not to interleave.
+    Return Type  :    NVMEState * (controller to wait for, NULL if none)
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request about to start
+*********************************************************************/
+static NVMEState *nvme_atomic_conflict(NVMEState *n, NVMERequest *req)
+{
+    NVME_rw *e = (NVME_rw *)&req->cmd;
+    NVMERequest *r;
+    NVMEState *p;
+    int atomic;
+
+    if ((e->opcode != NVME_CMD_READ && e->opcode != NVME_CMD_WRITE &&
+        e->opcode != NVME_CMD_ZONE_APPEND) || e->nsid == 0 ||
+        e->nsid > n->num_namespaces) {
+        return NULL;
+    }
+    atomic = nvme_atomic_write(n, e);
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        QTAILQ_FOREACH(r, &p->disk[e->nsid - 1].rw_inflight, rw_entry) {
+            if ((atomic || nvme_atomic_write(p, (NVME_rw *)&r->cmd)) &&
+                nvme_rw_overlap(e, (NVME_rw *)&r->cmd)) {
+                return p;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_io_start
+    Description  :    Runs an I/O command fetched from a SQ, handing
+                      its transfers to the worker of the SQ, to
+                      io_uring or to the backend, or completing it
+                      right away
+    Return Type  :    void
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+void nvme_io_start(NVMEState *n, NVMERequest *req)
+{
+    NVMEState *p;
+
+    if (n->num_workers || n->uring || n->backend) {
+        /* Rare, as hosts do not overlap commands in flight */
+        while ((p = nvme_atomic_conflict(n, req)) != NULL) {
+            nvme_workers_drain(p);
+        }
+    }
+    /* May wait for the transfers in flight too */
+    nvme_journal_prepare(n, req);
+    if (n->num_workers || n->uring || n->backend) {
+        /* Data transfers are collected for the SQ's worker or io_uring */
+        n->worker_req = req;
+    }
+    nvme_command_set(n, &req->cmd, &req->cqe);
+    n->worker_req = NULL;
+    if (req->nxfer) {
+        if (req->cmd.opcode == NVME_CMD_READ ||
+            req->cmd.opcode == NVME_CMD_WRITE ||
+            req->cmd.opcode == NVME_CMD_ZONE_APPEND) {
+            QTAILQ_INSERT_TAIL(&n->disk[req->cmd.nsid - 1].rw_inflight, req,
+                rw_entry);
+            req->rw_linked = 1;
+        }
+        /* Completed when the worker is done with the transfers */
+        if (n->backend) {
+            nvme_backend_submit(n, req);
+        } else if (n->uring) {
+            nvme_uring_submit(n, req);
+        } else {
+            nvme_worker_submit(n, req);
+        }
+        return;
+    }
+    nvme_req_complete(n, req);
 }
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Power fail atomicity journal.
+ *
+ * With awupf=<n> above one block, every namespace has a journal file of
+ * NVME_JOURNAL_SLOTS slots next to its data. A write of at most n blocks
+ * first copies its data and separate meta-data into a free slot, which is
+ * synced before any of it reaches the namespace files. Once the write
+ * completed its slot is applied; applied slots are retired together, the
+ * namespace files being synced before their headers are cleared, when no
+ * slot is free or before any other command modifies the namespace. A
+ * journal kept from an earlier run, with the files for an incoming
+ * migration, is played back over them once the device state is loaded,
+ * so a write that was cut short comes back whole.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include "migration.h"
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define NVME_JOURNAL_MAGIC 0x4c4e524aU /* "JRNL" */
+
+/* Header of a slot, its data and then separate meta-data following */
+typedef struct NVMEJournalEntry {
+    uint32_t magic;     /* 0 once retired */
+    uint32_t crc;       /* of the entry with crc 0, and the payload */
+    uint64_t seq;       /* order the writes started in */
+    uint64_t slba;
+    uint32_t nlb;       /* 1's based */
+    uint32_t rsvd;
+    uint64_t offset;    /* in the data file */
+    uint64_t len;
+    uint64_t meta_offset;
+    uint64_t meta_len;
+} NVMEJournalEntry;
+
+enum {
+    NVME_JOURNAL_FREE,
+    NVME_JOURNAL_STAGED,   /* written to the journal, write in flight */
+    NVME_JOURNAL_APPLIED,  /* write done, namespace files not synced */
+    NVME_JOURNAL_HELD,     /* not played back, kept for the next run */
+};
+
+typedef struct NVMEJournal {
+    int fd;
+    uint64_t slot_size;
+    uint64_t seq;
+    uint8_t state[NVME_JOURNAL_SLOTS];
+    /* Kept from an earlier run, to be played back */
+    uint8_t recover;
+    uint8_t *buf;
+} NVMEJournal;
+
+/*********************************************************************
+    Function     :    nvme_journal_crc
+    Description  :    Checksum of a slot, header and payload
+    Return Type  :    uint32_t
+
+    Arguments    :    NVMEJournalEntry * : Header, followed by payload
+*********************************************************************/
+static uint32_t nvme_journal_crc(NVMEJournalEntry *je)
+{
+    uint32_t saved = je->crc, crc;
+
+    je->crc = 0;
+    crc = crc32(0, (uint8_t *)je, sizeof(*je) + je->len + je->meta_len);
+    je->crc = saved;
+    return crc;
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_open
+    Description  :    Creates the journal of a namespace when awupf is
+                      above one block, or opens the one kept for an
+                      incoming migration
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      DiskInfo *   : NVME disk, its files created
+                      const char * : File name
+*********************************************************************/
+int nvme_journal_open(NVMEState *n, DiskInfo *disk, const char *name)
+{
+    uint32_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+    NVMEJournal *j;
+
+    if (n->awupf <= 1) {
+        return SUCCESS;
+    }
+    j = qemu_mallocz(sizeof(*j));
+    j->slot_size = DIV_ROUND_UP(sizeof(NVMEJournalEntry) +
+        (uint64_t)n->awupf *
+        (NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads) +
+        disk->idtfy_ns.lbafx[lba_idx].ms), PAGE_SIZE) * PAGE_SIZE;
+    j->fd = open(name, O_RDWR | O_CREAT | (incoming_expected ? 0 : O_TRUNC),
+        S_IRUSR | S_IWUSR);
+    if (j->fd < 0 || ftruncate(j->fd, j->slot_size * NVME_JOURNAL_SLOTS)) {
+        LOG_ERR("Error while creating the journal %s", name);
+        if (j->fd >= 0) {
+            close(j->fd);
+        }
+        qemu_free(j);
+        return FAIL;
+    }
+    j->buf = qemu_malloc(j->slot_size);
+    j->recover = incoming_expected;
+    disk->journal = j;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_close
+    Description  :    Retires the journal of a namespace and closes it
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+void nvme_journal_close(DiskInfo *disk)
+{
+    NVMEJournal *j = disk->journal;
+
+    if (j == NULL) {
+        return;
+    }
+    nvme_journal_retire(disk);
+    close(j->fd);
+    qemu_free(j->buf);
+    qemu_free(j);
+    disk->journal = NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_wanted
+    Description  :    Tells whether a command is a write the journal
+                      keeps whole across a power fail
+    Return Type  :    int (1 if it is)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd *   : Command
+*********************************************************************/
+int nvme_journal_wanted(NVMEState *n, NVMECmd *cmd)
+{
+    NVME_rw *e = (NVME_rw *)cmd;
+
+    return (e->opcode == NVME_CMD_WRITE ||
+        e->opcode == NVME_CMD_ZONE_APPEND) && e->nsid != 0 &&
+        e->nsid <= n->num_namespaces && n->disk[e->nsid - 1].journal &&
+        e->nlb + 1 <= n->awupf;
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_prepare
+    Description  :    Makes room in the journal before a command runs:
+                      a free slot for a write it keeps, or the journal
+                      retired before a command that modifies the
+                      namespace otherwise, which a later play back must
+                      not undo
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request about to start
+*********************************************************************/
+void nvme_journal_prepare(NVMEState *n, NVMERequest *req)
+{
+    NVMECmd *cmd = &req->cmd;
+    NVMEJournal *j;
+    DiskInfo *disk;
+    int i;
+
+    if (cmd->nsid == 0 || cmd->nsid > n->num_namespaces ||
+        n->disk[cmd->nsid - 1].journal == NULL) {
+        return;
+    }
+    disk = &n->disk[cmd->nsid - 1];
+    j = disk->journal;
+    if (!nvme_journal_wanted(n, cmd)) {
+        if (cmd->opcode == NVME_CMD_WRITE || cmd->opcode == NVME_CMD_DSM ||
+            cmd->opcode == NVME_CMD_COPY ||
+            cmd->opcode == NVME_CMD_ZONE_MGMT_SEND ||
+            cmd->opcode == NVME_CMD_ZONE_APPEND) {
+            nvme_journal_retire(disk);
+        }
+        return;
+    }
+    for (i = 0; i < NVME_JOURNAL_SLOTS; i++) {
+        if (j->state[i] == NVME_JOURNAL_FREE) {
+            return;
+        }
+    }
+    nvme_journal_retire(disk);
+    for (i = 0; i < NVME_JOURNAL_SLOTS; i++) {
+        if (j->state[i] == NVME_JOURNAL_FREE) {
+            return;
+        }
+    }
+    /* Every slot is a write in flight */
+    nvme_workers_drain(n);
+    nvme_journal_retire(disk);
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_stage
+    Description  :    Copies the data of a write about to be made into
+                      a free slot of the journal, synced
+    Return Type  :    int (slot, or -1 on failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+                      NVME_rw *   : Write, its data mapped in n->qsg
+                      uint64_t    : Offset of the data in the data file
+                      uint64_t    : Offset of the separate meta-data
+                      uint64_t    : Length of the separate meta-data, 0
+                                    if none
+*********************************************************************/
+int nvme_journal_stage(NVMEState *n, DiskInfo *disk, NVME_rw *e,
+    uint64_t offset, uint64_t meta_offset, uint64_t meta_len)
+{
+    NVMEJournal *j = disk->journal;
+    NVMEJournalEntry *je = (NVMEJournalEntry *)j->buf;
+    uint8_t *p = j->buf + sizeof(*je);
+    uint64_t size;
+    int slot, i;
+    ssize_t ret;
+
+    for (slot = 0; slot < NVME_JOURNAL_SLOTS; slot++) {
+        if (j->state[slot] == NVME_JOURNAL_FREE) {
+            break;
+        }
+    }
+    if (slot == NVME_JOURNAL_SLOTS ||
+        sizeof(*je) + n->qsg.size + meta_len > j->slot_size) {
+        LOG_ERR("%s(): no room in the journal of nsid:%d", __func__,
+            disk->nsid);
+        return -1;
+    }
+
+    memset(je, 0, sizeof(*je));
+    je->magic = NVME_JOURNAL_MAGIC;
+    je->seq = ++j->seq;
+    je->slba = e->slba;
+    je->nlb = e->nlb + 1;
+    je->offset = offset;
+    je->len = n->qsg.size;
+    je->meta_offset = meta_offset;
+    je->meta_len = meta_len;
+    for (i = 0; i < n->qsg.nsg; i++) {
+        nvme_dma_mem_read(n, n->qsg.sg[i].base, p, n->qsg.sg[i].len);
+        p += n->qsg.sg[i].len;
+    }
+    if (meta_len) {
+        nvme_dma_mem_read(n, e->mptr, p, meta_len);
+    }
+    je->crc = nvme_journal_crc(je);
+
+    size = sizeof(*je) + je->len + je->meta_len;
+    do {
+        ret = pwrite(j->fd, j->buf, size, slot * j->slot_size);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != size || qemu_fdatasync(j->fd) < 0) {
+        LOG_ERR("%s(): journal of nsid:%d not written: %s", __func__,
+            disk->nsid, ret < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    j->state[slot] = NVME_JOURNAL_STAGED;
+    return slot;
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_applied
+    Description  :    Marks the slot of a write done, to be retired
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+                      int        : Slot
+*********************************************************************/
+void nvme_journal_applied(DiskInfo *disk, int slot)
+{
+    if (disk->journal) {
+        disk->journal->state[slot] = NVME_JOURNAL_APPLIED;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_retire
+    Description  :    Syncs the namespace files and frees the slots of
+                      the writes done
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+void nvme_journal_retire(DiskInfo *disk)
+{
+    NVMEJournal *j = disk->journal;
+    NVMEJournalEntry je;
+    int i, applied = 0;
+
+    if (j == NULL) {
+        return;
+    }
+    for (i = 0; i < NVME_JOURNAL_SLOTS; i++) {
+        applied += j->state[i] == NVME_JOURNAL_APPLIED;
+    }
+    if (applied == 0) {
+        return;
+    }
+    if (qemu_fdatasync(disk->data.fd) < 0 ||
+        (disk->meta.fd >= 0 && qemu_fdatasync(disk->meta.fd) < 0)) {
+        /* The slots stay, for a play back to make the writes whole */
+        LOG_ERR("%s(): nsid:%d not synced: %s", __func__, disk->nsid,
+            strerror(errno));
+        return;
+    }
+    memset(&je, 0, sizeof(je));
+    for (i = 0; i < NVME_JOURNAL_SLOTS; i++) {
+        if (j->state[i] == NVME_JOURNAL_APPLIED) {
+            if (pwrite(j->fd, &je, sizeof(je), i * j->slot_size) !=
+                sizeof(je)) {
+                LOG_ERR("%s(): journal of nsid:%d not cleared", __func__,
+                    disk->nsid);
+                return;
+            }
+            j->state[i] = NVME_JOURNAL_FREE;
+        }
+    }
+    /* Not to be played back over later writes */
+    qemu_fdatasync(j->fd);
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_reset
+    Description  :    Empties a journal
+    Return Type  :    void
+
+    Arguments    :    NVMEJournal * : Journal
+*********************************************************************/
+static void nvme_journal_reset(NVMEJournal *j)
+{
+    if (ftruncate(j->fd, 0) < 0 ||
+        ftruncate(j->fd, j->slot_size * NVME_JOURNAL_SLOTS) < 0 ||
+        qemu_fdatasync(j->fd) < 0) {
+        LOG_ERR("%s(): journal not emptied: %s", __func__, strerror(errno));
+    }
+    memset(j->state, 0, sizeof(j->state));
+    j->recover = 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_discard
+    Description  :    Drops the journal kept from an earlier run, the
+                      namespace data coming from a block migration
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+void nvme_journal_discard(DiskInfo *disk)
+{
+    if (disk->journal && disk->journal->recover) {
+        nvme_journal_reset(disk->journal);
+    }
+}
+
+static int nvme_journal_seq_cmp(const void *a, const void *b)
+{
+    uint64_t sa = ((const NVMEJournalEntry *)a)->seq;
+    uint64_t sb = ((const NVMEJournalEntry *)b)->seq;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+/*********************************************************************
+    Function     :    nvme_journal_recover
+    Description  :    Plays the writes of a journal kept from an
+                      earlier run back over the namespace files, in the
+                      order they started, and empties it
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+*********************************************************************/
+void nvme_journal_recover(NVMEState *n, DiskInfo *disk)
+{
+    NVMEJournal *j = disk->journal;
+    NVMEJournalEntry order[NVME_JOURNAL_SLOTS], *je;
+    int i, k, nvalid = 0, bad = 0;
+    uint64_t size;
+    uint8_t *p;
+
+    if (j == NULL || !j->recover) {
+        return;
+    }
+    je = (NVMEJournalEntry *)j->buf;
+    for (i = 0; i < NVME_JOURNAL_SLOTS; i++) {
+        if (pread(j->fd, je, sizeof(*je), i * j->slot_size) != sizeof(*je) ||
+            je->magic != NVME_JOURNAL_MAGIC) {
+            continue;
+        }
+        /* Torn while being staged, the write had not started */
+        size = sizeof(*je) + je->len + je->meta_len;
+        if (size > j->slot_size ||
+            pread(j->fd, j->buf, size, i * j->slot_size) != size ||
+            nvme_journal_crc(je) != je->crc) {
+            continue;
+        }
+        order[nvalid] = *je;
+        order[nvalid].rsvd = i;
+        nvalid++;
+    }
+    qsort(order, nvalid, sizeof(*order), nvme_journal_seq_cmp);
+
+    for (k = 0; k < nvalid; k++) {
+        je = &order[k];
+        size = sizeof(*je) + je->len + je->meta_len;
+        p = j->buf + sizeof(*je);
+        if (pread(j->fd, j->buf, size, je->rsvd * j->slot_size) != size ||
+            nvme_backing_pio(&disk->data, p, je->offset, je->len, 1) ||
+            (je->meta_len && (disk->meta.fd < 0 ||
+            nvme_backing_pio(&disk->meta, p + je->len, je->meta_offset,
+            je->meta_len, 1)))) {
+            bad++;
+            continue;
+        }
+        if (disk->cow_map) {
+            nvme_cow_written(disk, je->slba, je->nlb);
+        }
+        j->seq = MAX(j->seq, je->seq);
+    }
+    if (nvalid) {
+        LOG_NORM("Device:%d nsid:%d played back %d journaled writes, "
+            "%d failed", n->instance, disk->nsid, nvalid - bad, bad);
+    }
+    if (bad || qemu_fdatasync(disk->data.fd) < 0 ||
+        (disk->meta.fd >= 0 && qemu_fdatasync(disk->meta.fd) < 0)) {
+        /* Left in the journal for the next run, their slots unused */
+        LOG_ERR("Device:%d nsid:%d journal kept", n->instance, disk->nsid);
+        for (k = 0; k < nvalid; k++) {
+            j->state[order[k].rsvd] = NVME_JOURNAL_HELD;
+        }
+        j->recover = 0;
+        return;
+    }
+    nvme_journal_reset(j);
+}
@@ -0,0 +1,22 @@
+#ifndef NVME_MONITOR_H_
+#define NVME_MONITOR_H_
+
+#include "monitor.h"
+
+/* "info nvme" / "query-nvme": namespaces and format progress of the
+ * NVMe controllers, for targets built with the device (CONFIG_NVME) */
+void do_nvme_info_print(Monitor *mon, const QObject *data);
+void do_nvme_info(Monitor *mon, QObject **ret_data);
+/* "nvme_set_qos": live IOPS and bandwidth limits */
+int do_nvme_set_qos(Monitor *mon, const QDict *qdict, QObject **ret_data);
+/* "nvme_cow_compact": detach a clone namespace from its base image */
+int do_nvme_cow_compact(Monitor *mon, const QDict *qdict, QObject **ret_data);
+/* "nvme_ns_*": Namespace Management and Attachment from the host side */
+int do_nvme_ns_create(Monitor *mon, const QDict *qdict, QObject **ret_data);
+void do_nvme_ns_create_print(Monitor *mon, const QObject *data);
+int do_nvme_ns_delete(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_nvme_ns_attach(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_nvme_ns_detach(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_nvme_ns_resize(Monitor *mon, const QDict *qdict, QObject **ret_data);
+
+#endif /* NVME_MONITOR_H_ */
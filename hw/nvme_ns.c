@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Namespace Management and Attachment.
+ *
+ * The controller has max_namespaces namespace IDs. Those past the ones
+ * given at start are unallocated until the host (Namespace Management)
+ * or the monitor creates them, out of the NVM capacity not taken by the
+ * other namespaces. A namespace is only active, i.e. visible to the host
+ * and taking commands, while attached; its backing files are created on
+ * its first attachment, sparse, and removed when it is deleted.
+ *
+ * Every change to an attached namespace, including its attachment and
+ * detachment, is added to the Changed Namespace List log page and, if
+ * the host enabled them, reported by a Namespace Attribute Changed
+ * notice. There is one notice per log page read, as the host rescans
+ * the namespaces listed anyway.
+ *
+ * Namespaces are those of the NVM subsystem: created, deleted, formatted
+ * or resized through any of its controllers, they change on all of them,
+ * while each controller has its own attachments.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+/*********************************************************************
+    Function     :    nvme_ns_bytes
+    Description  :    NVM taken by a namespace, its data only
+    Return Type  :    uint64_t
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+uint64_t nvme_ns_bytes(DiskInfo *disk)
+{
+    return disk->idtfy_ns.nsze * NVME_BLOCK_SIZE(
+        disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas & 0xf].lbads);
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_unallocated
+    Description  :    NVM capacity left for new or larger namespaces
+    Return Type  :    uint64_t (in bytes)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+uint64_t nvme_ns_unallocated(NVMEState *n)
+{
+    uint64_t used = 0;
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (n->disk[i].allocated) {
+            used += nvme_ns_bytes(&n->disk[i]);
+        }
+    }
+    return used < n->idtfy_ctrl->tnvmcap[0] ?
+        n->idtfy_ctrl->tnvmcap[0] - used : 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_changed
+    Description  :    Adds a namespace to the Changed Namespace List
+                      and sends a notice if none is pending a read of
+                      the list
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+*********************************************************************/
+void nvme_ns_changed(NVMEState *n, uint32_t nsid)
+{
+    uint32_t i, count = n->changed_ns_count;
+
+    for (i = 0; i < count && i < NVME_CHANGED_NS_MAX; i++) {
+        if (n->changed_ns[i] == nsid) {
+            return;
+        }
+    }
+    if (count < NVME_CHANGED_NS_MAX) {
+        n->changed_ns[count] = nsid;
+    }
+    if (count <= NVME_CHANGED_NS_MAX) {
+        n->changed_ns_count++;
+    }
+    if (count == 0 &&
+        (n->feature.asynchronous_event_configuration & NVME_AEN_NS_ATTR)) {
+        enqueue_async_event(n, event_type_notice, event_info_notice_ns_attr,
+            NVME_LOG_CHANGED_NS);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_reset
+    Description  :    Clears the counters of a namespace allocated
+                      anew and applies the controller QoS limits
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+*********************************************************************/
+static void nvme_ns_reset(NVMEState *n, DiskInfo *disk)
+{
+    disk->thresh_warn_issued = 0;
+    disk->write_data_counter = disk->read_data_counter = 0;
+    memset(disk->data_units_read, 0, sizeof(disk->data_units_read));
+    memset(disk->data_units_written, 0, sizeof(disk->data_units_written));
+    memset(disk->host_read_commands, 0, sizeof(disk->host_read_commands));
+    memset(disk->host_write_commands, 0, sizeof(disk->host_write_commands));
+    nvme_throttle_set(&disk->qos, n->qos_iops, n->qos_bps,
+        n->qos_iops_burst, n->qos_bps_burst);
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_sync
+    Description  :    Brings a namespace changed through a controller
+                      to the other controllers of its subsystem. They
+                      reopen its backing files, and report it changed
+                      where attached if it was deleted, or if asked
+                      to as its format or size changed.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+                      int         : 1 when the contents changed
+*********************************************************************/
+void nvme_ns_sync(NVMEState *n, uint32_t nsid, int changed)
+{
+    DiskInfo *disk = &n->disk[nsid - 1], *pd;
+    NVMEState *p;
+
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        if (p == n) {
+            continue;
+        }
+        pd = &p->disk[nsid - 1];
+        nvme_workers_drain(p);
+        nvme_close_storage_disk(pd);
+        if (disk->allocated && !pd->allocated) {
+            nvme_ns_reset(p, pd);
+        }
+        pd->idtfy_ns = disk->idtfy_ns;
+        pd->allocated = disk->allocated;
+        if (pd->attached && (changed || !pd->allocated)) {
+            nvme_ns_changed(p, nsid);
+        }
+        pd->attached &= pd->allocated;
+        if (nvme_storage_ready(disk) &&
+            nvme_storage_share(p, pd, disk) != SUCCESS) {
+            LOG_ERR("%s(): nsid:%u not shared with controller %d", __func__,
+                nsid, p->idtfy_ctrl->cntlid);
+            nvme_close_storage_disk(pd);
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_busy
+    Description  :    Checks whether a namespace is being formatted,
+                      through any controller of the subsystem
+    Return Type  :    int (1 if busy)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+*********************************************************************/
+int nvme_ns_busy(NVMEState *n, uint32_t nsid)
+{
+    NVMEState *p;
+
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        if (p->disk[nsid - 1].formatting) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_check_format
+    Description  :    Checks an LBA format and protection settings of
+                      a namespace against its capabilities
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    DiskInfo * : NVME disk
+                      uint8_t    : FLBAS
+                      uint8_t    : DPS
+*********************************************************************/
+static int nvme_ns_check_format(DiskInfo *disk, uint8_t flbas, uint8_t dps)
+{
+    uint8_t lba_idx = flbas & 0xf;
+    uint8_t pi = dps & 0x7;
+
+    if (lba_idx > disk->idtfy_ns.nlbaf || pi > 3) {
+        return FAIL;
+    }
+    if (pi && (!((disk->idtfy_ns.dpc & 0x7) & (1 << (pi - 1))) ||
+        !(disk->idtfy_ns.dpc & ((dps & 0x8) ? 0x10 : 0x8)))) {
+        return FAIL;
+    }
+    if (disk->idtfy_ns.lbafx[lba_idx].ms &&
+        !(disk->idtfy_ns.mc & ((flbas & 0x10) ? 1 : 2))) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_create
+    Description  :    Allocates a namespace of the size, LBA format
+                      and protection settings given, taking the lowest
+                      unallocated namespace id. Not attached.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *             : Pointer to NVME device
+                                                State
+                      NVMEIdentifyNamespace * : NSZE, NCAP, FLBAS and
+                                                DPS of the namespace
+                      uint32_t *              : Out: namespace id
+                      NVMEStatusField *       : Out: status on failure
+*********************************************************************/
+int nvme_ns_create(NVMEState *n, NVMEIdentifyNamespace *id, uint32_t *nsid,
+    NVMEStatusField *sf)
+{
+    DiskInfo *disk;
+    uint64_t nsze = id->nsze, zone_size;
+    uint32_t i, blk_sz;
+
+    for (i = 0; i < n->num_namespaces && n->disk[i].allocated; i++) {
+        continue;
+    }
+    if (i == n->num_namespaces) {
+        LOG_NORM("%s(): no namespace id left", __func__);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_NS_ID_UNAVAILABLE;
+        return FAIL;
+    }
+    disk = &n->disk[i];
+    if (nvme_ns_check_format(disk, id->flbas, id->dps) != SUCCESS) {
+        LOG_NORM("%s(): Invalid flbas:%x dps:%x", __func__, id->flbas,
+            id->dps);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_INVALID_FORMAT;
+        return FAIL;
+    }
+    if (id->ncap != nsze) {
+        LOG_NORM("%s(): ncap:%lu differs from nsze:%lu", __func__, id->ncap,
+            nsze);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_THIN_PROVISIONING_NOT_SUPPORTED;
+        return FAIL;
+    }
+    blk_sz = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[id->flbas & 0xf].lbads);
+    if (n->zone_size_mb) {
+        /* Whole zones, as nvme_zone_setup() lays them out */
+        zone_size = (uint64_t)n->zone_size_mb * BYTES_PER_MB / blk_sz;
+        nsze -= nsze % zone_size;
+    }
+    if (nsze == 0 || nsze > NVME_MAX_NAMESPACE_SIZE * BYTES_PER_MB / blk_sz) {
+        LOG_NORM("%s(): Invalid nsze:%lu", __func__, id->nsze);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    if (nsze * blk_sz > nvme_ns_unallocated(n)) {
+        LOG_NORM("%s(): %lu bytes left for nsze:%lu", __func__,
+            nvme_ns_unallocated(n), nsze);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_NS_INSUFFICIENT_CAPACITY;
+        return FAIL;
+    }
+
+    disk->idtfy_ns.nsze = disk->idtfy_ns.ncap = nsze;
+    disk->idtfy_ns.nuse = 0;
+    disk->idtfy_ns.flbas = id->flbas & 0x1f;
+    disk->idtfy_ns.dps = id->dps & 0xf;
+    disk->idtfy_ns.fpi = NVME_FPI_SUPPORTED;
+    nvme_ns_reset(n, disk);
+    disk->allocated = 1;
+    *nsid = disk->nsid;
+    nvme_ns_sync(n, disk->nsid, 0);
+    LOG_NORM("%s(): namespace %d of %lu blocks created", __func__,
+        disk->nsid, nsze);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_remove
+    Description  :    Detaches a namespace and frees it, with its
+                      backing files
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      DiskInfo *        : NVME disk, allocated
+                      NVMEStatusField * : Out: status on failure
+*********************************************************************/
+static int nvme_ns_remove(NVMEState *n, DiskInfo *disk, NVMEStatusField *sf)
+{
+    NVMEReservation *r;
+
+    if (nvme_ns_busy(n, disk->nsid)) {
+        LOG_NORM("%s(): nsid:%d is being formatted", __func__, disk->nsid);
+        sf->sc = NVME_SC_FORMAT_IN_PROGRESS;
+        return FAIL;
+    }
+    if (disk->attached) {
+        disk->attached = 0;
+        nvme_ns_changed(n, disk->nsid);
+    }
+    /* Nothing in flight may still use its files */
+    nvme_subsys_drain(n);
+    nvme_del_storage_disk(n, disk);
+    disk->idtfy_ns.nsze = disk->idtfy_ns.ncap = disk->idtfy_ns.nuse = 0;
+    disk->allocated = 0;
+    /* Its registrations go with it, not to a namespace created later */
+    r = &n->resv[disk->nsid - 1];
+    memset(r->regs, 0, sizeof(r->regs));
+    r->rtype = r->holder = 0;
+    r->gen++;
+    nvme_ns_sync(n, disk->nsid, 0);
+    LOG_NORM("%s(): namespace %d deleted", __func__, disk->nsid);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_delete
+    Description  :    Deletes a namespace, or all of them for
+                      NVME_NSID_ALL
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      uint32_t          : Namespace id
+                      NVMEStatusField * : Out: status on failure
+*********************************************************************/
+int nvme_ns_delete(NVMEState *n, uint32_t nsid, NVMEStatusField *sf)
+{
+    uint32_t i;
+
+    if (nsid == NVME_NSID_ALL) {
+        for (i = 0; i < n->num_namespaces; i++) {
+            if (n->disk[i].allocated &&
+                nvme_ns_remove(n, &n->disk[i], sf) != SUCCESS) {
+                return FAIL;
+            }
+        }
+        return SUCCESS;
+    }
+    if (nsid == 0 || nsid > n->num_namespaces ||
+        !n->disk[nsid - 1].allocated) {
+        LOG_NORM("%s(): Invalid nsid:%u", __func__, nsid);
+        sf->sc = NVME_SC_INVALID_NAMESPACE;
+        return FAIL;
+    }
+    return nvme_ns_remove(n, &n->disk[nsid - 1], sf);
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_attach
+    Description  :    Attaches a namespace to the controller, creating
+                      its backing files the first time or opening those
+                      of another controller of the subsystem, or
+                      detaches it
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      uint32_t          : Namespace id
+                      int               : 1 to attach, 0 to detach
+                      NVMEStatusField * : Out: status on failure
+*********************************************************************/
+int nvme_ns_attach(NVMEState *n, uint32_t nsid, int attach,
+    NVMEStatusField *sf)
+{
+    DiskInfo *disk, *from;
+
+    if (nsid == 0 || nsid > n->num_namespaces ||
+        !n->disk[nsid - 1].allocated) {
+        LOG_NORM("%s(): Invalid nsid:%u", __func__, nsid);
+        sf->sc = NVME_SC_INVALID_NAMESPACE;
+        return FAIL;
+    }
+    disk = &n->disk[nsid - 1];
+    if (attach && nvme_ns_busy(n, nsid)) {
+        LOG_NORM("%s(): nsid:%u is being formatted", __func__, nsid);
+        sf->sc = NVME_SC_FORMAT_IN_PROGRESS;
+        return FAIL;
+    }
+    if (attach == disk->attached) {
+        LOG_NORM("%s(): nsid:%u already %s", __func__, nsid,
+            attach ? "attached" : "detached");
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = attach ? NVME_NS_ALREADY_ATTACHED : NVME_NS_NOT_ATTACHED;
+        return FAIL;
+    }
+    if (attach && disk->data.fd < 0) {
+        from = nvme_subsys_ns_source(n, nsid);
+        if (from ? nvme_storage_share(n, disk, from) :
+            nvme_storage_alloc(n, disk)) {
+            LOG_ERR("%s(): no storage for nsid:%u", __func__, nsid);
+            nvme_close_storage_disk(disk);
+            sf->sc = NVME_SC_INTERNAL;
+            return FAIL;
+        }
+        if (from == NULL) {
+            nvme_ns_sync(n, nsid, 0);
+        }
+    }
+    disk->attached = attach;
+    nvme_ns_changed(n, nsid);
+    LOG_NORM("%s(): namespace %d %s", __func__, nsid,
+        attach ? "attached" : "detached");
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_ns_resize
+    Description  :    Changes the size of a namespace, within the NVM
+                      capacity left. Zoned namespaces and clones keep
+                      theirs.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      uint32_t          : Namespace id
+                      uint64_t          : New size in LBAs
+                      NVMEStatusField * : Out: status on failure
+*********************************************************************/
+int nvme_ns_resize(NVMEState *n, uint32_t nsid, uint64_t nsze,
+    NVMEStatusField *sf)
+{
+    DiskInfo *disk;
+    uint64_t old, new;
+
+    if (nsid == 0 || nsid > n->num_namespaces ||
+        !n->disk[nsid - 1].allocated) {
+        sf->sc = NVME_SC_INVALID_NAMESPACE;
+        return FAIL;
+    }
+    disk = &n->disk[nsid - 1];
+    if (nvme_ns_busy(n, nsid)) {
+        sf->sc = NVME_SC_FORMAT_IN_PROGRESS;
+        return FAIL;
+    }
+    old = nvme_ns_bytes(disk);
+    new = old / disk->idtfy_ns.nsze * nsze;
+    if (nsze == 0 || n->zone_size_mb || disk->cow_map ||
+        new > NVME_MAX_NAMESPACE_SIZE * BYTES_PER_MB) {
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    if (new > old && new - old > nvme_ns_unallocated(n)) {
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_NS_INSUFFICIENT_CAPACITY;
+        return FAIL;
+    }
+
+    nvme_subsys_drain(n);
+    if (nvme_storage_resize(n, disk, nsze) != SUCCESS) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    if (disk->attached) {
+        nvme_ns_changed(n, nsid);
+    }
+    nvme_ns_sync(n, nsid, 1);
+    LOG_NORM("%s(): namespace %d resized to %lu blocks", __func__, nsid,
+        nsze);
+    return SUCCESS;
+}
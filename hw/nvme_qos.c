@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * QoS throttling.
+ *
+ * Every namespace and every I/O SQ may be limited in commands and bytes
+ * per second by a pair of token buckets. A SQ over its limits is simply
+ * not fetched from, so its commands stay in guest memory. A command for
+ * a namespace over its limits has been fetched already: it waits on the
+ * QoS queue of the namespace holding a CQ entry, in order, until the
+ * QoS timer finds the buckets refilled and starts it. Nothing is failed.
+ * The garbage collection of an emulated FTL holds the commands of its
+ * namespace on the same queue, until it is done.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+/*********************************************************************
+    Function     :    nvme_qos_bytes
+    Description  :    Bytes a command moves, charged to the bandwidth
+                      buckets; 0 for the commands without data
+    Return Type  :    uint64_t
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd *   : Command
+*********************************************************************/
+static uint64_t nvme_qos_bytes(NVMEState *n, NVMECmd *cmd)
+{
+    NVME_rw *e = (NVME_rw *)cmd;
+    DiskInfo *disk;
+    uint8_t lba_idx;
+
+    if (e->opcode != NVME_CMD_READ && e->opcode != NVME_CMD_WRITE &&
+        e->opcode != NVME_CMD_ZONE_APPEND) {
+        return 0;
+    }
+    if (e->nsid == 0 || e->nsid > n->num_namespaces) {
+        return 0;
+    }
+    disk = &n->disk[e->nsid - 1];
+    lba_idx = disk->idtfy_ns.flbas & 0xf;
+    return (e->nlb + 1) *
+        (uint64_t)NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+}
+
+/*********************************************************************
+    Function     :    nvme_throttle_on
+    Description  :    Tells whether any limit is set
+    Return Type  :    int (1 when limited)
+
+    Arguments    :    NVMEThrottle * : Buckets
+*********************************************************************/
+static int nvme_throttle_on(NVMEThrottle *t)
+{
+    return t->iops != 0 || t->bps != 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_throttle_set
+    Description  :    Sets the limits and fills the buckets. A burst
+                      of 0 stands for one second worth of the rate.
+    Return Type  :    void
+
+    Arguments    :    NVMEThrottle * : Buckets
+                      uint64_t       : Commands per second, 0 for none
+                      uint64_t       : Bytes per second, 0 for none
+                      uint64_t       : Commands burst
+                      uint64_t       : Bytes burst
+*********************************************************************/
+void nvme_throttle_set(NVMEThrottle *t, uint64_t iops, uint64_t bps,
+    uint64_t iops_burst, uint64_t bps_burst)
+{
+    t->iops = iops;
+    t->bps = bps;
+    t->iops_burst = iops_burst ? iops_burst : iops;
+    t->bps_burst = bps_burst ? bps_burst : bps;
+    t->io_tokens = t->iops_burst;
+    t->byte_tokens = t->bps_burst;
+    t->stamp = qemu_get_clock_ns(vm_clock);
+}
+
+/*********************************************************************
+    Function     :    nvme_throttle_wait
+    Description  :    Refills the buckets for the time gone by and
+                      works out how long a command has to wait
+    Return Type  :    int64_t (ns to wait, 0 to go now)
+
+    Arguments    :    NVMEThrottle * : Buckets
+                      int64_t        : vm_clock now
+*********************************************************************/
+static int64_t nvme_throttle_wait(NVMEThrottle *t, int64_t now)
+{
+    double secs = 0, wait = 0;
+
+    /* vm_clock comes from the source after a migration */
+    if (now > t->stamp) {
+        secs = (double)(now - t->stamp) / get_ticks_per_sec();
+    }
+    t->stamp = now;
+
+    if (t->iops) {
+        t->io_tokens = MIN(t->io_tokens + secs * t->iops, t->iops_burst);
+        if (t->io_tokens < 1) {
+            wait = (1 - t->io_tokens) / t->iops;
+        }
+    }
+    if (t->bps) {
+        t->byte_tokens = MIN(t->byte_tokens + secs * t->bps, t->bps_burst);
+        if (t->byte_tokens < 0) {
+            wait = MAX(wait, -t->byte_tokens / t->bps);
+        }
+    }
+    if (wait == 0) {
+        return 0;
+    }
+    return (int64_t)(wait * get_ticks_per_sec()) + 1;
+}
+
+/*********************************************************************
+    Function     :    nvme_throttle_charge
+    Description  :    Takes a command out of the buckets. The byte
+                      bucket may go into debt, paid back before the
+                      next command gets through.
+    Return Type  :    void
+
+    Arguments    :    NVMEThrottle * : Buckets
+                      uint64_t       : Bytes of the command
+*********************************************************************/
+static void nvme_throttle_charge(NVMEThrottle *t, uint64_t bytes)
+{
+    if (t->iops) {
+        t->io_tokens -= 1;
+    }
+    if (t->bps) {
+        t->byte_tokens -= bytes;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_disk_wait
+    Description  :    Works out how long the next command of a namespace
+                      has to wait for its FTL garbage collection and its
+                      limits, charging it to them when it may go
+    Return Type  :    int64_t (ns to wait, 0 to go now)
+
+    Arguments    :    DiskInfo * : Namespace
+                      uint64_t   : Bytes of the command
+                      int64_t    : vm_clock now
+*********************************************************************/
+static int64_t nvme_qos_disk_wait(DiskInfo *disk, uint64_t bytes,
+    int64_t now)
+{
+    int64_t wait = nvme_ftl_busy(disk, now);
+
+    if (wait || !nvme_throttle_on(&disk->qos)) {
+        return wait;
+    }
+    wait = nvme_throttle_wait(&disk->qos, now);
+    if (wait == 0) {
+        nvme_throttle_charge(&disk->qos, bytes);
+    }
+    return wait;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_arm
+    Description  :    Makes the QoS timer fire by a deadline
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      int64_t     : vm_clock deadline
+*********************************************************************/
+static void nvme_qos_arm(NVMEState *n, int64_t deadline)
+{
+    if (n->qos_timer_target == 0 || deadline < n->qos_timer_target) {
+        n->qos_timer_target = deadline;
+        qemu_mod_timer(n->qos_timer, deadline);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_release
+    Description  :    Starts the first throttled command of a namespace
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : Namespace
+*********************************************************************/
+static void nvme_qos_release(NVMEState *n, DiskInfo *disk)
+{
+    NVMERequest *req = QSIMPLEQ_FIRST(&disk->qos_queue);
+
+    QSIMPLEQ_REMOVE_HEAD(&disk->qos_queue, worker_entry);
+    n->cq[n->sq[req->sq_id]->cq_id]->inflight--;
+    nvme_io_start(n, req);
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_sq_throttled
+    Description  :    Tells whether an I/O SQ is over its limits, in
+                      which case nothing is fetched from it until the
+                      QoS timer fires
+    Return Type  :    int (1 when throttled)
+
+    Arguments    :    NVMEState *    : Pointer to NVME device State
+                      NVMEIOSQueue * : I/O SQ
+*********************************************************************/
+int nvme_qos_sq_throttled(NVMEState *n, NVMEIOSQueue *sq)
+{
+    int64_t now, wait;
+
+    if (!nvme_throttle_on(&sq->qos)) {
+        return 0;
+    }
+    now = qemu_get_clock_ns(vm_clock);
+    wait = nvme_throttle_wait(&sq->qos, now);
+    if (wait == 0) {
+        return 0;
+    }
+    nvme_qos_arm(n, now + wait);
+    return 1;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_submit
+    Description  :    Charges a command fetched from an I/O SQ to the
+                      limits of the SQ and of its namespace, queueing
+                      it when the namespace is over its limits
+    Return Type  :    int (1 when queued, 0 when it may start now)
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+int nvme_qos_submit(NVMEState *n, NVMERequest *req)
+{
+    NVMEIOSQueue *sq = n->sq[req->sq_id];
+    uint64_t bytes = nvme_qos_bytes(n, &req->cmd);
+    DiskInfo *disk;
+    int64_t now, wait;
+
+    nvme_throttle_charge(&sq->qos, bytes);
+
+    if (req->cmd.nsid == 0 || req->cmd.nsid > n->num_namespaces) {
+        return 0;
+    }
+    disk = &n->disk[req->cmd.nsid - 1];
+    if (QSIMPLEQ_EMPTY(&disk->qos_queue)) {
+        if (!nvme_throttle_on(&disk->qos) && disk->ftl == NULL) {
+            return 0;
+        }
+        now = qemu_get_clock_ns(vm_clock);
+        wait = nvme_qos_disk_wait(disk, bytes, now);
+        if (wait == 0) {
+            return 0;
+        }
+        nvme_qos_arm(n, now + wait);
+    }
+    /* Behind the commands already waiting, so they run in order */
+    QSIMPLEQ_INSERT_TAIL(&disk->qos_queue, req, worker_entry);
+    n->cq[sq->cq_id]->inflight++;
+    return 1;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_timer_cb
+    Description  :    Starts the throttled commands the buckets let
+                      through, fetches again from the throttled SQs and
+                      re-arms for the next command to wait for
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+void nvme_qos_timer_cb(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMERequest *req;
+    DiskInfo *disk;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t wait, next = 0;
+    uint32_t i;
+
+    n->qos_timer_target = 0;
+    for (i = 0; i < n->num_namespaces; i++) {
+        disk = &n->disk[i];
+        while ((req = QSIMPLEQ_FIRST(&disk->qos_queue)) != NULL) {
+            wait = nvme_qos_disk_wait(disk, nvme_qos_bytes(n, &req->cmd),
+                now);
+            if (wait) {
+                if (next == 0 || now + wait < next) {
+                    next = now + wait;
+                }
+                break;
+            }
+            /* A write may start GC, holding the commands after it */
+            nvme_qos_release(n, disk);
+        }
+    }
+    if (next) {
+        nvme_qos_arm(n, next);
+    }
+
+    /* SQs over their limits re-arm the timer when fetched from */
+    if (!QTAILQ_EMPTY(&n->sq_active) && n->sq_processing_timer_target == 0) {
+        n->sq_processing_timer_target = now;
+        qemu_mod_timer(n->sq_processing_timer, now);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_flush
+    Description  :    Starts every throttled command regardless of the
+                      limits, so none is held when the VM stops
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_qos_flush(NVMEState *n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        while (!QSIMPLEQ_EMPTY(&n->disk[i].qos_queue)) {
+            nvme_qos_release(n, &n->disk[i]);
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_cancel_sq
+    Description  :    Takes the throttled commands of a SQ off the
+                      namespace queues, completing them as aborted
+                      when the guest deletes the SQ or dropping them
+                      with the SQ pool otherwise
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t    : SQ id
+                      int         : 1 to post the aborted completions
+*********************************************************************/
+void nvme_qos_cancel_sq(NVMEState *n, uint16_t sq_id, int abort)
+{
+    NVMEIOSQueue *sq = n->sq[sq_id];
+    NVMEIOCQueue *cq = n->cq[sq->cq_id];
+    NVMERequest *req, *next;
+    NVMEStatusField *sf;
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        QSIMPLEQ_FOREACH_SAFE(req, &n->disk[i].qos_queue, worker_entry,
+            next) {
+            if (req->sq_id != sq_id) {
+                continue;
+            }
+            QSIMPLEQ_REMOVE(&n->disk[i].qos_queue, req, NVMERequest,
+                worker_entry);
+            /* The CQ may have gone first on a controller reset */
+            if (cq == NULL) {
+                continue;
+            }
+            cq->inflight--;
+            if (abort) {
+                sf = (NVMEStatusField *)&req->cqe.status;
+                sf->sct = NVME_SCT_GEN_CMD_STATUS;
+                sf->sc = NVME_SC_ABORT_SQ_DELETED;
+                nvme_req_complete(n, req);
+            }
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_cancel_req
+    Description  :    Takes a throttled command off its namespace
+                      queue, for the Abort command to complete it
+    Return Type  :    int (0:1 Taken off:Not queued)
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+int nvme_qos_cancel_req(NVMEState *n, NVMERequest *req)
+{
+    NVMERequest *r;
+    DiskInfo *disk;
+
+    if (req->cmd.nsid == 0 || req->cmd.nsid > n->num_namespaces) {
+        return FAIL;
+    }
+    disk = &n->disk[req->cmd.nsid - 1];
+    QSIMPLEQ_FOREACH(r, &disk->qos_queue, worker_entry) {
+        if (r == req) {
+            QSIMPLEQ_REMOVE(&disk->qos_queue, req, NVMERequest,
+                worker_entry);
+            n->cq[n->sq[req->sq_id]->cq_id]->inflight--;
+            return SUCCESS;
+        }
+    }
+    return FAIL;
+}
+
+/*********************************************************************
+    Function     :    nvme_qos_kick
+    Description  :    Runs the QoS timer now, after the limits changed
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_qos_kick(NVMEState *n)
+{
+    nvme_qos_arm(n, qemu_get_clock_ns(vm_clock));
+}
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Reservations.
+ *
+ * Hosts sharing a namespace through the controllers of its subsystem
+ * register a key with it, then one of them, or all of them for the "all
+ * registrants" types, holds a reservation restricting what the others
+ * may read or write. A host is told apart by the Host Identifier feature
+ * it sets on its controllers, each controller standing for a host of its
+ * own while the feature is 0.
+ *
+ * The state lives in the subsystem and is checked when a command is
+ * fetched, before anything is transferred. It does not persist through
+ * a power loss (no PTPL) and no reservation notification is logged.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+/*********************************************************************
+    Function     :    nvme_resv_find
+    Description  :    Finds the registrant of the host a controller
+                      belongs to
+    Return Type  :    NVMERegistrant * (NULL if not registered)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEReservation * : Reservation of a namespace
+*********************************************************************/
+static NVMERegistrant *nvme_resv_find(NVMEState *n, NVMEReservation *r)
+{
+    NVMERegistrant *reg;
+    int i;
+
+    for (i = 0; i < NVME_SUBSYS_MAX_CTRLS; i++) {
+        reg = &r->regs[i];
+        if (reg->valid && (reg->cntlid == n->idtfy_ctrl->cntlid ||
+            (n->hostid && reg->hostid == n->hostid))) {
+            return reg;
+        }
+    }
+    return NULL;
+}
+
+/* Whether a registrant holds the reservation, alone or with the others */
+static int nvme_resv_holds(NVMEReservation *r, NVMERegistrant *reg)
+{
+    return reg && r->rtype && (r->rtype >= NVME_RESV_WRITE_EXCLUSIVE_ALL_REGS ||
+        &r->regs[r->holder] == reg);
+}
+
+/*********************************************************************
+    Function     :    nvme_resv_drop
+    Description  :    Unregisters a host. The reservation goes with
+                      its holder, or with the last registrant for the
+                      all registrants types.
+    Return Type  :    void
+
+    Arguments    :    NVMEReservation * : Reservation of a namespace
+                      NVMERegistrant *  : Registrant
+*********************************************************************/
+static void nvme_resv_drop(NVMEReservation *r, NVMERegistrant *reg)
+{
+    int i;
+
+    if (r->rtype && r->rtype < NVME_RESV_WRITE_EXCLUSIVE_ALL_REGS &&
+        &r->regs[r->holder] == reg) {
+        r->rtype = 0;
+    }
+    memset(reg, 0, sizeof(*reg));
+    for (i = 0; i < NVME_SUBSYS_MAX_CTRLS && !r->regs[i].valid; i++) {
+        continue;
+    }
+    if (i == NVME_SUBSYS_MAX_CTRLS) {
+        r->rtype = 0;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_resv_conflict
+    Description  :    Checks a command against the reservation of its
+                      namespace. Reads and Zone Management Receive are
+                      the read commands, the others write.
+    Return Type  :    int (1 when the command is not allowed)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+                      uint8_t     : Command opcode
+*********************************************************************/
+int nvme_resv_conflict(NVMEState *n, uint32_t nsid, uint8_t opcode)
+{
+    NVMEReservation *r = &n->resv[nsid - 1];
+    NVMERegistrant *reg;
+    int is_write = 1;
+
+    if (r->rtype == 0) {
+        return 0;
+    }
+    switch (opcode) {
+    case NVME_CMD_RESV_REGISTER:
+    case NVME_CMD_RESV_REPORT:
+    case NVME_CMD_RESV_ACQUIRE:
+    case NVME_CMD_RESV_RELEASE:
+        return 0;
+    case NVME_CMD_READ:
+    case NVME_CMD_ZONE_MGMT_RECV:
+        is_write = 0;
+        break;
+    }
+    reg = nvme_resv_find(n, r);
+    switch (r->rtype) {
+    case NVME_RESV_WRITE_EXCLUSIVE:
+        return is_write && !nvme_resv_holds(r, reg);
+    case NVME_RESV_EXCLUSIVE_ACCESS:
+        return !nvme_resv_holds(r, reg);
+    case NVME_RESV_WRITE_EXCLUSIVE_REG_ONLY:
+    case NVME_RESV_WRITE_EXCLUSIVE_ALL_REGS:
+        return is_write && reg == NULL;
+    default:
+        return reg == NULL;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_resv_registered
+    Description  :    Checks whether the host of a controller is
+                      registered with any namespace
+    Return Type  :    int (1 if registered)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_resv_registered(NVMEState *n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (nvme_resv_find(n, &n->resv[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_resv_register
+    Description  :    Reservation Register: registers the host with
+                      the new key, unregisters it or replaces its key
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEReservation * : Reservation of the namespace
+                      NVMECmd *         : Pointer to SQ cmd
+                      NVMEStatusField * : Out: status
+*********************************************************************/
+static uint8_t nvme_resv_register(NVMEState *n, NVMEReservation *r,
+    NVMECmd *sqe, NVMEStatusField *sf)
+{
+    uint32_t rrega = sqe->cdw10 & 0x7;
+    uint32_t iekey = sqe->cdw10 & 0x8;
+    uint32_t cptpl = sqe->cdw10 >> 30;
+    uint64_t keys[2]; /* CRKEY, NRKEY */
+    NVMERegistrant *reg;
+    int i;
+
+    /* Persist Through Power Loss cannot be turned on */
+    if (rrega > NVME_RESV_REPLACE || cptpl == 1 || cptpl == 3) {
+        LOG_NORM("%s(): Invalid rrega:%u cptpl:%u", __func__, rrega, cptpl);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    sf->sc = nvme_cmd_data_rw(n, sqe, (uint8_t *)keys, sizeof(keys), 0);
+    if (sf->sc != NVME_SC_SUCCESS) {
+        return FAIL;
+    }
+    reg = nvme_resv_find(n, r);
+    if (rrega == NVME_RESV_REGISTER) {
+        if (reg) {
+            /* Registering again with the same key changes nothing */
+            if (reg->rkey != keys[1]) {
+                sf->sc = NVME_SC_RESERVATION_CONFLICT;
+                return FAIL;
+            }
+            return SUCCESS;
+        }
+        for (i = 0; i < NVME_SUBSYS_MAX_CTRLS && r->regs[i].valid; i++) {
+            continue;
+        }
+        if (i == NVME_SUBSYS_MAX_CTRLS) {
+            sf->sc = NVME_SC_RESERVATION_CONFLICT;
+            return FAIL;
+        }
+        reg = &r->regs[i];
+        reg->valid = 1;
+        reg->rkey = keys[1];
+        reg->hostid = n->hostid;
+        reg->cntlid = n->idtfy_ctrl->cntlid;
+    } else if (reg == NULL || (!iekey && reg->rkey != keys[0])) {
+        sf->sc = NVME_SC_RESERVATION_CONFLICT;
+        return FAIL;
+    } else if (rrega == NVME_RESV_REPLACE) {
+        reg->rkey = keys[1];
+    } else {
+        nvme_resv_drop(r, reg);
+    }
+    r->gen++;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_resv_acquire
+    Description  :    Reservation Acquire: takes the reservation if
+                      none is held, or preempts the registrants with
+                      the key given, taking over the reservation if
+                      they hold it. Commands are not queued behind a
+                      reservation, none is left for Preempt and Abort
+                      to abort.
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEReservation * : Reservation of the namespace
+                      NVMECmd *         : Pointer to SQ cmd
+                      NVMEStatusField * : Out: status
+*********************************************************************/
+static uint8_t nvme_resv_acquire(NVMEState *n, NVMEReservation *r,
+    NVMECmd *sqe, NVMEStatusField *sf)
+{
+    uint32_t racqa = sqe->cdw10 & 0x7;
+    uint32_t iekey = sqe->cdw10 & 0x8;
+    uint8_t rtype = (sqe->cdw10 >> 8) & 0xff;
+    uint64_t keys[2]; /* CRKEY, PRKEY */
+    NVMERegistrant *reg;
+    int i, found = 0, all;
+
+    if (racqa > NVME_RESV_PREEMPT_ABORT || rtype == 0 ||
+        rtype > NVME_RESV_EXCLUSIVE_ACCESS_ALL_REGS) {
+        LOG_NORM("%s(): Invalid racqa:%u rtype:%u", __func__, racqa, rtype);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    sf->sc = nvme_cmd_data_rw(n, sqe, (uint8_t *)keys, sizeof(keys), 0);
+    if (sf->sc != NVME_SC_SUCCESS) {
+        return FAIL;
+    }
+    reg = nvme_resv_find(n, r);
+    if (reg == NULL || (!iekey && reg->rkey != keys[0])) {
+        sf->sc = NVME_SC_RESERVATION_CONFLICT;
+        return FAIL;
+    }
+
+    if (racqa == NVME_RESV_ACQUIRE) {
+        if (r->rtype == 0) {
+            r->rtype = rtype;
+            r->holder = reg - r->regs;
+        } else if (!nvme_resv_holds(r, reg) || r->rtype != rtype) {
+            sf->sc = NVME_SC_RESERVATION_CONFLICT;
+            return FAIL;
+        }
+        return SUCCESS;
+    }
+
+    /* Preempting the holders of an all registrants type takes a PRKEY
+     * of 0, and preempts all of the other registrants */
+    all = r->rtype >= NVME_RESV_WRITE_EXCLUSIVE_ALL_REGS && keys[1] == 0;
+    if (all || (r->rtype && r->rtype < NVME_RESV_WRITE_EXCLUSIVE_ALL_REGS &&
+        r->regs[r->holder].rkey == keys[1])) {
+        for (i = 0; i < NVME_SUBSYS_MAX_CTRLS; i++) {
+            if (&r->regs[i] != reg && r->regs[i].valid &&
+                (all || r->regs[i].rkey == keys[1])) {
+                memset(&r->regs[i], 0, sizeof(r->regs[i]));
+            }
+        }
+        r->rtype = rtype;
+        r->holder = reg - r->regs;
+    } else {
+        /* The reservation, if any, stays with its holders */
+        if (keys[1] == 0) {
+            sf->sc = NVME_SC_INVALID_FIELD;
+            return FAIL;
+        }
+        for (i = 0; i < NVME_SUBSYS_MAX_CTRLS; i++) {
+            if (&r->regs[i] != reg && r->regs[i].valid &&
+                r->regs[i].rkey == keys[1]) {
+                nvme_resv_drop(r, &r->regs[i]);
+                found = 1;
+            }
+        }
+        if (!found) {
+            sf->sc = NVME_SC_RESERVATION_CONFLICT;
+            return FAIL;
+        }
+    }
+    r->gen++;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_resv_release
+    Description  :    Reservation Release: releases the reservation
+                      the host holds, or clears it along with every
+                      registration
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEReservation * : Reservation of the namespace
+                      NVMECmd *         : Pointer to SQ cmd
+                      NVMEStatusField * : Out: status
+*********************************************************************/
+static uint8_t nvme_resv_release(NVMEState *n, NVMEReservation *r,
+    NVMECmd *sqe, NVMEStatusField *sf)
+{
+    uint32_t rrela = sqe->cdw10 & 0x7;
+    uint32_t iekey = sqe->cdw10 & 0x8;
+    uint8_t rtype = (sqe->cdw10 >> 8) & 0xff;
+    NVMERegistrant *reg;
+    uint64_t crkey;
+
+    if (rrela > NVME_RESV_CLEAR) {
+        LOG_NORM("%s(): Invalid rrela:%u", __func__, rrela);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    sf->sc = nvme_cmd_data_rw(n, sqe, (uint8_t *)&crkey, sizeof(crkey), 0);
+    if (sf->sc != NVME_SC_SUCCESS) {
+        return FAIL;
+    }
+    reg = nvme_resv_find(n, r);
+    if (reg == NULL || (!iekey && reg->rkey != crkey)) {
+        sf->sc = NVME_SC_RESERVATION_CONFLICT;
+        return FAIL;
+    }
+
+    if (rrela == NVME_RESV_CLEAR) {
+        memset(r->regs, 0, sizeof(r->regs));
+        r->rtype = 0;
+        r->gen++;
+        return SUCCESS;
+    }
+    /* Nothing to release for a host not holding it */
+    if (!nvme_resv_holds(r, reg)) {
+        return SUCCESS;
+    }
+    if (rtype != r->rtype) {
+        LOG_NORM("%s(): rtype:%u, %u held", __func__, rtype, r->rtype);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    r->rtype = 0;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_resv_report
+    Description  :    Reservation Report: the reservation status and
+                      a registrant entry per registered host, cut to
+                      the NUMD dwords asked for. Host Identifiers are
+                      64 bit, there is no extended data structure.
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEReservation * : Reservation of the namespace
+                      NVMECmd *         : Pointer to SQ cmd
+                      NVMEStatusField * : Out: status
+*********************************************************************/
+static uint8_t nvme_resv_report(NVMEState *n, NVMEReservation *r,
+    NVMECmd *sqe, NVMEStatusField *sf)
+{
+    uint8_t buf[sizeof(NVMEResvStatus) +
+        NVME_SUBSYS_MAX_CTRLS * sizeof(NVMEResvReportEntry)];
+    NVMEResvStatus *status = (NVMEResvStatus *)buf;
+    NVMEResvReportEntry *e = (NVMEResvReportEntry *)(status + 1);
+    uint64_t len = ((uint64_t)sqe->cdw10 + 1) * 4;
+    int i;
+
+    if (sqe->cdw11 & 1) {
+        LOG_NORM("%s(): no extended data structure", __func__);
+        sf->sc = NVME_SC_HOSTID_INCONSISTENT;
+        return FAIL;
+    }
+    memset(buf, 0, sizeof(buf));
+    status->gen = r->gen;
+    status->rtype = r->rtype;
+    for (i = 0; i < NVME_SUBSYS_MAX_CTRLS; i++) {
+        if (!r->regs[i].valid) {
+            continue;
+        }
+        e->cntlid = r->regs[i].cntlid;
+        e->rcsts = nvme_resv_holds(r, &r->regs[i]);
+        e->hostid = r->regs[i].hostid;
+        e->rkey = r->regs[i].rkey;
+        status->regctl++;
+        e++;
+    }
+    sf->sc = nvme_cmd_data_rw(n, sqe, buf, MIN(len, sizeof(buf)), 1);
+    return sf->sc == NVME_SC_SUCCESS ? SUCCESS : FAIL;
+}
+
+/*********************************************************************
+    Function     :    nvme_resv_command
+    Description  :    Reservation commands processing
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd   * : Pointer to SQ cmd
+                      NVMECQE   * : Pointer to CQ completion entries
+*********************************************************************/
+uint8_t nvme_resv_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEReservation *r = &n->resv[sqe->nsid - 1];
+
+    sf->sc = NVME_SC_SUCCESS;
+    LOG_DBG("%s(): opcode:0x%x nsid:%u", __func__, sqe->opcode, sqe->nsid);
+
+    switch (sqe->opcode) {
+    case NVME_CMD_RESV_REGISTER:
+        return nvme_resv_register(n, r, sqe, sf);
+    case NVME_CMD_RESV_REPORT:
+        return nvme_resv_report(n, r, sqe, sf);
+    case NVME_CMD_RESV_ACQUIRE:
+        return nvme_resv_acquire(n, r, sqe, sf);
+    default:
+        return nvme_resv_release(n, r, sqe, sf);
+    }
+}
@@ -24,120 +24,767 @@
 
 #include "nvme.h"
 #include "nvme_debug.h"
+#include "migration.h"
 #include <sys/mman.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MASK_AD         0x4
 #define MASK_IDW        0x2
 #define MASK_IDR        0x1
 
-static uint8_t read_dsm_ranges(uint64_t range_prp1, uint64_t range_prp2,
-    uint8_t *buffer_addr, uint64_t *data_size_p);
-static void dsm_dealloc(DiskInfo *disk, uint64_t slba, uint64_t nlb);
+/* Bounce buffer of the copies copy_file_range() does not do */
+#define NVME_COPY_BOUNCE_SIZE (1 << 20)
 
+/* Returned by the O_DIRECT transfers that cannot take the data, left to
+ * the mapped windows */
+#define NVME_DIRECT_FALLBACK 2
 
-void nvme_dma_mem_read(target_phys_addr_t addr, uint8_t *buf, int len)
+static void dsm_dealloc(NVMEState *n, DiskInfo *disk, uint64_t slba,
+    uint64_t nlb);
+static uint64_t nvme_format_total(DiskInfo *disk);
+static int nvme_format_step(DiskInfo *disk, uint64_t budget);
+static void nvme_mig_watch(NVMEState *n, uint32_t nsid);
+
+
+/* Host address of len bytes at addr when they are all in the CMB */
+static uint8_t *nvme_cmb_ptr(NVMEState *n, target_phys_addr_t addr, int len)
+{
+    pcibus_t base = n->dev.io_regions[NVME_CMB_BIR].addr;
+
+    if (n->cmb_buf == NULL || base == PCI_BAR_UNMAPPED || addr < base ||
+        addr - base + len > NVME_CMB_SIZE(n)) {
+        return NULL;
+    }
+    return n->cmb_buf + (addr - base);
+}
+
+void nvme_dma_mem_read(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len)
 {
-    cpu_physical_memory_rw(addr, buf, len, 0);
+    uint8_t *cmb = nvme_cmb_ptr(n, addr, len);
+
+    if (cmb) {
+        /* Commands, PRP lists and data placed in the CMB */
+        memcpy(buf, cmb, len);
+    } else {
+        cpu_physical_memory_rw(addr, buf, len, 0);
+    }
 }
 
-void nvme_dma_mem_write(target_phys_addr_t addr, uint8_t *buf, int len)
+/* Writes to the CMB go through the RAM write path too, which keeps the
+ * dirty tracking of migration right */
+void nvme_dma_mem_write(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len)
 {
     cpu_physical_memory_rw(addr, buf, len, 1);
 }
 
-static uint8_t do_rw_prp(NVMEState *n, uint64_t mem_addr, uint64_t *data_size_p,
-    uint64_t *file_offset_p, uint8_t *mapping_addr, uint8_t rw)
+/*********************************************************************
+    Function     :    nvme_map_prp
+    Description  :    Adds the guest memory described by PRP1, PRP2
+                      and the PRP lists to the scatter gather list,
+                      in memory pages of the size set by CC.MPS
+    Return Type  :    uint16_t (NVMe status code)
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      QEMUSGList * : Scatter gather list
+                      uint64_t     : PRP1
+                      uint64_t     : PRP2
+                      uint64_t     : Transfer length in bytes
+*********************************************************************/
+uint16_t nvme_map_prp(NVMEState *n, QEMUSGList *qsg, uint64_t prp1,
+    uint64_t prp2, uint64_t len)
 {
-    uint64_t data_len;
+    uint64_t prp_list[512];
+    uint64_t list_addr = prp2, trans_len;
+    uint32_t pg_size = n->page_size;
+    uint32_t i, avail, nents, batch;
+    int chain;
+
+    trans_len = min(len, pg_size - (prp1 % pg_size));
+    qemu_sglist_add(qsg, prp1, trans_len);
+    len -= trans_len;
+    if (len == 0) {
+        return NVME_SC_SUCCESS;
+    }
+    if (len <= pg_size) {
+        qemu_sglist_add(qsg, prp2, len);
+        return NVME_SC_SUCCESS;
+    }
 
-    if (*data_size_p == 0) {
-        return FAIL;
+    /* The last entry of a list page points to the next list page */
+    while (len) {
+        avail = (pg_size - (list_addr % pg_size)) / PRP_ENTRY_SIZE;
+        nents = (len + pg_size - 1) / pg_size;
+        chain = nents > avail;
+        if (chain) {
+            nents = avail - 1;
+            if (nents == 0) {
+                LOG_NORM("%s(): PRP list without entries", __func__);
+                return NVME_SC_INVALID_FIELD;
+            }
+        }
+        while (nents) {
+            batch = min(nents, ARRAY_SIZE(prp_list));
+            nvme_dma_mem_read(n, list_addr, (uint8_t *)prp_list,
+                batch * PRP_ENTRY_SIZE);
+            for (i = 0; i < batch; i++) {
+                trans_len = min(len, pg_size);
+                qemu_sglist_add(qsg, prp_list[i], trans_len);
+                len -= trans_len;
+            }
+            list_addr += batch * PRP_ENTRY_SIZE;
+            nents -= batch;
+        }
+        if (chain) {
+            nvme_dma_mem_read(n, list_addr, (uint8_t *)&list_addr,
+                PRP_ENTRY_SIZE);
+        }
     }
+    return NVME_SC_SUCCESS;
+}
 
-    /* Data Len to be written per page basis */
-    data_len = PAGE_SIZE - (mem_addr % PAGE_SIZE);
-    if (data_len > *data_size_p) {
-        data_len = *data_size_p;
+/*********************************************************************
+    Function     :    nvme_map_sgl
+    Description  :    Adds the guest memory described by a SGL to the
+                      scatter gather list, following its segments.
+                      Bit buckets are added as NVME_SGL_BIT_BUCKET_ADDR.
+    Return Type  :    uint16_t (NVMe status code)
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      QEMUSGList *  : Scatter gather list
+                      NVMESglDesc * : First descriptor, from the command
+                      uint64_t      : Transfer length in bytes
+                      int           : 1 when guest memory is read
+*********************************************************************/
+static uint16_t nvme_map_sgl(NVMEState *n, QEMUSGList *qsg,
+    NVMESglDesc *sgl1, uint64_t len, int is_write)
+{
+    NVMESglDesc seg[256];
+    NVMESglDesc d = *sgl1;
+    uint64_t seg_addr = 0, trans_len;
+    uint32_t seg_left = 0, nseg = 0, i = 0, batch = 0;
+    int in_last = 0;
+
+    for (;;) {
+        if (d.type & 0xf) {
+            /* Only the address sub type, keyed SGLs are for fabrics */
+            return NVME_SC_SGL_TYPE_INVALID;
+        }
+        trans_len = min((uint64_t)d.len, len);
+        switch (d.type >> 4) {
+        case NVME_SGL_DATA_BLOCK:
+            if (trans_len) {
+                qemu_sglist_add(qsg, d.addr, trans_len);
+            }
+            len -= trans_len;
+            break;
+        case NVME_SGL_BIT_BUCKET:
+            if (is_write) {
+                return NVME_SC_SGL_TYPE_INVALID;
+            }
+            if (trans_len) {
+                qemu_sglist_add(qsg, NVME_SGL_BIT_BUCKET_ADDR, trans_len);
+            }
+            len -= trans_len;
+            break;
+        case NVME_SGL_SEGMENT:
+        case NVME_SGL_LAST_SEGMENT:
+            /* Only as the last descriptor of a segment that is not the
+             * last one */
+            if (in_last || i < batch || seg_left || d.len == 0 ||
+                d.len % sizeof(d)) {
+                return NVME_SC_SGL_SEG_INVALID;
+            }
+            if (++nseg > NVME_SGL_MAX_SEGMENTS) {
+                return NVME_SC_SGL_NUM_INVALID;
+            }
+            in_last = (d.type >> 4) == NVME_SGL_LAST_SEGMENT;
+            seg_addr = d.addr;
+            seg_left = d.len / sizeof(d);
+            i = batch = 0;
+            break;
+        default:
+            return NVME_SC_SGL_TYPE_INVALID;
+        }
+        if (len == 0) {
+            /* Descriptors past the transfer length are ignored */
+            return NVME_SC_SUCCESS;
+        }
+        if (i == batch) {
+            if (seg_left == 0) {
+                return NVME_SC_SGL_DATA_LEN_INVALID;
+            }
+            batch = min(seg_left, ARRAY_SIZE(seg));
+            nvme_dma_mem_read(n, seg_addr, (uint8_t *)seg,
+                batch * sizeof(seg[0]));
+            seg_addr += batch * sizeof(seg[0]);
+            seg_left -= batch;
+            i = 0;
+        }
+        d = seg[i++];
     }
+}
 
-    LOG_DBG("File offset for read/write:%ld", *file_offset_p);
-    LOG_DBG("Length for read/write:%ld", data_len);
-    LOG_DBG("Address for read/write:%ld", mem_addr);
+/*********************************************************************
+    Function     :    nvme_map_data
+    Description  :    Builds n->qsg from the data pointer of a command,
+                      PRPs or a SGL as told by CDW0.PSDT
+    Return Type  :    uint16_t (NVMe status code)
 
-    switch (rw) {
-    case NVME_CMD_READ:
-        LOG_DBG("Read cmd called");
-        nvme_dma_mem_write(mem_addr, (mapping_addr + *file_offset_p), data_len);
-        break;
-    case NVME_CMD_WRITE:
-        LOG_DBG("Write cmd called");
-        nvme_dma_mem_read(mem_addr, (mapping_addr + *file_offset_p), data_len);
-        break;
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd *   : Command
+                      uint64_t    : Transfer length in bytes
+                      int         : 1 when guest memory is read
+*********************************************************************/
+static uint16_t nvme_map_data(NVMEState *n, NVMECmd *cmd, uint64_t len,
+    int is_write)
+{
+    /* The list is kept allocated from one command to the next */
+    n->qsg.nsg = 0;
+    n->qsg.size = 0;
+
+    switch (NVME_CMD_PSDT(cmd)) {
+    case NVME_PSDT_PRP:
+        return nvme_map_prp(n, &n->qsg, cmd->prp1, cmd->prp2, len);
+    case NVME_PSDT_SGL_MPTR_BUF:
+        return nvme_map_sgl(n, &n->qsg, (NVMESglDesc *)&cmd->prp1, len,
+            is_write);
     default:
-        LOG_ERR("Error- wrong opcode: %d", rw);
-        return FAIL;
+        LOG_NORM("%s(): unsupported PSDT %d", __func__, NVME_CMD_PSDT(cmd));
+        return NVME_SC_INVALID_FIELD;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_prp_rw
+    Description  :    Copies a controller buffer to or from the guest
+                      memory described by the PRPs of a command, as
+                      for identify data and log pages
+    Return Type  :    uint16_t (NVMe status code)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd *   : Command
+                      uint8_t *   : Controller buffer
+                      uint64_t    : Length in bytes
+                      int         : 1 to write guest memory, 0 to read it
+*********************************************************************/
+uint16_t nvme_prp_rw(NVMEState *n, NVMECmd *cmd, uint8_t *buf, uint64_t len,
+    int to_guest)
+{
+    ScatterGatherEntry *sg;
+    uint16_t sc;
+    int i;
+
+    n->qsg.nsg = 0;
+    n->qsg.size = 0;
+    sc = nvme_map_prp(n, &n->qsg, cmd->prp1, cmd->prp2, len);
+    if (sc != NVME_SC_SUCCESS) {
+        return sc;
+    }
+    for (i = 0; i < n->qsg.nsg; i++) {
+        sg = &n->qsg.sg[i];
+        if (to_guest) {
+            nvme_dma_mem_write(n, sg->base, buf, sg->len);
+        } else {
+            nvme_dma_mem_read(n, sg->base, buf, sg->len);
+        }
+        buf += sg->len;
     }
-    *file_offset_p = *file_offset_p + data_len;
-    *data_size_p = *data_size_p - data_len;
     return NVME_SC_SUCCESS;
 }
 
-static uint8_t do_rw_prp_list(NVMEState *n, NVMECmd *command,
-    uint64_t *data_size_p, uint64_t *file_offset_p, uint8_t *mapping_addr)
+/*********************************************************************
+    Function     :    nvme_cmd_data_rw
+    Description  :    Copies a controller buffer to or from the guest
+                      memory described by the data pointer of an NVM
+                      command, PRPs or a SGL, as for DSM ranges and
+                      zone reports
+    Return Type  :    uint16_t (NVMe status code)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd *   : Command
+                      uint8_t *   : Controller buffer
+                      uint64_t    : Length in bytes
+                      int         : 1 to write guest memory, 0 to read it
+*********************************************************************/
+uint16_t nvme_cmd_data_rw(NVMEState *n, NVMECmd *cmd, uint8_t *buf,
+    uint64_t len, int to_guest)
 {
-    uint64_t prp_list[512], prp_entries;
-    uint16_t i = 0;
-    uint8_t res = FAIL;
-    NVME_rw *cmd = (NVME_rw *)command;
-
-    LOG_DBG("Data Size remaining for read/write:%ld", *data_size_p);
-
-    /* Logic to find the number of PRP Entries */
-    prp_entries = (uint64_t) ((*data_size_p + PAGE_SIZE - 1) / PAGE_SIZE);
-    nvme_dma_mem_read(cmd->prp2, (uint8_t *)prp_list,
-        min(sizeof(prp_list), prp_entries * sizeof(uint64_t)));
-
-    /* Read/Write on PRPList */
-    while (*data_size_p != 0) {
-        if (i == 511 && *data_size_p > PAGE_SIZE) {
-            /* Calculate the actual number of remaining entries */
-            prp_entries = (uint64_t) ((*data_size_p + PAGE_SIZE - 1) /
-                PAGE_SIZE);
-            nvme_dma_mem_read(prp_list[511], (uint8_t *)prp_list,
-                min(sizeof(prp_list), prp_entries * sizeof(uint64_t)));
-            i = 0;
+    ScatterGatherEntry *sg;
+    uint16_t sc;
+    int i;
+
+    sc = nvme_map_data(n, cmd, len, !to_guest);
+    if (sc != NVME_SC_SUCCESS) {
+        return sc;
+    }
+    for (i = 0; i < n->qsg.nsg; i++) {
+        sg = &n->qsg.sg[i];
+        if (sg->base != NVME_SGL_BIT_BUCKET_ADDR) {
+            if (to_guest) {
+                nvme_dma_mem_write(n, sg->base, buf, sg->len);
+            } else {
+                nvme_dma_mem_read(n, sg->base, buf, sg->len);
+            }
+        }
+        buf += sg->len;
+    }
+    return NVME_SC_SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_direct_aligned
+    Description  :    Checks whether n->qsg and the file range can be
+                      transferred with O_DIRECT as they are
+    Return Type  :    int (1 if aligned)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file
+                      uint64_t          : Offset within the file
+*********************************************************************/
+static int nvme_direct_aligned(NVMEState *n, NVMEBackingFile *bf,
+    uint64_t offset)
+{
+    ScatterGatherEntry *sg;
+    int i;
+
+    for (i = 0; i < n->qsg.nsg; i++) {
+        sg = &n->qsg.sg[i];
+        if (sg->base == NVME_SGL_BIT_BUCKET_ADDR ||
+            !nvme_backing_direct_ok(bf, offset, sg->base, sg->len)) {
+            return 0;
         }
+        offset += sg->len;
+    }
+    return 1;
+}
 
-        res = do_rw_prp(n, prp_list[i], data_size_p,
-            file_offset_p, mapping_addr, cmd->opcode);
-        LOG_DBG("Data Size remaining for read/write:%ld", *data_size_p);
-        if (res == FAIL) {
+/*********************************************************************
+    Function     :    nvme_direct_rw
+    Description  :    Transfers an aligned n->qsg with a single
+                      O_DIRECT preadv or pwritev on the guest pages
+    Return Type  :    int (0:1 Success:Failure, NVME_DIRECT_FALLBACK
+                      if guest memory is not mappable)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file
+                      uint64_t          : Offset within the file
+                      int               : 1 to write the file from
+                                          guest memory, 0 to read it
+*********************************************************************/
+static int nvme_direct_rw(NVMEState *n, NVMEBackingFile *bf, uint64_t offset,
+    int is_write)
+{
+    struct iovec *iov;
+    target_phys_addr_t plen;
+    uint64_t done = 0;
+    ssize_t ret = 0;
+    int i, cnt;
+
+    if (n->qsg.nsg > IOV_MAX) {
+        return NVME_DIRECT_FALLBACK;
+    }
+    iov = qemu_malloc(n->qsg.nsg * sizeof(*iov));
+    for (cnt = 0; cnt < n->qsg.nsg; cnt++) {
+        plen = n->qsg.sg[cnt].len;
+        iov[cnt].iov_base = cpu_physical_memory_map(n->qsg.sg[cnt].base,
+            &plen, !is_write);
+        if (iov[cnt].iov_base == NULL) {
+            break;
+        }
+        iov[cnt].iov_len = plen;
+        if (plen != n->qsg.sg[cnt].len) {
+            cpu_physical_memory_unmap(iov[cnt].iov_base, plen, !is_write, 0);
             break;
         }
-        i++;
     }
-    return res;
+    if (cnt < n->qsg.nsg) {
+        /* Bounce buffer in use, or split RAM */
+        for (i = 0; i < cnt; i++) {
+            cpu_physical_memory_unmap(iov[i].iov_base, iov[i].iov_len,
+                !is_write, 0);
+        }
+        qemu_free(iov);
+        return NVME_DIRECT_FALLBACK;
+    }
+
+    do {
+        if (is_write) {
+            ret = pwritev(bf->direct_fd, iov, cnt, offset);
+        } else {
+            ret = preadv(bf->direct_fd, iov, cnt, offset);
+        }
+    } while (ret < 0 && errno == EINTR);
+    if (ret >= 0) {
+        done = ret;
+    }
+    if (done < n->qsg.size) {
+        LOG_ERR("Direct %s failed at offset %lu: %s",
+            is_write ? "write" : "read", offset + done,
+            ret < 0 ? strerror(errno) : "short transfer");
+    }
+    for (i = 0; i < cnt; i++) {
+        cpu_physical_memory_unmap(iov[i].iov_base, iov[i].iov_len,
+            !is_write, is_write ? 0 : iov[i].iov_len);
+    }
+    qemu_free(iov);
+    if (is_write) {
+        nvme_backing_set_dirty(bf, offset, n->qsg.size);
+    }
+    return done < n->qsg.size ? FAIL : SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_direct_bounce
+    Description  :    Transfers an unaligned n->qsg with O_DIRECT
+                      through the aligned bounce buffer of the device,
+                      reading the partial blocks at both ends first
+                      when writing
+    Return Type  :    int (0:1 Success:Failure, NVME_DIRECT_FALLBACK
+                      at the end of a file not aligned)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file
+                      uint64_t          : Offset within the file
+                      int               : 1 to write the file from
+                                          guest memory, 0 to read it
+*********************************************************************/
+static int nvme_direct_bounce(NVMEState *n, NVMEBackingFile *bf,
+    uint64_t offset, int is_write)
+{
+    uint64_t mask = bf->direct_align - 1;
+    uint64_t start = offset & ~mask;
+    uint64_t end = (offset + n->qsg.size + mask) & ~mask;
+    uint64_t len = end - start;
+    ScatterGatherEntry *sg;
+    uint8_t *p;
+    int i;
+
+    if (end > bf->size) {
+        /* The file does not end on an aligned size */
+        return NVME_DIRECT_FALLBACK;
+    }
+    if (len > n->direct_buf_size) {
+        qemu_vfree(n->direct_buf);
+        n->direct_buf = qemu_memalign(bf->direct_align > 4096 ?
+            bf->direct_align : 4096, len);
+        n->direct_buf_size = len;
+    }
+
+    if (!is_write) {
+        if (nvme_backing_dio(bf, n->direct_buf, start, len, 0) != SUCCESS) {
+            return FAIL;
+        }
+    } else {
+        if (start != offset && nvme_backing_dio(bf, n->direct_buf, start,
+                bf->direct_align, 0) != SUCCESS) {
+            return FAIL;
+        }
+        if (end != offset + n->qsg.size && nvme_backing_dio(bf,
+                n->direct_buf + len - bf->direct_align,
+                end - bf->direct_align, bf->direct_align, 0) != SUCCESS) {
+            return FAIL;
+        }
+    }
+
+    p = n->direct_buf + (offset - start);
+    for (i = 0; i < n->qsg.nsg; i++) {
+        sg = &n->qsg.sg[i];
+        if (sg->base == NVME_SGL_BIT_BUCKET_ADDR) {
+            /* Only in reads */
+        } else if (is_write) {
+            nvme_dma_mem_read(n, sg->base, p, sg->len);
+        } else {
+            nvme_dma_mem_write(n, sg->base, p, sg->len);
+        }
+        p += sg->len;
+    }
+
+    if (is_write) {
+        /* Even a failed write may have changed part of the range */
+        nvme_backing_set_dirty(bf, start, len);
+        return nvme_backing_dio(bf, n->direct_buf, start, len, 1);
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_sg_rw
+    Description  :    Transfers data between n->qsg and a backing file,
+                      skipping the file data of bit buckets. Files
+                      opened with O_DIRECT take the guest pages
+                      straight when aligned, or the bounce buffer.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file
+                      uint64_t          : Offset within the file
+                      int               : 1 to write the file from
+                                          guest memory, 0 to read it
+*********************************************************************/
+static int nvme_sg_rw(NVMEState *n, NVMEBackingFile *bf, uint64_t offset,
+    int is_write)
+{
+    ScatterGatherEntry *sg;
+    int i, ret;
+
+    if (bf->direct_fd >= 0) {
+        if (!nvme_direct_aligned(n, bf, offset)) {
+            ret = nvme_direct_bounce(n, bf, offset, is_write);
+        } else if (n->worker_req == NULL) {
+            ret = nvme_direct_rw(n, bf, offset, is_write);
+        } else {
+            /* The transfers of the workers or io_uring go direct */
+            ret = NVME_DIRECT_FALLBACK;
+        }
+        if (ret != NVME_DIRECT_FALLBACK) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < n->qsg.nsg; i++) {
+        sg = &n->qsg.sg[i];
+        if (sg->base != NVME_SGL_BIT_BUCKET_ADDR &&
+            nvme_backing_rw(n, bf, offset, sg->base, sg->len, is_write)) {
+            return FAIL;
+        }
+        offset += sg->len;
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_sg_range_rw
+    Description  :    Transfers a byte range of the data described by
+                      n->qsg between guest memory and a backing file,
+                      skipping the file data of bit buckets
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file
+                      uint64_t          : Offset of the data in the file
+                      uint64_t          : Start of the range in the data
+                      uint64_t          : End of the range in the data
+                      int               : 1 to write the file from
+                                          guest memory, 0 to read it
+*********************************************************************/
+int nvme_sg_range_rw(NVMEState *n, NVMEBackingFile *bf, uint64_t offset,
+    uint64_t start, uint64_t end, int is_write)
+{
+    ScatterGatherEntry *sg;
+    uint64_t sg_pos, from, to;
+    int i;
+
+    for (i = 0, sg_pos = 0; i < n->qsg.nsg && sg_pos < end; i++) {
+        sg = &n->qsg.sg[i];
+        from = MAX(start, sg_pos);
+        to = MIN(end, sg_pos + sg->len);
+        if (from < to && sg->base != NVME_SGL_BIT_BUCKET_ADDR &&
+            nvme_backing_rw(n, bf, offset + from,
+                sg->base + (from - sg_pos), to - from, is_write)) {
+            return FAIL;
+        }
+        sg_pos += sg->len;
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_is_zero
+    Description  :    Tells whether a buffer only holds zeroes,
+                      checking 64 bytes at a time with SSE2 where
+                      available. Stops at the first non-zero byte.
+    Return Type  :    int (1 if all zero)
+
+    Arguments    :    const uint8_t * : Buffer
+                      uint64_t        : Length in bytes
+*********************************************************************/
+static int nvme_is_zero(const uint8_t *p, uint64_t len)
+{
+    while (len && ((uintptr_t)p & 15)) {
+        if (*p) {
+            return 0;
+        }
+        p++;
+        len--;
+    }
+#ifdef __SSE2__
+    for (; len >= 64; p += 64, len -= 64) {
+        const __m128i *v = (const __m128i *)p;
+        __m128i t = _mm_or_si128(_mm_or_si128(v[0], v[1]),
+            _mm_or_si128(v[2], v[3]));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_setzero_si128())) !=
+            0xffff) {
+            return 0;
+        }
+    }
+#else
+    for (; len >= 4 * sizeof(long); p += 4 * sizeof(long),
+            len -= 4 * sizeof(long)) {
+        const long *d = (const long *)p;
+
+        if (d[0] | d[1] | d[2] | d[3]) {
+            return 0;
+        }
+    }
+#endif
+    while (len) {
+        if (*p) {
+            return 0;
+        }
+        p++;
+        len--;
+    }
+    return 1;
+}
+
+/*********************************************************************
+    Function     :    nvme_zero_scan
+    Description  :    Finds the blocks of a write whose data in guest
+                      memory is all zero, setting their bits in
+                      n->zero_map
+    Return Type  :    int (1 if any block is all zero)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Logical block size
+                      uint32_t    : Number of logical blocks
+*********************************************************************/
+static int nvme_zero_scan(NVMEState *n, uint32_t blk_sz, uint32_t nlb)
+{
+    ScatterGatherEntry *sg;
+    target_phys_addr_t plen;
+    uint64_t done, chunk, pos = 0;
+    uint32_t lba = 0;
+    int zero = 1, found = 0, i;
+    uint8_t *p;
+
+    bitmap_zero(n->zero_map, nlb);
+    for (i = 0; i < n->qsg.nsg; i++) {
+        sg = &n->qsg.sg[i];
+        plen = sg->len;
+        p = cpu_physical_memory_map(sg->base, &plen, 0);
+        if (p == NULL || plen != sg->len) {
+            /* Not guest RAM, written as it is */
+            if (p) {
+                cpu_physical_memory_unmap(p, plen, 0, 0);
+            }
+            return 0;
+        }
+        for (done = 0; done < sg->len; done += chunk) {
+            chunk = MIN(sg->len - done, blk_sz - pos);
+            if (zero && !nvme_is_zero(p + done, chunk)) {
+                zero = 0;
+            }
+            pos += chunk;
+            if (pos == blk_sz) {
+                if (zero) {
+                    set_bit(lba, n->zero_map);
+                    found = 1;
+                }
+                lba++;
+                pos = 0;
+                zero = 1;
+            }
+        }
+        cpu_physical_memory_unmap(p, plen, 0, 0);
+    }
+    return found;
+}
+
+/*********************************************************************
+    Function     :    nvme_zero_write
+    Description  :    Writes the blocks of a write that hold data,
+                      and deallocates the range of the backing file
+                      of those found all zero by nvme_zero_scan()
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file
+                      uint64_t          : Offset within the file
+                      uint32_t          : Logical block size
+                      uint32_t          : Number of logical blocks
+*********************************************************************/
+static int nvme_zero_write(NVMEState *n, NVMEBackingFile *bf,
+    uint64_t offset, uint32_t blk_sz, uint32_t nlb)
+{
+    uint32_t lba = 0, next;
+
+    while (lba < nlb) {
+        if (test_bit(lba, n->zero_map)) {
+            next = find_next_zero_bit(n->zero_map, nlb, lba);
+            nvme_backing_zero(bf, offset + (uint64_t)lba * blk_sz,
+                (uint64_t)(next - lba) * blk_sz);
+            lba = next;
+            continue;
+        }
+        next = find_next_bit(n->zero_map, nlb, lba);
+        if (nvme_sg_range_rw(n, bf, offset, (uint64_t)lba * blk_sz,
+                (uint64_t)next * blk_sz, 1)) {
+            return FAIL;
+        }
+        lba = next;
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_zero_dealloc
+    Description  :    Drops the blocks written all zero from the
+                      namespace utilization
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+                      uint64_t    : Starting LBA of the write
+                      uint32_t    : Number of logical blocks
+*********************************************************************/
+static void nvme_zero_dealloc(NVMEState *n, DiskInfo *disk, uint64_t slba,
+    uint32_t nlb)
+{
+    uint32_t lba, next;
+
+    for (lba = find_next_bit(n->zero_map, nlb, 0); lba < nlb;
+            lba = find_next_bit(n->zero_map, nlb, next)) {
+        next = find_next_zero_bit(n->zero_map, nlb, lba);
+        dsm_dealloc(n, disk, slba + lba, next - lba);
+    }
 }
 
 /*********************************************************************
     Function     :    update_ns_util
     Description  :    Updates the Namespace Utilization
-                      of NVME disk
+                      of NVME disk, as every controller of the
+                      subsystem sharing it reports it
     Return Type  :    void
 
     Arguments    :    NVMEState * : Pointer to NVME device State
-                      struct NVME_rw * : NVME IO command
+                      DiskInfo *  : NVME disk
+                      uint64_t    : Starting LBA
+                      uint64_t    : Number of LBAs, 0's based
 *********************************************************************/
-static void update_ns_util(DiskInfo *disk, uint64_t slba, uint64_t nlb)
+static void update_ns_util(NVMEState *n, DiskInfo *disk, uint64_t slba,
+    uint64_t nlb)
 {
+    DiskInfo *d;
+    NVMEState *p;
     uint64_t index;
 
-    /* Update the namespace utilization */
-    for (index = slba; index <= nlb + slba; index++) {
-        if (!((disk->ns_util[index / 8]) & (1 << (index % 8)))) {
-            disk->ns_util[(index / 8)] |= (1 << (index % 8));
-            disk->idtfy_ns.nuse++;
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        d = &p->disk[disk->nsid - 1];
+        if (d->ns_util == NULL) {
+            continue;
+        }
+        /* Update the namespace utilization */
+        for (index = slba; index <= nlb + slba; index++) {
+            if (!((d->ns_util[index / 8]) & (1 << (index % 8)))) {
+                d->ns_util[(index / 8)] |= (1 << (index % 8));
+                d->idtfy_ns.nuse++;
+            }
         }
     }
 }
@@ -161,7 +808,7 @@ static void nvme_update_stats(NVMEState *n, DiskInfo *disk, uint8_t opcode,
     if (opcode == NVME_CMD_WRITE) {
         uint64_t old_use = disk->idtfy_ns.nuse;
 
-        update_ns_util(disk, slba, nlb);
+        update_ns_util(n, disk, slba, nlb);
 
         /* check if there needs to be an event issued */
         if (old_use != disk->idtfy_ns.nuse && !disk->thresh_warn_issued &&
@@ -198,6 +845,149 @@ static void nvme_update_stats(NVMEState *n, DiskInfo *disk, uint8_t opcode,
     }
 }
 
+/* Access frequencies telling the data is not read again soon */
+static int nvme_dsm_af_drop(uint8_t af)
+{
+    return af == NVME_DSM_AF_INFREQ_WRITE_READ ||
+        af == NVME_DSM_AF_INFREQ_READ || af == NVME_DSM_AF_ONE_TIME_READ;
+}
+
+/*********************************************************************
+    Function     :    nvme_stream_drop
+    Description  :    Drops from the host page cache the data a stream
+                      hinted as not accessed again went past. Dirty
+                      pages are written back first and pages still
+                      mapped by Qemu stay, the advice is best effort.
+    Return Type  :    void
+
+    Arguments    :    DiskInfo *   : Pointer to disk info
+                      NVMEStream * : Stream
+                      uint64_t     : Data file offset to drop up to
+*********************************************************************/
+static void nvme_stream_drop(DiskInfo *disk, NVMEStream *s, uint64_t end)
+{
+    if (s->drop && end > s->behind) {
+        posix_fadvise(disk->data.fd, s->behind, end - s->behind,
+            POSIX_FADV_DONTNEED);
+    }
+    s->behind = end;
+}
+
+/*********************************************************************
+    Function     :    nvme_stream_advise
+    Description  :    Finds the sequential stream a read or write
+                      continues, or starts a new one, and advises the
+                      host about the data file accordingly: reads of
+                      a sequential stream (seen, or hinted by the DSM
+                      field) are read ahead in a window that grows up
+                      to readahead_kb, and streams hinted as not
+                      accessed again are dropped behind.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo  * : Pointer to disk info
+                      NVME_rw   * : Read or write command
+                      uint64_t    : Data file offset of the command
+                      uint64_t    : Data length in bytes
+*********************************************************************/
+static void nvme_stream_advise(NVMEState *n, DiskInfo *disk, NVME_rw *e,
+    uint64_t offset, uint64_t len)
+{
+    uint8_t dsm = ((NVMECmdRead *)e)->dsm;
+    uint8_t af = dsm & NVME_RW_DSM_AF_MASK;
+    uint8_t is_write = e->opcode != NVME_CMD_READ;
+    uint64_t ra_max = (uint64_t)n->readahead_kb * 1024;
+    uint64_t end = offset + len;
+    NVMEStream *s, *lru = NULL;
+    int i;
+
+    if (n->readahead_kb == 0) {
+        return;
+    }
+    for (i = 0; i < NVME_STREAMS; i++) {
+        s = &disk->streams[i];
+        if (s->cmds && s->is_write == is_write && s->next_lba == e->slba) {
+            break;
+        }
+        if (lru == NULL || s->last_use < lru->last_use) {
+            lru = s;
+        }
+    }
+    if (i == NVME_STREAMS) {
+        /* Start a new stream in place of the least recently used one,
+         * whose hinted data is not followed by anything else now */
+        s = lru;
+        if (s->cmds) {
+            nvme_stream_drop(disk, s, s->end);
+        }
+        s->is_write = is_write;
+        s->cmds = 0;
+        s->behind = offset;
+        s->ra_end = end;
+        s->ra_size = MIN(NVME_STREAM_RA_MIN, ra_max);
+    } else {
+        /* The previous commands may still be in flight, but the data
+         * they went past is not */
+        nvme_stream_drop(disk, s, offset);
+    }
+    s->cmds++;
+    s->next_lba = e->slba + e->nlb + 1;
+    s->end = end;
+    s->drop = nvme_dsm_af_drop(af);
+    s->last_use = ++disk->stream_clock;
+
+    if (is_write || (s->cmds < NVME_STREAM_SEQ_CMDS &&
+            !(dsm & NVME_RW_DSM_SEQ_REQ) &&
+            af != NVME_DSM_AF_SPECULATIVE_READ)) {
+        return;
+    }
+    /* Keep up to ra_size bytes read ahead of the stream, topped up when
+     * half of it has been read */
+    if (s->ra_end < end) {
+        s->ra_end = end;
+    }
+    if (s->ra_end - end <= s->ra_size / 2) {
+        posix_fadvise(disk->data.fd, s->ra_end, end + s->ra_size - s->ra_end,
+            POSIX_FADV_WILLNEED);
+        s->ra_end = end + s->ra_size;
+        s->ra_size = MIN((uint64_t)s->ra_size * 2, ra_max);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_stream_dsm_advise
+    Description  :    Advises the host about the data file from the
+                      context attributes of a dataset management range:
+                      ranges to be read sequentially, speculatively or
+                      as an integral dataset are read ahead (at most
+                      readahead_kb of them), ranges not accessed again
+                      soon are dropped from the page cache.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo  * : Pointer to disk info
+                      RangeDef  * : Range definition
+                      uint32_t    : Attributes of the command (CDW11)
+*********************************************************************/
+static void nvme_stream_dsm_advise(NVMEState *n, DiskInfo *disk,
+    RangeDef *r, uint32_t attr)
+{
+    uint32_t blk_sz = NVME_BLOCK_SIZE(
+        disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas & 0xf].lbads);
+    uint64_t offset = r->slba * blk_sz, len = (uint64_t)r->length * blk_sz;
+
+    if (n->readahead_kb == 0 || r->slba + r->length > disk->idtfy_ns.ncap) {
+        return;
+    }
+    if (r->ctxAttrib.SR || r->ctxAttrib.AF == NVME_DSM_AF_SPECULATIVE_READ ||
+            (attr & MASK_IDR)) {
+        posix_fadvise(disk->data.fd, offset,
+            MIN(len, (uint64_t)n->readahead_kb * 1024), POSIX_FADV_WILLNEED);
+    } else if (nvme_dsm_af_drop(r->ctxAttrib.AF)) {
+        posix_fadvise(disk->data.fd, offset, len, POSIX_FADV_DONTNEED);
+    }
+}
+
 /*********************************************************************
     Function     :    nvme_io_command
     Description  :    NVME Read or write cmd processing.
@@ -214,10 +1004,13 @@ uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     uint8_t res = FAIL;
     uint64_t data_size, file_offset;
-    uint8_t *mapping_addr;
     uint32_t nvme_blk_sz;
     DiskInfo *disk;
     uint8_t lba_idx;
+    /* Zone Append writes too */
+    int is_write = e->opcode != NVME_CMD_READ;
+    int zeroes, cow = 0, jslot = -1;
+    unsigned int ms = 0;
 
     sf->sc = NVME_SC_SUCCESS;
     LOG_DBG("%s(): called", __func__);
@@ -252,6 +1045,7 @@ uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
         data_size += (disk->idtfy_ns.lbafx[lba_idx].ms * (e->nlb + 1));
     }
 
+    /* MDTS is in units of the minimum page size, whatever CC.MPS is */
     if (n->idtfy_ctrl->mdts && data_size > PAGE_SIZE *
                 (1 << (n->idtfy_ctrl->mdts))) {
         LOG_ERR("%s(): data size:%ld exceeds max:%ld", __func__,
@@ -260,93 +1054,100 @@ uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
         return FAIL;
     }
 
-    file_offset = e->slba * nvme_blk_sz;
-    mapping_addr = disk->mapping_addr;
-
     /* Namespace not ready */
-    if (mapping_addr == NULL) {
+    if (!nvme_storage_ready(disk)) {
         LOG_NORM("%s():Namespace not ready", __func__);
         sf->sc = NVME_SC_NS_NOT_READY;
         return FAIL;
     }
 
-    /* Writing/Reading PRP1 */
-    res = do_rw_prp(n, e->prp1, &data_size, &file_offset, mapping_addr,
-        e->opcode);
-    if (res == FAIL) {
+    sf->sc = nvme_map_data(n, sqe, data_size, is_write);
+    if (sf->sc != NVME_SC_SUCCESS) {
+        LOG_NORM("%s(): bad data pointer, status 0x%x", __func__, sf->sc);
         return FAIL;
     }
-    if (data_size > 0) {
-        if (data_size <= PAGE_SIZE) {
-            res = do_rw_prp(n, e->prp2, &data_size, &file_offset, mapping_addr,
-                e->opcode);
+
+    /* Zone Append gets its LBA from the write pointer here */
+    if (disk->zone_count) {
+        if (e->opcode == NVME_CMD_ZONE_APPEND) {
+            res = nvme_zone_append(n, disk, e, cqe);
+        } else if (is_write) {
+            res = nvme_zone_write(n, disk, e->slba, e->nlb, sf);
         } else {
-            res = do_rw_prp_list(n, sqe, &data_size, &file_offset,
-                mapping_addr);
+            res = nvme_zone_read(disk, e->slba, e->nlb, sf);
         }
-        if (res == FAIL) {
+        if (res != SUCCESS) {
             return FAIL;
         }
     }
-
-    /* Spec states that non-zero meta data buffers shall be ignored, i.e. no
-     * error reported, when the DW4&5 (MPTR) field is not in use */
-    if ((e->mptr != 0) &&                /* if supplying separate meta buffer */
-        (disk->idtfy_ns.lbafx[lba_idx].ms != 0) &&       /* if using metadata */
-        ((disk->idtfy_ns.flbas & 0x10) == 0)) {   /* if using separate buffer */
-
-        /* Then go ahead and use the separate meta data buffer */
-        unsigned int ms, meta_offset, meta_size;
-        uint8_t *meta_mapping_addr;
-
+    file_offset = e->slba * nvme_blk_sz;
+    /* Separate meta-data, ignored when MPTR is not in use as the spec
+     * states for non-zero meta data buffers */
+    if ((e->mptr != 0) &&
+        ((disk->idtfy_ns.flbas & 0x10) == 0)) {
         ms = disk->idtfy_ns.lbafx[lba_idx].ms;
-        meta_offset = e->slba * ms;
-        meta_size = (e->nlb + 1) * ms;
-        meta_mapping_addr = disk->meta_mapping_addr + meta_offset;
+    }
 
-        if (e->opcode == NVME_CMD_READ) {
-            nvme_dma_mem_write(e->mptr, meta_mapping_addr, meta_size);
-        } else if (e->opcode == NVME_CMD_WRITE) {
-            nvme_dma_mem_read(e->mptr, meta_mapping_addr, meta_size);
+    /* Kept whole across a power fail from here on */
+    if (nvme_journal_wanted(n, sqe)) {
+        jslot = nvme_journal_stage(n, disk, e, file_offset, e->slba * ms,
+            (e->nlb + 1) * ms);
+        if (jslot < 0) {
+            sf->sc = NVME_SC_INTERNAL;
+            return FAIL;
         }
     }
 
-    nvme_update_stats(n, disk, e->opcode, e->slba, e->nlb);
-    return res;
-}
-
-/*********************************************************************
-    Function     :    read_dsm_ranges
-    Description  :    Read range definition data buffer specified
-                      in cmd through prp1 and prp2.
+    nvme_stream_advise(n, disk, e, file_offset, data_size);
+    /* All-zero blocks are deallocated rather than written, not with
+     * meta-data interleaved */
+    zeroes = n->zero_map && e->opcode == NVME_CMD_WRITE &&
+        !(disk->idtfy_ns.flbas & 0x10) &&
+        nvme_zero_scan(n, nvme_blk_sz, e->nlb + 1);
+    if (!is_write && disk->cow_map) {
+        cow = nvme_cow_read(n, disk, file_offset, e->slba, e->nlb + 1,
+            nvme_blk_sz);
+    }
+    if (zeroes) {
+        res = nvme_zero_write(n, &disk->data, file_offset, nvme_blk_sz,
+            e->nlb + 1);
+    } else if (cow == 0) {
+        res = nvme_sg_rw(n, &disk->data, file_offset, is_write);
+    } else {
+        res = cow < 0 ? FAIL : SUCCESS;
+    }
 
-    Return Type  :    uint8_t
-
-    Arguments    :    uint64_t    : PRP1
-                      uint64_t    : PRP2
-                      uint8_t   * : Pointer to target buffer location
-                      uint64_t  * : total data to be copied to target
-                                    buffer
-*********************************************************************/
-static uint8_t read_dsm_ranges(uint64_t range_prp1, uint64_t range_prp2,
-    uint8_t *buffer_addr, uint64_t *data_size_p)
-{
-    uint64_t data_len;
-
-    /* Data Len to be written per page basis */
-    data_len = PAGE_SIZE - (range_prp1 % PAGE_SIZE);
-    if (data_len > *data_size_p) {
-        data_len = *data_size_p;
+    if (ms && res == SUCCESS && nvme_backing_rw(n, &disk->meta,
+            e->slba * ms, e->mptr, (e->nlb + 1) * ms, is_write)) {
+        res = FAIL;
     }
-
-    nvme_dma_mem_read(range_prp1, buffer_addr, data_len);
-    *data_size_p = *data_size_p - data_len;
-    if (*data_size_p) {
-        buffer_addr = buffer_addr + data_len;
-        nvme_dma_mem_read(range_prp2, buffer_addr, *data_size_p);
+    if (jslot >= 0) {
+        if (n->worker_req && n->worker_req->nxfer) {
+            /* Applied once the worker is done with the transfers */
+            n->worker_req->jslot = jslot + 1;
+        } else {
+            nvme_journal_applied(disk, jslot);
+        }
+    }
+    if (res != SUCCESS) {
+        /* Whatever was transferred stays, as a device failing midway
+         * leaves it */
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
     }
 
-    return NVME_SC_SUCCESS;
+    nvme_update_stats(n, disk, is_write ? NVME_CMD_WRITE : NVME_CMD_READ,
+        e->slba, e->nlb);
+    if (is_write && disk->ftl) {
+        nvme_ftl_write(n, disk, e->slba, e->nlb + 1);
+    }
+    if (zeroes) {
+        nvme_zero_dealloc(n, disk, e->slba, e->nlb + 1);
+    }
+    if (is_write && disk->cow_map) {
+        nvme_cow_written(disk, e->slba, e->nlb + 1);
+    }
+    return res;
 }
 
 /*********************************************************************
@@ -355,22 +1156,36 @@ static uint8_t read_dsm_ranges(uint64_t range_prp1, uint64_t range_prp2,
 
     Return Type  :    void
 
-    Arguments    :    DiskInfo * : Pointer to NVME device State
-                      uint64_t   : Starting LBA
-                      uint64_t   : number of LBAs
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : Pointer to NVME disk
+                      uint64_t    : Starting LBA
+                      uint64_t    : number of LBAs
 *********************************************************************/
-static void dsm_dealloc(DiskInfo *disk, uint64_t slba, uint64_t nlb)
+static void dsm_dealloc(NVMEState *n, DiskInfo *disk, uint64_t slba,
+    uint64_t nlb)
 {
+    DiskInfo *d;
+    NVMEState *p;
     uint64_t index;
 
-    /* Update the namespace utilization and reset the bit positions */
-    for (index = slba; index < (nlb + slba); index++) {
-        if ((disk->ns_util[index / 8]) & (1 << (index % 8))) {
-            disk->ns_util[(index / 8)] ^= (1 << (index % 8));
-            assert(disk->idtfy_ns.nuse > 0);
-            disk->idtfy_ns.nuse--;
+    /* Update the namespace utilization and reset the bit positions, on
+     * every controller sharing the namespace */
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        d = &p->disk[disk->nsid - 1];
+        if (d->ns_util == NULL) {
+            continue;
+        }
+        for (index = slba; index < (nlb + slba); index++) {
+            if ((d->ns_util[index / 8]) & (1 << (index % 8))) {
+                d->ns_util[(index / 8)] ^= (1 << (index % 8));
+                assert(d->idtfy_ns.nuse > 0);
+                d->idtfy_ns.nuse--;
+            }
         }
     }
+    if (disk->ftl) {
+        nvme_ftl_trim(disk, slba, nlb);
+    }
 }
 
 /*********************************************************************
@@ -397,11 +1212,20 @@ uint8_t nvme_dsm_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
     sf->sc = NVME_SC_SUCCESS;
 
     disk = &n->disk[sqe->nsid - 1];
+    if (!nvme_storage_ready(disk)) {
+        LOG_NORM("%s():Namespace not ready", __func__);
+        sf->sc = NVME_SC_NS_NOT_READY;
+        return FAIL;
+    }
     nr = (sqe->cdw10 & 0xFF) + 1; /* Convert num ranges to 1-based value */
     buff_size = nr * sizeof(RangeDef);
     assert(buff_size <= PAGE_SIZE);
 
-    read_dsm_ranges(sqe->prp1, sqe->prp2, range_buff, &buff_size);
+    sf->sc = nvme_cmd_data_rw(n, sqe, range_buff, buff_size, 0);
+    if (sf->sc != NVME_SC_SUCCESS) {
+        LOG_NORM("%s(): bad data pointer, status 0x%x", __func__, sf->sc);
+        return FAIL;
+    }
 
     LOG_NORM("Processing ranges %d, attribute %d", nr, sqe->cdw11);
     /* Process dsm cmd for attribute deallocate. */
@@ -418,8 +1242,140 @@ uint8_t nvme_dsm_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
             }
             LOG_NORM("DSM deallocate cmd for Range #%d, slba = %ld, nlb = %ld",
                 i, slba, nlb);
-            dsm_dealloc(disk, slba, nlb);
+            dsm_dealloc(n, disk, slba, nlb);
+        }
+    } else {
+        for (i = 0; i < nr; i++, range_defs++) {
+            nvme_stream_dsm_advise(n, disk, range_defs, sqe->cdw11);
+        }
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_copy_command
+    Description  :    Copy command: copies the source ranges, one after
+                      the other, to the destination LBA within the
+                      namespace, along with their separate meta-data.
+                      The data never goes through guest memory.
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd   * : Pointer to SQ cmd
+                      NVMECQE   * : Pointer to CQ completion entries
+*********************************************************************/
+uint8_t nvme_copy_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
+{
+    NVMECmdCopy *c = (NVMECmdCopy *)sqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint8_t range_buff[PAGE_SIZE];
+    NVMECopyRange *ranges = (NVMECopyRange *)range_buff;
+    uint64_t dlba, nlb, total = 0;
+    uint32_t blk_sz, lba_sz, ms;
+    DiskInfo *disk;
+    uint8_t lba_idx;
+    int i;
+
+    LOG_DBG("%s(): called", __func__);
+    sf->sc = NVME_SC_SUCCESS;
+
+    disk = &n->disk[sqe->nsid - 1];
+    if (!nvme_storage_ready(disk)) {
+        LOG_NORM("%s():Namespace not ready", __func__);
+        sf->sc = NVME_SC_NS_NOT_READY;
+        return FAIL;
+    }
+    if (c->desfmt != 0) {
+        LOG_NORM("%s(): unsupported descriptor format %d", __func__,
+            c->desfmt);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    if (c->nr > disk->idtfy_ns.msrc) {
+        LOG_NORM("%s(): %d ranges exceed MSRC", __func__, c->nr + 1);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_CMD_NVM_ERR_SIZE_LIMIT;
+        return FAIL;
+    }
+
+    sf->sc = nvme_cmd_data_rw(n, sqe, range_buff,
+        (c->nr + 1) * sizeof(NVMECopyRange), 0);
+    if (sf->sc != NVME_SC_SUCCESS) {
+        LOG_NORM("%s(): bad data pointer, status 0x%x", __func__, sf->sc);
+        return FAIL;
+    }
+    for (i = 0; i <= c->nr; i++) {
+        nlb = ranges[i].nlb + 1;
+        if (nlb > disk->idtfy_ns.mssrl) {
+            LOG_NORM("%s(): range #%d exceeds MSSRL", __func__, i);
+            sf->sct = NVME_SCT_CMD_SPEC_ERR;
+            sf->sc = NVME_CMD_NVM_ERR_SIZE_LIMIT;
+            return FAIL;
+        }
+        if (ranges[i].slba + nlb > disk->idtfy_ns.ncap) {
+            LOG_NORM("%s(): range #%d out of range", __func__, i);
+            sf->sc = NVME_SC_LBA_RANGE;
+            return FAIL;
         }
+        total += nlb;
+    }
+    if (total > disk->idtfy_ns.mcl) {
+        LOG_NORM("%s(): %lu blocks exceed MCL", __func__, total);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_CMD_NVM_ERR_SIZE_LIMIT;
+        return FAIL;
+    }
+    if (c->sdlba + total > disk->idtfy_ns.ncap) {
+        LOG_NORM("%s(): destination out of range", __func__);
+        sf->sc = NVME_SC_LBA_RANGE;
+        return FAIL;
+    }
+    if (disk->zone_count) {
+        /* Sources may span zones, the destination is one sequential
+         * write */
+        for (i = 0; i <= c->nr; i++) {
+            if (nvme_zone_read(disk, ranges[i].slba, ranges[i].nlb, sf)) {
+                return FAIL;
+            }
+        }
+        if (nvme_zone_write(n, disk, c->sdlba, total - 1, sf)) {
+            return FAIL;
+        }
+    }
+
+    /* Same layout of the backing files as for reads and writes */
+    lba_idx = disk->idtfy_ns.flbas & 0xf;
+    blk_sz = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+    ms = disk->idtfy_ns.lbafx[lba_idx].ms;
+    lba_sz = blk_sz + ((disk->idtfy_ns.flbas & 0x10) ? ms : 0);
+
+    dlba = c->sdlba;
+    for (i = 0; i <= c->nr; i++) {
+        nlb = ranges[i].nlb + 1;
+        /* Sources still in the base image of a clone come up first */
+        if (disk->cow_map && nvme_cow_fill(disk, ranges[i].slba, nlb)) {
+            sf->sc = NVME_SC_INTERNAL;
+            return FAIL;
+        }
+        if (nvme_backing_copy(&disk->data, ranges[i].slba * blk_sz,
+                dlba * blk_sz, nlb * lba_sz)) {
+            sf->sc = NVME_SC_INTERNAL;
+            return FAIL;
+        }
+        if (ms != 0 && (disk->idtfy_ns.flbas & 0x10) == 0 &&
+                nvme_backing_copy(&disk->meta, ranges[i].slba * ms,
+                dlba * ms, nlb * ms)) {
+            sf->sc = NVME_SC_INTERNAL;
+            return FAIL;
+        }
+        update_ns_util(n, disk, dlba, nlb - 1);
+        if (disk->cow_map) {
+            nvme_cow_written(disk, dlba, nlb);
+        }
+        if (disk->ftl) {
+            nvme_ftl_write(n, disk, dlba, nlb);
+        }
+        dlba += nlb;
     }
     return SUCCESS;
 }
@@ -439,17 +1395,45 @@ uint8_t nvme_command_set(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
 
     /* As of NVMe spec rev 1.0b "All NVM cmds use the CMD.DW1 (NSID) field".
-     * Thus all NVM cmd set cmds must check for illegal namespaces up front */
-    if (sqe->nsid == 0 || (sqe->nsid > n->idtfy_ctrl->nn)) {
+     * Thus all NVM cmd set cmds must check for illegal namespaces up front,
+     * only the attached ones being active */
+    if (sqe->nsid == 0 || (sqe->nsid > n->idtfy_ctrl->nn) ||
+        !n->disk[sqe->nsid - 1].attached) {
         LOG_NORM("%s(): Invalid nsid:%u", __func__, sqe->nsid);
         sf->sc = NVME_SC_INVALID_NAMESPACE;
         return FAIL;
     }
+    if (nvme_resv_conflict(n, sqe->nsid, sqe->opcode)) {
+        LOG_NORM("%s(): opcode:0x%02x nsid:%u reserved", __func__,
+            sqe->opcode, sqe->nsid);
+        sf->sc = NVME_SC_RESERVATION_CONFLICT;
+        return FAIL;
+    }
 
     if (sqe->opcode == NVME_CMD_READ || (sqe->opcode == NVME_CMD_WRITE)){
         return nvme_io_command(n, sqe, cqe);
     } else if (sqe->opcode == NVME_CMD_DSM) {
         return nvme_dsm_command(n, sqe, cqe);
+    } else if (sqe->opcode == NVME_CMD_COPY) {
+        return nvme_copy_command(n, sqe, cqe);
+    } else if (n->disk[sqe->nsid - 1].zone_count &&
+            sqe->opcode == NVME_CMD_ZONE_APPEND) {
+        return nvme_io_command(n, sqe, cqe);
+    } else if (n->disk[sqe->nsid - 1].zone_count &&
+            (sqe->opcode == NVME_CMD_ZONE_MGMT_SEND ||
+            sqe->opcode == NVME_CMD_ZONE_MGMT_RECV)) {
+        if (!nvme_storage_ready(&n->disk[sqe->nsid - 1])) {
+            sf->sc = NVME_SC_NS_NOT_READY;
+            return FAIL;
+        }
+        return sqe->opcode == NVME_CMD_ZONE_MGMT_SEND ?
+            nvme_zone_mgmt_send(n, sqe, cqe) :
+            nvme_zone_mgmt_recv(n, sqe, cqe);
+    } else if (sqe->opcode == NVME_CMD_RESV_REGISTER ||
+            sqe->opcode == NVME_CMD_RESV_REPORT ||
+            sqe->opcode == NVME_CMD_RESV_ACQUIRE ||
+            sqe->opcode == NVME_CMD_RESV_RELEASE) {
+        return nvme_resv_command(n, sqe, cqe);
     } else if (sqe->opcode == NVME_CMD_FLUSH) {
         return NVME_SC_SUCCESS;
     } else {
@@ -459,218 +1443,1603 @@ uint8_t nvme_command_set(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
     }
 }
 /*********************************************************************
-    Function     :    nvme_create_meta_disk
-    Description  :    Creates a meta disk and sets the mapping address
-
-    Return Type  :    int
+    Function     :    nvme_backing_init
+    Description  :    Resets a backing file descriptor to the closed,
+                      unmapped state
+    Return Type  :    void
 
-    Arguments    :    uint32_t *   : Instance number of the nvme device
-                      uint32_t *   : Namespace id
-                      DiskInfo *   : NVME disk to create storage for
+    Arguments    :    NVMEBackingFile * : Backing file to reset
 *********************************************************************/
-static int nvme_create_meta_disk(uint32_t instance, uint32_t nsid,
-    DiskInfo *disk)
+void nvme_backing_init(NVMEBackingFile *bf)
 {
-    uint32_t ms;
+    memset(bf, 0, sizeof(*bf));
+    bf->fd = -1;
+    bf->direct_fd = -1;
+}
 
-    ms = disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas].ms;
-    if (ms != 0 && !(disk->idtfy_ns.flbas & 0x10)) {
-        char str[64];
-        uint64_t blks, msize;
+/*********************************************************************
+    Function     :    nvme_backing_unmap_all
+    Description  :    Drops every window mapped for a backing file
+    Return Type  :    void
 
-        snprintf(str, sizeof(str), "nvme_meta%d_n%d.img", instance, nsid);
-        blks = disk->idtfy_ns.ncap;
-        msize = blks * ms;
+    Arguments    :    NVMEBackingFile * : Backing file
+*********************************************************************/
+static void nvme_backing_unmap_all(NVMEBackingFile *bf)
+{
+    int i;
 
-        disk->mfd = open(str, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-        if (disk->mfd < 0) {
-            LOG_ERR("Error while creating the meta-storage");
-            return FAIL;
-        }
-        if (posix_fallocate(disk->mfd, 0, msize) != 0) {
-            LOG_ERR("Error while allocating meta-data space for namespace");
-            return FAIL;
-        }
-        disk->meta_mapping_addr = mmap(NULL, msize, PROT_READ | PROT_WRITE,
-            MAP_SHARED, disk->mfd, 0);
-        if (disk->meta_mapping_addr == NULL) {
-            LOG_ERR("Error while opening namespace meta-data: %d", disk->nsid);
-            return FAIL;
+    for (i = 0; i < NVME_MAP_WINDOWS; i++) {
+        if (bf->win[i].addr != NULL) {
+            munmap(bf->win[i].addr, bf->win[i].len);
+            bf->win[i].addr = NULL;
         }
-        disk->meta_mapping_size = msize;
-        memset(disk->meta_mapping_addr, 0xff, msize);
-    } else {
-        disk->meta_mapping_addr = NULL;
-        disk->meta_mapping_size = 0;
     }
-    return SUCCESS;
+    bf->last = NULL;
 }
 
 /*********************************************************************
-    Function     :    nvme_create_storage_disk
-    Description  :    Creates a NVME Storage Disk and the
-                      namespaces within
-    Return Type  :    int (0:1 Success:Failure)
-
-    Arguments    :    uint32_t : instance number of the nvme device
-                      uint32_t : namespace id
-                      DiskInfo * : NVME disk to create storage for
+    Function     :    nvme_backing_map
+    Description  :    Returns a host pointer for the given offset in
+                      the backing file, mapping its window if needed.
+                      The least recently used window is evicted when
+                      all slots are busy. The pointer stays valid until
+                      the next call for the same file.
+    Return Type  :    uint8_t * (NULL on failure)
+
+    Arguments    :    NVMEBackingFile * : Backing file
+                      uint64_t   : Offset within the file
+                      uint64_t * : In: bytes wanted, Out: bytes usable
+                                   from the returned pointer
 *********************************************************************/
-int nvme_create_storage_disk(uint32_t instance, uint32_t nsid, DiskInfo *disk,
-    NVMEState *n)
+uint8_t *nvme_backing_map(NVMEBackingFile *bf, uint64_t offset, uint64_t *len)
 {
-    uint32_t blksize, lba_idx;
-    uint64_t size, blks;
-    char str[64];
-
-    snprintf(str, sizeof(str), "nvme_disk%d_n%d.img", instance, nsid);
-    disk->nsid = nsid;
+    NVMEMapWindow *w = bf->last;
+    uint64_t index = offset >> NVME_MAP_WINDOW_SHIFT;
+    uint64_t base, avail;
+    int i;
 
-    disk->fd = open(str, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (disk->fd < 0) {
-        LOG_ERR("Error while creating the storage");
-        return FAIL;
+    if (offset >= bf->size) {
+        return NULL;
     }
 
-    lba_idx = disk->idtfy_ns.flbas & 0xf;
-    blks = disk->idtfy_ns.ncap;
-    blksize = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
-    size = blks * blksize;
-    if (disk->idtfy_ns.flbas & 0x10) {
-        /* extended lba */
-        size += (blks * disk->idtfy_ns.lbafx[lba_idx].ms);
-    }
+    if (w == NULL || w->addr == NULL || w->index != index) {
+        NVMEMapWindow *victim = &bf->win[0];
 
-    if (size == 0) {
-        return SUCCESS;
+        w = NULL;
+        for (i = 0; i < NVME_MAP_WINDOWS; i++) {
+            if (bf->win[i].addr != NULL && bf->win[i].index == index) {
+                w = &bf->win[i];
+                break;
+            }
+            if (bf->win[i].addr == NULL || (victim->addr != NULL &&
+                bf->win[i].last_use < victim->last_use)) {
+                victim = &bf->win[i];
+            }
+        }
+        if (w == NULL) {
+            w = victim;
+            if (w->addr != NULL) {
+                munmap(w->addr, w->len);
+                w->addr = NULL;
+            }
+            base = index << NVME_MAP_WINDOW_SHIFT;
+            w->len = min(NVME_MAP_WINDOW_SIZE, bf->size - base);
+            w->addr = mmap(NULL, w->len, PROT_READ |
+                (bf->read_only ? 0 : PROT_WRITE), MAP_SHARED, bf->fd, base);
+            if (w->addr == MAP_FAILED) {
+                LOG_ERR("Error mapping window %lu of backing file", index);
+                w->addr = NULL;
+                return NULL;
+            }
+            w->index = index;
+        }
+        bf->last = w;
     }
+    w->last_use = ++bf->use_clock;
 
-    if (posix_fallocate(disk->fd, 0, size) != 0) {
-        LOG_ERR("Error while allocating space for namespace");
-        return FAIL;
+    avail = w->len - (offset & (NVME_MAP_WINDOW_SIZE - 1));
+    if (*len > avail) {
+        *len = avail;
     }
+    return w->addr + (offset & (NVME_MAP_WINDOW_SIZE - 1));
+}
 
-    disk->mapping_addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
-        MAP_SHARED, disk->fd, 0);
-    if (disk->mapping_addr == NULL) {
-        LOG_ERR("Error while opening namespace: %d", disk->nsid);
-        return FAIL;
-    }
-    disk->mapping_size = size;
+/*********************************************************************
+    Function     :    nvme_backing_set_dirty
+    Description  :    Marks the chunks covering a written range so
+                      that a running migration sends them again
+    Return Type  :    void
 
-    if (nvme_create_meta_disk(instance, nsid, disk) != SUCCESS) {
-        return FAIL;
-    }
+    Arguments    :    NVMEBackingFile * : Backing file
+                      uint64_t          : Offset within the file
+                      uint64_t          : Length in bytes
+*********************************************************************/
+void nvme_backing_set_dirty(NVMEBackingFile *bf, uint64_t offset,
+    uint64_t len)
+{
+    uint64_t chunk, last;
 
-    disk->ns_util = qemu_mallocz((disk->idtfy_ns.nsze + 7) / 8);
-    if (disk->ns_util == NULL) {
-        LOG_ERR("Error while reallocating the ns_util");
-        return FAIL;
+    if (bf->dirty == NULL || len == 0) {
+        return;
     }
-    disk->thresh_warn_issued = 0;
+    last = (offset + len - 1) >> NVME_MIG_CHUNK_SHIFT;
+    for (chunk = offset >> NVME_MIG_CHUNK_SHIFT; chunk <= last; chunk++) {
+        if (!test_and_set_bit(chunk, bf->dirty)) {
+            bf->dirty_count++;
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_backing_rw
+    Description  :    Transfers data between guest memory and a
+                      backing file, window by window. With I/O
+                      workers the transfer is left to the worker
+                      of the request being processed.
+    Return Type  :    int (0:1 Success:Failure)
 
-    LOG_NORM("created disk storage, mapping_addr:%p size:%lu",
-        disk->mapping_addr, disk->mapping_size);
+    Arguments    :    NVMEState *        : Pointer to NVME device State
+                      NVMEBackingFile *  : Backing file
+                      uint64_t           : Offset within the file
+                      target_phys_addr_t : Guest address
+                      uint64_t           : Length in bytes
+                      int                : 1 to write the file from
+                                           guest memory, 0 to read it
+*********************************************************************/
+int nvme_backing_rw(NVMEState *n, NVMEBackingFile *bf, uint64_t offset,
+    target_phys_addr_t mem_addr, uint64_t len, int is_write)
+{
+    uint64_t chunk;
+    uint8_t *p;
 
+    if (n->worker_req) {
+        return nvme_worker_add_xfer(n, bf, offset, mem_addr, len, is_write);
+    }
+    while (len) {
+        chunk = len;
+        p = nvme_backing_map(bf, offset, &chunk);
+        if (p == NULL) {
+            LOG_ERR("Access beyond backing file: offset %lu", offset);
+            return FAIL;
+        }
+        if (is_write) {
+            nvme_dma_mem_read(n, mem_addr, p, chunk);
+            nvme_backing_set_dirty(bf, offset, chunk);
+        } else {
+            nvme_dma_mem_write(n, mem_addr, p, chunk);
+        }
+        offset += chunk;
+        mem_addr += chunk;
+        len -= chunk;
+    }
     return SUCCESS;
 }
 
 /*********************************************************************
-    Function     :    nvme_create_storage_disks
-    Description  :    Creates a NVME Storage Disks and the
-                      namespaces within
+    Function     :    nvme_fd_pio
+    Description  :    Reads or writes a file descriptor until the
+                      whole length is transferred
     Return Type  :    int (0:1 Success:Failure)
 
-    Arguments    :    NVMEState * : Pointer to NVME device State
+    Arguments    :    int       : File descriptor
+                      uint8_t * : Host buffer
+                      uint64_t  : Offset within the file
+                      uint64_t  : Length in bytes
+                      int       : 1 to write the file from the
+                                  buffer, 0 to read it
 *********************************************************************/
-int nvme_create_storage_disks(NVMEState *n)
+static int nvme_fd_pio(int fd, uint8_t *buf, uint64_t offset, uint64_t len,
+    int is_write)
 {
-    uint32_t i;
-    int ret = SUCCESS;
+    uint64_t done = 0;
+    ssize_t ret;
 
-    for (i = 0; i < n->num_namespaces; i++) {
-        ret = nvme_create_storage_disk(n->instance, i + 1, &n->disk[i], n);
+    while (done < len) {
+        if (is_write) {
+            ret = pwrite(fd, buf + done, len - done, offset + done);
+        } else {
+            ret = pread(fd, buf + done, len - done, offset + done);
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            LOG_ERR("Backing file %s failed at offset %lu: %s",
+                is_write ? "write" : "read", offset + done,
+                ret < 0 ? strerror(errno) : "end of file");
+            return FAIL;
+        }
+        done += ret;
     }
+    return SUCCESS;
+}
 
-    LOG_NORM("%s():Backing store created for instance %d", __func__,
-        n->instance);
+/*********************************************************************
+    Function     :    nvme_backing_pio
+    Description  :    Reads or writes a backing file through its file
+                      descriptor rather than the mapped windows
+    Return Type  :    int (0:1 Success:Failure)
 
-    return ret;
+    Arguments    :    NVMEBackingFile * : Backing file
+                      uint8_t *         : Host buffer
+                      uint64_t          : Offset within the file
+                      uint64_t          : Length in bytes
+                      int               : 1 to write the file from
+                                          the buffer, 0 to read it
+*********************************************************************/
+int nvme_backing_pio(NVMEBackingFile *bf, uint8_t *buf, uint64_t offset,
+    uint64_t len, int is_write)
+{
+    return nvme_fd_pio(bf->fd, buf, offset, len, is_write);
 }
 
 /*********************************************************************
-    Function     :    nvme_close_meta_disk
-    Description  :    Deletes NVME meta storage Disk
+    Function     :    nvme_backing_dio
+    Description  :    Reads or writes a backing file through its
+                      O_DIRECT descriptor, with the buffer, offset and
+                      length aligned
     Return Type  :    int (0:1 Success:Failure)
 
-    Arguments    :    DiskInfo * : Pointer to NVME disk
+    Arguments    :    NVMEBackingFile * : Backing file
+                      uint8_t *         : Host buffer
+                      uint64_t          : Offset within the file
+                      uint64_t          : Length in bytes
+                      int               : 1 to write the file from
+                                          the buffer, 0 to read it
 *********************************************************************/
-static int nvme_close_meta_disk(DiskInfo *disk)
+int nvme_backing_dio(NVMEBackingFile *bf, uint8_t *buf, uint64_t offset,
+    uint64_t len, int is_write)
 {
-    if (disk->meta_mapping_addr != NULL) {
-        if (munmap(disk->meta_mapping_addr, disk->meta_mapping_size) < 0) {
-            LOG_ERR("Error while closing meta namespace: %d", disk->nsid);
-            return FAIL;
-        } else {
-            disk->meta_mapping_addr = NULL;
-            disk->meta_mapping_size = 0;
-            if (close(disk->mfd) < 0) {
-                LOG_ERR("Unable to close the nvme disk");
-                return FAIL;
-            }
-        }
-    }
-    return SUCCESS;
+    return nvme_fd_pio(bf->direct_fd, buf, offset, len, is_write);
 }
 
 /*********************************************************************
-    Function     :    nvme_close_storage_disk
-    Description  :    Deletes NVME Storage Disk
+    Function     :    nvme_backing_direct_ok
+    Description  :    Checks whether a transfer can use the O_DIRECT
+                      descriptor of a backing file
+    Return Type  :    int (1 if it can)
+
+    Arguments    :    NVMEBackingFile * : Backing file
+                      uint64_t          : Offset within the file
+                      uint64_t          : Guest or host address
+                      uint64_t          : Length in bytes
+*********************************************************************/
+int nvme_backing_direct_ok(NVMEBackingFile *bf, uint64_t offset,
+    uint64_t addr, uint64_t len)
+{
+    return bf->direct_fd >= 0 &&
+        ((offset | addr | len) & (bf->direct_align - 1)) == 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_backing_copy
+    Description  :    Copies a range of a backing file to another
+                      offset of the same file in the host.
+                      copy_file_range() lets the filesystem share the
+                      blocks (reflink) or copy them in the kernel; what
+                      it does not copy, e.g. overlapping ranges, goes
+                      through a bounce buffer, backwards when the
+                      destination overlaps the end of the source.
     Return Type  :    int (0:1 Success:Failure)
 
-    Arguments    :    DiskInfo * : Pointer to NVME disk
+    Arguments    :    NVMEBackingFile * : Backing file
+                      uint64_t          : Source offset
+                      uint64_t          : Destination offset
+                      uint64_t          : Length in bytes
 *********************************************************************/
-int nvme_close_storage_disk(DiskInfo *disk)
+int nvme_backing_copy(NVMEBackingFile *bf, uint64_t src, uint64_t dst,
+    uint64_t len)
 {
-    if (disk->mapping_addr != NULL) {
-        if (munmap(disk->mapping_addr, disk->mapping_size) < 0) {
-            LOG_ERR("Error while closing namespace: %d", disk->nsid);
-            return FAIL;
-        } else {
-            disk->mapping_addr = NULL;
-            disk->mapping_size = 0;
-            if (close(disk->fd) < 0) {
-                LOG_ERR("Unable to close the nvme disk");
-                return FAIL;
+    int backwards = dst > src && dst < src + len;
+    uint64_t done = 0, chunk, off;
+    int ret = SUCCESS;
+    uint8_t *buf;
+
+    if (src == dst || len == 0) {
+        return SUCCESS;
+    }
+    nvme_backing_set_dirty(bf, dst, len);
+
+#ifdef CONFIG_COPY_FILE_RANGE
+    if (!backwards && !(src > dst && src < dst + len)) {
+        loff_t in, out;
+        ssize_t copied;
+
+        while (done < len) {
+            in = src + done;
+            out = dst + done;
+            copied = copy_file_range(bf->fd, &in, bf->fd, &out, len - done,
+                0);
+            if (copied < 0 && errno == EINTR) {
+                continue;
             }
-        }
-        if (disk->ns_util) {
-            qemu_free(disk->ns_util);
-            disk->ns_util = NULL;
+            if (copied <= 0) {
+                /* Not supported here, the rest is copied below */
+                break;
+            }
+            done += copied;
         }
     }
-    if (nvme_close_meta_disk(disk) != SUCCESS) {
-        return FAIL;
+    if (done == len) {
+        return SUCCESS;
     }
-    return SUCCESS;
+#endif
+
+    buf = qemu_malloc(MIN(len - done, NVME_COPY_BOUNCE_SIZE));
+    while (done < len && ret == SUCCESS) {
+        chunk = MIN(len - done, NVME_COPY_BOUNCE_SIZE);
+        off = backwards ? len - done - chunk : done;
+        ret = nvme_backing_pio(bf, buf, src + off, chunk, 0);
+        if (ret == SUCCESS) {
+            ret = nvme_backing_pio(bf, buf, dst + off, chunk, 1);
+        }
+        done += chunk;
+    }
+    qemu_free(buf);
+    return ret;
 }
 
 /*********************************************************************
-    Function     :    nvme_close_storage_disks
-    Description  :    Closes the NVME Storage Disks and the
-                      associated namespaces
+    Function     :    nvme_backing_zero
+    Description  :    Zeroes a range of a backing file, punching a hole
+                      in it where the host supports that
     Return Type  :    int (0:1 Success:Failure)
 
-    Arguments    :    NVMEState * : Pointer to NVME device State
+    Arguments    :    NVMEBackingFile * : Backing file
+                      uint64_t          : Offset within the file
+                      uint64_t          : Length in bytes
 *********************************************************************/
-int nvme_close_storage_disks(NVMEState *n)
+int nvme_backing_zero(NVMEBackingFile *bf, uint64_t offset, uint64_t len)
 {
-    uint32_t i;
+    uint64_t done = 0, chunk;
     int ret = SUCCESS;
+    uint8_t *buf;
 
-    for (i = 0; i < n->num_namespaces; i++) {
-        ret = nvme_close_storage_disk(&n->disk[i]);
+    if (len == 0) {
+        return SUCCESS;
+    }
+    nvme_backing_set_dirty(bf, offset, len);
+
+#if defined(CONFIG_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(bf->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+            len) == 0) {
+        return SUCCESS;
+    }
+#endif
+
+    buf = qemu_mallocz(MIN(len, NVME_COPY_BOUNCE_SIZE));
+    while (done < len && ret == SUCCESS) {
+        chunk = MIN(len - done, NVME_COPY_BOUNCE_SIZE);
+        ret = nvme_backing_pio(bf, buf, offset + done, chunk, 1);
+        done += chunk;
     }
+    qemu_free(buf);
     return ret;
 }
 
+/*********************************************************************
+    Function     :    nvme_backing_create
+    Description  :    Creates a backing file of the given size. The
+                      contents are kept when waiting for an incoming
+                      migration, as they either live on shared storage
+                      or are about to be streamed in. Otherwise the
+                      file is truncated, dropping the old blocks at
+                      once, and left sparse for nvme_format_step() to
+                      preallocate.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEBackingFile * : Backing file to set up
+                      const char *      : File name
+                      uint64_t          : Size in bytes
+*********************************************************************/
+static int nvme_backing_create(NVMEBackingFile *bf, const char *name,
+    uint64_t size)
+{
+    nvme_backing_init(bf);
+    bf->fd = open(name, O_RDWR | O_CREAT | (incoming_expected ? 0 : O_TRUNC),
+        S_IRUSR | S_IWUSR);
+    if (bf->fd < 0) {
+        LOG_ERR("Error while creating %s", name);
+        return FAIL;
+    }
+    if (incoming_expected) {
+        if (size && posix_fallocate(bf->fd, 0, size) != 0) {
+            LOG_ERR("Error while allocating %lu bytes for %s", size, name);
+            return FAIL;
+        }
+    } else if (ftruncate(bf->fd, size) < 0) {
+        LOG_ERR("Error while sizing %s to %lu bytes", name, size);
+        return FAIL;
+    }
+    bf->size = size;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_backing_open
+    Description  :    Opens a backing file another controller of the
+                      subsystem created, as it is
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEBackingFile * : Backing file to set up
+                      const char *      : File name
+                      uint64_t          : Size in bytes
+*********************************************************************/
+static int nvme_backing_open(NVMEBackingFile *bf, const char *name,
+    uint64_t size)
+{
+    nvme_backing_init(bf);
+    bf->fd = open(name, O_RDWR);
+    if (bf->fd < 0) {
+        LOG_ERR("Error while opening %s", name);
+        return FAIL;
+    }
+    bf->size = size;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_backing_open_direct
+    Description  :    Opens a backing file a second time with O_DIRECT
+                      for the data transfers, and finds the alignment
+                      its buffers, offsets and lengths need. Stays
+                      with the page cache when the host file system
+                      does not support it.
+    Return Type  :    void
+
+    Arguments    :    NVMEBackingFile * : Backing file, created
+                      const char *      : File name
+*********************************************************************/
+static void nvme_backing_open_direct(NVMEBackingFile *bf, const char *name)
+{
+    static const uint32_t aligns[] = { 512, 4096 };
+    uint8_t *buf;
+    int i;
+
+    bf->direct_fd = open(name, O_RDWR | O_DIRECT);
+    if (bf->direct_fd < 0) {
+        LOG_NORM("%s not opened with O_DIRECT: %s", name, strerror(errno));
+        return;
+    }
+    buf = qemu_memalign(8192, 8192);
+    for (i = 0; i < ARRAY_SIZE(aligns) && !bf->direct_align; i++) {
+        if (bf->size >= aligns[i] &&
+            pread(bf->direct_fd, buf + aligns[i], aligns[i], 0) >= 0) {
+            bf->direct_align = aligns[i];
+        }
+    }
+    qemu_vfree(buf);
+    if (!bf->direct_align) {
+        LOG_NORM("%s not usable with O_DIRECT", name);
+        close(bf->direct_fd);
+        bf->direct_fd = -1;
+        return;
+    }
+    LOG_NORM("%s opened with O_DIRECT, %u byte alignment", name,
+        bf->direct_align);
+}
+
+/*********************************************************************
+    Function     :    nvme_backing_close
+    Description  :    Unmaps and closes a backing file
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEBackingFile * : Backing file
+*********************************************************************/
+int nvme_backing_close(NVMEBackingFile *bf)
+{
+    int ret = SUCCESS;
+
+    nvme_backing_unmap_all(bf);
+    qemu_free(bf->dirty);
+    if (bf->fd >= 0 && close(bf->fd) < 0) {
+        LOG_ERR("Unable to close the nvme disk");
+        ret = FAIL;
+    }
+    if (bf->direct_fd >= 0) {
+        close(bf->direct_fd);
+    }
+    nvme_backing_init(bf);
+    return ret;
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_name
+    Description  :    Name of a backing file of a namespace, after the
+                      subsystem the controller belongs to so that its
+                      controllers open the same files, or after the
+                      controller instance
+    Return Type  :    void
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      const char * : "disk", "meta", "zone" or "jrnl"
+                      uint32_t     : Namespace id
+                      char *       : Out: file name
+                      size_t       : Size of the buffer
+*********************************************************************/
+static void nvme_storage_name(NVMEState *n, const char *kind, uint32_t nsid,
+    char *buf, size_t len)
+{
+    if (n->subsys_name) {
+        snprintf(buf, len, "nvme_%s_%s_n%d.img", kind, n->subsys_name, nsid);
+    } else {
+        snprintf(buf, len, "nvme_%s%d_n%d.img", kind, n->instance, nsid);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_create_meta_disk
+    Description  :    Creates a meta disk for separate meta-data
+                      buffers
+
+    Return Type  :    int
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      uint32_t *   : Namespace id
+                      DiskInfo *   : NVME disk to create storage for
+*********************************************************************/
+static int nvme_create_meta_disk(NVMEState *n, uint32_t nsid, DiskInfo *disk)
+{
+    uint32_t ms;
+
+    ms = disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas].ms;
+    if (ms != 0 && !(disk->idtfy_ns.flbas & 0x10)) {
+        char str[64];
+        uint64_t msize;
+
+        nvme_storage_name(n, "meta", nsid, str, sizeof(str));
+        msize = disk->idtfy_ns.ncap * ms;
+
+        if (nvme_backing_create(&disk->meta, str, msize) != SUCCESS) {
+            LOG_ERR("Error while creating the meta-storage");
+            return FAIL;
+        }
+    } else {
+        nvme_backing_init(&disk->meta);
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_ready
+    Description  :    Checks whether the namespace has backing storage
+    Return Type  :    int (1 if ready)
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+int nvme_storage_ready(DiskInfo *disk)
+{
+    return disk->data.fd >= 0 && disk->data.size != 0 && !disk->formatting;
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_open
+    Description  :    Creates the backing files of a namespace for its
+                      current LBA format, without initializing them
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : namespace id
+                      DiskInfo *  : NVME disk to create storage for
+*********************************************************************/
+static int nvme_storage_open(NVMEState *n, uint32_t nsid, DiskInfo *disk)
+{
+    uint32_t blksize, lba_idx;
+    uint64_t size, blks;
+    char str[64];
+
+    nvme_storage_name(n, "disk", nsid, str, sizeof(str));
+    disk->nsid = nsid;
+    /* Streams of a previous format do not carry over */
+    memset(disk->streams, 0, sizeof(disk->streams));
+    /* Zones depend on the LBA size, and size the namespace */
+    nvme_zone_setup(n, disk);
+
+    lba_idx = disk->idtfy_ns.flbas & 0xf;
+    blks = disk->idtfy_ns.ncap;
+    blksize = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+    size = blks * blksize;
+    if (disk->idtfy_ns.flbas & 0x10) {
+        /* extended lba */
+        size += (blks * disk->idtfy_ns.lbafx[lba_idx].ms);
+    }
+
+    if (nvme_backing_create(&disk->data, str, size) != SUCCESS) {
+        LOG_ERR("Error while creating the storage");
+        return FAIL;
+    }
+    if (size == 0) {
+        nvme_backing_init(&disk->meta);
+        nvme_backing_init(&disk->zones);
+        return SUCCESS;
+    }
+    if (n->direct) {
+        nvme_backing_open_direct(&disk->data, str);
+    }
+
+    if (nvme_create_meta_disk(n, nsid, disk) != SUCCESS) {
+        return FAIL;
+    }
+
+    if (disk->zone_count) {
+        nvme_storage_name(n, "zone", nsid, str, sizeof(str));
+        if (nvme_backing_create(&disk->zones, str,
+                disk->zone_count * sizeof(NVMEZone)) != SUCCESS) {
+            LOG_ERR("Error while creating the zone storage");
+            return FAIL;
+        }
+        /* Zones kept for an incoming migration may be open already */
+        nvme_zone_recount(disk);
+    } else {
+        nvme_backing_init(&disk->zones);
+    }
+
+    disk->ns_util = qemu_mallocz((disk->idtfy_ns.nsze + 7) / 8);
+    if (disk->ns_util == NULL) {
+        LOG_ERR("Error while reallocating the ns_util");
+        return FAIL;
+    }
+    disk->thresh_warn_issued = 0;
+    if (n->ftl && nvme_ftl_open(n, disk) != SUCCESS) {
+        return FAIL;
+    }
+    nvme_storage_name(n, "jrnl", nsid, str, sizeof(str));
+    if (nvme_journal_open(n, disk, str) != SUCCESS) {
+        return FAIL;
+    }
+
+    LOG_NORM("created disk storage, size:%lu (mapped in %llu MB windows)",
+        disk->data.size, NVME_MAP_WINDOW_SIZE / BYTES_PER_MB);
+
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_create_storage_disk
+    Description  :    Creates a NVME Storage Disk and the
+                      namespaces within, formatted before returning
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    uint32_t : instance number of the nvme device
+                      uint32_t : namespace id
+                      DiskInfo * : NVME disk to create storage for
+*********************************************************************/
+int nvme_create_storage_disk(uint32_t instance, uint32_t nsid, DiskInfo *disk,
+    NVMEState *n)
+{
+    int ret;
+
+    if (nvme_storage_open(n, nsid, disk) != SUCCESS) {
+        return FAIL;
+    }
+    /* Files kept for an incoming migration are preallocated already */
+    disk->format_done = incoming_expected ? nvme_format_total(disk) : 0;
+    if (n->base_path) {
+        if (nvme_cow_open(n, disk) != SUCCESS) {
+            return FAIL;
+        }
+        /* The overlay of a clone only takes the blocks written */
+        disk->format_done = MAX(disk->format_done, disk->data.size);
+    }
+    while ((ret = nvme_format_step(disk, UINT64_MAX)) == 0) {
+        continue;
+    }
+    return ret < 0 ? FAIL : SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_create_storage_disks
+    Description  :    Creates a NVME Storage Disks and the
+                      namespaces within
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_create_storage_disks(NVMEState *n)
+{
+    uint32_t i;
+    int ret = SUCCESS;
+
+    DiskInfo *from;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        /* Namespace Management creates the others */
+        if (!n->disk[i].allocated) {
+            continue;
+        }
+        from = nvme_subsys_ns_source(n, i + 1);
+        if (from) {
+            ret = nvme_storage_share(n, &n->disk[i], from);
+        } else if (NVME_SUBSYS_PRIMARY(n) == n) {
+            ret = nvme_create_storage_disk(n->instance, i + 1, &n->disk[i],
+                n);
+        }
+    }
+
+    LOG_NORM("%s():Backing store created for instance %d", __func__,
+        n->instance);
+
+    return ret;
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_alloc
+    Description  :    Creates the backing files of a namespace made by
+                      Namespace Management, on its first attachment.
+                      Unlike at start the data file is left sparse,
+                      only separate meta-data is initialized.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk without storage
+*********************************************************************/
+int nvme_storage_alloc(NVMEState *n, DiskInfo *disk)
+{
+    int ret;
+
+    if (nvme_storage_open(n, disk->nsid, disk) != SUCCESS) {
+        nvme_close_storage_disk(disk);
+        return FAIL;
+    }
+    disk->format_done = disk->data.size;
+    while ((ret = nvme_format_step(disk, UINT64_MAX)) == 0) {
+        continue;
+    }
+    if (ret < 0) {
+        nvme_close_storage_disk(disk);
+        return FAIL;
+    }
+    /* Sent to a migration in progress from now on */
+    disk->mig_sync = 0;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_share
+    Description  :    Opens the backing files of a namespace another
+                      controller of the subsystem has open, taking its
+                      utilization from there. Writes made through this
+                      controller are sent by the one migrating the
+                      data, once it tracks them.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk without storage
+                      DiskInfo *  : Same namespace on the other
+                                    controller, ready
+*********************************************************************/
+int nvme_storage_share(NVMEState *n, DiskInfo *disk, DiskInfo *from)
+{
+    NVMEState *primary = NVME_SUBSYS_PRIMARY(n);
+    DiskInfo *pd = &primary->disk[from->nsid - 1];
+    char str[64];
+
+    memset(disk->streams, 0, sizeof(disk->streams));
+    disk->idtfy_ns = from->idtfy_ns;
+    nvme_storage_name(n, "disk", from->nsid, str, sizeof(str));
+    if (nvme_backing_open(&disk->data, str, from->data.size) != SUCCESS) {
+        return FAIL;
+    }
+    if (n->direct) {
+        nvme_backing_open_direct(&disk->data, str);
+    }
+    nvme_storage_name(n, "meta", from->nsid, str, sizeof(str));
+    if (from->meta.fd >= 0 &&
+        nvme_backing_open(&disk->meta, str, from->meta.size) != SUCCESS) {
+        nvme_close_storage_disk(disk);
+        return FAIL;
+    }
+    disk->ns_util = qemu_malloc((disk->idtfy_ns.nsze + 7) / 8);
+    memcpy(disk->ns_util, from->ns_util, (disk->idtfy_ns.nsze + 7) / 8);
+    disk->thresh_warn_issued = from->thresh_warn_issued;
+    disk->format_done = from->format_done;
+    disk->mig_sync = 0;
+    if (primary != n && pd->mig_sync && pd->data.dirty) {
+        nvme_mig_watch(primary, from->nsid);
+    }
+    LOG_NORM("%s(): nsid:%d shared, size:%lu", __func__, from->nsid,
+        disk->data.size);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_close_storage_disk
+    Description  :    Deletes NVME Storage Disk
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    DiskInfo * : Pointer to NVME disk
+*********************************************************************/
+int nvme_close_storage_disk(DiskInfo *disk)
+{
+    int ret = SUCCESS;
+
+    disk->mig_sync = 0;
+    /* A format or a new LBA format leaves nothing to share */
+    nvme_cow_close(disk);
+    nvme_ftl_close(disk);
+    /* Retired first, with the files still open */
+    nvme_journal_close(disk);
+    if (disk->data.fd >= 0) {
+        if (nvme_backing_close(&disk->data) != SUCCESS) {
+            LOG_ERR("Error while closing namespace: %d", disk->nsid);
+            ret = FAIL;
+        }
+        if (disk->ns_util) {
+            qemu_free(disk->ns_util);
+            disk->ns_util = NULL;
+        }
+    }
+    if (disk->meta.fd >= 0 && nvme_backing_close(&disk->meta) != SUCCESS) {
+        LOG_ERR("Error while closing meta namespace: %d", disk->nsid);
+        ret = FAIL;
+    }
+    if (disk->zones.fd >= 0 && nvme_backing_close(&disk->zones) != SUCCESS) {
+        LOG_ERR("Error while closing zones of namespace: %d", disk->nsid);
+        ret = FAIL;
+    }
+    return ret;
+}
+
+/*********************************************************************
+    Function     :    nvme_close_storage_disks
+    Description  :    Closes the NVME Storage Disks and the
+                      associated namespaces
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_close_storage_disks(NVMEState *n)
+{
+    uint32_t i;
+    int ret = SUCCESS;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        ret = nvme_close_storage_disk(&n->disk[i]);
+    }
+    return ret;
+}
+
+/*********************************************************************
+    Function     :    nvme_del_storage_disk
+    Description  :    Closes NVME Storage Disk and removes its backing
+                      files, once its namespace is deleted
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : Pointer to NVME disk
+*********************************************************************/
+int nvme_del_storage_disk(NVMEState *n, DiskInfo *disk)
+{
+    static const char * const kinds[] = { "disk", "meta", "zone", "jrnl" };
+    char str[64];
+    int i, ret;
+
+    ret = nvme_close_storage_disk(disk);
+    for (i = 0; i < ARRAY_SIZE(kinds); i++) {
+        nvme_storage_name(n, kinds[i], disk->nsid, str, sizeof(str));
+        if (unlink(str) < 0 && errno != ENOENT) {
+            LOG_ERR("Error while removing %s", str);
+            ret = FAIL;
+        }
+    }
+    return ret;
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_resize
+    Description  :    Changes the size of a namespace, with its backing
+                      files if created. Blocks past a smaller size are
+                      deallocated, those added read as zeroes and their
+                      separate meta-data as ones. The namespace is not
+                      zoned and no transfer is in flight.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+                      uint64_t    : New size in LBAs
+*********************************************************************/
+int nvme_storage_resize(NVMEState *n, DiskInfo *disk, uint64_t nsze)
+{
+    uint32_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+    uint32_t ms = disk->idtfy_ns.lbafx[lba_idx].ms;
+    uint64_t old = disk->idtfy_ns.nsze;
+    uint64_t size, offset, len, avail;
+    uint8_t *ns_util, *p;
+
+    /* No journaled write to be played back past a shrink */
+    nvme_journal_retire(disk);
+    if (nsze < old && disk->ns_util) {
+        dsm_dealloc(n, disk, nsze, old - nsze);
+    }
+    disk->idtfy_ns.nsze = disk->idtfy_ns.ncap = nsze;
+    if (disk->data.fd < 0) {
+        /* Sized when attached */
+        return SUCCESS;
+    }
+
+    size = nsze * NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+    if (disk->idtfy_ns.flbas & 0x10) {
+        size += nsze * ms;
+    }
+    nvme_backing_unmap_all(&disk->data);
+    if (ftruncate(disk->data.fd, size) < 0) {
+        LOG_ERR("Error while resizing namespace %d to %lu bytes", disk->nsid,
+            size);
+        return FAIL;
+    }
+    disk->data.size = size;
+    if (disk->meta.fd >= 0) {
+        size = nsze * ms;
+        nvme_backing_unmap_all(&disk->meta);
+        if (ftruncate(disk->meta.fd, size) < 0) {
+            LOG_ERR("Error while resizing meta-data of namespace %d",
+                disk->nsid);
+            return FAIL;
+        }
+        offset = disk->meta.size;
+        disk->meta.size = size;
+        while (offset < size) {
+            len = min(size - offset, NVME_MAP_WINDOW_SIZE -
+                (offset & (NVME_MAP_WINDOW_SIZE - 1)));
+            avail = len;
+            p = nvme_backing_map(&disk->meta, offset, &avail);
+            if (p == NULL || avail != len) {
+                LOG_ERR("Error while opening namespace meta-data: %d",
+                    disk->nsid);
+                return FAIL;
+            }
+            memset(p, 0xff, len);
+            offset += len;
+        }
+    }
+
+    ns_util = qemu_mallocz((nsze + 7) / 8);
+    memcpy(ns_util, disk->ns_util, min(nsze + 7, old + 7) / 8);
+    qemu_free(disk->ns_util);
+    disk->ns_util = ns_util;
+    if (disk->ftl && nvme_ftl_resize(n, disk) != SUCCESS) {
+        return FAIL;
+    }
+
+    /* A migration in progress sends the namespace again, with its new
+     * size and all of its data */
+    qemu_free(disk->data.dirty);
+    qemu_free(disk->meta.dirty);
+    disk->data.dirty = disk->meta.dirty = NULL;
+    disk->data.dirty_count = disk->meta.dirty_count = 0;
+    disk->mig_sync = 0;
+    return SUCCESS;
+}
+
+
+/*********************************************************************
+    Function     :    nvme_format_total
+    Description  :    Bytes a format initializes: the data backing
+                      file and the separate meta-data file, if any
+    Return Type  :    uint64_t
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+static uint64_t nvme_format_total(DiskInfo *disk)
+{
+    return disk->data.size + (disk->meta.fd >= 0 ? disk->meta.size : 0);
+}
+
+/*********************************************************************
+    Function     :    nvme_format_remaining
+    Description  :    Bytes left before the namespace format is done
+    Return Type  :    uint64_t
+
+    Arguments    :    DiskInfo * : NVME disk
+*********************************************************************/
+uint64_t nvme_format_remaining(DiskInfo *disk)
+{
+    return disk->formatting ? nvme_format_total(disk) - disk->format_done : 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_format_step
+    Description  :    Initializes up to budget bytes of a namespace
+                      being formatted, from disk->format_done on. The
+                      data file only needs its blocks allocated, the
+                      truncation having already discarded the old
+                      data; separate meta-data is also filled with
+                      ones. Updates the Format Progress Indicator.
+    Return Type  :    int (1 when done, 0 if more is left, -1 on error)
+
+    Arguments    :    DiskInfo * : NVME disk, backing files open
+                      uint64_t   : Maximum number of bytes to handle
+*********************************************************************/
+static int nvme_format_step(DiskInfo *disk, uint64_t budget)
+{
+    uint64_t total = nvme_format_total(disk);
+    uint64_t offset, len, avail;
+    NVMEBackingFile *bf;
+    uint8_t *p;
+
+    while (budget && disk->format_done < total) {
+        if (disk->format_done < disk->data.size) {
+            bf = &disk->data;
+            offset = disk->format_done;
+        } else {
+            bf = &disk->meta;
+            offset = disk->format_done - disk->data.size;
+        }
+        /* Stay within a mapping window */
+        len = min(budget, bf->size - offset);
+        len = min(len, NVME_MAP_WINDOW_SIZE -
+            (offset & (NVME_MAP_WINDOW_SIZE - 1)));
+        if (posix_fallocate(bf->fd, offset, len) != 0) {
+            LOG_ERR("Error while allocating namespace %d at %lu",
+                disk->nsid, offset);
+            return -1;
+        }
+        if (bf == &disk->meta) {
+            avail = len;
+            p = nvme_backing_map(bf, offset, &avail);
+            if (p == NULL || avail != len) {
+                LOG_ERR("Error while opening namespace meta-data: %d",
+                    disk->nsid);
+                return -1;
+            }
+            memset(p, 0xff, len);
+        }
+        disk->format_done += len;
+        budget -= len;
+    }
+
+    /* Percentage left, rounded up so that 0 means done */
+    disk->idtfy_ns.fpi = NVME_FPI_SUPPORTED;
+    if (disk->format_done < total) {
+        disk->idtfy_ns.fpi |= ((total - disk->format_done) * 100 + total - 1) /
+            total;
+    }
+    return disk->format_done >= total;
+}
+
+/*********************************************************************
+    Function     :    nvme_format_start
+    Description  :    Recreates the backing files of a namespace for
+                      the LBA format set in its Identify structure and
+                      starts initializing them in the background. The
+                      namespace reports Namespace Not Ready until done.
+    Return Type  :    uint16_t (NVMe status code)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk to format
+*********************************************************************/
+uint16_t nvme_format_start(NVMEState *n, DiskInfo *disk)
+{
+    if (nvme_storage_open(n, disk->nsid, disk) != SUCCESS) {
+        nvme_close_storage_disk(disk);
+        return NVME_SC_INTERNAL;
+    }
+    disk->format_done = 0;
+    disk->formatting = 1;
+    disk->idtfy_ns.fpi = NVME_FPI_SUPPORTED | 100;
+    qemu_mod_timer(n->format_timer, qemu_get_clock_ns(vm_clock));
+    return NVME_SC_SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_format_complete
+    Description  :    Ends the format of a namespace and posts the
+                      completion of its Format NVM command, if still
+                      outstanding
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo *  : NVME disk
+                      int         : Result of the last nvme_format_step
+*********************************************************************/
+static void nvme_format_complete(NVMEState *n, DiskInfo *disk, int ret)
+{
+    NVMERequest *req = disk->format_req;
+    NVMEStatusField *sf;
+
+    disk->formatting = 0;
+    disk->format_req = NULL;
+    if (ret < 0) {
+        LOG_ERR("Format of namespace %d failed", disk->nsid);
+        nvme_close_storage_disk(disk);
+    } else {
+        LOG_NORM("%s(): namespace %d formatted", __func__, disk->nsid);
+    }
+    nvme_ns_sync(n, disk->nsid, 1);
+    if (req) {
+        sf = (NVMEStatusField *)&req->cqe.status;
+        if (ret < 0) {
+            sf->sc = NVME_SC_INTERNAL;
+        }
+        n->cq[ACQ_ID]->inflight--;
+        nvme_req_complete(n, req);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_format_timer_cb
+    Description  :    Advances every namespace being formatted by one
+                      step and rearms itself while any is left
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+void nvme_format_timer_cb(void *opaque)
+{
+    NVMEState *n = (NVMEState *)opaque;
+    DiskInfo *disk;
+    uint32_t i;
+    int ret, pending = 0;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        disk = &n->disk[i];
+        if (!disk->formatting) {
+            continue;
+        }
+        ret = nvme_format_step(disk, NVME_FORMAT_STEP);
+        if (ret) {
+            nvme_format_complete(n, disk, ret);
+        } else {
+            pending = 1;
+        }
+    }
+    if (pending) {
+        qemu_mod_timer(n->format_timer,
+            qemu_get_clock_ns(vm_clock) + NVME_FORMAT_INTERVAL);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_format_finish_all
+    Description  :    Completes the formats in progress synchronously,
+                      e.g. before the device state is migrated
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_format_finish_all(NVMEState *n)
+{
+    DiskInfo *disk;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        disk = &n->disk[i];
+        if (!disk->formatting) {
+            continue;
+        }
+        while ((ret = nvme_format_step(disk, UINT64_MAX)) == 0) {
+            continue;
+        }
+        nvme_format_complete(n, disk, ret);
+    }
+    qemu_del_timer(n->format_timer);
+}
+
+/*********************************************************************
+    Function     :    nvme_format_reset
+    Description  :    Forgets the Format NVM commands outstanding on a
+                      controller reset. The formats themselves go on.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_format_reset(NVMEState *n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (n->disk[i].format_req) {
+            n->disk[i].format_req = NULL;
+            n->cq[ACQ_ID]->inflight--;
+        }
+    }
+}
+
+
+/* Records of the "nvme-storage" live migration section */
+#define NVME_MIG_FLAG_CHUNK     0x01
+#define NVME_MIG_FLAG_FORMAT    0x02
+#define NVME_MIG_FLAG_EOS       0x04
+#define NVME_MIG_FLAG_COW       0x08
+
+/*********************************************************************
+    Function     :    nvme_mig_track
+    Description  :    Starts dirty tracking of a backing file with
+                      every chunk marked, so the whole file is sent
+    Return Type  :    void
+
+    Arguments    :    NVMEBackingFile * : Backing file
+*********************************************************************/
+static void nvme_mig_track(NVMEBackingFile *bf)
+{
+    uint64_t nchunks;
+
+    if (bf->fd < 0 || bf->size == 0) {
+        return;
+    }
+    nchunks = (bf->size + NVME_MIG_CHUNK_SIZE - 1) >> NVME_MIG_CHUNK_SHIFT;
+    qemu_free(bf->dirty);
+    bf->dirty = bitmap_new(nchunks);
+    bitmap_fill(bf->dirty, nchunks);
+    bf->dirty_count = nchunks;
+}
+
+/*********************************************************************
+    Function     :    nvme_mig_watch
+    Description  :    Starts dirty tracking of a namespace on the other
+                      controllers of the subsystem, with no chunk
+                      marked. The controller migrating the data picks
+                      up the chunks they write.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State,
+                                    migrating the data
+                      uint32_t    : Namespace id
+*********************************************************************/
+static void nvme_mig_watch(NVMEState *n, uint32_t nsid)
+{
+    NVMEBackingFile *bfs[2];
+    NVMEState *p;
+    int i;
+
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        bfs[0] = &p->disk[nsid - 1].data;
+        bfs[1] = &p->disk[nsid - 1].meta;
+        for (i = 0; i < ARRAY_SIZE(bfs) && p != n; i++) {
+            if (bfs[i]->fd >= 0 && bfs[i]->size) {
+                qemu_free(bfs[i]->dirty);
+                bfs[i]->dirty = bitmap_new((bfs[i]->size +
+                    NVME_MIG_CHUNK_SIZE - 1) >> NVME_MIG_CHUNK_SHIFT);
+                bfs[i]->dirty_count = 0;
+            }
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_mig_merge
+    Description  :    Moves the chunks of a backing file the other
+                      controllers of the subsystem wrote into the dirty
+                      chunks of the controller migrating the data
+    Return Type  :    void
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file of the namespace
+                      uint32_t          : Namespace id
+                      int               : 1 for meta-data
+*********************************************************************/
+static void nvme_mig_merge(NVMEState *n, NVMEBackingFile *bf, uint32_t nsid,
+    int meta)
+{
+    NVMEBackingFile *pbf;
+    NVMEState *p;
+    uint64_t nchunks, chunk;
+
+    if (bf->dirty == NULL) {
+        return;
+    }
+    nchunks = (bf->size + NVME_MIG_CHUNK_SIZE - 1) >> NVME_MIG_CHUNK_SHIFT;
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        pbf = meta ? &p->disk[nsid - 1].meta : &p->disk[nsid - 1].data;
+        if (p == n || pbf->dirty == NULL || pbf->size != bf->size) {
+            continue;
+        }
+        for (chunk = find_first_bit(pbf->dirty, nchunks); chunk < nchunks;
+                chunk = find_next_bit(pbf->dirty, nchunks, chunk + 1)) {
+            if (!test_and_set_bit(chunk, bf->dirty)) {
+                bf->dirty_count++;
+            }
+        }
+        bitmap_zero(pbf->dirty, nchunks);
+        pbf->dirty_count = 0;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_mig_cleanup
+    Description  :    Stops dirty tracking on every namespace, on all
+                      of the controllers of the subsystem
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_mig_cleanup(NVMEState *n)
+{
+    NVMEState *p;
+    DiskInfo *disk;
+    uint32_t i;
+
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        for (i = 0; i < p->num_namespaces; i++) {
+            disk = &p->disk[i];
+            qemu_free(disk->data.dirty);
+            qemu_free(disk->meta.dirty);
+            qemu_free(disk->zones.dirty);
+            disk->data.dirty = disk->meta.dirty = disk->zones.dirty = NULL;
+            disk->data.dirty_count = disk->meta.dirty_count = 0;
+            disk->zones.dirty_count = 0;
+            disk->mig_sync = 0;
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_mig_sync_formats
+    Description  :    Sends the LBA format of the namespaces so the
+                      destination lays out its backing files the same
+                      way, a size of 0 standing for no backing files.
+                      Namespaces (re)created since the last call, e.g.
+                      by a Format NVM, get their dirty tracking rearmed
+                      when the data is migrated.
+    Return Type  :    void
+
+    Arguments    :    QEMUFile *  : Migration stream
+                      NVMEState * : Pointer to NVME device State
+                      int         : Send every namespace, not only
+                                    the (re)created ones
+*********************************************************************/
+static void nvme_mig_sync_formats(QEMUFile *f, NVMEState *n, int force)
+{
+    DiskInfo *disk;
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        disk = &n->disk[i];
+        if (disk->formatting) {
+            /* Sent once formatted, at the latest when the VM stops */
+            continue;
+        }
+        if (force || !disk->mig_sync) {
+            qemu_put_be32(f, NVME_MIG_FLAG_FORMAT);
+            qemu_put_be32(f, i + 1);
+            qemu_put_byte(f, disk->idtfy_ns.flbas);
+            qemu_put_byte(f, disk->idtfy_ns.dps);
+            qemu_put_be64(f, disk->data.fd >= 0 ? disk->idtfy_ns.nsze : 0);
+        }
+        if (!disk->mig_sync && n->mig_blk_enable) {
+            nvme_mig_track(&disk->data);
+            nvme_mig_track(&disk->meta);
+            nvme_mig_track(&disk->zones);
+            nvme_mig_watch(n, i + 1);
+        }
+        disk->mig_sync = 1;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_mig_send_dirty
+    Description  :    Sends the dirty chunks of a backing file
+    Return Type  :    int (1 once no dirty chunk is left)
+
+    Arguments    :    QEMUFile *        : Migration stream
+                      NVMEBackingFile * : Backing file
+                      uint32_t          : Namespace id
+                      uint8_t           : 0 for data, 1 for meta-data,
+                                          2 for zones
+                      int               : Stop when the stream is
+                                          rate limited
+*********************************************************************/
+static int nvme_mig_send_dirty(QEMUFile *f, NVMEBackingFile *bf,
+    uint32_t nsid, uint8_t meta, int limit)
+{
+    uint64_t nchunks, chunk, offset, len;
+    uint8_t *p;
+
+    if (bf->dirty == NULL) {
+        return 1;
+    }
+    nchunks = (bf->size + NVME_MIG_CHUNK_SIZE - 1) >> NVME_MIG_CHUNK_SHIFT;
+    chunk = find_first_bit(bf->dirty, nchunks);
+    while (chunk < nchunks) {
+        if (limit && qemu_file_rate_limit(f)) {
+            return 0;
+        }
+        offset = chunk << NVME_MIG_CHUNK_SHIFT;
+        len = min(NVME_MIG_CHUNK_SIZE, bf->size - offset);
+        p = nvme_backing_map(bf, offset, &len);
+        if (p == NULL) {
+            qemu_file_set_error(f);
+            return 1;
+        }
+        clear_bit(chunk, bf->dirty);
+        bf->dirty_count--;
+
+        qemu_put_be32(f, NVME_MIG_FLAG_CHUNK);
+        qemu_put_be32(f, nsid);
+        qemu_put_byte(f, meta);
+        qemu_put_be64(f, offset);
+        qemu_put_be32(f, len);
+        qemu_put_buffer(f, p, len);
+
+        chunk = find_next_bit(bf->dirty, nchunks, chunk + 1);
+    }
+    return 1;
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_mig_set_params
+    Description  :    Records whether storage is migrated (migrate -b)
+    Return Type  :    void
+
+    Arguments    :    int    : Block migration requested
+                      int    : Incremental block migration requested
+                      void * : Pointer to NVME device State
+*********************************************************************/
+void nvme_storage_mig_set_params(int blk_enable, int shared, void *opaque)
+{
+    NVMEState *n = (NVMEState *)opaque;
+
+    n->mig_blk_enable = blk_enable | shared;
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_save_live
+    Description  :    Live save handler for the namespace backing
+                      files. Without block migration only the LBA
+                      formats are sent, the files being expected on
+                      shared storage.
+    Return Type  :    int (1 when the remaining data can be sent
+                      within the maximum downtime)
+
+    Arguments    :    Monitor *  : Monitor which started migration
+                      QEMUFile * : Migration stream
+                      int        : Stage, negative when cancelled
+                      void *     : Pointer to NVME device State
+*********************************************************************/
+int nvme_storage_save_live(Monitor *mon, QEMUFile *f, int stage,
+    void *opaque)
+{
+    NVMEState *n = (NVMEState *)opaque;
+    uint64_t remaining = 0;
+    uint32_t i;
+
+    if (NVME_SUBSYS_PRIMARY(n) != n) {
+        /* The first controller of the subsystem sends the namespaces */
+        if (stage >= 0) {
+            qemu_put_be32(f, NVME_MIG_FLAG_EOS);
+        }
+        return stage >= 0;
+    }
+    if (stage < 0) {
+        nvme_mig_cleanup(n);
+        return 0;
+    }
+
+    nvme_mig_sync_formats(f, n, stage != 2);
+    for (i = 0; i < n->num_namespaces; i++) {
+        nvme_mig_merge(n, &n->disk[i].data, i + 1, 0);
+        nvme_mig_merge(n, &n->disk[i].meta, i + 1, 1);
+    }
+    for (i = 0; i < n->num_namespaces && stage != 1; i++) {
+        if (!nvme_mig_send_dirty(f, &n->disk[i].data, i + 1, 0, stage == 2) ||
+            !nvme_mig_send_dirty(f, &n->disk[i].meta, i + 1, 1, stage == 2) ||
+            !nvme_mig_send_dirty(f, &n->disk[i].zones, i + 1, 2, stage == 2)) {
+            break;
+        }
+    }
+    for (i = 0; i < n->num_namespaces; i++) {
+        remaining += (n->disk[i].data.dirty_count +
+            n->disk[i].meta.dirty_count + n->disk[i].zones.dirty_count) <<
+            NVME_MIG_CHUNK_SHIFT;
+    }
+    for (i = 0; i < n->num_namespaces && stage == 3; i++) {
+        /* Whichever way the data goes, the blocks of clones still shared
+         * with their base image */
+        qemu_put_be32(f, NVME_MIG_FLAG_COW);
+        qemu_put_be32(f, i + 1);
+        nvme_cow_save(f, &n->disk[i]);
+    }
+    qemu_put_be32(f, NVME_MIG_FLAG_EOS);
+
+    if (stage == 3 || qemu_file_has_error(f)) {
+        nvme_mig_cleanup(n);
+        return 0;
+    }
+    /* Done once the rest can be sent within the allowed downtime, at the
+     * rate the stream is limited to (given per 100ms) */
+    return qemu_file_get_rate_limit(f) > 0 && (double)remaining * 100000000 /
+        qemu_file_get_rate_limit(f) <= migrate_max_downtime();
+}
+
+/*********************************************************************
+    Function     :    nvme_storage_load
+    Description  :    Load handler for the namespace backing files
+    Return Type  :    int (0 on success, negative errno otherwise)
+
+    Arguments    :    QEMUFile * : Migration stream
+                      void *     : Pointer to NVME device State
+                      int        : Section version
+*********************************************************************/
+int nvme_storage_load(QEMUFile *f, void *opaque, int version_id)
+{
+    NVMEState *n = (NVMEState *)opaque;
+    NVMEBackingFile *bf;
+    DiskInfo *disk;
+    uint32_t flags, nsid;
+    uint64_t offset, len, avail, nsze;
+    uint8_t flbas, dps, meta;
+    uint8_t *p;
+    int ret;
+
+    do {
+        flags = qemu_get_be32(f);
+        if (flags == NVME_MIG_FLAG_FORMAT) {
+            nsid = qemu_get_be32(f);
+            flbas = qemu_get_byte(f);
+            dps = qemu_get_byte(f);
+            nsze = qemu_get_be64(f);
+            if (nsid == 0 || nsid > n->num_namespaces) {
+                LOG_ERR("%s(): bad nsid:%u", __func__, nsid);
+                return -EINVAL;
+            }
+            disk = &n->disk[nsid - 1];
+            if ((flbas & 0xf) > disk->idtfy_ns.nlbaf) {
+                LOG_ERR("%s(): bad flbas:%x", __func__, flbas);
+                return -EINVAL;
+            }
+            if (nsze == 0) {
+                /* Deleted, or not attached yet, on the source */
+                if (disk->data.fd >= 0) {
+                    LOG_NORM("%s(): deleting nsid:%u", __func__, nsid);
+                    nvme_del_storage_disk(n, disk);
+                    nvme_ns_sync(n, nsid, 0);
+                }
+            } else if (disk->idtfy_ns.flbas != flbas ||
+                disk->idtfy_ns.nsze != nsze || disk->data.fd < 0) {
+                LOG_NORM("%s(): reformatting nsid:%u, flbas:%x", __func__,
+                    nsid, flbas);
+                nvme_close_storage_disk(disk);
+                disk->idtfy_ns.nuse = 0;
+                disk->idtfy_ns.flbas = flbas;
+                disk->idtfy_ns.nsze = disk->idtfy_ns.ncap = nsze;
+                disk->idtfy_ns.dps = dps;
+                if (nvme_create_storage_disk(n->instance, nsid, disk, n)) {
+                    return -EIO;
+                }
+                nvme_ns_sync(n, nsid, 0);
+            }
+        } else if (flags == NVME_MIG_FLAG_CHUNK) {
+            nsid = qemu_get_be32(f);
+            meta = qemu_get_byte(f);
+            offset = qemu_get_be64(f);
+            len = qemu_get_be32(f);
+            if (nsid == 0 || nsid > n->num_namespaces ||
+                len > NVME_MIG_CHUNK_SIZE) {
+                LOG_ERR("%s(): bad chunk nsid:%u len:%lu", __func__, nsid,
+                    len);
+                return -EINVAL;
+            }
+            bf = meta == 2 ? &n->disk[nsid - 1].zones : meta ?
+                &n->disk[nsid - 1].meta : &n->disk[nsid - 1].data;
+            /* The source's data, which no local journal may undo */
+            nvme_journal_discard(&n->disk[nsid - 1]);
+            avail = len;
+            p = nvme_backing_map(bf, offset, &avail);
+            if (p == NULL || avail != len) {
+                LOG_ERR("%s(): chunk beyond nsid:%u, offset:%lu", __func__,
+                    nsid, offset);
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, p, len);
+        } else if (flags == NVME_MIG_FLAG_COW) {
+            nsid = qemu_get_be32(f);
+            if (nsid == 0 || nsid > n->num_namespaces) {
+                LOG_ERR("%s(): bad nsid:%u", __func__, nsid);
+                return -EINVAL;
+            }
+            ret = nvme_cow_load(f, n, &n->disk[nsid - 1]);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (flags != NVME_MIG_FLAG_EOS) {
+            LOG_ERR("%s(): unknown flags:%x", __func__, flags);
+            return -EINVAL;
+        }
+        if (qemu_file_has_error(f)) {
+            return -EIO;
+        }
+    } while (flags != NVME_MIG_FLAG_EOS);
+
+    return 0;
+}
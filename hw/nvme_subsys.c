@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * NVM subsystems.
+ *
+ * Controllers started with the same subsys=<name> form one NVM subsystem
+ * and share its namespaces, each controller being a separate PCI function
+ * with its own queues, I/O workers and interrupts, so that a host running
+ * multipath I/O spreads its commands over them. The first controller
+ * defines the namespaces, as its properties give them; the others take
+ * them as they are when they join, whatever their own properties.
+ *
+ * Every controller opens the same backing files, named after the
+ * subsystem rather than the controller instance, so the data written
+ * through one is read through the others. The state of a namespace, its
+ * Identify Namespace structure and whether it is allocated, is kept the
+ * same on all of them by nvme_ns_sync(). Whether it is attached is up to
+ * each controller.
+ *
+ * A controller without a subsys property is the only one of its own
+ * subsystem, with the backing files named after its instance as before.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+/* Named subsystems, looked up by the controllers joining them */
+static QTAILQ_HEAD(, NVMESubsys) nvme_subsystems =
+    QTAILQ_HEAD_INITIALIZER(nvme_subsystems);
+
+/*********************************************************************
+    Function     :    nvme_subsys_find
+    Description  :    Looks up a named subsystem
+    Return Type  :    NVMESubsys * (NULL if none)
+
+    Arguments    :    const char * : Subsystem name
+*********************************************************************/
+static NVMESubsys *nvme_subsys_find(const char *name)
+{
+    NVMESubsys *s;
+
+    QTAILQ_FOREACH(s, &nvme_subsystems, entry) {
+        if (!strcmp(s->name, name)) {
+            break;
+        }
+    }
+    return s;
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_check
+    Description  :    Checks the subsys property of a controller and
+                      whether it can share the namespaces of the
+                      subsystem. Zoned namespaces, the emulated FTL
+                      and clones keep state only one controller sees.
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_subsys_check(NVMEState *n)
+{
+    NVMESubsys *s;
+    const char *p;
+
+    if (n->subsys_name == NULL) {
+        return SUCCESS;
+    }
+    for (p = n->subsys_name; *p; p++) {
+        if (!qemu_isalnum(*p) && *p != '-' && *p != '_') {
+            break;
+        }
+    }
+    if (*p || p == n->subsys_name || p - n->subsys_name >
+        NVME_SUBSYS_NAME_MAX) {
+        LOG_ERR("bad subsys value:%s, must be 1 to %d letters, digits, "
+            "'-' or '_'", n->subsys_name, NVME_SUBSYS_NAME_MAX);
+        return FAIL;
+    }
+    if (n->zone_size_mb || n->ftl || n->base_path) {
+        LOG_ERR("subsys %s: zoned namespaces, ftl and base cannot be "
+            "shared", n->subsys_name);
+        return FAIL;
+    }
+    s = nvme_subsys_find(n->subsys_name);
+    if (s && s->num_ctrls == NVME_SUBSYS_MAX_CTRLS) {
+        LOG_ERR("subsys %s has %d controllers already", n->subsys_name,
+            NVME_SUBSYS_MAX_CTRLS);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_primary_of
+    Description  :    Finds the controller defining the namespaces of
+                      the subsystem a new controller joins
+    Return Type  :    NVMEState * (NULL when the controller is the
+                      first one)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+NVMEState *nvme_subsys_primary_of(NVMEState *n)
+{
+    NVMESubsys *s;
+
+    if (n->subsys_name == NULL) {
+        return NULL;
+    }
+    s = nvme_subsys_find(n->subsys_name);
+    return s ? QTAILQ_FIRST(&s->ctrls) : NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_join
+    Description  :    Adds a controller to its subsystem, created for
+                      the first one. Others take the namespaces of the
+                      first one, with their attachments; their backing
+                      files are opened along with those of the other
+                      namespaces of the controller.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMEState * : First controller of the subsystem,
+                                    NULL for this one
+*********************************************************************/
+void nvme_subsys_join(NVMEState *n, NVMEState *primary)
+{
+    NVMESubsys *s;
+    uint32_t i;
+
+    if (primary) {
+        s = primary->subsys;
+        for (i = 0; i < n->num_namespaces; i++) {
+            n->disk[i].idtfy_ns = primary->disk[i].idtfy_ns;
+            n->disk[i].allocated = primary->disk[i].allocated;
+            n->disk[i].attached = primary->disk[i].attached;
+        }
+    } else {
+        s = qemu_mallocz(sizeof(*s));
+        QTAILQ_INIT(&s->ctrls);
+        s->resv = qemu_mallocz(sizeof(*s->resv) * n->num_namespaces);
+        if (n->subsys_name) {
+            s->name = qemu_strdup(n->subsys_name);
+            QTAILQ_INSERT_TAIL(&nvme_subsystems, s, entry);
+        }
+    }
+    QTAILQ_INSERT_TAIL(&s->ctrls, n, subsys_entry);
+    s->num_ctrls++;
+    n->subsys = s;
+    n->resv = s->resv;
+    if (s->name) {
+        LOG_NORM("%s(): controller %d joined subsys %s, %u controllers",
+            __func__, n->idtfy_ctrl->cntlid, s->name, s->num_ctrls);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_leave
+    Description  :    Removes a controller from its subsystem, freed
+                      with the last one. The next controller defines
+                      the namespaces from then on.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_subsys_leave(NVMEState *n)
+{
+    NVMESubsys *s = n->subsys;
+
+    if (s == NULL) {
+        return;
+    }
+    QTAILQ_REMOVE(&s->ctrls, n, subsys_entry);
+    n->subsys = NULL;
+    n->resv = NULL;
+    if (--s->num_ctrls) {
+        return;
+    }
+    if (s->name) {
+        QTAILQ_REMOVE(&nvme_subsystems, s, entry);
+        qemu_free(s->name);
+    }
+    qemu_free(s->resv);
+    qemu_free(s);
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_drain
+    Description  :    Waits for the I/O transfers of every controller
+                      of the subsystem, e.g. before the backing files
+                      of a namespace are changed
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_subsys_drain(NVMEState *n)
+{
+    NVMEState *p;
+
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        nvme_workers_drain(p);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_ctrl
+    Description  :    Looks up a controller of the subsystem by its
+                      controller ID
+    Return Type  :    NVMEState * (NULL if none)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t    : Controller ID
+*********************************************************************/
+NVMEState *nvme_subsys_ctrl(NVMEState *n, uint16_t cntlid)
+{
+    NVMEState *p;
+
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        if (p->idtfy_ctrl->cntlid == cntlid) {
+            break;
+        }
+    }
+    return p;
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_nqn
+    Description  :    NVM Subsystem NQN of a controller, from the
+                      subsystem name or its instance
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      char *      : Out: NQN
+                      size_t      : Size of the buffer
+*********************************************************************/
+void nvme_subsys_nqn(NVMEState *n, char *buf, size_t len)
+{
+    if (n->subsys_name) {
+        snprintf(buf, len, NVME_SUBSYS_NQN_PREFIX "%s", n->subsys_name);
+    } else {
+        snprintf(buf, len, NVME_SUBSYS_NQN_PREFIX "nvme%d", n->instance);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_nguid
+    Description  :    Namespace Globally Unique Identifier: a hash of
+                      the subsystem NQN followed by the namespace id,
+                      the same whichever controller reports it
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+                      uint8_t *   : Out: 16 byte NGUID
+*********************************************************************/
+void nvme_subsys_nguid(NVMEState *n, uint32_t nsid, uint8_t *nguid)
+{
+    char nqn[sizeof(n->idtfy_ctrl->subnqn)];
+    uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+    const char *p;
+    int i;
+
+    nvme_subsys_nqn(n, nqn, sizeof(nqn));
+    for (p = nqn; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+    }
+    memset(nguid, 0, 16);
+    for (i = 0; i < 8; i++) {
+        nguid[i] = hash >> (56 - 8 * i);
+    }
+    for (i = 0; i < 4; i++) {
+        nguid[12 + i] = nsid >> (24 - 8 * i);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_subsys_ns_source
+    Description  :    Finds another controller of the subsystem with
+                      the backing files of a namespace open, for a
+                      controller to open them too
+    Return Type  :    DiskInfo * (NULL if none)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint32_t    : Namespace id
+*********************************************************************/
+DiskInfo *nvme_subsys_ns_source(NVMEState *n, uint32_t nsid)
+{
+    NVMEState *p;
+
+    QTAILQ_FOREACH(p, &n->subsys->ctrls, subsys_entry) {
+        if (p != n && nvme_storage_ready(&p->disk[nsid - 1])) {
+            return &p->disk[nsid - 1];
+        }
+    }
+    return NULL;
+}
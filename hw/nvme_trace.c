@@ -0,0 +1,705 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Command trace capture and replay.
+ *
+ * With trace=<file> every command completed by the device is appended to
+ * a binary log, see nvme_trace.h. With replay=<file> the device plays the
+ * host of a log instead of a guest: it enables the controller, creates an
+ * I/O queue pair for each queue of the log in RAM of its own, and submits
+ * the reads and writes of the log through the doorbells at their original
+ * pace, or faster, then reports their latency and throughput and shuts
+ * qemu down. The commands run through the whole device model, fetching,
+ * QoS, I/O workers, io_uring or backend, so a log replays the same on
+ * every build.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include "nvme_trace.h"
+
+/*
+ * The replay keeps its queues and data in RAM of the device mapped past
+ * any guest RAM, NVME_REPLAY_WINDOW bytes for each device, which the guest
+ * is never told about; offsets in it:
+ */
+#define NVME_REPLAY_ADDR   0xc00000000ULL
+#define NVME_REPLAY_WINDOW 0x10000000ULL
+#define NVME_REPLAY_ASQ    0
+#define NVME_REPLAY_ACQ    0x1000
+#define NVME_REPLAY_PRP    0x2000
+#define NVME_REPLAY_DATA   0x3000
+/* Transfers are cut to the 2MB the PRP list page describes */
+#define NVME_REPLAY_DATA_SIZE (PAGE_SIZE * (PAGE_SIZE / sizeof(uint64_t)))
+#define NVME_REPLAY_QSIZE  256
+/* Then the SQ and CQ of each I/O queue pair, from QID 1 */
+#define NVME_REPLAY_QUEUES (NVME_REPLAY_DATA + NVME_REPLAY_DATA_SIZE)
+#define NVME_REPLAY_QSTRIDE \
+    (NVME_REPLAY_QSIZE * (sizeof(NVMECmd) + sizeof(NVMECQE)))
+#define NVME_REPLAY_SQ(qid) \
+    (NVME_REPLAY_QUEUES + ((qid) - 1) * NVME_REPLAY_QSTRIDE)
+#define NVME_REPLAY_CQ(qid) \
+    (NVME_REPLAY_SQ(qid) + NVME_REPLAY_QSIZE * sizeof(NVMECmd))
+#define NVME_REPLAY_MAX_QUEUES \
+    ((NVME_REPLAY_WINDOW - NVME_REPLAY_QUEUES) / NVME_REPLAY_QSTRIDE)
+
+/* A traced SQ, replayed on a queue pair of its own */
+typedef struct NVMEReplayQueue {
+    uint16_t sq_id;       /* traced */
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t cq_rung;     /* CQ head last written to the doorbell */
+    uint32_t outstanding;
+    NVMETraceRecord **rec; /* of the SQ, in the order fetched */
+    uint64_t nrec;
+    uint64_t next;        /* next record to submit */
+    int64_t issued[NVME_REPLAY_QSIZE];
+} NVMEReplayQueue;
+
+typedef struct NVMEReplay {
+    NVMETraceRecord *rec;
+    uint64_t nrec;
+    uint64_t done;
+    uint32_t qsize;
+    NVMEReplayQueue *q;   /* QID 1 onwards */
+    uint16_t nq;
+    target_phys_addr_t addr;
+    ram_addr_t ram_size;
+    ram_addr_t ram_offset;
+    uint8_t *ram;
+    uint64_t data_size;   /* largest transfer */
+    int64_t vm_start;     /* vm_clock when the first record went */
+    int64_t start;        /* host clock when the first record went */
+    int64_t end;
+    uint32_t *lat;        /* us, of every completed command */
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t cut;         /* transfers cut to data_size */
+    int ready;
+    QEMUTimer *timer;
+} NVMEReplay;
+
+/*********************************************************************
+    Function     :    nvme_trace_init
+    Description  :    Creates the trace file of the device
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_trace_init(NVMEState *n)
+{
+    NVMETraceHeader h;
+    struct timeval tv;
+
+    n->trace_file = fopen(n->trace_path, "wb");
+    if (n->trace_file == NULL) {
+        LOG_ERR("Cannot create trace %s: %s", n->trace_path, strerror(errno));
+        return FAIL;
+    }
+    /* Records are written from the main thread, buffer them well */
+    setvbuf(n->trace_file, NULL, _IOFBF, 1 << 20);
+
+    gettimeofday(&tv, NULL);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, NVME_TRACE_MAGIC, sizeof(NVME_TRACE_MAGIC));
+    h.version = NVME_TRACE_VERSION;
+    h.record_size = sizeof(NVMETraceRecord);
+    h.start = tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+    h.num_namespaces = n->num_namespaces;
+    if (fwrite(&h, sizeof(h), 1, n->trace_file) != 1) {
+        LOG_ERR("Cannot write trace %s", n->trace_path);
+        fclose(n->trace_file);
+        n->trace_file = NULL;
+        return FAIL;
+    }
+    n->trace_start = get_clock();
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_trace_req
+    Description  :    Appends a request about to be completed to the
+                      trace
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request, with its status set
+*********************************************************************/
+void nvme_trace_req(NVMEState *n, NVMERequest *req)
+{
+    NVME_rw *e = (NVME_rw *)&req->cmd;
+    NVMETraceRecord r;
+
+    r.submit = req->trace_ns - n->trace_start;
+    r.complete = get_clock() - n->trace_start;
+    r.slba = e->slba;
+    r.nsid = e->nsid;
+    r.sq_id = req->sq_id;
+    r.cid = e->cid;
+    r.nlb = e->nlb;
+    memcpy(&r.status, &req->cqe.status, sizeof(r.status));
+    r.status &= ~1;
+    r.opcode = e->opcode;
+    r.flags = e->fuse;
+    r.rsvd = 0;
+    if (fwrite(&r, sizeof(r), 1, n->trace_file) != 1) {
+        LOG_ERR("Cannot write trace %s, stopped", n->trace_path);
+        fclose(n->trace_file);
+        n->trace_file = NULL;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_trace_uninit
+    Description  :    Closes the trace file, flushing it
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_trace_uninit(NVMEState *n)
+{
+    if (n->trace_file) {
+        fclose(n->trace_file);
+        n->trace_file = NULL;
+    }
+}
+
+static void nvme_replay_ram(void *host_addr, ram_addr_t offset,
+    ram_addr_t length, void *opaque)
+{
+    ram_addr_t *total = opaque;
+
+    *total += length;
+}
+
+static int nvme_replay_sq_cmp(const void *a, const void *b)
+{
+    uint16_t qa = *(const uint16_t *)a, qb = *(const uint16_t *)b;
+
+    return qa < qb ? -1 : qa > qb;
+}
+
+static int nvme_replay_cmp(const void *a, const void *b)
+{
+    const NVMETraceRecord *ra = a, *rb = b;
+
+    return ra->submit < rb->submit ? -1 : ra->submit > rb->submit;
+}
+
+static int nvme_replay_lat_cmp(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t *)a, lb = *(const uint32_t *)b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_load
+    Description  :    Reads the I/O commands of a trace the device can
+                      replay, in the order they were fetched
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      NVMEReplay * : Replay
+*********************************************************************/
+static int nvme_replay_load(NVMEState *n, NVMEReplay *r)
+{
+    NVMETraceHeader h;
+    NVMETraceRecord rec;
+    uint64_t skipped = 0, max = 0;
+    FILE *f;
+
+    f = fopen(n->replay_path, "rb");
+    if (f == NULL) {
+        LOG_ERR("Cannot open trace %s: %s", n->replay_path, strerror(errno));
+        return FAIL;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(h.magic, NVME_TRACE_MAGIC, sizeof(NVME_TRACE_MAGIC)) ||
+        h.version != NVME_TRACE_VERSION ||
+        h.record_size != sizeof(NVMETraceRecord)) {
+        LOG_ERR("%s is not a trace of version %d", n->replay_path,
+            NVME_TRACE_VERSION);
+        fclose(f);
+        return FAIL;
+    }
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        /* Admin commands and namespaces not there are left out */
+        if (rec.sq_id == 0 || rec.nsid == 0 ||
+            rec.nsid > n->num_namespaces ||
+            (rec.opcode != NVME_CMD_READ && rec.opcode != NVME_CMD_WRITE &&
+            rec.opcode != NVME_CMD_FLUSH &&
+            rec.opcode != NVME_CMD_ZONE_APPEND)) {
+            skipped++;
+            continue;
+        }
+        if (r->nrec == max) {
+            max = max ? max * 2 : 4096;
+            r->rec = qemu_realloc(r->rec, max * sizeof(rec));
+        }
+        r->rec[r->nrec++] = rec;
+    }
+    fclose(f);
+    if (r->nrec == 0) {
+        LOG_ERR("Nothing to replay in %s", n->replay_path);
+        return FAIL;
+    }
+    qsort(r->rec, r->nrec, sizeof(rec), nvme_replay_cmp);
+    LOG_NORM("Device:%d replaying %lu commands of %s, %lu left out",
+        n->instance, r->nrec, n->replay_path, skipped);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_queues
+    Description  :    Gives each SQ of the trace an I/O queue pair of
+                      the replay, their records in the order fetched;
+                      SQs past the queues the device has share them
+    Return Type  :    void
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      NVMEReplay * : Replay
+*********************************************************************/
+static void nvme_replay_queues(NVMEState *n, NVMEReplay *r)
+{
+    NVMEReplayQueue *q;
+    uint16_t *ids, *id;
+    uint64_t i, nids = 0;
+
+    ids = qemu_malloc(r->nrec * sizeof(*ids));
+    for (i = 0; i < r->nrec; i++) {
+        ids[i] = r->rec[i].sq_id;
+    }
+    qsort(ids, r->nrec, sizeof(*ids), nvme_replay_sq_cmp);
+    for (i = 0; i < r->nrec; i++) {
+        if (nids == 0 || ids[nids - 1] != ids[i]) {
+            ids[nids++] = ids[i];
+        }
+    }
+
+    r->nq = MIN(nids, MIN(NVME_MAX_QID(n), NVME_REPLAY_MAX_QUEUES));
+    if (r->nq < nids) {
+        LOG_NORM("Device:%d replays the %lu SQs traced on %u queues",
+            n->instance, nids, r->nq);
+    }
+    r->q = qemu_mallocz(r->nq * sizeof(*r->q));
+    for (i = 0; i < r->nq; i++) {
+        r->q[i].sq_id = ids[i];
+    }
+    for (i = 0; i < r->nrec; i++) {
+        id = bsearch(&r->rec[i].sq_id, ids, nids, sizeof(*ids),
+            nvme_replay_sq_cmp);
+        r->q[(id - ids) % r->nq].nrec++;
+    }
+    for (i = 0; i < r->nq; i++) {
+        r->q[i].rec = qemu_malloc(r->q[i].nrec * sizeof(*r->q[i].rec));
+    }
+    /* r->rec is sorted, so is each queue */
+    for (i = 0; i < r->nrec; i++) {
+        id = bsearch(&r->rec[i].sq_id, ids, nids, sizeof(*ids),
+            nvme_replay_sq_cmp);
+        q = &r->q[(id - ids) % r->nq];
+        q->rec[q->next++] = &r->rec[i];
+    }
+    for (i = 0; i < r->nq; i++) {
+        r->q[i].next = 0;
+    }
+    qemu_free(ids);
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_ram_init
+    Description  :    Allocates the RAM the replay keeps its queues and
+                      data in, and maps it where only the device looks
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      NVMEReplay * : Replay
+*********************************************************************/
+static int nvme_replay_ram_init(NVMEState *n, NVMEReplay *r)
+{
+    ram_addr_t ram = 0;
+
+    /* Guest RAM is below 4GB, and from 4GB on for what does not fit */
+    qemu_ram_foreach_block(nvme_replay_ram, &ram);
+    r->addr = NVME_REPLAY_ADDR + n->instance * NVME_REPLAY_WINDOW;
+    if (0x100000000ULL + ram > r->addr) {
+        LOG_ERR("Replay RAM at %#llx would be in guest RAM, give the guest "
+            "less", (unsigned long long)r->addr);
+        return FAIL;
+    }
+    r->ram_size = NVME_REPLAY_SQ(r->nq + 1);
+    r->ram_offset = qemu_ram_alloc(&n->dev.qdev, "nvme.replay", r->ram_size);
+    r->ram = qemu_get_ram_ptr(r->ram_offset);
+    cpu_register_physical_memory(r->addr, r->ram_size, r->ram_offset);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_setup
+    Description  :    Enables the controller and creates the I/O
+                      queue pairs of the replay, as a host driver would
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      NVMEReplay * : Replay
+*********************************************************************/
+static int nvme_replay_setup(NVMEState *n, NVMEReplay *r)
+{
+    NVMEAdmCmdCreateCQ cq;
+    NVMEAdmCmdCreateSQ sq;
+    NVMECQE cqe;
+    uint64_t prp;
+    uint32_t i;
+    uint16_t mqes, qid;
+
+    if (n->cntrl_reg[NVME_CTST] & CC_EN) {
+        LOG_ERR("The guest enabled the controller, which replay needs");
+        return FAIL;
+    }
+
+    /* 2 entry admin queues, 4KB pages, 64 byte SQ and 16 byte CQ entries */
+    nvme_mmio_writel(n, NVME_AQA, 0x00010001);
+    nvme_mmio_writel(n, NVME_ASQ, r->addr + NVME_REPLAY_ASQ);
+    nvme_mmio_writel(n, NVME_ASQ + 4, (r->addr + NVME_REPLAY_ASQ) >> 32);
+    nvme_mmio_writel(n, NVME_ACQ, r->addr + NVME_REPLAY_ACQ);
+    nvme_mmio_writel(n, NVME_ACQ + 4, (r->addr + NVME_REPLAY_ACQ) >> 32);
+    nvme_mmio_writel(n, NVME_CC, CC_EN | (6 << 16) | (4 << 20));
+    if (!(n->cntrl_reg[NVME_CTST] & CC_EN)) {
+        LOG_ERR("Replay could not enable the controller");
+        return FAIL;
+    }
+
+    memcpy(&mqes, n->cntrl_reg, sizeof(mqes));
+    r->qsize = MIN(NVME_REPLAY_QSIZE, mqes + 1);
+
+    /* No interrupts, completions are seen in nvme_req_complete() */
+    for (qid = 1; qid <= r->nq; qid++) {
+        memset(&cq, 0, sizeof(cq));
+        cq.opcode = NVME_ADM_CMD_CREATE_CQ;
+        cq.prp1 = r->addr + NVME_REPLAY_CQ(qid);
+        cq.qid = qid;
+        cq.qsize = r->qsize - 1;
+        cq.pc = 1;
+        memset(&cqe, 0, sizeof(cqe));
+        nvme_admin_command(n, (NVMECmd *)&cq, &cqe);
+        if (cqe.status.sc || cqe.status.sct) {
+            LOG_ERR("Replay could not create CQ %u", qid);
+            return FAIL;
+        }
+        memset(&sq, 0, sizeof(sq));
+        sq.opcode = NVME_ADM_CMD_CREATE_SQ;
+        sq.prp1 = r->addr + NVME_REPLAY_SQ(qid);
+        sq.qid = qid;
+        sq.qsize = r->qsize - 1;
+        sq.pc = 1;
+        sq.cqid = qid;
+        memset(&cqe, 0, sizeof(cqe));
+        nvme_admin_command(n, (NVMECmd *)&sq, &cqe);
+        if (cqe.status.sc || cqe.status.sct) {
+            LOG_ERR("Replay could not create SQ %u", qid);
+            return FAIL;
+        }
+    }
+
+    /* Every command uses the same buffer, through the same PRP list */
+    r->data_size = NVME_REPLAY_DATA_SIZE;
+    if (n->idtfy_ctrl->mdts) {
+        r->data_size = MIN(r->data_size,
+            (uint64_t)PAGE_SIZE << n->idtfy_ctrl->mdts);
+    }
+    for (i = 1; i < r->data_size / PAGE_SIZE; i++) {
+        prp = r->addr + NVME_REPLAY_DATA + i * PAGE_SIZE;
+        memcpy(r->ram + NVME_REPLAY_PRP + (i - 1) * sizeof(prp), &prp,
+            sizeof(prp));
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_cmd
+    Description  :    Builds the command of a trace record, its data
+                      in the replay buffer
+    Return Type  :    void
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEReplay *      : Replay
+                      NVMETraceRecord * : Record
+                      NVME_rw *         : Command to fill in
+*********************************************************************/
+static void nvme_replay_cmd(NVMEState *n, NVMEReplay *r,
+    NVMETraceRecord *rec, NVME_rw *e)
+{
+    DiskInfo *disk = &n->disk[rec->nsid - 1];
+    uint8_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+    uint32_t lba_sz = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+    uint64_t len;
+    uint32_t nlb = rec->nlb + 1;
+
+    if (disk->idtfy_ns.flbas & 0x10) {
+        lba_sz += disk->idtfy_ns.lbafx[lba_idx].ms;
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->opcode = rec->opcode;
+    e->nsid = rec->nsid;
+    e->slba = rec->slba;
+    e->nlb = rec->nlb;
+    if (rec->opcode == NVME_CMD_FLUSH) {
+        return;
+    }
+
+    len = (uint64_t)nlb * lba_sz;
+    if (len > r->data_size) {
+        nlb = r->data_size / lba_sz;
+        e->nlb = nlb - 1;
+        len = (uint64_t)nlb * lba_sz;
+        r->cut++;
+    }
+    r->bytes += len;
+    e->prp1 = r->addr + NVME_REPLAY_DATA;
+    if (len > 2 * PAGE_SIZE) {
+        e->prp2 = r->addr + NVME_REPLAY_PRP;
+    } else if (len > PAGE_SIZE) {
+        e->prp2 = r->addr + NVME_REPLAY_DATA + PAGE_SIZE;
+    }
+    /* Separate meta-data lands in the data buffer as well */
+    e->mptr = r->addr + NVME_REPLAY_DATA;
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_report
+    Description  :    Logs the latency and throughput of the replay
+    Return Type  :    void
+
+    Arguments    :    NVMEState *  : Pointer to NVME device State
+                      NVMEReplay * : Replay
+*********************************************************************/
+static void nvme_replay_report(NVMEState *n, NVMEReplay *r)
+{
+    uint64_t elapsed = MAX(r->end - r->start, 1);
+    uint64_t orig = r->rec[r->nrec - 1].complete - r->rec[0].submit;
+    uint64_t i, sum = 0;
+
+    qsort(r->lat, r->done, sizeof(*r->lat), nvme_replay_lat_cmp);
+    for (i = 0; i < r->done; i++) {
+        sum += r->lat[i];
+    }
+    LOG_NORM("Device:%d replayed %lu commands on %u queues in %lu ms "
+        "(%lu ms traced), %lu errors, %lu transfers cut", n->instance,
+        r->done, r->nq, elapsed / 1000000, orig / 1000000, r->errors,
+        r->cut);
+    LOG_NORM("Device:%d %lu IOPS, %lu KB/s", n->instance,
+        r->done * 1000000000 / elapsed,
+        r->bytes * 1000000000 / elapsed / 1024);
+    LOG_NORM("Device:%d latency us: avg %lu, p50 %u, p99 %u, p99.9 %u, "
+        "max %u", n->instance, sum / r->done, r->lat[r->done / 2],
+        r->lat[r->done * 99 / 100], r->lat[r->done * 999 / 1000],
+        r->lat[r->done - 1]);
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_submit
+    Description  :    Submits the records of a queue that are due, as
+                      its SQ has room
+    Return Type  :    int64_t : vm_clock the next record is due at, 0
+                      if none waits for its time
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEReplay *      : Replay
+                      uint16_t          : QID of the queue
+                      int64_t           : vm_clock now
+*********************************************************************/
+static int64_t nvme_replay_submit(NVMEState *n, NVMEReplay *r, uint16_t qid,
+    int64_t now)
+{
+    NVMEReplayQueue *q = &r->q[qid - 1];
+    NVMETraceRecord *rec;
+    NVME_rw e;
+    int64_t due = 0;
+    uint16_t tail = q->sq_tail;
+
+    while (q->next < q->nrec && q->outstanding < r->qsize - 1) {
+        rec = q->rec[q->next];
+        if (n->replay_speed) {
+            due = r->vm_start + (rec->submit - r->rec[0].submit) /
+                n->replay_speed;
+            if (due > now) {
+                break;
+            }
+            due = 0;
+        }
+        nvme_replay_cmd(n, r, rec, &e);
+        e.cid = tail;
+        memcpy(r->ram + NVME_REPLAY_SQ(qid) + tail * sizeof(e), &e,
+            sizeof(e));
+        q->issued[tail] = get_clock();
+        tail = (tail + 1) % r->qsize;
+        q->outstanding++;
+        q->next++;
+    }
+
+    if (q->cq_head != q->cq_rung) {
+        q->cq_rung = q->cq_head;
+        nvme_mmio_writel(n, NVME_CQ0HDBL + qid * QUEUE_BASE_ADDRESS_WIDTH,
+            q->cq_head);
+    }
+    if (tail != q->sq_tail) {
+        q->sq_tail = tail;
+        nvme_mmio_writel(n, NVME_SQ0TDBL + qid * QUEUE_BASE_ADDRESS_WIDTH,
+            tail);
+    }
+    return due;
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_timer_cb
+    Description  :    Submits the records that are due on each queue,
+                      and returns the CQ entries reaped
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_replay_timer_cb(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMEReplay *r = n->replay;
+    int64_t now = qemu_get_clock_ns(vm_clock), due, next = 0;
+    uint16_t qid;
+
+    if (!r->ready) {
+        if (nvme_replay_setup(n, r)) {
+            LOG_ERR("Device:%d replay abandoned", n->instance);
+            return;
+        }
+        r->ready = 1;
+        r->vm_start = now;
+        r->start = get_clock();
+    }
+
+    /* Each SQ keeps its own order; a full one holds back only itself */
+    for (qid = 1; qid <= r->nq; qid++) {
+        due = nvme_replay_submit(n, r, qid, now);
+        if (due && (next == 0 || due < next)) {
+            next = due;
+        }
+    }
+    if (next) {
+        qemu_mod_timer(r->timer, next);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_complete
+    Description  :    Accounts a replayed command being completed, and
+                      reports once all are
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request of a replay I/O SQ
+*********************************************************************/
+void nvme_replay_complete(NVMEState *n, NVMERequest *req)
+{
+    NVMEReplay *r = n->replay;
+    NVMEReplayQueue *q;
+    uint16_t cid = req->cmd.cid;
+
+    if (!r->ready || req->sq_id == 0 || req->sq_id > r->nq ||
+        cid >= r->qsize) {
+        return;
+    }
+    q = &r->q[req->sq_id - 1];
+    r->end = get_clock();
+    r->lat[r->done++] = (r->end - q->issued[cid]) / 1000;
+    q->outstanding--;
+    q->cq_head = (q->cq_head + 1) % r->qsize;
+    if (req->cqe.status.sc || req->cqe.status.sct) {
+        r->errors++;
+    }
+
+    if (r->done == r->nrec) {
+        nvme_replay_report(n, r);
+        qemu_system_shutdown_request();
+    } else {
+        /* Room for the next ones, if due */
+        qemu_mod_timer(r->timer, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_init
+    Description  :    Loads the trace to replay, which starts as soon
+                      as the VM runs
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_replay_init(NVMEState *n)
+{
+    NVMEReplay *r = qemu_mallocz(sizeof(*r));
+    uint16_t i;
+
+    if (nvme_replay_load(n, r)) {
+        qemu_free(r->rec);
+        qemu_free(r);
+        return FAIL;
+    }
+    nvme_replay_queues(n, r);
+    if (nvme_replay_ram_init(n, r)) {
+        for (i = 0; i < r->nq; i++) {
+            qemu_free(r->q[i].rec);
+        }
+        qemu_free(r->q);
+        qemu_free(r->rec);
+        qemu_free(r);
+        return FAIL;
+    }
+    r->lat = qemu_malloc(r->nrec * sizeof(*r->lat));
+    r->timer = qemu_new_timer_ns(vm_clock, nvme_replay_timer_cb, n);
+    qemu_mod_timer(r->timer, qemu_get_clock_ns(vm_clock));
+    n->replay = r;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_replay_uninit
+    Description  :    Stops the replay
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_replay_uninit(NVMEState *n)
+{
+    NVMEReplay *r = n->replay;
+    uint16_t i;
+
+    if (r == NULL) {
+        return;
+    }
+    qemu_del_timer(r->timer);
+    qemu_free_timer(r->timer);
+    cpu_register_physical_memory(r->addr, r->ram_size, IO_MEM_UNASSIGNED);
+    qemu_ram_free(r->ram_offset);
+    for (i = 0; i < r->nq; i++) {
+        qemu_free(r->q[i].rec);
+    }
+    qemu_free(r->q);
+    qemu_free(r->lat);
+    qemu_free(r->rec);
+    qemu_free(r);
+    n->replay = NULL;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef NVME_TRACE_H
+#define NVME_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Command trace written by an NVMe device started with trace=<file>, and
+ * read back with replay=<file>. A header is followed by one record per
+ * command in the order they complete, in host byte order. Times are in
+ * ns of the host monotonic clock since the trace started.
+ */
+
+#define NVME_TRACE_MAGIC   "NVMETRC"
+#define NVME_TRACE_VERSION 1
+
+typedef struct NVMETraceHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t start;          /* host time of day, ns since the Epoch */
+    uint32_t num_namespaces;
+    uint32_t rsvd;
+} NVMETraceHeader;
+
+typedef struct NVMETraceRecord {
+    uint64_t submit;         /* fetched from its SQ */
+    uint64_t complete;       /* posted to its CQ */
+    uint64_t slba;           /* CDW10-11 */
+    uint32_t nsid;
+    uint16_t sq_id;          /* 0 for admin commands */
+    uint16_t cid;
+    uint16_t nlb;            /* CDW12[0-15], 0's based */
+    uint16_t status;         /* status field of the CQE, phase tag clear */
+    uint8_t  opcode;
+    uint8_t  flags;          /* CDW0[8-15]: fuse and PSDT */
+    uint16_t rsvd;
+} NVMETraceRecord;
+
+#endif /* NVME_TRACE_H */
@@ -0,0 +1,645 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * io_uring engine.
+ *
+ * An alternative to the I/O worker threads: the transfers collected for
+ * a request go to the host kernel as io_uring entries, reading into and
+ * writing from guest RAM registered as fixed buffers, on the namespace
+ * files registered as fixed files. Entries are published as the commands
+ * are fetched and the kernel is entered once per batch from a bottom
+ * half, or not at all while a SQPOLL thread is awake. Completions are
+ * reaped from the shared completion ring by the SQ processing timer and
+ * when the ring file descriptor polls readable. So the queue depth of
+ * the guest becomes the queue depth of the host.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+#ifdef CONFIG_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* The kernel registers fixed buffers of at most 1 GB */
+#define NVME_URING_BUF_MAX (1ULL << 30)
+
+typedef struct NVMEUring {
+    int fd;
+    struct io_uring_params p;
+    /* Submission ring, entries up to tail are filled in */
+    uint8_t *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    struct io_uring_sqe *sqes;
+    unsigned tail;
+    unsigned submitted;
+    /* Completion ring, shares the mapping of the submission ring when
+     * the kernel has IORING_FEAT_SINGLE_MMAP */
+    uint8_t *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Guest RAM registered on the first transfer, none if refused */
+    struct iovec *bufs;
+    uint32_t nbufs;
+    int bufs_registered;
+    /* Fixed files: data and meta-data of each namespace, NULL if the
+     * kernel refused them */
+    int *files;
+    /* Enters the kernel for the entries of a batch */
+    QEMUBH *bh;
+} NVMEUring;
+
+static unsigned nvme_uring_load(unsigned *p)
+{
+    unsigned v = *(volatile unsigned *)p;
+
+    __sync_synchronize();
+    return v;
+}
+
+static void nvme_uring_store(unsigned *p, unsigned v)
+{
+    __sync_synchronize();
+    *(volatile unsigned *)p = v;
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_flush
+    Description  :    Enters the kernel to submit the published entries
+                      and to wait for completions or, with SQPOLL, for
+                      room in the submission ring. A SQPOLL thread that
+                      is awake needs no system call at all. When the
+                      completion ring overflowed, completions are
+                      reaped instead.
+    Return Type  :    int (0:-1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      unsigned    : Completions to wait for
+                      unsigned    : io_uring_enter() flags
+*********************************************************************/
+static int nvme_uring_flush(NVMEState *n, unsigned min_complete,
+    unsigned flags)
+{
+    NVMEUring *u = n->uring;
+    int ret;
+
+    if (u->p.flags & IORING_SETUP_SQPOLL) {
+        u->submitted = u->tail;
+        if (nvme_uring_load(u->sq_flags) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        } else if (min_complete == 0 && !(flags & IORING_ENTER_SQ_WAIT)) {
+            return 0;
+        }
+    } else if (min_complete == 0 && u->submitted == u->tail) {
+        return 0;
+    }
+    if (min_complete) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    do {
+        ret = syscall(__NR_io_uring_enter, u->fd, u->tail - u->submitted,
+            min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno == EBUSY || errno == EAGAIN) {
+            nvme_uring_complete(n);
+            return 0;
+        }
+        LOG_ERR("io_uring_enter failed: %s", strerror(errno));
+        return -1;
+    }
+    if (!(u->p.flags & IORING_SETUP_SQPOLL)) {
+        u->submitted += ret;
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_flush_bh
+    Description  :    Submits the entries of the commands fetched since
+                      the last run, once per main loop iteration
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+static void nvme_uring_flush_bh(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMEUring *u = n->uring;
+
+    nvme_uring_flush(n, 0, 0);
+    if (u->submitted != u->tail) {
+        /* Completion ring overflowed, try again */
+        qemu_bh_schedule(u->bh);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_add_block
+    Description  :    Adds a block of guest RAM to the fixed buffers
+    Return Type  :    void
+
+    Arguments    :    void *     : Host address of the block
+                      ram_addr_t : Offset of the block
+                      ram_addr_t : Length of the block
+                      void *     : NVMEUring
+*********************************************************************/
+static void nvme_uring_add_block(void *host, ram_addr_t offset,
+    ram_addr_t length, void *opaque)
+{
+    NVMEUring *u = opaque;
+    ram_addr_t done;
+
+    for (done = 0; done < length; done += NVME_URING_BUF_MAX) {
+        u->bufs = qemu_realloc(u->bufs, (u->nbufs + 1) * sizeof(*u->bufs));
+        u->bufs[u->nbufs].iov_base = (uint8_t *)host + done;
+        u->bufs[u->nbufs].iov_len = MIN(length - done, NVME_URING_BUF_MAX);
+        u->nbufs++;
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_register_buffers
+    Description  :    Registers the guest RAM as fixed buffers, which
+                      pins it. Done on the first transfer, when every
+                      RAM block of the machine exists.
+    Return Type  :    void
+
+    Arguments    :    NVMEUring * : Ring
+*********************************************************************/
+static void nvme_uring_register_buffers(NVMEUring *u)
+{
+    u->bufs_registered = 1;
+    qemu_ram_foreach_block(nvme_uring_add_block, u);
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+        u->bufs, u->nbufs) < 0) {
+        LOG_NORM("Guest RAM not registered with io_uring: %s",
+            strerror(errno));
+        qemu_free(u->bufs);
+        u->bufs = NULL;
+        u->nbufs = 0;
+        return;
+    }
+    LOG_NORM("Registered %u guest RAM buffers with io_uring", u->nbufs);
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_buffer
+    Description  :    Finds the fixed buffer holding a host range
+    Return Type  :    int (buffer index, -1 if none)
+
+    Arguments    :    NVMEUring * : Ring
+                      uint8_t *   : Host address
+                      uint64_t    : Length in bytes
+*********************************************************************/
+static int nvme_uring_buffer(NVMEUring *u, uint8_t *host, uint64_t len)
+{
+    uint8_t *base;
+    uint32_t i;
+
+    for (i = 0; i < u->nbufs; i++) {
+        base = u->bufs[i].iov_base;
+        if (host >= base && host + len <= base + u->bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_file
+    Description  :    Finds the fixed file slot of a backing file,
+                      registering the file in it once after it was
+                      opened. The slot holds the O_DIRECT descriptor
+                      when the file has one.
+    Return Type  :    int (slot, -1 if none)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      NVMEBackingFile * : Backing file
+*********************************************************************/
+static int nvme_uring_file(NVMEState *n, NVMEBackingFile *bf)
+{
+    NVMEUring *u = n->uring;
+    struct io_uring_files_update up;
+    int slot = -1;
+    uint32_t i;
+
+    if (u->files == NULL) {
+        return -1;
+    }
+    for (i = 0; i < n->num_namespaces && slot < 0; i++) {
+        if (bf == &n->disk[i].data) {
+            slot = 2 * i;
+        } else if (bf == &n->disk[i].meta) {
+            slot = 2 * i + 1;
+        }
+    }
+    if (slot < 0) {
+        return -1;
+    }
+    if (!bf->uring_fixed) {
+        memset(&up, 0, sizeof(up));
+        up.offset = slot;
+        up.fds = (uintptr_t)(bf->direct_fd >= 0 ? &bf->direct_fd : &bf->fd);
+        if (syscall(__NR_io_uring_register, u->fd,
+            IORING_REGISTER_FILES_UPDATE, &up, 1) != 1) {
+            LOG_ERR("Fixed file %d not updated: %s", slot, strerror(errno));
+            return -1;
+        }
+        bf->uring_fixed = 1;
+        u->files[slot] = bf->direct_fd >= 0 ? bf->direct_fd : bf->fd;
+    }
+    return slot;
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_get_sqe
+    Description  :    Takes the next free entry of the submission
+                      ring, making room when it is full
+    Return Type  :    struct io_uring_sqe *
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+static struct io_uring_sqe *nvme_uring_get_sqe(NVMEState *n)
+{
+    NVMEUring *u = n->uring;
+    struct io_uring_sqe *sqe;
+
+    while (u->tail - nvme_uring_load(u->sq_head) >= u->p.sq_entries) {
+        nvme_uring_store(u->sq_tail, u->tail);
+        nvme_uring_flush(n, 0, IORING_ENTER_SQ_WAIT);
+    }
+    sqe = &u->sqes[u->tail & *u->sq_mask];
+    u->tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_put
+    Description  :    Drops a reference on a request's transfers and
+                      completes the request after the last one
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+static void nvme_uring_put(NVMEState *n, NVMERequest *req)
+{
+    if (--req->xfer_pending == 0) {
+        nvme_worker_finish(n, req);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_submit
+    Description  :    Queues the transfers of a request on the ring,
+                      keeping a CQ entry for it. The kernel is entered
+                      after the batch of commands being fetched.
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+void nvme_uring_submit(NVMEState *n, NVMERequest *req)
+{
+    NVMEUring *u = n->uring;
+    NVMEIOSQueue *sq = n->sq[req->sq_id];
+    struct io_uring_sqe *sqe;
+    NVMEXfer *x;
+    uint32_t i;
+    int buf, file, fd;
+
+    n->cq[sq->cq_id]->inflight++;
+    n->worker_inflight++;
+    if (!u->bufs_registered) {
+        nvme_uring_register_buffers(u);
+    }
+
+    /* Held until every transfer is queued, as making room in the ring
+     * may complete the first ones */
+    req->xfer_pending = req->nxfer + 1;
+    for (i = 0; i < req->nxfer; i++) {
+        x = &req->xfer[i];
+        sqe = nvme_uring_get_sqe(n);
+        buf = nvme_uring_buffer(u, x->host, x->len);
+        if (buf >= 0) {
+            sqe->opcode = x->is_write ? IORING_OP_WRITE_FIXED :
+                IORING_OP_READ_FIXED;
+            sqe->buf_index = buf;
+        } else {
+            sqe->opcode = x->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        fd = x->direct ? x->bf->direct_fd : x->bf->fd;
+        file = nvme_uring_file(n, x->bf);
+        if (file >= 0 && u->files[file] == fd) {
+            sqe->fd = file;
+            sqe->flags = IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = fd;
+        }
+        sqe->addr = (uintptr_t)x->host;
+        sqe->len = x->len;
+        sqe->off = x->offset;
+        sqe->user_data = (uintptr_t)x;
+    }
+    nvme_uring_store(u->sq_tail, u->tail);
+    qemu_bh_schedule(u->bh);
+    nvme_uring_put(n, req);
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_xfer_done
+    Description  :    Accounts for a completed transfer, finishing a
+                      short one synchronously
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMEXfer *  : Transfer
+                      int         : Bytes transferred or -errno
+*********************************************************************/
+static void nvme_uring_xfer_done(NVMEState *n, NVMEXfer *x, int res)
+{
+    NVMERequest *req = x->req;
+    NVMEStatusField *sf = (NVMEStatusField *) &req->cqe.status;
+
+    if (res < 0) {
+        LOG_ERR("Backing file %s failed at offset %lu: %s",
+            x->is_write ? "write" : "read", x->offset, strerror(-res));
+        sf->sc = NVME_SC_INTERNAL;
+    } else if (res < x->len && nvme_backing_pio(x->bf, x->host + res,
+        x->offset + res, x->len - res, x->is_write)) {
+        sf->sc = NVME_SC_INTERNAL;
+    }
+    nvme_uring_put(n, req);
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_complete
+    Description  :    Reaps the completion ring without entering the
+                      kernel, unless completions overflowed the ring
+                      and wait in the kernel. Handler of the ring file
+                      descriptor, also polled by the SQ processing
+                      timer.
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+void nvme_uring_complete(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMEUring *u = n->uring;
+    struct io_uring_cqe *cqe;
+    unsigned head = *u->cq_head;
+    NVMEXfer *x;
+    int res;
+
+    for (;;) {
+        while (head != nvme_uring_load(u->cq_tail)) {
+            cqe = &u->cqes[head & *u->cq_mask];
+            x = (NVMEXfer *)(uintptr_t)cqe->user_data;
+            res = cqe->res;
+            nvme_uring_store(u->cq_head, ++head);
+            nvme_uring_xfer_done(n, x, res);
+        }
+        if (!(nvme_uring_load(u->sq_flags) & IORING_SQ_CQ_OVERFLOW)) {
+            break;
+        }
+        /* Have the kernel move the overflowed completions to the ring */
+        if (syscall(__NR_io_uring_enter, u->fd, 0, 0,
+            IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            LOG_ERR("io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_drain
+    Description  :    Waits for every transfer on the ring and
+                      completes the requests
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_uring_drain(NVMEState *n)
+{
+    nvme_uring_store(n->uring->sq_tail, n->uring->tail);
+    while (n->worker_inflight) {
+        if (nvme_uring_flush(n, 1, 0)) {
+            return;
+        }
+        nvme_uring_complete(n);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_map
+    Description  :    Maps the rings and entries shared with the kernel
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEUring * : Ring being set up
+*********************************************************************/
+static int nvme_uring_map(NVMEUring *u)
+{
+    struct io_uring_params *p = &u->p;
+    void *ptr;
+
+    u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p->cq_off.cqes +
+        p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_ring_size = u->cq_ring_size =
+            MAX(u->sq_ring_size, u->cq_ring_size);
+    }
+
+    ptr = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        return FAIL;
+    }
+    u->sq_ring = ptr;
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        ptr = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED) {
+            return FAIL;
+        }
+        u->cq_ring = ptr;
+    }
+    ptr = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+        IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) {
+        return FAIL;
+    }
+    u->sqes = ptr;
+
+    u->sq_head = (unsigned *)(u->sq_ring + p->sq_off.head);
+    u->sq_tail = (unsigned *)(u->sq_ring + p->sq_off.tail);
+    u->sq_mask = (unsigned *)(u->sq_ring + p->sq_off.ring_mask);
+    u->sq_flags = (unsigned *)(u->sq_ring + p->sq_off.flags);
+    u->cq_head = (unsigned *)(u->cq_ring + p->cq_off.head);
+    u->cq_tail = (unsigned *)(u->cq_ring + p->cq_off.tail);
+    u->cq_mask = (unsigned *)(u->cq_ring + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(u->cq_ring + p->cq_off.cqes);
+    u->tail = u->submitted = *u->sq_tail;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_unmap
+    Description  :    Unmaps what nvme_uring_map() mapped
+    Return Type  :    void
+
+    Arguments    :    NVMEUring * : Ring
+*********************************************************************/
+static void nvme_uring_unmap(NVMEUring *u)
+{
+    if (u->sqes) {
+        munmap(u->sqes, u->p.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (u->cq_ring && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_init
+    Description  :    Sets up the ring of the device, with a kernel
+                      SQ polling thread if asked for
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_uring_init(NVMEState *n)
+{
+    NVMEUring *u = qemu_mallocz(sizeof(*u));
+    unsigned *array;
+    uint32_t i, nfiles = 2 * n->num_namespaces;
+
+    if (n->uring_sqpoll) {
+        u->p.flags |= IORING_SETUP_SQPOLL;
+        u->p.sq_thread_idle = n->uring_sqpoll;
+    }
+    u->fd = syscall(__NR_io_uring_setup, n->uring_entries, &u->p);
+    if (u->fd < 0) {
+        LOG_ERR("Cannot set up io_uring: %s", strerror(errno));
+        qemu_free(u);
+        return FAIL;
+    }
+    if (nvme_uring_map(u)) {
+        LOG_ERR("Cannot map the io_uring rings: %s", strerror(errno));
+        nvme_uring_unmap(u);
+        close(u->fd);
+        qemu_free(u);
+        return FAIL;
+    }
+    /* Entries are used in ring order */
+    array = (unsigned *)(u->sq_ring + u->p.sq_off.array);
+    for (i = 0; i < u->p.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    /* Empty slots, filled in as the files are used */
+    u->files = qemu_malloc(nfiles * sizeof(*u->files));
+    for (i = 0; i < nfiles; i++) {
+        u->files[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES,
+        u->files, nfiles) < 0) {
+        LOG_NORM("No fixed files with io_uring: %s", strerror(errno));
+        qemu_free(u->files);
+        u->files = NULL;
+    }
+
+    n->uring = u;
+    u->bh = qemu_bh_new(nvme_uring_flush_bh, n);
+    qemu_set_fd_handler(u->fd, nvme_uring_complete, NULL, n);
+    LOG_NORM("Device:%d io_uring of %u entries%s", n->instance,
+        u->p.sq_entries, n->uring_sqpoll ? " with SQPOLL" : "");
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_uring_uninit
+    Description  :    Completes the outstanding requests and tears
+                      the ring down
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_uring_uninit(NVMEState *n)
+{
+    NVMEUring *u = n->uring;
+
+    if (u == NULL) {
+        return;
+    }
+    nvme_uring_drain(n);
+    qemu_set_fd_handler(u->fd, NULL, NULL, NULL);
+    qemu_bh_delete(u->bh);
+    nvme_uring_unmap(u);
+    close(u->fd);
+    qemu_free(u->bufs);
+    qemu_free(u->files);
+    qemu_free(u);
+    n->uring = NULL;
+}
+
+#else
+
+int nvme_uring_init(NVMEState *n)
+{
+    LOG_ERR("Built without io_uring support");
+    return FAIL;
+}
+
+void nvme_uring_uninit(NVMEState *n)
+{
+}
+
+void nvme_uring_submit(NVMEState *n, NVMERequest *req)
+{
+}
+
+void nvme_uring_complete(void *opaque)
+{
+}
+
+void nvme_uring_drain(NVMEState *n)
+{
+}
+
+#endif /* CONFIG_IO_URING */
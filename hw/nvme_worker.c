@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * I/O worker threads.
+ *
+ * The main thread keeps fetching commands, checking them and posting
+ * completions, since guest memory, the CQs and MSI-X may only be touched
+ * from there. For reads and writes it maps the guest buffers and hands
+ * the copies to the worker of the SQ, so the commands of one SQ run in
+ * order on one host thread while different SQs run in parallel. Workers
+ * push finished requests on a list without taking any lock and wake the
+ * main loop through a pipe, which then posts the CQ entries.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include <poll.h>
+
+/*********************************************************************
+    Function     :    nvme_xfer_run
+    Description  :    Copies one transfer between the backing file
+                      and the mapped guest memory
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEXfer * : Transfer
+*********************************************************************/
+int nvme_xfer_run(NVMEXfer *x)
+{
+    if (x->direct) {
+        return nvme_backing_dio(x->bf, x->host, x->offset, x->len,
+            x->is_write);
+    }
+    return nvme_backing_pio(x->bf, x->host, x->offset, x->len, x->is_write);
+}
+
+/*********************************************************************
+    Function     :    nvme_worker_done
+    Description  :    Pushes a request on the list of done requests,
+                      waking the main loop when the list was empty.
+                      Called from the workers.
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+static void nvme_worker_done(NVMEState *n, NVMERequest *req)
+{
+    NVMERequest *head;
+    char c = 0;
+
+    do {
+        head = n->worker_done;
+        req->done_next = head;
+    } while (!__sync_bool_compare_and_swap(&n->worker_done, head, req));
+
+    if (head == NULL && write(n->worker_pipe[1], &c, 1) != 1) {
+        /* The pipe is already full of wake ups */
+        LOG_DBG("Worker wake up not written");
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_worker_thread
+    Description  :    Runs the transfers of the requests queued to a
+                      worker until it is stopped
+    Return Type  :    void *
+
+    Arguments    :    void * : NVMEWorker of the thread
+*********************************************************************/
+static void *nvme_worker_thread(void *opaque)
+{
+    NVMEWorker *w = opaque;
+    NVMERequest *req;
+    NVMEStatusField *sf;
+    uint32_t i;
+
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        req = QSIMPLEQ_FIRST(&w->queue);
+        if (req == NULL) {
+            if (w->stop) {
+                break;
+            }
+            qemu_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&w->queue, worker_entry);
+        qemu_mutex_unlock(&w->lock);
+
+        for (i = 0; i < req->nxfer; i++) {
+            if (nvme_xfer_run(&req->xfer[i])) {
+                sf = (NVMEStatusField *) &req->cqe.status;
+                sf->sc = NVME_SC_INTERNAL;
+                break;
+            }
+        }
+        nvme_worker_done(w->n, req);
+
+        qemu_mutex_lock(&w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/*********************************************************************
+    Function     :    nvme_worker_finish
+    Description  :    Releases the guest memory of a request done by
+                      a worker or io_uring and posts its completion
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+void nvme_worker_finish(NVMEState *n, NVMERequest *req)
+{
+    NVMEIOSQueue *sq = n->sq[req->sq_id];
+    NVMEXfer *x;
+    uint32_t i;
+
+    for (i = 0; i < req->nxfer; i++) {
+        x = &req->xfer[i];
+        /* Guest pages read into are marked dirty here */
+        cpu_physical_memory_unmap(x->host, x->len, !x->is_write, x->len);
+        if (x->is_write) {
+            nvme_backing_set_dirty(x->bf, x->offset, x->len);
+        }
+    }
+    if (req->rw_linked) {
+        QTAILQ_REMOVE(&n->disk[req->cmd.nsid - 1].rw_inflight, req,
+            rw_entry);
+        req->rw_linked = 0;
+    }
+    if (req->jslot) {
+        nvme_journal_applied(&n->disk[req->cmd.nsid - 1], req->jslot - 1);
+        req->jslot = 0;
+    }
+    req->nxfer = 0;
+    n->cq[sq->cq_id]->inflight--;
+    n->worker_inflight--;
+    nvme_req_complete(n, req);
+}
+
+/*********************************************************************
+    Function     :    nvme_workers_complete
+    Description  :    Completes every request the workers are done
+                      with. Handler of the worker pipe, also polled
+                      by the SQ processing timer.
+    Return Type  :    void
+
+    Arguments    :    void * : Pointer to NVME device State
+*********************************************************************/
+void nvme_workers_complete(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMERequest *req, *next, *list = NULL;
+    char buf[64];
+
+    /* Read the wake ups before taking the list, so none gets lost */
+    while (read(n->worker_pipe[0], buf, sizeof(buf)) > 0) {
+        ;
+    }
+    req = __sync_lock_test_and_set(&n->worker_done, NULL);
+
+    /* The list is in reverse order of completion */
+    while (req != NULL) {
+        next = req->done_next;
+        req->done_next = list;
+        list = req;
+        req = next;
+    }
+    for (req = list; req != NULL; req = next) {
+        next = req->done_next;
+        nvme_worker_finish(n, req);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_worker_add_xfer
+    Description  :    Maps the guest memory of a transfer for the
+                      request being processed, to be copied by its
+                      worker. Parts that cannot be mapped are copied
+                      right away.
+    Return Type  :    int (0:1 Success:Failure of a copy right away)
+
+    Arguments    :    NVMEState *        : Pointer to NVME device State
+                      NVMEBackingFile *  : Backing file
+                      uint64_t           : Offset within the file
+                      target_phys_addr_t : Guest address
+                      uint64_t           : Length in bytes
+                      int                : 1 to write the file from
+                                           guest memory, 0 to read it
+*********************************************************************/
+int nvme_worker_add_xfer(NVMEState *n, NVMEBackingFile *bf, uint64_t offset,
+    target_phys_addr_t mem_addr, uint64_t len, int is_write)
+{
+    NVMERequest *req = n->worker_req;
+    target_phys_addr_t plen;
+    NVMEXfer *x;
+    void *host;
+    int ret;
+
+    while (len) {
+        plen = len;
+        host = cpu_physical_memory_map(mem_addr, &plen, !is_write);
+        if (host == NULL) {
+            /* Bounce buffer in use */
+            n->worker_req = NULL;
+            ret = nvme_backing_rw(n, bf, offset, mem_addr, len, is_write);
+            n->worker_req = req;
+            return ret;
+        }
+        if (req->nxfer == req->xfer_max) {
+            req->xfer_max = req->xfer_max ? req->xfer_max * 2 : 4;
+            req->xfer = qemu_realloc(req->xfer,
+                req->xfer_max * sizeof(*req->xfer));
+        }
+        x = &req->xfer[req->nxfer++];
+        x->req = req;
+        x->bf = bf;
+        x->offset = offset;
+        x->host = host;
+        x->len = plen;
+        x->is_write = is_write;
+        x->direct = nvme_backing_direct_ok(bf, offset, (uintptr_t)host, plen);
+
+        offset += plen;
+        mem_addr += plen;
+        len -= plen;
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_worker_submit
+    Description  :    Queues a request with transfers to the worker
+                      of its SQ, keeping a CQ entry for it
+    Return Type  :    void
+
+    Arguments    :    NVMEState *   : Pointer to NVME device State
+                      NVMERequest * : Request
+*********************************************************************/
+void nvme_worker_submit(NVMEState *n, NVMERequest *req)
+{
+    NVMEIOSQueue *sq = n->sq[req->sq_id];
+    NVMEWorker *w = &n->workers[(req->sq_id - 1) % n->num_workers];
+
+    n->cq[sq->cq_id]->inflight++;
+    n->worker_inflight++;
+
+    qemu_mutex_lock(&w->lock);
+    QSIMPLEQ_INSERT_TAIL(&w->queue, req, worker_entry);
+    qemu_cond_signal(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+}
+
+/*********************************************************************
+    Function     :    nvme_workers_drain
+    Description  :    Waits for the workers to be done with every
+                      request and completes them
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_workers_drain(NVMEState *n)
+{
+    struct pollfd pfd;
+
+    if (n->backend) {
+        nvme_backend_drain(n);
+        return;
+    }
+    if (n->uring) {
+        nvme_uring_drain(n);
+        return;
+    }
+    while (n->worker_inflight) {
+        pfd.fd = n->worker_pipe[0];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            LOG_ERR("Waiting for I/O workers failed: %s", strerror(errno));
+            return;
+        }
+        nvme_workers_complete(n);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_workers_init
+    Description  :    Starts the I/O worker threads, if any
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+int nvme_workers_init(NVMEState *n)
+{
+    NVMEWorker *w;
+    uint32_t i;
+
+    n->worker_pipe[0] = n->worker_pipe[1] = -1;
+    if (n->num_workers == 0) {
+        return SUCCESS;
+    }
+    if (qemu_pipe(n->worker_pipe) < 0) {
+        LOG_ERR("Cannot create the I/O worker pipe: %s", strerror(errno));
+        return FAIL;
+    }
+    fcntl_setfl(n->worker_pipe[0], O_NONBLOCK);
+    fcntl_setfl(n->worker_pipe[1], O_NONBLOCK);
+    qemu_set_fd_handler(n->worker_pipe[0], nvme_workers_complete, NULL, n);
+
+    n->workers = qemu_mallocz(n->num_workers * sizeof(*n->workers));
+    for (i = 0; i < n->num_workers; i++) {
+        w = &n->workers[i];
+        w->n = n;
+        qemu_mutex_init(&w->lock);
+        qemu_cond_init(&w->cond);
+        QSIMPLEQ_INIT(&w->queue);
+        qemu_thread_create(&w->thread, nvme_worker_thread, w);
+    }
+    LOG_NORM("Device:%d started %u I/O workers", n->instance,
+        n->num_workers);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_workers_uninit
+    Description  :    Completes the outstanding requests and stops
+                      the I/O worker threads
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_workers_uninit(NVMEState *n)
+{
+    NVMEWorker *w;
+    uint32_t i;
+
+    if (n->workers == NULL) {
+        return;
+    }
+    nvme_workers_drain(n);
+
+    for (i = 0; i < n->num_workers; i++) {
+        w = &n->workers[i];
+        qemu_mutex_lock(&w->lock);
+        w->stop = 1;
+        qemu_cond_signal(&w->cond);
+        qemu_mutex_unlock(&w->lock);
+        pthread_join(w->thread.thread, NULL);
+        qemu_cond_destroy(&w->cond);
+        qemu_mutex_destroy(&w->lock);
+    }
+    qemu_free(n->workers);
+    n->workers = NULL;
+
+    qemu_set_fd_handler(n->worker_pipe[0], NULL, NULL, NULL);
+    close(n->worker_pipe[0]);
+    close(n->worker_pipe[1]);
+    n->worker_pipe[0] = n->worker_pipe[1] = -1;
+}
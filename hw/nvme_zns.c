@@ -0,0 +1,669 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Zoned namespaces.
+ *
+ * With zone_size_mb set, every namespace is made of zones of that size
+ * which are written sequentially at their write pointer. The write
+ * pointer and state of each zone are kept in a backing file of the
+ * namespace (nvme_zone<instance>_n<nsid>.img), mapped like the data, so
+ * they go wherever the data goes: kept with -incoming and sent by block
+ * migration. The counts of open and active zones the limits apply to are
+ * derived from that file.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+/* Zone of the given index, valid until the next zone is looked up */
+static NVMEZone *nvme_zone_get(DiskInfo *disk, uint64_t idx)
+{
+    uint64_t len = sizeof(NVMEZone);
+
+    return (NVMEZone *)nvme_backing_map(&disk->zones, idx * sizeof(NVMEZone),
+        &len);
+}
+
+static int nvme_zone_is_open(uint8_t state)
+{
+    return state == NVME_ZONE_IMPLICIT_OPEN ||
+        state == NVME_ZONE_EXPLICIT_OPEN;
+}
+
+static int nvme_zone_is_active(uint8_t state)
+{
+    return nvme_zone_is_open(state) || state == NVME_ZONE_CLOSED;
+}
+
+/* Fails a command with a command specific status */
+static uint8_t nvme_zone_error(NVMEStatusField *sf, uint8_t sc)
+{
+    sf->sct = NVME_SCT_CMD_SPEC_ERR;
+    sf->sc = sc;
+    return FAIL;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_transition
+    Description  :    Moves a zone to a new state and write pointer,
+                      keeping the open and active counts and the
+                      migration dirty tracking up to date
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : Pointer to disk info
+                      uint64_t   : Zone index
+                      NVMEZone * : The zone
+                      uint8_t    : New state
+                      uint64_t   : New write pointer
+*********************************************************************/
+static void nvme_zone_transition(DiskInfo *disk, uint64_t idx, NVMEZone *z,
+    uint8_t state, uint64_t wp)
+{
+    disk->zone_open += nvme_zone_is_open(state) - nvme_zone_is_open(z->state);
+    disk->zone_active += nvme_zone_is_active(state) -
+        nvme_zone_is_active(z->state);
+    z->state = state;
+    z->wp = wp;
+    nvme_backing_set_dirty(&disk->zones, idx * sizeof(NVMEZone),
+        sizeof(NVMEZone));
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_open_room
+    Description  :    Makes room for one more open zone, closing an
+                      implicitly opened zone when the limit is reached
+    Return Type  :    int (1 if a zone may be opened)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo  * : Pointer to disk info
+*********************************************************************/
+static int nvme_zone_open_room(NVMEState *n, DiskInfo *disk)
+{
+    NVMEZone *z;
+    uint64_t i;
+
+    if (n->max_open_zones == 0 || disk->zone_open < n->max_open_zones) {
+        return 1;
+    }
+    for (i = 0; i < disk->zone_count; i++) {
+        z = nvme_zone_get(disk, i);
+        if (z != NULL && z->state == NVME_ZONE_IMPLICIT_OPEN) {
+            nvme_zone_transition(disk, i, z, NVME_ZONE_CLOSED, z->wp);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_open
+    Description  :    Opens a zone implicitly (by a write) or explicitly
+                      (by a Zone Send Action), within the limits of
+                      open and active zones
+    Return Type  :    uint8_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      DiskInfo  *       : Pointer to disk info
+                      uint64_t          : Zone index
+                      uint8_t           : NVME_ZONE_IMPLICIT_OPEN or
+                                          NVME_ZONE_EXPLICIT_OPEN
+                      NVMEStatusField * : Status of the command
+*********************************************************************/
+static uint8_t nvme_zone_open(NVMEState *n, DiskInfo *disk, uint64_t idx,
+    uint8_t state, NVMEStatusField *sf)
+{
+    NVMEZone *z = nvme_zone_get(disk, idx);
+
+    if (z == NULL) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    switch (z->state) {
+    case NVME_ZONE_EXPLICIT_OPEN:
+        return SUCCESS;
+    case NVME_ZONE_IMPLICIT_OPEN:
+        if (state == NVME_ZONE_IMPLICIT_OPEN) {
+            return SUCCESS;
+        }
+        break;
+    case NVME_ZONE_EMPTY:
+        if (n->max_active_zones &&
+                disk->zone_active >= n->max_active_zones) {
+            return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_TOO_MANY_ACTIVE);
+        }
+        /* fall through */
+    case NVME_ZONE_CLOSED:
+        if (!nvme_zone_open_room(n, disk)) {
+            return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_TOO_MANY_OPEN);
+        }
+        z = nvme_zone_get(disk, idx);
+        if (z == NULL) {
+            sf->sc = NVME_SC_INTERNAL;
+            return FAIL;
+        }
+        break;
+    default:
+        return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_TRANSITION);
+    }
+    nvme_zone_transition(disk, idx, z, state, z->wp);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_discard
+    Description  :    Drops the data written to a zone being reset,
+                      which reads as zeroes afterwards
+    Return Type  :    int (0:1 Success:Failure)
+
+    Arguments    :    DiskInfo * : Pointer to disk info
+                      uint64_t   : Zone index
+                      uint64_t   : LBAs written to the zone
+*********************************************************************/
+static int nvme_zone_discard(DiskInfo *disk, uint64_t idx, uint64_t nlb)
+{
+    uint8_t lba_idx = disk->idtfy_ns.flbas & 0xf;
+    uint32_t blk_sz = NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[lba_idx].lbads);
+    uint32_t ms = disk->idtfy_ns.lbafx[lba_idx].ms;
+    uint64_t zslba = idx * disk->zone_size;
+
+    if (disk->cow_map) {
+        /* None of the zone reads from the base image of a clone again */
+        nvme_cow_written(disk, zslba, disk->zone_size);
+    }
+    if (disk->ftl) {
+        nvme_ftl_trim(disk, zslba, disk->zone_size);
+    }
+    /* Same layout of the backing files as for reads and writes */
+    if (disk->idtfy_ns.flbas & 0x10) {
+        return nvme_backing_zero(&disk->data, zslba * blk_sz,
+            nlb * (blk_sz + ms));
+    }
+    if (nvme_backing_zero(&disk->data, zslba * blk_sz, nlb * blk_sz)) {
+        return FAIL;
+    }
+    if (ms != 0 && disk->meta.fd >= 0) {
+        return nvme_backing_zero(&disk->meta, zslba * ms, nlb * ms);
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_action
+    Description  :    Applies a Zone Send Action to one zone
+    Return Type  :    uint8_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      DiskInfo  *       : Pointer to disk info
+                      uint64_t          : Zone index
+                      uint8_t           : Zone Send Action
+                      NVMEStatusField * : Status of the command
+*********************************************************************/
+static uint8_t nvme_zone_action(NVMEState *n, DiskInfo *disk, uint64_t idx,
+    uint8_t zsa, NVMEStatusField *sf)
+{
+    NVMEZone *z = nvme_zone_get(disk, idx);
+    uint8_t state;
+
+    if (z == NULL) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    state = z->state;
+    switch (zsa) {
+    case NVME_ZSA_OPEN:
+        return nvme_zone_open(n, disk, idx, NVME_ZONE_EXPLICIT_OPEN, sf);
+    case NVME_ZSA_CLOSE:
+        if (state == NVME_ZONE_CLOSED) {
+            return SUCCESS;
+        }
+        if (nvme_zone_is_open(state)) {
+            nvme_zone_transition(disk, idx, z, NVME_ZONE_CLOSED, z->wp);
+            return SUCCESS;
+        }
+        break;
+    case NVME_ZSA_FINISH:
+        if (state == NVME_ZONE_FULL) {
+            return SUCCESS;
+        }
+        if (state == NVME_ZONE_EMPTY || nvme_zone_is_active(state)) {
+            nvme_zone_transition(disk, idx, z, NVME_ZONE_FULL,
+                disk->zone_cap);
+            return SUCCESS;
+        }
+        break;
+    case NVME_ZSA_RESET:
+        if (state == NVME_ZONE_EMPTY || state == NVME_ZONE_FULL ||
+                nvme_zone_is_active(state)) {
+            if (z->wp && nvme_zone_discard(disk, idx, z->wp)) {
+                sf->sc = NVME_SC_INTERNAL;
+                return FAIL;
+            }
+            z = nvme_zone_get(disk, idx);
+            nvme_zone_transition(disk, idx, z, NVME_ZONE_EMPTY, 0);
+            return SUCCESS;
+        }
+        break;
+    case NVME_ZSA_OFFLINE:
+        if (state == NVME_ZONE_OFFLINE) {
+            return SUCCESS;
+        }
+        if (state == NVME_ZONE_READ_ONLY) {
+            nvme_zone_transition(disk, idx, z, NVME_ZONE_OFFLINE, 0);
+            return SUCCESS;
+        }
+        break;
+    }
+    return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_TRANSITION);
+}
+
+/* Zones a Zone Send Action with Select All applies to */
+static int nvme_zone_select_all(uint8_t zsa, uint8_t state)
+{
+    switch (zsa) {
+    case NVME_ZSA_OPEN:
+        return state == NVME_ZONE_CLOSED;
+    case NVME_ZSA_CLOSE:
+        return nvme_zone_is_open(state);
+    case NVME_ZSA_FINISH:
+        return nvme_zone_is_active(state);
+    case NVME_ZSA_RESET:
+        return nvme_zone_is_active(state) || state == NVME_ZONE_FULL;
+    case NVME_ZSA_OFFLINE:
+        return state == NVME_ZONE_READ_ONLY;
+    }
+    return 0;
+}
+
+/* Zones a Report Zones filter (ZRASF) lists */
+static int nvme_zone_report_match(uint8_t zrasf, uint8_t state)
+{
+    static const uint8_t zrasf_state[] = {
+        [NVME_ZRASF_EMPTY] = NVME_ZONE_EMPTY,
+        [NVME_ZRASF_IMPLICIT_OPEN] = NVME_ZONE_IMPLICIT_OPEN,
+        [NVME_ZRASF_EXPLICIT_OPEN] = NVME_ZONE_EXPLICIT_OPEN,
+        [NVME_ZRASF_CLOSED] = NVME_ZONE_CLOSED,
+        [NVME_ZRASF_FULL] = NVME_ZONE_FULL,
+        [NVME_ZRASF_READ_ONLY] = NVME_ZONE_READ_ONLY,
+        [NVME_ZRASF_OFFLINE] = NVME_ZONE_OFFLINE,
+    };
+
+    return zrasf == NVME_ZRASF_ALL || zrasf_state[zrasf] == state;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_setup
+    Description  :    Lays out the zones of a namespace for its current
+                      LBA format. The namespace ends with its last
+                      whole zone.
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo  * : Pointer to disk info
+*********************************************************************/
+void nvme_zone_setup(NVMEState *n, DiskInfo *disk)
+{
+    uint32_t blk_sz = NVME_BLOCK_SIZE(
+        disk->idtfy_ns.lbafx[disk->idtfy_ns.flbas & 0xf].lbads);
+
+    disk->zone_count = disk->zone_open = disk->zone_active = 0;
+    if (n->zone_size_mb == 0) {
+        return;
+    }
+    disk->zone_size = (uint64_t)n->zone_size_mb * BYTES_PER_MB / blk_sz;
+    disk->zone_cap = n->zone_cap_mb ?
+        (uint64_t)n->zone_cap_mb * BYTES_PER_MB / blk_sz : disk->zone_size;
+    disk->zone_count = disk->idtfy_ns.nsze / disk->zone_size;
+    disk->idtfy_ns.nsze = disk->zone_count * disk->zone_size;
+    disk->idtfy_ns.ncap = disk->idtfy_ns.nsze;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_recount
+    Description  :    Counts the open and active zones of a namespace
+                      from its zone file, once opened or migrated
+    Return Type  :    void
+
+    Arguments    :    DiskInfo * : Pointer to disk info
+*********************************************************************/
+void nvme_zone_recount(DiskInfo *disk)
+{
+    NVMEZone *z;
+    uint64_t i;
+
+    disk->zone_open = disk->zone_active = 0;
+    for (i = 0; i < disk->zone_count; i++) {
+        z = nvme_zone_get(disk, i);
+        if (z == NULL) {
+            return;
+        }
+        disk->zone_open += nvme_zone_is_open(z->state);
+        disk->zone_active += nvme_zone_is_active(z->state);
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_close_all
+    Description  :    Closes the open zones of every namespace, as a
+                      controller reset does
+    Return Type  :    void
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+void nvme_zone_close_all(NVMEState *n)
+{
+    DiskInfo *disk;
+    NVMEZone *z;
+    uint32_t i;
+    uint64_t j;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        disk = &n->disk[i];
+        for (j = 0; j < disk->zone_count && disk->zone_open; j++) {
+            z = nvme_zone_get(disk, j);
+            if (z != NULL && nvme_zone_is_open(z->state)) {
+                nvme_zone_transition(disk, j, z, NVME_ZONE_CLOSED, z->wp);
+            }
+        }
+    }
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_read
+    Description  :    Checks a read against the zones it spans
+    Return Type  :    uint8_t (0:1 Success:Failure)
+
+    Arguments    :    DiskInfo *        : Pointer to disk info
+                      uint64_t          : Starting LBA
+                      uint64_t          : Number of LBAs, 0's based
+                      NVMEStatusField * : Status of the command
+*********************************************************************/
+uint8_t nvme_zone_read(DiskInfo *disk, uint64_t slba, uint64_t nlb,
+    NVMEStatusField *sf)
+{
+    uint64_t idx, last = (slba + nlb) / disk->zone_size;
+    NVMEZone *z;
+
+    for (idx = slba / disk->zone_size; idx <= last; idx++) {
+        z = nvme_zone_get(disk, idx);
+        if (z == NULL) {
+            sf->sc = NVME_SC_INTERNAL;
+            return FAIL;
+        }
+        if (z->state == NVME_ZONE_OFFLINE) {
+            return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_OFFLINE);
+        }
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_write
+    Description  :    Checks a write against the write pointer of its
+                      zone, opening the zone if needed, and advances
+                      the write pointer. The zone is full once its
+                      capacity is written.
+    Return Type  :    uint8_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState *       : Pointer to NVME device State
+                      DiskInfo  *       : Pointer to disk info
+                      uint64_t          : Starting LBA
+                      uint64_t          : Number of LBAs, 0's based
+                      NVMEStatusField * : Status of the command
+*********************************************************************/
+uint8_t nvme_zone_write(NVMEState *n, DiskInfo *disk, uint64_t slba,
+    uint64_t nlb, NVMEStatusField *sf)
+{
+    uint64_t idx = slba / disk->zone_size, zslba = idx * disk->zone_size;
+    NVMEZone *z = nvme_zone_get(disk, idx);
+    uint64_t wp;
+
+    if (z == NULL) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    switch (z->state) {
+    case NVME_ZONE_FULL:
+        return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_FULL);
+    case NVME_ZONE_READ_ONLY:
+        return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_READ_ONLY);
+    case NVME_ZONE_OFFLINE:
+        return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_OFFLINE);
+    }
+    if (slba != zslba + z->wp) {
+        LOG_NORM("%s(): write at %lu, write pointer at %lu", __func__, slba,
+            zslba + z->wp);
+        return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_INVALID_WRITE);
+    }
+    if (slba + nlb + 1 > zslba + disk->zone_cap) {
+        return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_BOUNDARY);
+    }
+    if (nvme_zone_open(n, disk, idx, NVME_ZONE_IMPLICIT_OPEN, sf)) {
+        return FAIL;
+    }
+    z = nvme_zone_get(disk, idx);
+    if (z == NULL) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    wp = z->wp + nlb + 1;
+    nvme_zone_transition(disk, idx, z,
+        wp == disk->zone_cap ? NVME_ZONE_FULL : z->state, wp);
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_append
+    Description  :    Zone Append: turns the command into a write at
+                      the write pointer of the zone it names and
+                      returns the LBA written in DW0 and DW1 of the
+                      completion
+    Return Type  :    uint8_t (0:1 Success:Failure)
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      DiskInfo  * : Pointer to disk info
+                      NVME_rw   * : Zone Append command, ZSLBA in SLBA
+                      NVMECQE   * : Completion entry
+*********************************************************************/
+uint8_t nvme_zone_append(NVMEState *n, DiskInfo *disk, NVME_rw *e,
+    NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEZone *z;
+    uint64_t slba;
+
+    if (e->slba % disk->zone_size) {
+        LOG_NORM("%s(): %lu is not the start of a zone", __func__, e->slba);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    z = nvme_zone_get(disk, e->slba / disk->zone_size);
+    if (z == NULL) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    slba = e->slba + z->wp;
+    if (nvme_zone_write(n, disk, slba, e->nlb, sf)) {
+        return FAIL;
+    }
+    e->slba = slba;
+    cqe->cmd_specific = (uint32_t)slba;
+    cqe->rsvd = slba >> 32;
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_mgmt_send
+    Description  :    Zone Management Send: close, finish, open, reset
+                      or offline the zone starting at SLBA, or every
+                      zone the action applies to with Select All
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd   * : Pointer to SQ cmd
+                      NVMECQE   * : Pointer to CQ completion entries
+*********************************************************************/
+uint8_t nvme_zone_mgmt_send(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint64_t slba = sqe->cdw10 | ((uint64_t)sqe->cdw11 << 32);
+    uint8_t zsa = sqe->cdw13 & 0xff;
+    DiskInfo *disk = &n->disk[sqe->nsid - 1];
+    uint64_t idx, closed = 0;
+    NVMEZone *z;
+
+    sf->sc = NVME_SC_SUCCESS;
+    if (zsa < NVME_ZSA_CLOSE || zsa > NVME_ZSA_OFFLINE) {
+        LOG_NORM("%s(): unsupported action %x", __func__, zsa);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    if (!(sqe->cdw13 & NVME_ZSA_SELECT_ALL)) {
+        if (slba >= disk->idtfy_ns.nsze) {
+            sf->sc = NVME_SC_LBA_RANGE;
+            return FAIL;
+        }
+        if (slba % disk->zone_size) {
+            LOG_NORM("%s(): %lu is not the start of a zone", __func__, slba);
+            sf->sc = NVME_SC_INVALID_FIELD;
+            return FAIL;
+        }
+        return nvme_zone_action(n, disk, slba / disk->zone_size, zsa, sf);
+    }
+
+    if (zsa == NVME_ZSA_OPEN && n->max_open_zones) {
+        /* Either every closed zone is opened or none is */
+        for (idx = 0; idx < disk->zone_count; idx++) {
+            z = nvme_zone_get(disk, idx);
+            closed += z != NULL && z->state == NVME_ZONE_CLOSED;
+        }
+        if (disk->zone_open + closed > n->max_open_zones) {
+            return nvme_zone_error(sf, NVME_CMD_ZONE_ERR_TOO_MANY_OPEN);
+        }
+    }
+    for (idx = 0; idx < disk->zone_count; idx++) {
+        z = nvme_zone_get(disk, idx);
+        if (z != NULL && nvme_zone_select_all(zsa, z->state) &&
+                nvme_zone_action(n, disk, idx, zsa, sf)) {
+            return FAIL;
+        }
+    }
+    return SUCCESS;
+}
+
+/*********************************************************************
+    Function     :    nvme_zone_mgmt_recv
+    Description  :    Zone Management Receive: reports the zones from
+                      the one holding SLBA on, filtered by state. The
+                      header counts every matching zone, or only the
+                      ones reported with Partial Report.
+    Return Type  :    uint8_t
+
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      NVMECmd   * : Pointer to SQ cmd
+                      NVMECQE   * : Pointer to CQ completion entries
+*********************************************************************/
+uint8_t nvme_zone_mgmt_recv(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint64_t slba = sqe->cdw10 | ((uint64_t)sqe->cdw11 << 32);
+    uint64_t len = ((uint64_t)sqe->cdw12 + 1) * 4;
+    uint8_t zra = sqe->cdw13 & 0xff, zrasf = (sqe->cdw13 >> 8) & 0xff;
+    int partial = (sqe->cdw13 & NVME_ZRA_PARTIAL) != 0;
+    DiskInfo *disk = &n->disk[sqe->nsid - 1];
+    uint64_t idx, nr = 0, max;
+    NVMEZoneDescr *d;
+    NVMEZone *z;
+    uint8_t *buf;
+
+    sf->sc = NVME_SC_SUCCESS;
+    if (zra != NVME_ZRA_REPORT || zrasf > NVME_ZRASF_OFFLINE) {
+        LOG_NORM("%s(): unsupported action %x/%x", __func__, zra, zrasf);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    if (slba >= disk->idtfy_ns.nsze) {
+        sf->sc = NVME_SC_LBA_RANGE;
+        return FAIL;
+    }
+    /* MDTS is in units of the minimum page size */
+    if (n->idtfy_ctrl->mdts && len > PAGE_SIZE *
+                (1 << (n->idtfy_ctrl->mdts))) {
+        LOG_NORM("%s(): report of %lu bytes exceeds MDTS", __func__, len);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+
+    /* A 64 byte header then the descriptors */
+    buf = qemu_mallocz(MAX(len, sizeof(NVMEZoneDescr)));
+    d = (NVMEZoneDescr *)buf + 1;
+    max = len / sizeof(NVMEZoneDescr) - (len >= sizeof(NVMEZoneDescr));
+    for (idx = slba / disk->zone_size; idx < disk->zone_count; idx++) {
+        z = nvme_zone_get(disk, idx);
+        if (z == NULL) {
+            qemu_free(buf);
+            sf->sc = NVME_SC_INTERNAL;
+            return FAIL;
+        }
+        if (!nvme_zone_report_match(zrasf, z->state)) {
+            continue;
+        }
+        if (nr == max && partial) {
+            break;
+        }
+        if (nr < max) {
+            d[nr].zt = NVME_ZONE_TYPE_SEQ_WRITE;
+            d[nr].zs = (z->state ? z->state : NVME_ZONE_STATE_EMPTY) << 4;
+            d[nr].zcap = disk->zone_cap;
+            d[nr].zslba = idx * disk->zone_size;
+            /* No write pointer for read only and offline zones */
+            d[nr].wp = (z->state == NVME_ZONE_READ_ONLY ||
+                z->state == NVME_ZONE_OFFLINE) ? UINT64_MAX :
+                d[nr].zslba + z->wp;
+        }
+        nr++;
+    }
+    *(uint64_t *)buf = nr;
+
+    sf->sc = nvme_cmd_data_rw(n, sqe, buf, len, 1);
+    qemu_free(buf);
+    return sf->sc == NVME_SC_SUCCESS ? SUCCESS : FAIL;
+}
+
+/*********************************************************************
+    Function     :    nvme_identify_zoned_ns
+    Description  :    Fills the Zoned Namespace Command Set specific
+                      Identify Namespace data of a namespace
+    Return Type  :    void
+
+    Arguments    :    NVMEState *           : Pointer to NVME device State
+                      DiskInfo  *           : Pointer to disk info
+                      NVMEIdentifyZonedNs * : Identify data to fill
+*********************************************************************/
+void nvme_identify_zoned_ns(NVMEState *n, DiskInfo *disk,
+    NVMEIdentifyZonedNs *id)
+{
+    int i;
+
+    memset(id, 0, sizeof(*id));
+    /* 0's based, all ones for no limit */
+    id->mar = n->max_active_zones ? n->max_active_zones - 1 : UINT32_MAX;
+    id->mor = n->max_open_zones ? n->max_open_zones - 1 : UINT32_MAX;
+    for (i = 0; i <= disk->idtfy_ns.nlbaf; i++) {
+        id->lbafe[i].zsze = (uint64_t)n->zone_size_mb * BYTES_PER_MB /
+            NVME_BLOCK_SIZE(disk->idtfy_ns.lbafx[i].lbads);
+    }
+}
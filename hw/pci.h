@@ -172,6 +172,8 @@ struct PCIDevice {
 
     /* Space to store MSIX table */
     uint8_t *msix_table_page;
+    /* Size of the table page, pending bits are in its second half */
+    uint32_t msix_page_size;
     /* MMIO index used to map MSIX table and pending bit entries. */
     int msix_mmio_index;
     /* Reference-count for entries actually in use by driver. */
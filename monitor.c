@@ -28,6 +28,7 @@
 #include "hw/pcmcia.h"
 #include "hw/pc.h"
 #include "hw/pci.h"
+#include "hw/nvme_monitor.h"
 #include "hw/watchdog.h"
 #include "hw/loader.h"
 #include "gdbstub.h"
@@ -2901,6 +2902,16 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_pci_info_print,
         .mhandler.info_new = do_pci_info,
     },
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show NVMe namespaces and format progress",
+        .user_print = do_nvme_info_print,
+        .mhandler.info_new = do_nvme_info,
+    },
+#endif
 #if defined(TARGET_I386) || defined(TARGET_SH4) || defined(TARGET_SPARC)
     {
         .name       = "tlb",
@@ -3172,6 +3183,16 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = do_pci_info_print,
         .mhandler.info_new = do_pci_info,
     },
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show NVMe namespaces and format progress",
+        .user_print = do_nvme_info_print,
+        .mhandler.info_new = do_nvme_info,
+    },
+#endif
     {
         .name       = "kvm",
         .args_type  = "",
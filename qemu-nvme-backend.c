@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * NVMe storage backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Runs the transfers of an NVMe device started with backend=SOCKET, see
+ * hw/nvme_backend.h. One device at a time; when it goes away the next
+ * connection is served, so either side can be restarted.
+ */
+
+#include "hw/nvme_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+/* Namespaces of a device, times data and meta-data */
+#define NVME_BACKEND_MAX_FILES (2 * 256)
+
+typedef struct Region {
+    uint8_t *host;
+    uint64_t len;
+} Region;
+
+static int verbose;
+static Region regions[NVME_BACKEND_MAX_REGIONS];
+/* Buffered and O_DIRECT descriptor of each file slot */
+static int files[NVME_BACKEND_MAX_FILES][2];
+
+static void usage(const char *name)
+{
+    printf(
+"Usage: %s [OPTIONS] SOCKET\n"
+"Run the storage I/O of an NVMe device started with backend=SOCKET\n"
+"\n"
+"  -v, --verbose        display each connection\n"
+"  -h, --help           display this help and exit\n",
+    name);
+}
+
+static void reset(void)
+{
+    int i, j;
+
+    for (i = 0; i < NVME_BACKEND_MAX_REGIONS; i++) {
+        if (regions[i].host) {
+            munmap(regions[i].host, regions[i].len);
+        }
+        regions[i].host = NULL;
+    }
+    for (i = 0; i < NVME_BACKEND_MAX_FILES; i++) {
+        for (j = 0; j < 2; j++) {
+            if (files[i][j] >= 0) {
+                close(files[i][j]);
+            }
+            files[i][j] = -1;
+        }
+    }
+}
+
+/* Receives a message and the descriptor passed with it, if any */
+static ssize_t recv_msg(int sock, void *buf, size_t len, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t ret;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    do {
+        ret = recvmsg(sock, &mh, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    *fd = -1;
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return ret;
+}
+
+/* Runs one transfer, returns 0 or -errno */
+static int64_t run_xfer(NVMEBackendXfer *x)
+{
+    uint8_t *host;
+    uint64_t done = 0;
+    ssize_t ret;
+    int fd;
+
+    if (x->region >= NVME_BACKEND_MAX_REGIONS || !regions[x->region].host ||
+        x->addr > regions[x->region].len ||
+        x->len > regions[x->region].len - x->addr ||
+        x->file >= NVME_BACKEND_MAX_FILES || files[x->file][0] < 0) {
+        return -EINVAL;
+    }
+    host = regions[x->region].host + x->addr;
+    fd = files[x->file][0];
+    if ((x->flags & NVME_BACKEND_F_DIRECT) && files[x->file][1] >= 0) {
+        fd = files[x->file][1];
+    }
+    while (done < x->len) {
+        if (x->flags & NVME_BACKEND_F_WRITE) {
+            ret = pwrite(fd, host + done, x->len - done, x->offset + done);
+        } else {
+            ret = pread(fd, host + done, x->len - done, x->offset + done);
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+        if (ret == 0) {
+            /* Reads past the end of the file return zeroes */
+            if (x->flags & NVME_BACKEND_F_WRITE) {
+                return -EIO;
+            }
+            memset(host + done, 0, x->len - done);
+            break;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/* Serves a device until it disconnects */
+static void serve(int sock, NVMEBackendMsg *m, size_t size)
+{
+    NVMEBackendXfer *x = (NVMEBackendXfer *)(m + 1);
+    NVMEBackendMsg reply;
+    ssize_t len;
+    uint32_t i;
+    void *host;
+    int fd;
+
+    for (;;) {
+        len = recv_msg(sock, m, size, &fd);
+        if (len < (ssize_t)sizeof(*m)) {
+            break;
+        }
+        memset(&reply, 0, sizeof(reply));
+        switch (m->type) {
+        case NVME_BACKEND_HELLO:
+            if (m->tag != NVME_BACKEND_MAGIC ||
+                m->index != NVME_BACKEND_VERSION) {
+                fprintf(stderr, "unsupported protocol %u\n", m->index);
+                return;
+            }
+            reply = *m;
+            break;
+        case NVME_BACKEND_REGION:
+            if (fd < 0 || m->index >= NVME_BACKEND_MAX_REGIONS) {
+                goto bad;
+            }
+            host = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+            close(fd);
+            if (host == MAP_FAILED) {
+                perror("mmap");
+                return;
+            }
+            if (regions[m->index].host) {
+                munmap(regions[m->index].host, regions[m->index].len);
+            }
+            regions[m->index].host = host;
+            regions[m->index].len = m->size;
+            if (verbose) {
+                printf("region %u: %" PRIu64 " bytes\n", m->index, m->size);
+            }
+            continue;
+        case NVME_BACKEND_FILE:
+            if (fd < 0 || m->index >= NVME_BACKEND_MAX_FILES) {
+                goto bad;
+            }
+            i = !!(m->flags & NVME_BACKEND_F_DIRECT);
+            if (files[m->index][i] >= 0) {
+                close(files[m->index][i]);
+            }
+            files[m->index][i] = fd;
+            continue;
+        case NVME_BACKEND_IO:
+            if (len != (ssize_t)(sizeof(*m) + m->count * sizeof(*x))) {
+                goto bad;
+            }
+            reply.type = NVME_BACKEND_DONE;
+            reply.tag = m->tag;
+            for (i = 0; i < m->count && reply.result == 0; i++) {
+                reply.result = run_xfer(&x[i]);
+            }
+            break;
+        default:
+            goto bad;
+        }
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+            break;
+        }
+    }
+    return;
+
+bad:
+    if (fd >= 0) {
+        close(fd);
+    }
+    fprintf(stderr, "bad message type %u\n", m->type);
+}
+
+int main(int argc, char **argv)
+{
+    const char *sopt = "vh";
+    struct option lopt[] = {
+        { "verbose", 0, NULL, 'v' },
+        { "help", 0, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct sockaddr_un sun;
+    NVMEBackendMsg *m;
+    size_t size;
+    int ch, sock, conn;
+
+    while ((ch = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+        switch (ch) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(argv[optind]) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        exit(1);
+    }
+    strcpy(sun.sun_path, argv[optind]);
+    sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    unlink(sun.sun_path);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        listen(sock, 1) < 0) {
+        perror(sun.sun_path);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    size = sizeof(*m) + NVME_BACKEND_MAX_XFERS * sizeof(NVMEBackendXfer);
+    m = malloc(size);
+    memset(files, -1, sizeof(files));
+    /* One device at a time: the HELLO of a new connection is answered
+     * once every IO of the previous one is done, which the device waits
+     * for before it runs them again itself */
+    for (;;) {
+        conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+        if (verbose) {
+            printf("device connected\n");
+        }
+        serve(conn, m, size);
+        close(conn);
+        reset();
+        if (verbose) {
+            printf("device disconnected\n");
+        }
+    }
+    return 0;
+}
@@ -825,6 +825,241 @@ Example:
                                                "password": "12345" } }
 <- { "return": {} }
 
+EQMP
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_set_qos",
+        .args_type  = "device:s,nsid:i,iops:l,bps:o,iops_burst:l?,bps_burst:o?",
+        .params     = "device nsid iops bps [iops_burst [bps_burst]]",
+        .help       = "set the IOPS and bandwidth limits of an NVMe "
+                      "namespace, or of the I/O queues for nsid 0",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_set_qos,
+    },
+#endif
+
+SQMP
+nvme_set_qos
+------------
+
+Limit the commands and bytes per second of an NVMe namespace, or of each
+I/O submission queue of the controller. Commands over the limits are
+delayed in the device, not failed.
+
+Arguments:
+
+- "device": qdev id of the controller, or nvme<instance> (json-string)
+- "nsid": namespace identifier, 0 for the I/O submission queues (json-int)
+- "iops": commands per second, 0 for no limit (json-int)
+- "bps": bytes per second, 0 for no limit (json-int)
+- "iops_burst": commands let through at once, one second worth if
+                omitted (json-int, optional)
+- "bps_burst": bytes let through at once, one second worth if omitted
+               (json-int, optional)
+
+Example:
+
+-> { "execute": "nvme_set_qos", "arguments": { "device": "nvme0",
+                                               "nsid": 1,
+                                               "iops": 1000,
+                                               "bps": 10485760 } }
+<- { "return": {} }
+
+EQMP
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_cow_compact",
+        .args_type  = "device:s,nsid:i",
+        .params     = "device nsid",
+        .help       = "copy the blocks an NVMe namespace shares with its "
+                      "base image and close the base",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_cow_compact,
+    },
+#endif
+
+SQMP
+nvme_cow_compact
+----------------
+
+Copy the blocks an NVMe namespace cloned from a base image still shares
+with it into its own backing file, in the background and while the guest
+keeps running. The base image is closed once none is left; "query-nvme"
+shows the progress.
+
+Arguments:
+
+- "device": qdev id of the controller, or nvme<instance> (json-string)
+- "nsid": namespace identifier (json-int)
+
+Example:
+
+-> { "execute": "nvme_cow_compact", "arguments": { "device": "nvme0",
+                                                   "nsid": 1 } }
+<- { "return": {} }
+
+EQMP
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_create",
+        .args_type  = "device:s,size_mb:i,lbaf:i?",
+        .params     = "device size_mb [lbaf]",
+        .help       = "create an NVMe namespace, not attached",
+        .user_print = do_nvme_ns_create_print,
+        .mhandler.cmd_new = do_nvme_ns_create,
+    },
+#endif
+
+SQMP
+nvme_ns_create
+--------------
+
+Create a namespace on an NVMe controller out of its unallocated capacity,
+at the lowest namespace ID not allocated, as Namespace Management does.
+The namespace is not attached; its backing files are created once it is.
+
+Arguments:
+
+- "device": qdev id of the controller, or nvme<instance> (json-string)
+- "size_mb": size of the namespace in MB (json-int)
+- "lbaf": LBA format, 0 by default (json-int, optional)
+
+Example:
+
+-> { "execute": "nvme_ns_create", "arguments": { "device": "nvme0",
+                                                 "size_mb": 1024 } }
+<- { "return": { "nsid": 2 } }
+
+EQMP
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_delete",
+        .args_type  = "device:s,nsid:i",
+        .params     = "device nsid",
+        .help       = "delete an NVMe namespace and its backing files",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_delete,
+    },
+#endif
+
+SQMP
+nvme_ns_delete
+--------------
+
+Delete a namespace of an NVMe controller, detaching it first, and remove
+its backing files. The guest is notified if the namespace was attached.
+
+Arguments:
+
+- "device": qdev id of the controller, or nvme<instance> (json-string)
+- "nsid": namespace identifier (json-int)
+
+Example:
+
+-> { "execute": "nvme_ns_delete", "arguments": { "device": "nvme0",
+                                                 "nsid": 2 } }
+<- { "return": {} }
+
+EQMP
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_attach",
+        .args_type  = "device:s,nsid:i",
+        .params     = "device nsid",
+        .help       = "attach an NVMe namespace to its controller",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_attach,
+    },
+#endif
+
+SQMP
+nvme_ns_attach
+--------------
+
+Attach a namespace to its NVMe controller, which makes it visible to the
+guest and notifies it with a Namespace Attribute Changed event.
+
+Arguments:
+
+- "device": qdev id of the controller, or nvme<instance> (json-string)
+- "nsid": namespace identifier (json-int)
+
+Example:
+
+-> { "execute": "nvme_ns_attach", "arguments": { "device": "nvme0",
+                                                 "nsid": 2 } }
+<- { "return": {} }
+
+EQMP
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_detach",
+        .args_type  = "device:s,nsid:i",
+        .params     = "device nsid",
+        .help       = "detach an NVMe namespace from its controller",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_detach,
+    },
+#endif
+
+SQMP
+nvme_ns_detach
+--------------
+
+Detach a namespace from its NVMe controller. Its data is kept until the
+namespace is deleted.
+
+Arguments:
+
+- "device": qdev id of the controller, or nvme<instance> (json-string)
+- "nsid": namespace identifier (json-int)
+
+Example:
+
+-> { "execute": "nvme_ns_detach", "arguments": { "device": "nvme0",
+                                                 "nsid": 2 } }
+<- { "return": {} }
+
+EQMP
+
+#ifdef CONFIG_NVME
+    {
+        .name       = "nvme_ns_resize",
+        .args_type  = "device:s,nsid:i,size_mb:i",
+        .params     = "device nsid size_mb",
+        .help       = "grow or shrink an NVMe namespace",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_nvme_ns_resize,
+    },
+#endif
+
+SQMP
+nvme_ns_resize
+--------------
+
+Change the size of a namespace of an NVMe controller, within its
+unallocated capacity. Blocks past a smaller size are deallocated. Zoned
+namespaces and clones cannot be resized.
+
+Arguments:
+
+- "device": qdev id of the controller, or nvme<instance> (json-string)
+- "nsid": namespace identifier (json-int)
+- "size_mb": new size of the namespace in MB (json-int)
+
+Example:
+
+-> { "execute": "nvme_ns_resize", "arguments": { "device": "nvme0",
+                                                 "nsid": 1,
+                                                 "size_mb": 2048 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1459,6 +1694,81 @@ Note: This example has been shortened as the real response is too long.
 
 EQMP
 
+SQMP
+query-nvme
+----------
+
+Show the namespaces of the NVMe controllers and the progress of the
+Format NVM commands running on them.
+
+Each controller is represented by a json-object containing:
+
+- "instance": controller instance number (json-int)
+- "qdev_id": qdev id of the device, empty if none (json-string)
+- "subsys": NVM subsystem the controller is part of, empty if none
+  (json-string)
+- "cntlid": controller ID (json-int)
+- "capacity": NVM capacity of the namespaces in bytes (json-int)
+- "unallocated": bytes of it left for new namespaces (json-int)
+- "namespaces": a json-array of the allocated namespaces, each a json-object
+  with:
+     - "nsid": namespace identifier (json-int)
+     - "size": size of the data backing file in bytes (json-int)
+     - "attached": true if attached to the controller (json-bool)
+     - "ready": true if the namespace accepts I/O (json-bool)
+     - "formatting": true while a format is in progress (json-bool)
+     - "progress": percentage of the format done (json-int)
+     - "remaining": bytes left to format (json-int)
+     - "iops": commands per second limit, 0 for none (json-int)
+     - "bps": bytes per second limit, 0 for none (json-int)
+     - "clone": true if cloned from a base image (json-bool)
+     - "shared": blocks still read from the base image (json-int)
+     - "compacting": true while nvme_cow_compact runs (json-bool)
+     - "ftl": true if the FTL is emulated (json-bool)
+     - "waf": FTL write amplification in hundredths (json-int)
+     - "gc_blocks": blocks reclaimed by FTL garbage collection (json-int)
+     - "gc_stall": ns commands were held by garbage collection (json-int)
+     - "reservation": type of the reservation held, 0 for none (json-int)
+
+Example:
+
+-> { "execute": "query-nvme" }
+<- {
+      "return":[
+         {
+            "instance":0,
+            "qdev_id":"",
+            "subsys":"",
+            "cntlid":0,
+            "capacity":536870912,
+            "unallocated":0,
+            "namespaces":[
+               {
+                  "nsid":1,
+                  "size":536870912,
+                  "attached":true,
+                  "ready":false,
+                  "formatting":true,
+                  "progress":43,
+                  "remaining":306184192,
+                  "iops":0,
+                  "bps":0,
+                  "clone":false,
+                  "shared":0,
+                  "compacting":false,
+                  "ftl":false,
+                  "waf":0,
+                  "gc_blocks":0,
+                  "gc_stall":0,
+                  "reservation":0
+               }
+            ]
+         }
+      ]
+   }
+
+EQMP
+
 SQMP
 query-kvm
 ---------